@@ -10,19 +10,28 @@ TCPstub::TCPstub() :
   myIP(IPAddress(0, 0, 0, 0)),
   myPort(0),
   worker(nullptr),
-  tm(nullptr) { }
+  tm(nullptr),
+  requests(0),
+  holdCount(0),
+  splitTime(0) { }
 
 TCPstub::TCPstub(TCPstub& t) :
   myIP(t.myIP),
   myPort(t.myPort),
   worker(nullptr),
-  tm(nullptr) { }
+  tm(nullptr),
+  requests(0),
+  holdCount(0),
+  splitTime(0) { }
 
 TCPstub::TCPstub(IPAddress ip, uint16_t port) :
   myIP(ip),
   myPort(port),
   worker(nullptr),
-  tm(nullptr) { }
+  tm(nullptr),
+  requests(0),
+  holdCount(0),
+  splitTime(0) { }
 
 // Destructor
 TCPstub::~TCPstub() {
@@ -181,6 +190,35 @@ void TCPstub::setIdentity(IPAddress ip, uint16_t port) {
   myPort = port;    
 }
 
+// respond: send the frame, or hold it back as holdResponses() or splitResponses() say
+void TCPstub::respond(ModbusMessage& frame) {
+  // Are we to collect responses?
+  if (holdCount) {
+    // Yes. Send all in one go, last first, when complete
+    held.push_back(frame);
+    if (held.size() >= holdCount) {
+      lock_guard<mutex> lockOut(outLock);
+      for (auto it = held.rbegin(); it != held.rend(); ++it) {
+        for (auto& b : *it) outQueue.push(b);
+      }
+      held.clear();
+      holdCount = 0;
+    }
+    return;
+  }
+  // Send it in two pieces?
+  size_t cut = splitTime ? frame.size() / 2 : frame.size();
+  {
+    lock_guard<mutex> lockOut(outLock);
+    for (size_t i = 0; i < cut; ++i) outQueue.push(frame[i]);
+  }
+  if (cut < frame.size()) {
+    delay(splitTime);
+    lock_guard<mutex> lockOut(outLock);
+    for (size_t i = cut; i < frame.size(); ++i) outQueue.push(frame[i]);
+  }
+}
+
 // handleConnection: worker task method
 void TCPstub::workerTask(TCPstub *instance) {
   while (1) {
@@ -191,21 +229,31 @@ void TCPstub::workerTask(TCPstub *instance) {
       uint8_t TCPhead[6];
       {
         lock_guard<mutex> lockIn(instance->inLock);
-        uint16_t i = 0;
-        // Serial.print("Read  ");
-        // Keep the TCPhead and discard the rest.
-        while (!instance->inQueue.empty()) {
-          uint8_t byte = instance->inQueue.front();
-          if (i < 6) {
-            TCPhead[i++] = byte;
-          }
+        for (uint8_t i = 0; i < 6; ++i) {
+          TCPhead[i] = instance->inQueue.front();
+          instance->inQueue.pop();
+        }
+      }
+      // Take the request the header tells about, and discard it. Requests sent back to back
+      // will be read one by one
+      uint16_t len = (TCPhead[4] << 8) | TCPhead[5];
+      if (TCPhead[2] || TCPhead[3] || len > 254) {
+        // Out of sync - drop all there is
+        len = instance->inQueue.size();
+      }
+      uint32_t waitStart = millis();
+      while (instance->inQueue.size() < len && millis() - waitStart < 100) {
+        delay(1);
+      }
+      {
+        lock_guard<mutex> lockIn(instance->inLock);
+        while (len-- && !instance->inQueue.empty()) {
           instance->inQueue.pop();
-          // Serial.printf("%02X ", byte);
         }
-        // Serial.println((*instance->tm).size());
       }
       // Get the TID
-      tid = ((TCPhead[0] << 8) & 0xFF) | (TCPhead[1] & 0xFF);
+      tid = (TCPhead[0] << 8) | TCPhead[1];
+      instance->requests++;
 
       // Look for the tid in the TestCase map
       auto tc = (*instance->tm).find(tid);
@@ -216,39 +264,24 @@ void TCPstub::workerTask(TCPstub *instance) {
         // Does the test case prescribe an initial delay?
         if (myTest->delayTime) {
           // Yes. idle until time has passed
-          // Serial.printf("Wait for %d\n", myTest->delayTime);
           delay(myTest->delayTime);
         }
         // Do we have to send a response?
         if (myTest->response.size() > 0) {
-          // Yes, we do. Lock the outQueue, since we ar egoing to write to it
-          lock_guard<mutex> lockOut(instance->outLock);
-
-          // Are we asked to fake the transaction ID?
+          // Yes, we do. Are we asked to fake the transaction ID?
           if (myTest->fakeTransactionID == true) {
             TCPhead[0] += 13;
           }
 
           // Set the response size in the TCP header
-          TCPhead[4] = (myTest->response.size() << 8) & 0xFF;
+          TCPhead[4] = (myTest->response.size() >> 8) & 0xFF;
           TCPhead[5] = myTest->response.size() & 0xFF;
 
-          // Serial.print("Write ");
-          // Write the TCP header
-          for (uint8_t i = 0; i < 6; ++i) {
-            instance->outQueue.push(TCPhead[i]);
-            // Serial.printf("%02X ", TCPhead[i]);
-          }
-
-          // Now write the response
-          const uint8_t *cp = myTest->response.data();
-          size_t cnt = myTest->response.size();
-          while (cnt--) {
-            instance->outQueue.push(*cp);
-            // Serial.printf("%02X ", *cp);
-            cp++;
-          }
-          // Serial.println();
+          // TCP header and response make the frame
+          ModbusMessage frame;
+          frame.add(TCPhead, 6);
+          frame.append(myTest->response);
+          instance->respond(frame);
         }
         // Are we to stop ourselves after response has been sent?
         if (myTest->stopAfterResponding == true) {
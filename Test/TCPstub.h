@@ -7,7 +7,9 @@
 #include <Client.h>
 #include <map>
 #include <queue>
+#include <vector>
 #include <mutex>      // NOLINT
+#include <atomic>
 #include "ModbusMessage.h"
 
 using std::mutex;
@@ -88,6 +90,15 @@ public:
   // setIdentity changes the simulated host/port
   void setIdentity(IPAddress ip, uint16_t port);
 
+  // requestCount returns the number of requests the worker has received so far
+  inline uint32_t requestCount() { return requests; }
+
+  // holdResponses keeps the responses to the next count requests and sends them all at once, last first
+  inline void holdResponses(uint8_t count) { holdCount = count; }
+
+  // splitResponses sends each response in two pieces, the second one ms later. 0: in one piece
+  inline void splitResponses(uint32_t ms) { splitTime = ms; }
+
 protected:
   IPAddress myIP;
   uint16_t  myPort;
@@ -97,6 +108,13 @@ protected:
   queue<uint8_t> outQueue;
   mutex inLock;
   mutex outLock;
+  std::atomic<uint32_t> requests;
+  std::atomic<uint8_t> holdCount;
+  std::atomic<uint32_t> splitTime;
+  std::vector<ModbusMessage> held;
+
+  // respond: send the frame, or hold it back as holdResponses() or splitResponses() say
+  void respond(ModbusMessage& frame);
 
   // handleConnection: worker task method
   static void workerTask(TCPstub *instance);
@@ -15,6 +15,10 @@
 
 #include "TCPstub.h"
 #include "CoilData.h"
+#include "ModbusMessagePool.h"
+#include "ModbusReadCache.h"
+#include "ModbusRegisterBank.h"
+#include "ModbusChangeFilter.h"
 
 #define STRINGIFY(x) #x
 #define LNO(x) "line " STRINGIFY(x) " "
@@ -139,6 +143,35 @@ ModbusMessage FC06(ModbusMessage request) {
   return ECHO_RESPONSE;
 }
 
+// Worker function function code 0x10
+ModbusMessage FC10(ModbusMessage request) {
+  uint16_t addr = 0;        // Start address to write
+  uint16_t wrds = 0;        // Number of words to write
+  ModbusMessage response;
+
+  // Get addr and words from data array. Values are MSB-first, get() will convert to binary
+  request.get(2, addr, wrds);
+
+  // Range valid?
+  if (!addr || !wrds || (addr + wrds - 1) > 32 || request.size() != 7 + wrds * 2) {
+    // No. Return error response
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+    return response;
+  }
+
+  // Modbus address is 1..n, memory address 0..n-1
+  addr--;
+
+  // Fill in new values
+  for (uint16_t i = 0; i < wrds; i++) {
+    request.get(7 + i * 2, memo[addr + i]);
+  }
+
+  // Return address and number of words written
+  response.add(request.getServerID(), request.getFunctionCode(), (uint16_t)(addr + 1), wrds);
+  return response;
+}
+
 // Worker function function code 0x41 (user defined)
 ModbusMessage FC41(ModbusMessage request) {
   // return nothing to test timeout
@@ -425,6 +458,15 @@ bool MSG08(uint8_t serverID, uint8_t functionCode, Error error, const char *name
   return testOutput(__func__, name, makeVector(expected), msg);
 }
 
+bool MSG09(uint8_t serverID, uint8_t functionCode, uint16_t p1, uint16_t p2, uint16_t p3, uint16_t p4, uint8_t count, uint16_t *arrayOfWords, const char *name, const char *expected) {
+  ModbusMessage msg;
+  Error e = msg.setMessage(serverID, functionCode, p1, p2, p3, p4, count, arrayOfWords);
+  if (e != SUCCESS) {
+    msg.setError(serverID, functionCode, e);
+  }
+  return testOutput(__func__, name, makeVector(expected), msg);
+}
+
 void handleData(ModbusMessage response, uint32_t token) 
 {
   // catch highest token processed
@@ -457,6 +499,87 @@ void handleError(Error err, uint32_t token)
   }
 }
 
+// TestServer: a ModbusServer without any connection, to be used by localRequest() only.
+// Every test gets its own, so the sealed state or the limits set will not touch the others
+class TestServer : public ModbusServer {
+public:
+  using ModbusServer::deferRequest;
+  using ModbusServer::admit;
+  using ModbusServer::release;
+  using ModbusServer::shed;
+  using ModbusServer::expireDeferred;
+protected:
+  void isInstance() { }
+};
+
+// Deferred worker test helpers. FCdeferred keeps the responder and has DeferredTask respond with
+// deferredResponse 50ms later, and with deferredLate - if it is set - another 50ms later.
+MBSresponder deferredResponder;
+ModbusMessage deferredResponse;
+ModbusMessage deferredLate;
+
+void DeferredTask(void *) {
+  delay(50);
+  deferredResponder(deferredResponse);
+  if (deferredLate.size()) {
+    delay(50);
+    deferredResponder(deferredLate);
+  }
+  vTaskDelete(NULL);
+}
+
+void FCdeferred(ModbusMessage request, MBSresponder respond) {
+  deferredResponder = respond;
+  xTaskCreatePinnedToCore(DeferredTask, "DeferredTask", 4096, nullptr, 5, nullptr, 1);
+}
+
+// Register bank stress test helpers. BankTask writes the same value into all 8 holding
+// registers of the bank, in two steps within one update, until bankWriting is false.
+std::atomic<bool> bankWriting(false);
+std::atomic<bool> bankWriterDone(false);
+
+void BankTask(void *b) {
+  ModbusRegisterBank *bank = static_cast<ModbusRegisterBank *>(b);
+  uint16_t values[4];
+  uint16_t value = 0;
+  while (bankWriting) {
+    value++;
+    for (uint8_t i = 0; i < 4; ++i) values[i] = value;
+    bank->beginUpdate();
+    bank->setHoldingRegisters(0, 4, values);
+    bank->setHoldingRegisters(4, 4, values);
+    bank->endUpdate();
+  }
+  bankWriterDone = true;
+  vTaskDelete(NULL);
+}
+
+// TestClient: a ModbusClient only collecting the requests given to it by addRequestH().
+// The tests respond to them through the completions kept, or split up responses by deliverParts().
+class TestClient : public ModbusClient {
+public:
+  using ModbusClient::coalesce;
+  using ModbusClient::deliverParts;
+  std::vector<ModbusMessage> requests;
+  std::vector<SyncHandle> completions;
+  uint32_t pendingRequests() { return 0; }
+protected:
+  void isInstance() { }
+  Error addRequestM(ModbusMessage msg, uint32_t token) { return SUCCESS; }
+  ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token) { return ModbusMessage(); }
+  Error addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion) {
+    requests.push_back(msg);
+    completions.push_back(completion);
+    return SUCCESS;
+  }
+};
+
+// TestBridge: a bridge taking requests by deferRequest() only
+class TestBridge : public ModbusBridgeWiFi {
+public:
+  using ModbusServer::deferRequest;
+};
+
 // setup() called once at startup. 
 // We will do all test here to have them run once
 void setup()
@@ -586,6 +709,17 @@ void setup()
   MSG08(1, 0x05, (Error)0xE1, LNO(__LINE__) "correct call", "01 85 E1");
   MSG08(1, 0x05, (Error)0x73, LNO(__LINE__) "correct call (unk.err)", "01 85 73");
 
+  // #### MSG, setMessage(serverID, functionCode, p1, p2, p3, p4, count, arrayOfWords) #09
+  MSG09(0, 0x17, 0x1122, 0x0002, 0x3344, 2, 4, words, LNO(__LINE__) "invalid server id",        "00 97 E1");
+  MSG09(1, 0x07, 0x1122, 0x0002, 0x3344, 2, 4, words, LNO(__LINE__) "invalid FC for MSG09",     "01 87 E6");
+
+  MSG09(1, 0x17, 0x1020, 3, 0x2030, 2, 4, words, LNO(__LINE__) "correct call 0x17",
+        "01 17 10 20 00 03 20 30 00 02 04 00 00 11 11");
+  MSG09(1, 0x17, 0x1020, 3, 0x2030, 2, 6, words, LNO(__LINE__) "wrong word count 0x17", "01 97 03");
+  MSG09(1, 0x17, 0x1020, 0, 0x2030, 2, 4, words, LNO(__LINE__) "illegal read count(0) 0x17", "01 97 E7");
+  MSG09(1, 0x17, 0x1020, 126, 0x2030, 2, 4, words, LNO(__LINE__) "illegal read count(126) 0x17", "01 97 E7");
+  MSG09(1, 0x17, 0x1020, 3, 0x2030, 122, 244, words, LNO(__LINE__) "illegal write count(122) 0x17", "01 97 E7");
+
   // Testing add()
   ModbusMessage adder;
 
@@ -779,14 +913,72 @@ void setup()
   delay(5000);
   stub.flush();
 
-  // Send response with wrong transaction ID
+  // Case to test request expiry. The first request is held up by the stub until it times out,
+  // so the second one will outlive its ttl in the queue. It must be answered with REQUEST_EXPIRED
+  // and never be sent.
+  stub.setIdentity(testHost, 502);
+  TestTCP.setTarget(testHost, 502, 500, 200);
+  uint32_t stubRequests = stub.requestCount();
+  tc = new TestCase { 
+    .name = LNO(__LINE__),
+    .testname = "Request blocking the queue",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 07"),
+    .expected = makeVector("01 87 E0"),
+    .delayTime = 3000,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(tc->token, 1, 0x07);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+  tc = new TestCase { 
+    .name = LNO(__LINE__),
+    .testname = "Request expired in queue",
+    .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+    .token = Token++,
+    .response = makeVector("01 03 02 11 11"),
+    .expected = makeVector("01 83 F1"),
+    .delayTime = 0,
+    .stopAfterResponding = false,
+    .fakeTransactionID = false
+  };
+  testCasesByTID[tc->transactionID] = tc;
+  testCasesByToken[tc->token] = tc;
+  e = TestTCP.addRequest(RequestOptions(RequestPriority::BULK, 200), tc->token, 1, 0x03, 1, 1);
+  if (e != SUCCESS) {
+    ModbusMessage r;
+    r.add(e);
+    testOutput(tc->testname, tc->name, tc->expected, r);
+    highestTokenProcessed = tc->token;
+  }
+  // Wait for secure timeout end
+  WAIT_FOR_FINISH(TestTCP)
+  delay(5000);
+  stub.flush();
+  // Only the first request may have reached the stub
+  testsExecuted++;
+  if (stub.requestCount() - stubRequests == 1) {
+    testsPassed++;
+  } else {
+    Serial.printf(LNO(__LINE__) "%u requests sent instead of 1\n", stub.requestCount() - stubRequests);
+  }
+
+  // Send response with wrong transaction ID. It is taken for a late one and dropped - the request times out
   tc = new TestCase { 
     .name = LNO(__LINE__),
     .testname = "Wrong transaction ID in response",
     .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
     .token = Token++,
     .response = makeVector("01 07"),
-    .expected = makeVector("01 87 EB"),
+    .expected = makeVector("01 87 E0"),
     .delayTime = 0,
     .stopAfterResponding = false,
     .fakeTransactionID = true
@@ -1088,6 +1280,216 @@ void setup()
     highestTokenProcessed = tc->token;
   }
 
+  WAIT_FOR_FINISH(TestTCP)
+
+  // Pipelined requests: several requests are sent before the responses arrive
+  TestTCP.setMaxInflightRequests(4);
+  TestTCP.setTarget(testHost, 502, 2000, 0);
+  stub.setIdentity(testHost, 502);
+  for (uint8_t i = 0; i < 4; ++i) {
+    tc = new TestCase { 
+      .name = LNO(__LINE__),
+      .testname = "Pipelined 0x03 request",
+      .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+      .token = Token++,
+      .response = makeVector("01 03 02 00 00"),
+      .expected = makeVector("01 03 02 00 00"),
+      .delayTime = 0,
+      .stopAfterResponding = false,
+      .fakeTransactionID = false
+    };
+    tc->response.resize(4);
+    tc->response.add(i);
+    tc->expected = tc->response;
+    testCasesByTID[tc->transactionID] = tc;
+    testCasesByToken[tc->token] = tc;
+    e = TestTCP.addRequest(tc->token, 1, 0x03, 1 + i, 1);
+    if (e != SUCCESS) {
+      ModbusMessage r;
+      r.add(e);
+      testOutput(tc->testname, tc->name, tc->expected, r);
+      highestTokenProcessed = tc->token;
+    }
+    // The queue takes 2 requests only - let the worker send this one first
+    delay(10);
+  }
+  WAIT_FOR_FINISH(TestTCP)
+
+  // Pipelined requests: responses matched by the transaction ID, however they arrive
+  {
+    // pipelined: send a read of address, to be answered by response
+    auto pipelined = [&](const char *name, const char *testname, const char *response, const char *expected, uint16_t address, bool fakeTID) {
+      tc = new TestCase { 
+        .name = name,
+        .testname = testname,
+        .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+        .token = Token++,
+        .response = makeVector(response),
+        .expected = makeVector(expected),
+        .delayTime = 0,
+        .stopAfterResponding = false,
+        .fakeTransactionID = fakeTID
+      };
+      testCasesByTID[tc->transactionID] = tc;
+      testCasesByToken[tc->token] = tc;
+      e = TestTCP.addRequest(tc->token, 1, 0x03, address, 1);
+      if (e != SUCCESS) {
+        ModbusMessage r;
+        r.add(e);
+        testOutput(tc->testname, tc->name, tc->expected, r);
+        highestTokenProcessed = tc->token;
+      }
+      // The queue takes 2 requests only - let the worker send this one first
+      delay(10);
+    };
+    // Responses are processed out of order here - the highest token is no sign of being done
+    auto waitForAll = [&]() {
+      while (TestTCP.pendingRequests()) delay(10);
+    };
+
+    // Three responses arriving in reverse order, glued together in one read
+    stub.holdResponses(3);
+    pipelined(LNO(__LINE__), "Out of order, glued (1)", "01 03 02 00 11", "01 03 02 00 11", 1, false);
+    pipelined(LNO(__LINE__), "Out of order, glued (2)", "01 03 02 00 12", "01 03 02 00 12", 2, false);
+    pipelined(LNO(__LINE__), "Out of order, glued (3)", "01 03 02 00 13", "01 03 02 00 13", 3, false);
+    waitForAll();
+
+    // A response with an unknown transaction ID is dropped: its request times out, the other is served
+    stub.holdResponses(2);
+    pipelined(LNO(__LINE__), "Unknown transaction ID", "01 03 02 00 21", "01 83 E0", 1, true);
+    pipelined(LNO(__LINE__), "Behind unknown transaction ID", "01 03 02 00 22", "01 03 02 00 22", 2, false);
+    waitForAll();
+
+    // Responses split into two pieces, the cut in the TCP header
+    stub.splitResponses(50);
+    pipelined(LNO(__LINE__), "Split response (1)", "01 03 02 00 31", "01 03 02 00 31", 1, false);
+    pipelined(LNO(__LINE__), "Split response (2)", "01 03 02 00 32", "01 03 02 00 32", 2, false);
+    waitForAll();
+    stub.splitResponses(0);
+  }
+  TestTCP.setMaxInflightRequests(1);
+
+  // Priority lanes and time to live: requests queued behind one the stub takes its time to answer
+  {
+    // lane: queue a read of address with options, answered by response after delayTime
+    auto lane = [&](const char *name, const char *testname, RequestOptions o, const char *response, const char *expected, uint16_t address, uint32_t delayTime) {
+      tc = new TestCase { 
+        .name = name,
+        .testname = testname,
+        .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+        .token = Token++,
+        .response = makeVector(response),
+        .expected = makeVector(expected),
+        .delayTime = delayTime,
+        .stopAfterResponding = false,
+        .fakeTransactionID = false
+      };
+      testCasesByTID[tc->transactionID] = tc;
+      testCasesByToken[tc->token] = tc;
+      e = TestTCP.addRequest(o, tc->token, 1, 0x03, address, 1);
+      if (e != SUCCESS) {
+        ModbusMessage r;
+        r.add(e);
+        testOutput(tc->testname, tc->name, tc->expected, r);
+        highestTokenProcessed = tc->token;
+      }
+      // The inbox takes 2 requests only - let the worker queue this one first
+      delay(10);
+    };
+
+    // A CONTROL request overtakes the BULK requests queued before it
+    lane(LNO(__LINE__), "Lanes, blocking", RequestPriority::BULK, "01 03 02 00 41", "01 03 02 00 41", 1, 300);
+    lane(LNO(__LINE__), "Lanes, BULK (1)", RequestPriority::BULK, "01 03 02 00 42", "01 03 02 00 42", 2, 200);
+    lane(LNO(__LINE__), "Lanes, BULK (2)", RequestPriority::BULK, "01 03 02 00 43", "01 03 02 00 43", 3, 200);
+    lane(LNO(__LINE__), "Lanes, CONTROL", RequestPriority::CONTROL, "01 03 02 00 44", "01 03 02 00 44", 4, 0);
+    uint32_t control = tc->token;
+    uint32_t waitStart = millis();
+    while (highestTokenProcessed < control && millis() - waitStart < 3000) delay(1);
+    // Answered to CONTROL, both BULK requests still have to be served
+    uint32_t behind = TestTCP.pendingRequests();
+    testsExecuted++;
+    if (highestTokenProcessed >= control && behind == 2) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "CONTROL request did not overtake, %u requests left behind\n", behind);
+    }
+    while (TestTCP.pendingRequests()) delay(10);
+
+    // A request waiting longer than its time to live is answered with REQUEST_EXPIRED, unsent.
+    // One that is due in time is sent, in the same lane
+    uint32_t sentBefore = stub.requestCount();
+    lane(LNO(__LINE__), "TTL, blocking", RequestPriority::BULK, "01 03 02 00 51", "01 03 02 00 51", 1, 300);
+    lane(LNO(__LINE__), "TTL expired", RequestOptions(RequestPriority::ALARM, 100), "01 03 02 00 52", "01 83 F1", 2, 0);
+    lane(LNO(__LINE__), "TTL in time", RequestOptions(RequestPriority::ALARM, 2000), "01 03 02 00 53", "01 03 02 00 53", 3, 0);
+    while (TestTCP.pendingRequests()) delay(10);
+    testsExecuted++;
+    if (stub.requestCount() - sentBefore == 2) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "%u requests sent instead of 2\n", stub.requestCount() - sentBefore);
+    }
+  }
+
+  // Connection pool must not be changed while the client is running
+  testsExecuted++;
+  if (!TestTCP.addConnection(stub)) {
+    testsPassed++;
+  } else {
+    Serial.print(LNO(__LINE__) "addConnection() accepted while running\n");
+  }
+  WAIT_FOR_FINISH(TestTCP)
+
+  // Change filter on two targets with the same server ID and range: each keeps its own values
+  {
+    std::vector<std::string> reported;
+    ModbusChangeFilter filter([&reported](const ModbusChange& c, uint32_t) {
+      char buf[32];
+      snprintf(buf, 32, "%08X:%u %X", c.host, c.port, c.values[0]);
+      reported.push_back(buf);
+    });
+    TestTCP.useChangeFilter(&filter);
+    IPAddress hosts[4] = { testHost, testHost2, testHost, testHost2 };
+    const char *responses[4] = { "01 03 02 00 05", "01 03 02 00 07", "01 03 02 00 05", "01 03 02 00 07" };
+    for (uint8_t i = 0; i < 4; ++i) {
+      TestTCP.setTarget(hosts[i], 502, 2000, 200);
+      stub.setIdentity(hosts[i], 502);
+      tc = new TestCase {
+        .name = LNO(__LINE__),
+        .testname = "Change filter, two targets",
+        .transactionID = static_cast<uint16_t>(TestTCP.getMessageCount() & 0xFFFF),
+        .token = Token++,
+        .response = makeVector(responses[i]),
+        .expected = makeVector(responses[i]),
+        .delayTime = 0,
+        .stopAfterResponding = true,
+        .fakeTransactionID = false
+      };
+      testCasesByTID[tc->transactionID] = tc;
+      testCasesByToken[tc->token] = tc;
+      e = TestTCP.addRequest(tc->token, 1, READ_HOLD_REGISTER, 1, 1);
+      if (e != SUCCESS) {
+        ModbusMessage r;
+        r.add(e);
+        testOutput(tc->testname, tc->name, tc->expected, r);
+      }
+      WAIT_FOR_FINISH(TestTCP)
+      // The filter took the response - handleData() will not see it
+      highestTokenProcessed = tc->token;
+    }
+    TestTCP.useChangeFilter(nullptr);
+    // Only the first poll of each target is reported, the second ones are unchanged
+    std::vector<std::string> expected = { "C0A60101:502 5", "1AB70416:502 7" };
+    testsExecuted++;
+    if (reported == expected) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Change filter with two targets: %u changes reported\n", (unsigned int)reported.size());
+      for (auto& r : reported) {
+        Serial.printf("   %s\n", r.c_str());
+      }
+    }
+  }
+
   // Print summary. We will have to wait a bit to get all test cases executed!
   WAIT_FOR_FINISH(TestTCP)
 
@@ -1171,6 +1573,7 @@ void setup()
     RTUserver.registerWorker(1, READ_HOLD_REGISTER, &FC03);      // FC=03 for serverID=1
     RTUserver.registerWorker(1, READ_INPUT_REGISTER, &FC03);     // FC=04 for serverID=1
     RTUserver.registerWorker(1, WRITE_HOLD_REGISTER, &FC06);     // FC=06 for serverID=1
+    RTUserver.registerWorker(1, WRITE_MULT_REGISTERS, &FC10);    // FC=10 for serverID=1
     RTUserver.registerWorker(1, USER_DEFINED_44, &FC44);         // FC=44 for serverID=1
     RTUserver.registerWorker(1, USER_DEFINED_45, &FC45);         // FC=45 for serverID=1
     RTUserver.registerWorker(2, READ_HOLD_REGISTER, &FC03);      // FC=03 for serverID=2
@@ -1546,6 +1949,52 @@ void setup()
     // We will have to wait a bit to get all test cases executed!
     WAIT_FOR_FINISH(RTUclient)
 
+    // Batch write: touching ranges are merged, each write gets the result of its request.
+    // 2..3 and 4 go as one FC 0x10, 20 as FC 0x06, 31 and 32..33 as one FC 0x10 beyond memo
+    {
+      std::vector<Error> batchResults;
+      uint32_t batchToken = 0;
+      std::atomic<bool> batchDone(false);
+      uint32_t sent = RTUclient.getMessageCount();
+      std::vector<BatchWrite> batch = {
+        BatchWrite(1, 2, { 0x1111, 0x2222 }),
+        BatchWrite(1, 4, { 0x3333 }),
+        BatchWrite(1, 20, { 0x4444 }),
+        BatchWrite(1, 31, { 0x5555 }),
+        BatchWrite(1, 32, { 0x6666, 0x7777 }),
+      };
+      uint32_t t = Token++;
+      e = RTUclient.addBatchWrite(batch, [&](const std::vector<Error>& results, uint32_t token) {
+        batchResults = results;
+        batchToken = token;
+        batchDone = true;
+      }, t);
+      for (uint16_t i = 0; i < 50 && !batchDone; ++i) delay(100);
+      highestTokenProcessed = t;
+
+      testsExecuted++;
+      if (e == SUCCESS && RTUclient.getMessageCount() - sent == 3) {
+        testsPassed++;
+      } else {
+        Serial.printf(LNO(__LINE__) "Batch write queued as %u requests (%02X)\n", (unsigned int)(RTUclient.getMessageCount() - sent), e);
+      }
+
+      testsExecuted++;
+      std::vector<Error> expected = { SUCCESS, SUCCESS, SUCCESS, ILLEGAL_DATA_ADDRESS, ILLEGAL_DATA_ADDRESS };
+      if (batchDone && batchToken == t && batchResults == expected) {
+        testsPassed++;
+      } else {
+        Serial.printf(LNO(__LINE__) "Batch write results wrong (%u results)\n", (unsigned int)batchResults.size());
+      }
+
+      testsExecuted++;
+      if (memo[1] == 0x1111 && memo[2] == 0x2222 && memo[3] == 0x3333 && memo[19] == 0x4444 && memo[30] != 0x5555) {
+        testsPassed++;
+      } else {
+        Serial.print(LNO(__LINE__) "Batch write values not written as expected\n");
+      }
+    }
+
     // Test Broadcasts
     // Set up some BC data
     uint8_t bcdata[] = "Broadcast data #1";
@@ -2214,6 +2663,901 @@ void setup()
   // Print summary.
   Serial.printf("----->    FC redefiniton: %4d, passed: %4d\n", testsExecuted, testsPassed);
 
+  // ******************************************************************************
+  // Message pool tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  // Servers and clients may hold pool buffers right now, so all checks are relative
+  uint16_t poolBase = ModbusMessagePool::inUse();
+  uint32_t poolExhausted = ModbusMessagePool::exhausted();
+
+  // #1 - acquire and release a single buffer
+  testsExecuted++;
+  ModbusMessage *pm = ModbusMessagePool::acquire();
+  if (pm && pm->size() == 0 && ModbusMessagePool::inUse() == poolBase + 1) {
+    pm->add((uint8_t)1, (uint8_t)3);
+    ModbusMessagePool::release(pm);
+    if (ModbusMessagePool::inUse() == poolBase) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Message pool #1 release failed\n");
+    }
+  } else {
+    Serial.print(LNO(__LINE__) "Message pool #1 acquire failed\n");
+  }
+
+  // #2 - recycled buffers must be empty
+  testsExecuted++;
+  pm = ModbusMessagePool::acquire();
+  if (pm->size() == 0) {
+    testsPassed++;
+  } else {
+    Serial.print(LNO(__LINE__) "Message pool #2 buffer not empty\n");
+  }
+  ModbusMessagePool::release(pm);
+
+  // #3 - exhaust the pool
+  testsExecuted++;
+  {
+    ModbusMessage *pms[MESSAGE_POOL_SIZE + 1];
+    uint16_t cnt = ModbusMessagePool::poolSize() - poolBase + 1;
+    for (uint16_t i = 0; i < cnt; ++i) {
+      pms[i] = ModbusMessagePool::acquire();
+    }
+    bool okay = (ModbusMessagePool::highWaterMark() == ModbusMessagePool::poolSize());
+    okay = okay && (ModbusMessagePool::exhausted() == poolExhausted + 1);
+    for (uint16_t i = 0; i < cnt; ++i) {
+      ModbusMessagePool::release(pms[i]);
+    }
+    okay = okay && (ModbusMessagePool::inUse() == poolBase);
+    if (okay) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Message pool #3 exhaustion failed\n");
+    }
+  }
+
+  // Print summary.
+  Serial.printf("----->    Message pool tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // ModbusMessageView tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    // A TCP packet with MBAP header in front
+    ModbusMessage tcpPacket;
+    tcpPacket.add((uint16_t)0x1234, (uint16_t)0, (uint16_t)6);
+    tcpPacket.add((uint8_t)1, READ_HOLD_REGISTER, (uint16_t)0x1020, (uint16_t)4);
+    ModbusMessageView packetView(tcpPacket);
+
+    // Strip MBAP header by slicing
+    ModbusMessageView mv = packetView.slice(6);
+    testOutput("View slice", LNO(__LINE__), makeVector("01 03 10 20 00 04"), static_cast<ModbusMessage>(mv));
+
+    // Value extraction from a view
+    testsExecuted++;
+    uint16_t addr = 0;
+    uint16_t words = 0;
+    if (mv.getServerID() == 1 && mv.getFunctionCode() == READ_HOLD_REGISTER && mv.get(2, addr, words) == 6 && addr == 0x1020 && words == 4) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "View value extraction failed\n");
+    }
+
+    // Values not fitting shall not be read
+    testsExecuted++;
+    uint32_t tooLong = 0xFFFFFFFF;
+    if (mv.get(4, tooLong) == 4 && tooLong == 0 && packetView.slice(12).size() == 0) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "View bounds check failed\n");
+    }
+
+    // A view worker shall be served by localRequest()
+    MBserver.registerWorker(4, READ_HOLD_REGISTER, [](ModbusMessageView request) -> ModbusMessage {
+      ModbusMessage response;
+      response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)2, (uint16_t)(request[3] + request[5]));
+      return response;
+    });
+    testOutput("View worker", LNO(__LINE__), makeVector("04 03 02 00 24"), MBserver.localRequest(ModbusMessage(4, READ_HOLD_REGISTER, (uint16_t)0x1020, (uint16_t)4)));
+    MBserver.unregisterWorker(4);
+  }
+
+  // Print summary.
+  Serial.printf("----->    ModbusMessageView tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Sealed dispatch table tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    TestServer sealed;
+    sealed.registerWorker(1, READ_HOLD_REGISTER, [](ModbusMessage request) -> ModbusMessage {
+      ModbusMessage response;
+      response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)2, (uint16_t)0x0303);
+      return response;
+    });
+    sealed.registerWorker(1, ANY_FUNCTION_CODE, FCany);
+    sealed.registerWorker(2, WRITE_HOLD_REGISTER, [](ModbusMessage request) -> ModbusMessage {
+      return ECHO_RESPONSE;
+    });
+    sealed.seal();
+
+    // #1 - server is sealed
+    testsExecuted++;
+    if (sealed.isSealed()) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Sealed dispatch #1 server not sealed\n");
+    }
+
+    // #2 - exact function code is looked up in the table
+    testOutput("Sealed dispatch", LNO(__LINE__), makeVector("01 03 02 03 03"), sealed.localRequest(ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)1, (uint16_t)1)));
+
+    // #3 - other function codes fall back to the ANY_FUNCTION_CODE worker
+    testOutput("Sealed dispatch", LNO(__LINE__), makeVector("01 04 41 4E 59 20 46 43"), sealed.localRequest(ModbusMessage(1, READ_INPUT_REGISTER, (uint16_t)1, (uint16_t)1)));
+
+    // #4 - function codes above 0x7F are not in the table, but served by ANY_FUNCTION_CODE as well
+    testOutput("Sealed dispatch", LNO(__LINE__), makeVector("01 85 41 4E 59 20 46 43"), sealed.localRequest(makeVector("01 85 00 01")));
+
+    // #5 - no ANY_FUNCTION_CODE worker: unknown function codes are illegal, also above 0x7F
+    ModbusMessage expected;
+    expected.setError(2, READ_HOLD_REGISTER, ILLEGAL_FUNCTION);
+    testOutput("Sealed dispatch", LNO(__LINE__), expected, sealed.localRequest(ModbusMessage(2, READ_HOLD_REGISTER, (uint16_t)1, (uint16_t)1)));
+    expected.setError(2, 0x85, ILLEGAL_FUNCTION);
+    testOutput("Sealed dispatch", LNO(__LINE__), expected, sealed.localRequest(makeVector("02 85 00 01")));
+    testOutput("Sealed dispatch", LNO(__LINE__), makeVector("02 06 00 01 00 05"), sealed.localRequest(ModbusMessage(2, WRITE_HOLD_REGISTER, (uint16_t)1, (uint16_t)5)));
+
+    // #6 - unknown server IDs are not in the table
+    expected.setError(3, READ_HOLD_REGISTER, INVALID_SERVER);
+    testOutput("Sealed dispatch", LNO(__LINE__), expected, sealed.localRequest(ModbusMessage(3, READ_HOLD_REGISTER, (uint16_t)1, (uint16_t)1)));
+
+    // #7 - registrations after sealing are rejected
+    sealed.registerWorker(1, READ_INPUT_REGISTER, [](ModbusMessage request) -> ModbusMessage {
+      return ECHO_RESPONSE;
+    });
+    sealed.registerWorker(3, READ_HOLD_REGISTER, [](ModbusMessage request) -> ModbusMessage {
+      return ECHO_RESPONSE;
+    });
+    testOutput("Sealed dispatch", LNO(__LINE__), makeVector("01 04 41 4E 59 20 46 43"), sealed.localRequest(ModbusMessage(1, READ_INPUT_REGISTER, (uint16_t)1, (uint16_t)1)));
+    testsExecuted++;
+    if (!sealed.isServerFor(3) && !sealed.getWorker(3, READ_HOLD_REGISTER) && !sealed.unregisterWorker(1)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Sealed dispatch #7 registration accepted after sealing\n");
+    }
+  }
+
+  // Print summary.
+  Serial.printf("----->    Sealed dispatch tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Deferred worker tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    TestServer deferred;
+    deferred.registerDeferredWorker(1, READ_HOLD_REGISTER, FCdeferred);
+    deferred.registerDeferredWorker(1, WRITE_COIL, [](ModbusMessage request, MBSresponder respond) {
+      deferredResponder = respond;
+    });
+    deferred.registerWorker(1, READ_COIL, [](ModbusMessage request) -> ModbusMessage {
+      return ECHO_RESPONSE;
+    });
+
+    // #1 - response from another task in time: localRequest() waits for it
+    deferredResponse = makeVector("01 03 02 12 34");
+    deferredLate.clear();
+    testOutput("Deferred worker", LNO(__LINE__), makeVector("01 03 02 12 34"), deferred.localRequest(ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)1, (uint16_t)1)));
+    delay(100);
+
+    // #2 - the worker gives up and responds with TIMEOUT. The real response coming later is dropped
+    ModbusMessage answer;
+    uint16_t answers = 0;
+    MBSresponder collect = [&answer, &answers](ModbusMessage response) {
+      answer = response;
+      answers++;
+    };
+    uint32_t messages = deferred.getMessageCount();
+    uint32_t errors = deferred.getErrorCount();
+    deferredResponse.setError(1, READ_HOLD_REGISTER, TIMEOUT);
+    deferredLate = makeVector("01 03 02 56 78");
+    ModbusMessage request(1, READ_HOLD_REGISTER, (uint16_t)1, (uint16_t)1);
+    deferred.deferRequest(ModbusMessageView(request.data(), request.size()), collect);
+    delay(200);
+    testOutput("Deferred worker", LNO(__LINE__), makeVector("01 83 E0"), answer);
+    testsExecuted++;
+    if (answers == 1 && deferred.getMessageCount() - messages == 1 && deferred.getErrorCount() - errors == 1) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Deferred worker #2 late response was taken\n");
+    }
+
+    // #3 - deferRequest() only takes requests for deferred workers
+    answers = 0;
+    request = ModbusMessage(1, READ_COIL, (uint16_t)1, (uint16_t)1);
+    testsExecuted++;
+    if (!deferred.deferRequest(ModbusMessageView(request.data(), request.size()), collect)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Deferred worker #3 request for a plain worker taken\n");
+    }
+
+    // #4 - the responder outlives the request: the request buffer is gone when it is called
+    request = ModbusMessage(1, WRITE_COIL, (uint16_t)7, (uint16_t)0xFF00);
+    testsExecuted++;
+    if (deferred.deferRequest(ModbusMessageView(request.data(), request.size()), collect) && answers == 0) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Deferred worker #4 request not deferred\n");
+    }
+    request = ModbusMessage(1, WRITE_COIL, (uint16_t)0, (uint16_t)0);
+    deferredResponder(ECHO_RESPONSE);
+    testOutput("Deferred worker", LNO(__LINE__), makeVector("01 05 00 07 FF 00"), answer);
+
+    // #5 - a second response to the same request is ignored
+    deferredResponder(makeVector("01 05 00 00 00 00"));
+    testsExecuted++;
+    if (answers == 1) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Deferred worker #5 second response taken\n");
+    }
+
+    // #6 - a worker never responding: localRequest() gives up after the deferred timeout
+    deferred.setDeferredTimeout(100);
+    unsigned long start = millis();
+    testOutput("Deferred worker", LNO(__LINE__), makeVector("01 85 E0"), deferred.localRequest(ModbusMessage(1, WRITE_COIL, (uint16_t)7, (uint16_t)0xFF00)));
+    testsExecuted++;
+    unsigned long waited = millis() - start;
+    if (waited >= 100 && waited < 1000) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Deferred worker #6 waited %lu ms, expected 100\n", waited);
+    }
+    deferredResponder(ECHO_RESPONSE);
+
+    // #7 - deferRequest(): expireDeferred() answers with TIMEOUT once it is due, the late response is dropped
+    answers = 0;
+    answer.clear();
+    request = ModbusMessage(1, WRITE_COIL, (uint16_t)7, (uint16_t)0xFF00);
+    deferred.deferRequest(ModbusMessageView(request.data(), request.size()), collect);
+    deferred.expireDeferred();
+    testsExecuted++;
+    if (answers == 0) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Deferred worker #7 expired before the timeout\n");
+    }
+    delay(150);
+    deferred.expireDeferred();
+    deferredResponder(ECHO_RESPONSE);
+    testOutput("Deferred worker", LNO(__LINE__), makeVector("01 85 E0"), answer);
+    testsExecuted++;
+    if (answers == 1) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Deferred worker #7 %u responses\n", answers);
+    }
+
+    // #8 - a stopping server has all of them answered at once, even without a timeout
+    deferred.setDeferredTimeout(0);
+    answers = 0;
+    deferred.deferRequest(ModbusMessageView(request.data(), request.size()), collect);
+    deferred.expireDeferred();
+    bool kept = answers == 0;
+    deferred.expireDeferred(true);
+    testsExecuted++;
+    if (kept && answers == 1) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Deferred worker #8 %u responses\n", answers);
+    }
+    deferredResponder = nullptr;
+  }
+
+  // Print summary.
+  Serial.printf("----->    Deferred worker tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Read cache tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    ModbusReadCache cache(100);
+    ModbusMessage request(1, READ_HOLD_REGISTER, (uint16_t)10, (uint16_t)4);
+    ModbusMessage response;
+
+    // #1 - empty cache: a miss
+    testsExecuted++;
+    if (!cache.get(request, response) && cache.getMissCount() == 1) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Read cache #1 hit in empty cache\n");
+    }
+
+    // #2 - the response put is there for the same range and parts of it
+    ModbusMessage data = makeVector("01 03 08 00 01 00 02 00 03 00 04");
+    cache.put(request, data, cache.generation());
+    response.clear();
+    cache.get(request, response);
+    testOutput("Read cache", LNO(__LINE__), data, response);
+    ModbusMessage part(1, READ_HOLD_REGISTER, (uint16_t)11, (uint16_t)2);
+    response.clear();
+    cache.get(part, response);
+    testOutput("Read cache", LNO(__LINE__), makeVector("01 03 04 00 02 00 03"), response);
+
+    // #3 - other function codes and ranges beyond the entry are misses
+    ModbusMessage other(1, READ_INPUT_REGISTER, (uint16_t)10, (uint16_t)4);
+    ModbusMessage beyond(1, READ_HOLD_REGISTER, (uint16_t)12, (uint16_t)4);
+    testsExecuted++;
+    if (!cache.get(other, response) && !cache.get(beyond, response) && cache.getHitCount() == 2 && cache.getMissCount() == 3) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Read cache #3 hit for a range not cached\n");
+    }
+
+    // #4 - a write outside the range keeps the entry, one into it drops it
+    ModbusMessage write(1, WRITE_HOLD_REGISTER, (uint16_t)20, (uint16_t)0x55);
+    cache.invalidate(write);
+    testsExecuted++;
+    if (cache.get(request, response)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Read cache #4 entry dropped by unrelated write\n");
+    }
+    write = ModbusMessage(1, WRITE_HOLD_REGISTER, (uint16_t)12, (uint16_t)0x55);
+    cache.invalidate(write);
+    testsExecuted++;
+    if (!cache.get(request, response) && !cache.get(part, response)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Read cache #4 entry not dropped by write\n");
+    }
+
+    // #5 - a response read before a write is not taken
+    uint32_t generation = cache.generation();
+    cache.invalidate(write);
+    cache.put(request, data, generation);
+    testsExecuted++;
+    if (!cache.get(request, response)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Read cache #5 stale response taken\n");
+    }
+
+    // #6 - entries expire after maxAge
+    cache.put(request, data, cache.generation());
+    testsExecuted++;
+    if (cache.get(request, response)) {
+      delay(150);
+      if (!cache.get(request, response)) {
+        testsPassed++;
+      } else {
+        Serial.print(LNO(__LINE__) "Read cache #6 entry did not expire\n");
+      }
+    } else {
+      Serial.print(LNO(__LINE__) "Read cache #6 entry not taken\n");
+    }
+  }
+
+  // Print summary.
+  Serial.printf("----->    Read cache tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Bridge merged read tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    TestClient upstream;
+    TestBridge merging;
+    merging.attachServer(8, 4, READ_HOLD_REGISTER, &upstream);
+    merging.mergeReads(8);
+    std::vector<ModbusMessage> answers;
+    MBSresponder collect = [&answers](ModbusMessage response) {
+      answers.push_back(response);
+    };
+    ModbusMessage read(8, READ_HOLD_REGISTER, (uint16_t)1, (uint16_t)2);
+    ModbusMessage other(8, READ_HOLD_REGISTER, (uint16_t)5, (uint16_t)2);
+
+    // #1 - identical reads are forwarded once, another read on its own
+    for (uint8_t i = 0; i < 3; ++i) {
+      merging.deferRequest(ModbusMessageView(read.data(), read.size()), collect);
+    }
+    merging.deferRequest(ModbusMessageView(other.data(), other.size()), collect);
+    testsExecuted++;
+    if (upstream.requests.size() == 2 && answers.empty() && merging.pendingRequests(8) == 2) {
+      testsPassed++;
+      testOutput("Bridge merge", LNO(__LINE__), makeVector("04 03 00 01 00 02"), upstream.requests[0]);
+      testOutput("Bridge merge", LNO(__LINE__), makeVector("04 03 00 05 00 02"), upstream.requests[1]);
+
+      // #2 - all waiting for the read get its response
+      upstream.completions[0]->complete(makeVector("04 03 04 00 0A 00 0B"));
+      testsExecuted++;
+      if (answers.size() == 3) {
+        testsPassed++;
+        for (auto& a : answers) {
+          testOutput("Bridge merge", LNO(__LINE__), makeVector("08 03 04 00 0A 00 0B"), a);
+        }
+      } else {
+        Serial.printf(LNO(__LINE__) "Bridge merge #2 %u answers instead of 3\n", (unsigned int)answers.size());
+      }
+      answers.clear();
+      upstream.completions[1]->complete(makeVector("04 03 04 00 0C 00 0D"));
+      testsExecuted++;
+      if (answers.size() == 1) {
+        testsPassed++;
+        testOutput("Bridge merge", LNO(__LINE__), makeVector("08 03 04 00 0C 00 0D"), answers[0]);
+      } else {
+        Serial.printf(LNO(__LINE__) "Bridge merge #2 %u answers instead of 1\n", (unsigned int)answers.size());
+      }
+
+      // #3 - the read is forwarded again once its response is in. An upstream error goes to all
+      answers.clear();
+      merging.deferRequest(ModbusMessageView(read.data(), read.size()), collect);
+      merging.deferRequest(ModbusMessageView(read.data(), read.size()), collect);
+      testsExecuted++;
+      if (upstream.requests.size() == 3) {
+        testsPassed++;
+        ModbusMessage error;
+        error.setError(4, READ_HOLD_REGISTER, TIMEOUT);
+        upstream.completions[2]->complete(error);
+        testsExecuted++;
+        if (answers.size() == 2) {
+          testsPassed++;
+          for (auto& a : answers) {
+            testOutput("Bridge merge", LNO(__LINE__), makeVector("08 83 E0"), a);
+          }
+        } else {
+          Serial.printf(LNO(__LINE__) "Bridge merge #3 %u answers instead of 2\n", (unsigned int)answers.size());
+        }
+      } else {
+        Serial.printf(LNO(__LINE__) "Bridge merge #3 %u requests forwarded instead of 3\n", (unsigned int)upstream.requests.size());
+      }
+    } else {
+      Serial.printf(LNO(__LINE__) "Bridge merge #1 %u requests forwarded, %u answered\n", (unsigned int)upstream.requests.size(), (unsigned int)answers.size());
+    }
+
+    // Whatever is left over: respond, else the bridge will wait for it forever
+    for (auto& c : upstream.completions) {
+      c->complete(makeVector("04 03 04 00 00 00 00"));
+    }
+  }
+
+  // Print summary.
+  Serial.printf("----->    Bridge merge tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Register bank tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    ModbusRegisterBank bank(8, 2, 16);
+    TestServer bankServer;
+    bank.attach(bankServer, 1);
+
+    // #1 - values set are read back, by the application and by the server
+    uint16_t values[4] = { 1, 2, 3, 4 };
+    uint16_t readBack[4] = { 0 };
+    testsExecuted++;
+    if (bank.setHoldingRegisters(2, 4, values) && bank.getHoldingRegisters(2, 4, readBack)
+     && !memcmp(values, readBack, sizeof(values)) && bank.getHoldingRegister(5) == 4) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Register bank #1 values not read back\n");
+    }
+    testOutput("Register bank", LNO(__LINE__), makeVector("01 03 08 00 01 00 02 00 03 00 04"), bankServer.localRequest(ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)2, (uint16_t)4)));
+
+    // #2 - writes by the server are seen by the application
+    testOutput("Register bank", LNO(__LINE__), makeVector("01 06 00 07 12 34"), bankServer.localRequest(ModbusMessage(1, WRITE_HOLD_REGISTER, (uint16_t)7, (uint16_t)0x1234)));
+    testOutput("Register bank", LNO(__LINE__), makeVector("01 05 00 03 FF 00"), bankServer.localRequest(ModbusMessage(1, WRITE_COIL, (uint16_t)3, (uint16_t)0xFF00)));
+    testsExecuted++;
+    if (bank.getHoldingRegister(7) == 0x1234 && bank.getCoil(3) && !bank.getCoil(2)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Register bank #2 server writes not seen\n");
+    }
+
+    // #3 - addresses beyond the tables
+    ModbusMessage expected;
+    expected.setError(1, READ_HOLD_REGISTER, ILLEGAL_DATA_ADDRESS);
+    testOutput("Register bank", LNO(__LINE__), expected, bankServer.localRequest(ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)6, (uint16_t)4)));
+    testsExecuted++;
+    if (!bank.setHoldingRegisters(6, 4, values) && !bank.setInputRegister(2, 1) && bank.getHoldingRegister(8) == 0) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Register bank #3 address beyond table accepted\n");
+    }
+
+    // #4 - a read never sees an update half done, while another task is writing all the time
+    uint16_t zeroes[8] = { 0 };
+    bank.setHoldingRegisters(0, 8, zeroes);
+    bankWriting = true;
+    bankWriterDone = false;
+    xTaskCreatePinnedToCore(BankTask, "BankTask", 4096, &bank, 5, nullptr, 0);
+    uint32_t torn = 0;
+    uint32_t reads = 0;
+    uint32_t changes = 0;
+    uint16_t last = 0;
+    unsigned long start = millis();
+    while (millis() - start < 500) {
+      ModbusMessage response = bankServer.localRequest(ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)0, (uint16_t)8));
+      reads++;
+      uint16_t first = 0;
+      response.get(3, first);
+      for (uint8_t i = 1; i < 8; ++i) {
+        uint16_t v = 0;
+        response.get(3 + 2 * i, v);
+        if (v != first) {
+          torn++;
+          break;
+        }
+      }
+      if (first != last) changes++;
+      last = first;
+    }
+    bankWriting = false;
+    while (!bankWriterDone) {
+      delay(1);
+    }
+    testsExecuted++;
+    if (!torn && changes > 1) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Register bank #4 %u torn reads, %u changes seen in %u reads\n", torn, changes, reads);
+    }
+  }
+
+  // Print summary.
+  Serial.printf("----->    Register bank tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Adaptive timeout tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    ModbusHealth health;
+    health.setLimits(10, 3, 4000);
+    ModbusDevice device(5);
+    ModbusDevice other(6);
+    ModbusHealthEntry entry;
+
+    // #1 - nothing known: the client's timeout. The first response: srtt 20ms, rttvar 10ms
+    testsExecuted++;
+    bool unknown = health.timeout(device, 2000) == 2000;
+    health.success(device, 20000);
+    if (unknown && health.timeout(device, 2000) == 60) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Health #1 timeout %u, expected 60\n", health.timeout(device, 2000));
+    }
+
+    // #2 - degrade: each timeout doubles the wait
+    testsExecuted++;
+    health.failure(device);
+    uint32_t once = health.timeout(device, 2000);
+    health.failure(device);
+    uint32_t twice = health.timeout(device, 2000);
+    if (once == 120 && twice == 240 && health.admit(device)) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Health #2 timeouts %u, %u, expected 120, 240\n", once, twice);
+    }
+
+    // #3 - back off after the third timeout in a row. Other devices are not affected
+    testsExecuted++;
+    health.failure(device);
+    health.get(device, entry);
+    if (!health.admit(device) && entry.backedOff && entry.failures == 3 && entry.probeIn > 0 && entry.probeIn <= 1000
+     && health.admit(other) && health.timeout(other, 2000) == 2000) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Health #3 not backed off (failures %u, probe in %u)\n", entry.failures, entry.probeIn);
+    }
+
+    // #4 - a probe is let through after the back-off period, but only one
+    delay(1100);
+    testsExecuted++;
+    bool probe = health.admit(device);
+    if (probe && !health.admit(device)) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Health #4 probe %s\n", probe ? "not alone" : "refused");
+    }
+
+    // #5 - a failed probe doubles the back-off period
+    testsExecuted++;
+    health.failure(device);
+    health.get(device, entry);
+    if (!health.admit(device) && entry.backedOff && entry.probeIn > 1000 && entry.probeIn <= 2000) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Health #5 probe in %u, expected 1000..2000\n", entry.probeIn);
+    }
+
+    // #6 - recover: the first response ends the back-off and the doubling
+    testsExecuted++;
+    health.success(device, 20000);
+    health.get(device, entry);
+    if (health.admit(device) && !entry.backedOff && !entry.failures && health.timeout(device, 2000) == 50) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Health #6 not recovered (failures %u, timeout %u)\n", entry.failures, health.timeout(device, 2000));
+    }
+  }
+
+  // Print summary.
+  Serial.printf("----->    Adaptive timeout tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Change filter tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    // Changes reported, as "address:value value ..." each
+    std::vector<std::string> reported;
+    ModbusChangeFilter filter([&](const ModbusChange& c, uint32_t) {
+      char buf[16];
+      std::string s;
+      snprintf(buf, 16, "%u:", c.address);
+      s = buf;
+      for (uint16_t i = 0; i < c.count; ++i) {
+        snprintf(buf, 16, " %X", c.values ? c.values[i] : (c.coils[i] ? 1 : 0));
+        s += buf;
+      }
+      reported.push_back(s);
+    }, 2);
+    auto poll = [&](const char *response, uint16_t address, uint16_t count) {
+      reported.clear();
+      return filter.update(makeVector(response), address, count, 0);
+    };
+    auto expect = [&](std::vector<std::string> changes, const char *what, const char *line) {
+      testsExecuted++;
+      if (reported == changes) {
+        testsPassed++;
+      } else {
+        Serial.printf("%sChange filter %s: %u changes reported\n", line, what, (unsigned int)reported.size());
+        for (auto& r : reported) {
+          Serial.printf("   %s\n", r.c_str());
+        }
+      }
+    };
+
+    // #1 - the first poll of a range reports all of it, an unchanged one nothing
+    poll("01 03 08 00 01 00 02 00 03 00 04", 10, 4);
+    expect({ "10: 1 2 3 4" }, "first poll", LNO(__LINE__));
+    poll("01 03 08 00 01 00 02 00 03 00 04", 10, 4);
+    expect({}, "unchanged poll", LNO(__LINE__));
+
+    // #2 - only the runs of changed registers are reported
+    poll("01 03 08 00 01 00 12 00 13 00 04", 10, 4);
+    expect({ "11: 12 13" }, "one run", LNO(__LINE__));
+    poll("01 03 08 00 21 00 12 00 13 00 24", 10, 4);
+    expect({ "10: 21", "13: 24" }, "two runs", LNO(__LINE__));
+
+    // #3 - changes within the deadband are not reported until they add up
+    filter.setDeadband(1, READ_HOLD_REGISTER, 10, 1, 5);
+    poll("01 03 08 00 24 00 12 00 13 00 24", 10, 4);
+    expect({}, "change of 3 within deadband 5", LNO(__LINE__));
+    poll("01 03 08 00 27 00 12 00 13 00 24", 10, 4);
+    expect({ "10: 27" }, "change of 6 beyond deadband 5", LNO(__LINE__));
+
+    // #4 - coils are taken bit by bit
+    poll("01 01 01 05", 0, 4);
+    expect({ "0: 1 0 1 0" }, "first coil poll", LNO(__LINE__));
+    poll("01 01 01 07", 0, 4);
+    expect({ "1: 1" }, "coil changed", LNO(__LINE__));
+
+    // #5 - ranges beyond maxBlocks are reported completely every time
+    poll("01 04 02 00 05", 0, 1);
+    poll("01 04 02 00 05", 0, 1);
+    expect({ "0: 5" }, "range not kept", LNO(__LINE__));
+
+    // #6 - responses not matching the read are refused. clear() forgets the values
+    testsExecuted++;
+    uint32_t responses = filter.getResponseCount();
+    if (!poll("01 03 04 00 01 00 02", 10, 4) && !poll("01 83 02", 10, 4) && filter.getResponseCount() == responses) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Change filter took a response not matching the read\n");
+    }
+    filter.clear();
+    poll("01 03 08 00 27 00 12 00 13 00 24", 10, 4);
+    expect({ "10: 27 12 13 24" }, "poll after clear", LNO(__LINE__));
+
+    testsExecuted++;
+    if (filter.getResponseCount() == 11 && filter.getChangeCount() == 10) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Change filter counted %u responses, %u changes\n", filter.getResponseCount(), filter.getChangeCount());
+    }
+  }
+
+  // Print summary.
+  Serial.printf("----->    Change filter tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Request limit tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    TestServer limitServer;
+    const uint32_t clientA(0x0A000001);
+    const uint32_t clientB(0x0A000002);
+    // admitted: count the requests of a client let through, releasing each
+    auto admitted = [&](uint32_t client, uint16_t tries) {
+      uint16_t count = 0;
+      for (uint16_t i = 0; i < tries; ++i) {
+        if (limitServer.admit(client)) {
+          count++;
+          limitServer.release();
+        }
+      }
+      return count;
+    };
+
+    // #1 - a burst of 3 is let through, the 4th is shed
+    limitServer.limitRate(10, 3);
+    testsExecuted++;
+    uint16_t count = admitted(clientA, 4);
+    if (count == 3 && limitServer.getShedCount() == 1) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Request limits #1 %u of 4 admitted, %u shed\n", count, limitServer.getShedCount());
+    }
+
+    // #2 - another client has a bucket of its own
+    testsExecuted++;
+    count = admitted(clientB, 4);
+    if (count == 3 && limitServer.getShedCount() == 2) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Request limits #2 %u of 4 admitted, %u shed\n", count, limitServer.getShedCount());
+    }
+
+    // #3 - at 10 per second the bucket has taken up one more request after 120ms
+    delay(120);
+    testsExecuted++;
+    count = admitted(clientA, 3);
+    if (count == 1) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Request limits #3 %u admitted after refill, expected 1\n", count);
+    }
+
+    // #4 - no more than 2 in flight. The third is shed with SERVER_DEVICE_BUSY
+    limitServer.limitRate(0);
+    limitServer.limitInflight(2);
+    limitServer.resetCounts();
+    testsExecuted++;
+    bool first = limitServer.admit(clientA);
+    bool second = limitServer.admit(clientB);
+    bool third = limitServer.admit(clientA);
+    if (first && second && !third && limitServer.getShedCount() == 1) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Request limits #4 admitted %d %d %d, %u shed\n", first, second, third, limitServer.getShedCount());
+    }
+    ModbusMessage request(1, READ_HOLD_REGISTER, (uint16_t)1, (uint16_t)1);
+    testOutput("Request limits", LNO(__LINE__), makeVector("01 83 06"), limitServer.shed(ModbusMessageView(request)));
+
+    // #5 - a release makes room for the next one
+    limitServer.release();
+    testsExecuted++;
+    if (limitServer.admit(clientA) && !limitServer.admit(clientB)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Request limits #5 not admitted after release\n");
+    }
+    limitServer.release();
+    limitServer.release();
+    limitServer.limitInflight(0);
+  }
+
+  // Print summary.
+  Serial.printf("----->    Request limit tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
+  // ******************************************************************************
+  // Read coalescing tests
+  // ******************************************************************************
+  testsExecuted = 0;
+  testsPassed = 0;
+  {
+    TestClient client;
+    ModbusDevice device(1);
+    // Responses delivered, by token
+    std::map<uint32_t, ModbusMessage> got;
+    client.onResponseHandler([&got](ModbusMessage response, uint32_t token) { got[token] = response; });
+
+    // #1 - touching ranges above and below are merged into one read
+    ModbusMessage queued(1, READ_HOLD_REGISTER, (uint16_t)10, (uint16_t)4);
+    SyncHandle queuedSync = nullptr;
+    CoalescedParts parts;
+    bool above = client.coalesce(queued, 1, queuedSync, parts, ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)14, (uint16_t)2), 2, nullptr);
+    bool below = client.coalesce(queued, 1, queuedSync, parts, ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)6, (uint16_t)4), 3, nullptr);
+    testsExecuted++;
+    if (above && below && parts.size() == 3) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Coalescing #1 merged %d/%d, %u parts\n", above, below, (unsigned int)parts.size());
+    }
+    testOutput("Coalesced request", LNO(__LINE__), makeVector("01 03 00 06 00 0A"), queued);
+
+    // #2 - each token gets its own slice of the response
+    ModbusMessage response = makeVector("01 03 14 00 06 00 07 00 08 00 09 00 0A 00 0B 00 0C 00 0D 00 0E 00 0F");
+    client.deliverParts(device, parts, queued, response);
+    testOutput("Coalesced part 1", LNO(__LINE__), makeVector("01 03 08 00 0A 00 0B 00 0C 00 0D"), got[1]);
+    testOutput("Coalesced part 2", LNO(__LINE__), makeVector("01 03 04 00 0E 00 0F"), got[2]);
+    testOutput("Coalesced part 3", LNO(__LINE__), makeVector("01 03 08 00 06 00 07 00 08 00 09"), got[3]);
+
+    // #3 - coils: the bits of each part are shifted down to bit 0
+    ModbusMessage coils(1, READ_COIL, (uint16_t)0, (uint16_t)8);
+    CoalescedParts coilParts;
+    testsExecuted++;
+    if (client.coalesce(coils, 4, queuedSync, coilParts, ModbusMessage(1, READ_COIL, (uint16_t)8, (uint16_t)4), 5, nullptr)) {
+      testsPassed++;
+    } else {
+      Serial.print(LNO(__LINE__) "Coalescing #3 coils not merged\n");
+    }
+    response = makeVector("01 01 02 A5 0B");
+    client.deliverParts(device, coilParts, coils, response);
+    testOutput("Coalesced coils 1", LNO(__LINE__), makeVector("01 01 01 A5"), got[4]);
+    testOutput("Coalesced coils 2", LNO(__LINE__), makeVector("01 01 01 0B"), got[5]);
+
+    // #4 - an error response goes to all parts, and so does a response of the wrong length
+    got.clear();
+    response = makeVector("01 83 04");
+    client.deliverParts(device, parts, queued, response);
+    testsExecuted++;
+    if (got.size() == 3 && got[1] == got[2] && got[2] == got[3] && got[3] == response) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Coalescing #4 error delivered to %u parts\n", (unsigned int)got.size());
+    }
+    got.clear();
+    response = makeVector("01 03 04 00 06 00 07");
+    client.deliverParts(device, parts, queued, response);
+    ModbusMessage lengthError;
+    lengthError.setError(1, READ_HOLD_REGISTER, PACKET_LENGTH_ERROR);
+    testsExecuted++;
+    if (got.size() == 3 && got[1] == lengthError && got[2] == lengthError && got[3] == lengthError) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Coalescing #4 length error delivered to %u parts\n", (unsigned int)got.size());
+    }
+
+    // #5 - a gap, too many registers, another server or function code: not merged
+    ModbusMessage single(1, READ_HOLD_REGISTER, (uint16_t)10, (uint16_t)4);
+    ModbusMessage big(1, READ_HOLD_REGISTER, (uint16_t)0, (uint16_t)100);
+    CoalescedParts none;
+    bool gap = client.coalesce(single, 6, queuedSync, none, ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)15, (uint16_t)2), 7, nullptr);
+    bool large = client.coalesce(big, 6, queuedSync, none, ModbusMessage(1, READ_HOLD_REGISTER, (uint16_t)100, (uint16_t)30), 7, nullptr);
+    bool server = client.coalesce(single, 6, queuedSync, none, ModbusMessage(2, READ_HOLD_REGISTER, (uint16_t)14, (uint16_t)2), 7, nullptr);
+    bool fc = client.coalesce(single, 6, queuedSync, none, ModbusMessage(1, READ_INPUT_REGISTER, (uint16_t)14, (uint16_t)2), 7, nullptr);
+    testsExecuted++;
+    if (!gap && !large && !server && !fc && none.empty()) {
+      testsPassed++;
+    } else {
+      Serial.printf(LNO(__LINE__) "Coalescing #5 merged gap %d, large %d, server %d, fc %d\n", gap, large, server, fc);
+    }
+    testOutput("Not coalesced", LNO(__LINE__), makeVector("01 03 00 0A 00 04"), single);
+    testOutput("Not coalesced, too large", LNO(__LINE__), makeVector("01 03 00 00 00 64"), big);
+  }
+
+  // Print summary.
+  Serial.printf("----->    Read coalescing tests: %4d, passed: %4d\n", testsExecuted, testsPassed);
+
   // ******************************************************************************
   // Counter tests
   // ******************************************************************************
@@ -2221,6 +3565,7 @@ void setup()
   Serial.printf("RTUclient: %d messages, %d errors.\n", RTUclient.getMessageCount(), RTUclient.getErrorCount());
   Serial.printf("MBserver: %d messages, %d errors.\n", MBserver.getMessageCount(), MBserver.getErrorCount());
   Serial.printf("Bridge: %d messages, %d errors.\n", Bridge.getMessageCount(), Bridge.getErrorCount());
+  Serial.printf("Message pool: %d in use, high water mark %d, exhausted %u times.\n", ModbusMessagePool::inUse(), ModbusMessagePool::highWaterMark(), ModbusMessagePool::exhausted());
 
 /*
   // ******************************************************************************
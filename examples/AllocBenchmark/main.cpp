@@ -0,0 +1,125 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+
+// Benchmark counting heap allocations per transaction.
+// The global operator new is replaced by one counting its calls. A request is served by a local server,
+// its response handed over through a SyncCompletion and a MBOnData handler the way the clients do it,
+// and its CRC checked the way the RTU code does. Handing over a copy and handing over by std::move()
+// are run next to each other, so the difference is seen directly.
+
+// Includes: <Arduino.h> for Serial etc.
+#include <Arduino.h>
+#include <new>
+
+// Include the headers for the server, the client's SyncCompletion and RTUutils
+#include "ModbusServer.h"
+#include "ModbusClient.h"
+#include "RTUutils.h"
+
+// Number of transactions per test
+#define ROUNDS 1000
+
+// Allocation counter
+volatile uint32_t allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (!p) abort();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// A server to call localRequest() on - no connection needed
+class LocalServer : public ModbusServer {
+  void isInstance() {}
+};
+LocalServer server;
+
+// Worker answering FC 0x03 with two registers
+ModbusMessage FC03(ModbusMessage request) {
+  ModbusMessage response;
+  response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)4, (uint16_t)0x1234, (uint16_t)0x5678);
+  return response;
+}
+
+// Response handler as it would be registered with a client
+uint32_t responses = 0;
+MBOnData handler = [](ModbusMessage response, uint32_t token) {
+  if (response.getError() == SUCCESS) responses++;
+};
+
+// Print out one result line
+void report(const char *name, uint32_t count) {
+  Serial.printf("  %-28s %6.2f allocations/transaction\n", name, (float)count / ROUNDS);
+}
+
+// Setup() - we will do all in here
+void setup() {
+// Init Serial monitor
+  Serial.begin(115200);
+  while (!Serial) {}
+  Serial.println("__ OK __");
+
+  server.registerWorker(1, READ_HOLD_REGISTER, &FC03);
+  ModbusMessage request(1, READ_HOLD_REGISTER, (uint16_t)10, (uint16_t)2);
+  ModbusMessage frame(request);
+  RTUutils::addCRC(frame);
+
+  Serial.printf("%d transactions each:\n", ROUNDS);
+
+  // The server's part: worker call and response
+  uint32_t start = allocations;
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    ModbusMessage response = server.localRequest(request);
+  }
+  report("localRequest", allocations - start);
+
+  // Response handed to the handler as a copy and moved
+  ModbusMessage response = server.localRequest(request);
+  start = allocations;
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    ModbusMessage m(response);
+    handler(m, r);
+  }
+  report("onData, copy", allocations - start);
+  start = allocations;
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    ModbusMessage m(response);
+    handler(std::move(m), r);
+  }
+  report("onData, moved", allocations - start);
+
+  // Response handed over to a waiting syncRequest. The completion itself is counted, too
+  start = allocations;
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    SyncHandle sync = std::make_shared<SyncCompletion>();
+    ModbusMessage m(response);
+    sync->complete(std::move(m));
+    ModbusMessage result;
+    sync->wait(0, result);
+  }
+  report("syncRequest handover", allocations - start);
+
+  // CRC calculation and check on a message
+  volatile uint16_t crc = 0;
+  start = allocations;
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    crc = RTUutils::calcCRC(request);
+    crc = RTUutils::validCRC(frame);
+  }
+  report("calcCRC + validCRC", allocations - start);
+
+  Serial.printf("%u responses seen by the handler\n", responses);
+}
+
+// loop() - nothing done here
+void loop() {
+  delay(10000);
+}
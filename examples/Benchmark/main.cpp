@@ -0,0 +1,353 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+
+// Benchmark suite for the hot paths of the library, to get a baseline to measure changes against.
+// Each case is run ROUNDS times and reported with operations per second, heap allocations and bytes
+// allocated per operation. The global operator new is replaced by one counting its calls.
+// Cases: ModbusMessage construction, add() and get(), RTUutils::calcCRC(), Modbus ASCII encoding and
+// decoding, CoilData set() and slice(), ModbusServer::getWorker() lookup and client/server transactions
+// through the loopback interface.
+// Runs on ESP32 as a sketch and on Linux as a program - see examples/Linux/Makefile.
+
+#include "options.h"
+#include <new>
+#include <stdlib.h>
+#include <mutex>               // NOLINT
+#include <condition_variable>  // NOLINT
+
+#if IS_LINUX
+#include "ModbusServerTCPepoll.h"
+#define Output printf
+#else
+// Includes: <Arduino.h> for Serial etc., WiFi.h for the loopback interface
+#include <Arduino.h>
+#include <WiFi.h>
+#include "ModbusServerWiFi.h"
+#define Output Serial.printf
+#endif
+#include "ModbusClientTCP.h"
+#include "RTUutils.h"
+#include "CoilData.h"
+
+// Number of operations per case, and of transactions for the loopback cases
+#define ROUNDS 10000
+#define TRANSACTIONS 1000
+// Requests in flight for the pipelined loopback case
+#define INFLIGHT 4
+
+// Port for the loopback server - no root rights needed on Linux
+uint16_t port = 5020;
+
+// Allocation counters
+volatile uint32_t allocations = 0;
+volatile uint32_t allocated = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  allocated += size;
+  void *p = malloc(size ? size : 1);
+  if (!p) abort();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// Meter: takes time and allocations of a case
+struct Meter {
+  uint32_t startTime;
+  uint32_t startAllocations;
+  uint32_t startAllocated;
+  void start() {
+    startAllocations = allocations;
+    startAllocated = allocated;
+    startTime = micros();
+  }
+  // report: print out the result for ops operations
+  void report(const char *name, uint32_t ops) {
+    uint32_t elapsed = micros() - startTime;
+    uint32_t count = allocations - startAllocations;
+    uint32_t bytes = allocated - startAllocated;
+    Output("  %-28s %10.0f ops/s %8.2f allocs/op %9.1f bytes/op\n", name,
+      (double)ops * 1000000.0 / (elapsed ? elapsed : 1), (double)count / ops, (double)bytes / ops);
+  }
+};
+
+// Keeps the compiler from optimizing the cases away
+volatile uint32_t sink = 0;
+
+// Worker answering FC 0x03 with the register addresses as values
+ModbusMessage FC03(ModbusMessage request) {
+  uint16_t addr = 0;
+  uint16_t words = 0;
+  ModbusMessage response;
+  request.get(2, addr);
+  request.get(4, words);
+  response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)(words * 2));
+  for (uint16_t i = 0; i < words; ++i) {
+    response.add((uint16_t)(addr + i));
+  }
+  return response;
+}
+
+// The loopback server and client
+#if IS_LINUX
+ModbusServerTCPepoll MBserver;
+Client tcpClient;
+#else
+ModbusServerWiFi MBserver;
+WiFiClient tcpClient;
+#endif
+ModbusClientTCP MBclient(tcpClient);
+
+// Errors seen, and pipelined requests answered, signalled by the client's handlers
+volatile uint32_t errors = 0;
+uint32_t completed = 0;
+std::mutex completedLock;
+std::condition_variable completedSignal;
+
+// complete: count a pipelined request as answered and wake up the case waiting for it
+void complete() {
+  {
+    std::lock_guard<std::mutex> lock(completedLock);
+    completed++;
+  }
+  completedSignal.notify_one();
+}
+
+// messageCases: ModbusMessage construction, add() and get()
+void messageCases() {
+  Meter m;
+  Output("ModbusMessage:\n");
+
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    ModbusMessage msg(1, READ_HOLD_REGISTER, (uint16_t)r, (uint16_t)10);
+    sink += msg.size();
+  }
+  m.report("construct FC03 request", ROUNDS);
+
+  ModbusMessage msg;
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS / 100; ++r) {
+    msg.clear();
+    msg.add((uint8_t)1, (uint8_t)READ_HOLD_REGISTER, (uint8_t)200);
+    for (uint16_t i = 0; i < 100; ++i) {
+      msg.add((uint16_t)i);
+    }
+  }
+  m.report("add(uint16_t)", ROUNDS);
+
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS / 100; ++r) {
+    uint16_t index = 3;
+    for (uint16_t i = 0; i < 100; ++i) {
+      uint16_t v = 0;
+      index = msg.get(index, v);
+      sink += v;
+    }
+  }
+  m.report("get(uint16_t)", ROUNDS);
+
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    ModbusMessage copy(msg);
+    sink += copy.size();
+  }
+  m.report("copy 203 bytes", ROUNDS);
+}
+
+// crcCases: RTUutils::calcCRC() for a short request and a full size response
+void crcCases() {
+  Meter m;
+  uint8_t data[256];
+  for (uint16_t i = 0; i < sizeof(data); ++i) {
+    data[i] = (i * 37 + 11) & 0xFF;
+  }
+  Output("RTUutils:\n");
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    sink += RTUutils::calcCRC(data, 6);
+  }
+  m.report("calcCRC 6 bytes", ROUNDS);
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    sink += RTUutils::calcCRC(data, 254);
+  }
+  m.report("calcCRC 254 bytes", ROUNDS);
+}
+
+// asciiCases: Modbus ASCII encoding with LRC and decoding of a full size frame
+void asciiCases() {
+  Meter m;
+  uint8_t data[255];
+  for (uint16_t i = 0; i < 254; ++i) {
+    data[i] = (i * 37 + 11) & 0xFF;
+  }
+  data[254] = RTUutils::calcLRC(data, 254);
+  uint8_t frame[514];
+  frame[0] = ':';
+  RTUutils::encodeASCII(data, 255, frame + 1);
+  frame[511] = '\r';
+  frame[512] = '\n';
+
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    RTUutils::encodeASCII(data, 254, frame + 1);
+    sink += RTUutils::calcLRC(data, 254) + frame[r % 508 + 1];
+  }
+  m.report("encode ASCII 254 bytes", ROUNDS);
+
+  ModbusMessage target;
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    RTUutils::ASCIIdecoder decoder(target, 512);
+    for (uint16_t i = 0; i < 513; ++i) {
+      if (decoder.take(frame[i]) != RTUutils::ASCIIdecoder::MORE) break;
+    }
+    sink += target.size();
+  }
+  m.report("decode ASCII 254 bytes", ROUNDS);
+}
+
+// coilCases: CoilData set() and slice()
+void coilCases() {
+  Meter m;
+  CoilData coils(2000);
+  Output("CoilData:\n");
+
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    coils.set(r % 2000, (r & 1) != 0);
+  }
+  m.report("set(index, bool)", ROUNDS);
+
+  CoilData pattern("1011001110001111");
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    coils.set(r % 1900, pattern);
+  }
+  m.report("set(index, 16 coils)", ROUNDS);
+
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    CoilData s = coils.slice(r % 1000, 800);
+    sink += s.coils();
+  }
+  m.report("slice 800 coils", ROUNDS);
+}
+
+// dispatchCases: worker lookup with a number of servers and function codes registered
+void dispatchCases() {
+  Meter m;
+  Output("ModbusServer:\n");
+
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    MBSworker w = MBserver.getWorker(1 + r % 8, READ_HOLD_REGISTER);
+    sink += w ? 1 : 0;
+  }
+  m.report("getWorker", ROUNDS);
+
+  ModbusMessage request(1, READ_HOLD_REGISTER, (uint16_t)0, (uint16_t)10);
+  m.start();
+  for (uint32_t r = 0; r < ROUNDS; ++r) {
+    ModbusMessage response = MBserver.localRequest(request);
+    sink += response.size();
+  }
+  m.report("localRequest", ROUNDS);
+}
+
+// loopbackCases: transactions through the loopback interface
+void loopbackCases() {
+  Meter m;
+  Output("Loopback client/server:\n");
+
+  // One request at a time
+  m.start();
+  for (uint32_t r = 0; r < TRANSACTIONS; ++r) {
+    ModbusMessage response = MBclient.syncRequest(r, 1, READ_HOLD_REGISTER, (uint16_t)0, (uint16_t)10);
+    if (response.getError() != SUCCESS) errors++;
+  }
+  m.report("syncRequest", TRANSACTIONS);
+
+  // Several requests in flight. Queue no more than that, the message pool would run dry else.
+  // The handlers signal each answer, so the next request is queued as soon as a slot is free
+  completed = 0;
+  MBclient.setMaxInflightRequests(INFLIGHT);
+  m.start();
+  for (uint32_t r = 0; r < TRANSACTIONS; ++r) {
+    {
+      std::unique_lock<std::mutex> lock(completedLock);
+      completedSignal.wait(lock, [r] { return r - completed < INFLIGHT; });
+    }
+    MBclient.addRequest(r, 1, READ_HOLD_REGISTER, (uint16_t)0, (uint16_t)10);
+  }
+  {
+    std::unique_lock<std::mutex> lock(completedLock);
+    completedSignal.wait_for(lock, std::chrono::milliseconds(10000), [] { return completed >= TRANSACTIONS; });
+  }
+  m.report("addRequest, pipelined", TRANSACTIONS);
+
+  if (errors) Output("  %u transactions failed!\n", errors);
+}
+
+// runBenchmarks: set up server and client, then run all cases
+void runBenchmarks() {
+  // Register workers for some servers and function codes, so getWorker() has to look
+  for (uint8_t s = 1; s <= 8; ++s) {
+    MBserver.registerWorker(s, READ_HOLD_REGISTER, &FC03);
+    MBserver.registerWorker(s, READ_INPUT_REGISTER, &FC03);
+  }
+  MBserver.start(port, 2, 10000);
+
+  MBclient.onDataHandler([](ModbusMessage response, uint32_t token) { complete(); });
+  MBclient.onErrorHandler([](Error error, uint32_t token) { errors++; complete(); });
+  // No interval between requests to the same target, we want to see the full speed
+  MBclient.setTimeout(2000, 0);
+#if IS_LINUX
+  // Disable Nagle algorithm
+  tcpClient.setNoDelay(true);
+#endif
+  MBclient.begin();
+  MBclient.setTarget(IPAddress(127, 0, 0, 1), port);
+  delay(100);
+
+  Output("%d operations or %d transactions per case:\n", ROUNDS, TRANSACTIONS);
+  messageCases();
+  crcCases();
+  asciiCases();
+  coilCases();
+  dispatchCases();
+  loopbackCases();
+}
+
+#if IS_LINUX
+// ============= main =============
+int main(int argc, char **argv) {
+  runBenchmarks();
+  return 0;
+}
+#else
+// Setup() - we will do all in here
+void setup() {
+// Init Serial monitor
+  Serial.begin(115200);
+  while (!Serial) {}
+  Serial.println("__ OK __");
+
+// Fake WiFi start to initialize internal loopback
+  WiFi.begin("foo", "bar");
+
+  runBenchmarks();
+}
+
+// loop() - nothing done here
+void loop() {
+  delay(10000);
+}
+#endif
@@ -0,0 +1,72 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+
+// Benchmark for the CRC16 engines in RTUutils.
+// All engines are run on the same data for typical Modbus frame lengths; results are checked
+// against each other and the throughput is printed for each.
+// calcCRC() will use the engine selected by MODBUS_CRC_ENGINE (see RTUutils.h).
+
+// Includes: <Arduino.h> for Serial etc.
+#include <Arduino.h>
+
+// Include the headers for ModbusMessage and RTUutils
+#include "ModbusMessage.h"
+#include "RTUutils.h"
+
+// Number of CRC calculations per engine and length
+#define ROUNDS 10000
+
+// Frame lengths to test: short request, medium and maximum size responses
+const uint16_t lengths[] = { 6, 8, 64, 254 };
+
+uint8_t data[256];
+
+// The engines to compare
+struct Engine {
+  const char *name;
+  uint16_t (*crc)(const uint8_t *data, uint16_t len);
+};
+Engine engines[] = {
+  { "bytewise", RTUutils::calcCRCbytewise },
+  { "slicing4", RTUutils::calcCRCslicing4 },
+  { "slicing8", RTUutils::calcCRCslicing8 },
+};
+
+// Setup() - we will do all in here
+void setup() {
+// Init Serial monitor
+  Serial.begin(115200);
+  while (!Serial) {}
+  Serial.println("__ OK __");
+
+// Fill the data with something random
+  for (uint16_t i = 0; i < sizeof(data); ++i) {
+    data[i] = random(256);
+  }
+
+  Serial.printf("calcCRC() engine: %d\n", MODBUS_CRC_ENGINE);
+
+  for (auto len : lengths) {
+    uint16_t reference = RTUutils::calcCRCbytewise(data, len);
+    Serial.printf("Length %3d:\n", len);
+    for (auto& e : engines) {
+      volatile uint16_t result = 0;
+      uint32_t start = micros();
+      for (uint32_t r = 0; r < ROUNDS; ++r) {
+        result = e.crc(data, len);
+      }
+      uint32_t elapsed = micros() - start;
+      // Bytes per microsecond is MB/s
+      Serial.printf("  %-10s %8u us, %6.2f MB/s %s\n", e.name, elapsed,
+        (float)len * ROUNDS / (elapsed ? elapsed : 1),
+        (result == reference) ? "" : "MISMATCH!");
+    }
+  }
+}
+
+// loop() - nothing done here
+void loop() {
+  delay(10000);
+}
@@ -0,0 +1,123 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+
+// Benchmark for the CoilData bit operations.
+// A full size set of 2000 coils is sliced, overwritten, counted and compared, once by CoilData's
+// own (word-at-a-time) methods and once by bit-by-bit loops doing the same through the coil interface.
+// Results are checked against each other and the time per operation is printed for both.
+
+// Includes: <Arduino.h> for Serial etc.
+#include <Arduino.h>
+
+// Include the header for CoilData
+#include "CoilData.h"
+
+// Number of runs per operation
+#define ROUNDS 1000
+
+// Full size coil set as in a FC 0x01 response or FC 0x0F request
+#define COILS 2000
+
+CoilData coils(COILS);
+uint8_t image[COILS / 8];
+
+// Bit-by-bit counterparts of the CoilData methods
+CoilData bitSlice(CoilData& c, uint16_t start, uint16_t length) {
+  CoilData retval(length);
+  for (uint16_t i = 0; i < length; ++i) {
+    if (c[start + i]) retval.set(i, true);
+  }
+  return retval;
+}
+
+void bitSet(CoilData& c, uint16_t start, uint16_t length, const uint8_t *data) {
+  for (uint16_t i = 0; i < length; ++i) {
+    c.set(start + i, (data[i >> 3] & (1 << (i & 7))) ? true : false);
+  }
+}
+
+uint16_t bitCount(CoilData& c) {
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < c.coils(); ++i) {
+    if (c[i]) count++;
+  }
+  return count;
+}
+
+bool bitEqual(CoilData& a, CoilData& b) {
+  if (a.coils() != b.coils()) return false;
+  for (uint16_t i = 0; i < a.coils(); ++i) {
+    if (a[i] != b[i]) return false;
+  }
+  return true;
+}
+
+// Print out one result line
+void report(const char *name, uint32_t bitwise, uint32_t wordwise, bool match) {
+  Serial.printf("  %-10s bitwise %8.2f us, wordwise %8.2f us %s\n", name,
+    (float)bitwise / ROUNDS, (float)wordwise / ROUNDS, match ? "" : "MISMATCH!");
+}
+
+// Setup() - we will do all in here
+void setup() {
+// Init Serial monitor
+  Serial.begin(115200);
+  while (!Serial) {}
+  Serial.println("__ OK __");
+
+// Fill the coils and the write image with something random
+  for (uint16_t i = 0; i < COILS; ++i) {
+    coils.set(i, random(2) ? true : false);
+  }
+  for (uint16_t i = 0; i < sizeof(image); ++i) {
+    image[i] = random(256);
+  }
+
+  Serial.printf("%d coils, %d rounds:\n", COILS, ROUNDS);
+
+  // slice: an odd start will need all bits shifted
+  CoilData s1, s2;
+  uint32_t start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) s1 = bitSlice(coils, 3, COILS - 3);
+  uint32_t bitwise = micros() - start;
+  start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) s2 = coils.slice(3, COILS - 3);
+  report("slice", bitwise, micros() - start, s1 == s2);
+
+  // set: write the image as a FC 0x0F request would
+  CoilData c1(COILS), c2(COILS);
+  start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) bitSet(c1, 5, COILS - 5, image);
+  bitwise = micros() - start;
+  start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) c2.set(5, COILS - 5, image);
+  report("set", bitwise, micros() - start, c1 == c2);
+
+  // coilsSetON
+  volatile uint16_t n1 = 0;
+  volatile uint16_t n2 = 0;
+  start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) n1 = bitCount(coils);
+  bitwise = micros() - start;
+  start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) n2 = coils.coilsSetON();
+  report("count", bitwise, micros() - start, n1 == n2);
+
+  // operator==
+  CoilData copy(coils);
+  volatile bool e1 = false;
+  volatile bool e2 = false;
+  start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) e1 = bitEqual(coils, copy);
+  bitwise = micros() - start;
+  start = micros();
+  for (uint32_t r = 0; r < ROUNDS; ++r) e2 = (coils == copy);
+  report("compare", bitwise, micros() - start, e1 == e2);
+}
+
+// loop() - nothing done here
+void loop() {
+  delay(10000);
+}
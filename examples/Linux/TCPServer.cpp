@@ -0,0 +1,61 @@
+#include <unistd.h>
+#include "Logging.h"
+#include "ModbusServerTCPepoll.h"
+
+// Server registers to serve. Each will hold its own address as value, with a counter in register 0
+uint16_t counter = 0;
+
+// Worker function for function code 0x03 (read holding registers)
+ModbusMessage FC03(ModbusMessage request) {
+  uint16_t addr = 0;
+  uint16_t words = 0;
+  ModbusMessage response;
+
+  // Get start address and number of registers requested
+  request.get(2, addr);
+  request.get(4, words);
+
+  // Address and words valid? We have 100 registers
+  if (words && words <= 125 && addr + words <= 100) {
+    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)(words * 2));
+    for (uint16_t i = addr; i < addr + words; ++i) {
+      response.add((uint16_t)(i ? i : counter++));
+    }
+  } else {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  }
+  return response;
+}
+
+// ============= main =============
+int main(int argc, char **argv) {
+  // Define the Modbus server
+  ModbusServerTCPepoll MBserver;
+  uint16_t port = 502;
+  uint16_t maxClients = 100;
+
+  if (argc > 3) {
+    printf("Usage: %s [port [maxClients]]\n", argv[0]);
+    return -1;
+  }
+  if (argc > 1) port = atoi(argv[1]) & 0xFFFF;
+  if (argc > 2) maxClients = atoi(argv[2]) & 0xFFFF;
+
+  // Serve server ID 1, function code 0x03
+  MBserver.registerWorker(1, READ_HOLD_REGISTER, &FC03);
+
+  // Start the server with an idle timeout of 60s
+  if (!MBserver.start(port, maxClients, 60000)) {
+    printf("Could not start server on port %u\n", port);
+    return -1;
+  }
+  printf("Serving on port %u, up to %u clients\n", port, maxClients);
+
+  // Report what is going on every 10s
+  while (1) {
+    sleep(10);
+    printf("%u clients, %u requests, %u errors\n", MBserver.activeClients(), MBserver.getMessageCount(), MBserver.getErrorCount());
+  }
+
+  return 0;
+}
@@ -8,17 +8,19 @@
 #include "Client.h"
 #include "Logging.h"
 #include <libexplain/connect.h>
+#include <fcntl.h>
+#include <poll.h>
 
 // Default constructor: just initialize host variables
-Client::Client() : sockfd(-1), host(NIL_ADDR), port(0) { } 
+Client::Client() : sockfd(-1), host(NIL_ADDR), port(0), connectTimeout(0) { } 
 
 // Constructor with IP/port: initialize, then try to connect
-Client::Client(IPAddress ip, uint16_t p) : sockfd(-1), host(NIL_ADDR), port(0) {
+Client::Client(IPAddress ip, uint16_t p) : sockfd(-1), host(NIL_ADDR), port(0), connectTimeout(0) {
   connect(ip, p);
 }
 
 // Constructor with hostname/port: initialize, then try to connect
-Client::Client(const char *hostname, uint16_t p) : sockfd(-1), host(NIL_ADDR), port(0) {
+Client::Client(const char *hostname, uint16_t p) : sockfd(-1), host(NIL_ADDR), port(0), connectTimeout(0) {
   connect(hostname, p);
 }
 
@@ -44,6 +46,38 @@ int Client::connect(IPAddress ip, uint16_t p) {
   server.sin_addr.s_addr = ::htonl(uint32_t(ip));
   server.sin_port = ::htons(p);
 
+// Connect timeout set? Then connect without blocking and wait for the result that long only
+  if (connectTimeout) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    int rc = ::connect(sockfd, (struct sockaddr *)&server, sizeof(server));
+    if (rc < 0 && errno == EINPROGRESS) {
+      struct pollfd pfd = { sockfd, POLLOUT, 0 };
+      rc = ::poll(&pfd, 1, connectTimeout);
+      if (rc == 0) {
+        errno = ETIMEDOUT;
+        rc = -1;
+      } else if (rc > 0) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+        errno = err;
+        rc = err ? -1 : 0;
+      }
+    }
+    fcntl(sockfd, F_SETFL, flags);
+    if (rc < 0) {
+      LOG_E("Error connecting to %s:%d - %s\n", buf, p, strerror(errno));
+      ::close(sockfd);
+      sockfd = -1;
+      return rc;
+    }
+    LOG_D("Connected.\n");
+    host = ip;
+    port = p;
+    return 0;
+  }
+
 // Try to connect
   int rc = ::connect(sockfd, (struct sockaddr *)&server, sizeof(server));
 
@@ -126,6 +160,29 @@ size_t Client::write(const uint8_t *buf, size_t size) {
   return rc;
 }
 
+// write (scatter): send two blocks of data in one go, without putting them together first
+size_t Client::write(const uint8_t *head, size_t headSize, const uint8_t *buf, size_t size) {
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<uint8_t *>(head);
+  iov[0].iov_len = headSize;
+  iov[1].iov_base = const_cast<uint8_t *>(buf);
+  iov[1].iov_len = size;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+// Send both, disabled SIGPIPE
+  ssize_t rc = ::sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+  LOG_D("send buffers[%d+%d] -> %d\n", headSize, size, rc);
+// Something wrong?
+  if (rc <= 0) {
+  // Yes, print it out
+    LOG_E("Error sending: %s (%d)\n", strerror(errno), errno);
+    return 0;
+  }
+  return rc;
+}
+
 // available: return number of waiting bytes to be read - if any (but 255 max)
 int Client::available() {
   uint8_t buf[256];
@@ -223,6 +280,11 @@ void Client::setNoDelay(bool yesNo) {
   setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *) &yes, sizeof(int));
 }
 
+// setConnectTimeout: give up connecting after ms. 0 waits as long as the system does
+void Client::setConnectTimeout(uint32_t ms) {
+  connectTimeout = ms;
+}
+
 // hostname_to_ip: try to find an IP address for a given host name
 IPAddress Client::hostname_to_ip(const char *hostname)
 {
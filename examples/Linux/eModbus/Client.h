@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -28,6 +29,7 @@ public:
   bool disconnect();
   size_t write(uint8_t t);
   size_t write(const uint8_t *buf, size_t size);
+  size_t write(const uint8_t *head, size_t headSize, const uint8_t *buf, size_t size);
   int available();
   int read();
   int read(uint8_t *buf, size_t size);
@@ -35,6 +37,10 @@ public:
   void flush();
   void stop();
   void setNoDelay(bool yesNo);
+  // setConnectTimeout: give up connecting after ms. 0 (default) waits as long as the system does
+  void setConnectTimeout(uint32_t ms);
+  // fd: the socket, -1 if there is none
+  inline int fd() const { return sockfd; }
   uint8_t connected();
   operator bool();
   static IPAddress hostname_to_ip(const char *hostname);
@@ -43,6 +49,7 @@ protected:
   int sockfd;
   IPAddress host;
   uint16_t port;
+  uint32_t connectTimeout;
   struct sockaddr_in server;
 };
 
@@ -0,0 +1,205 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "options.h"
+
+#if IS_LINUX
+#include "HardwareSerial.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include "Logging.h"
+
+// Constructor: keep the device path, the device will be opened by begin()
+HardwareSerial::HardwareSerial(const char *device) :
+  HS_device(nullptr),
+  HS_fd(-1),
+  HS_baudRate(0),
+  HS_head(0),
+  HS_tail(0) {
+  HS_device = new char[strlen(device) + 1];
+  strcpy(HS_device, device);
+}
+
+// Destructor: close the device
+HardwareSerial::~HardwareSerial() {
+  end();
+  delete[] HS_device;
+}
+
+// speedOf: termios speed constant for a baud rate, B0 if there is none
+static speed_t speedOf(uint32_t baudRate) {
+  switch (baudRate) {
+  case 1200: return B1200;
+  case 2400: return B2400;
+  case 4800: return B4800;
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+  case 460800: return B460800;
+  case 921600: return B921600;
+  default: return B0;
+  }
+}
+
+// begin: open the device with baudRate and config
+bool HardwareSerial::begin(uint32_t baudRate, uint32_t config) {
+  end();
+  speed_t speed = speedOf(baudRate);
+  if (speed == B0) {
+    LOG_E("Baud rate %u not supported\n", baudRate);
+    return false;
+  }
+
+  HS_fd = ::open(HS_device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (HS_fd < 0) {
+    LOG_E("Error %d opening %s: %s\n", errno, HS_device, strerror(errno));
+    return false;
+  }
+
+  // Raw mode, no blocking reads - see HardwareSerial.h
+  struct termios tio;
+  if (tcgetattr(HS_fd, &tio)) {
+    LOG_E("%s is no serial device: %s\n", HS_device, strerror(errno));
+    end();
+    return false;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+  tio.c_cflag |= ((config >> 8) & 0x0F) == 7 ? CS7 : CS8;
+  switch ((config >> 4) & 0x0F) {
+  case 1: tio.c_cflag |= PARENB; break;
+  case 2: tio.c_cflag |= PARENB | PARODD; break;
+  default: break;
+  }
+  if ((config & 0x0F) == 2) tio.c_cflag |= CSTOPB;
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(HS_fd, TCSANOW, &tio)) {
+    LOG_E("Error setting up %s: %s\n", HS_device, strerror(errno));
+    end();
+    return false;
+  }
+
+  // Ask the driver to hand up received bytes without delay. Not all will know about it
+  struct serial_struct ss;
+  if (ioctl(HS_fd, TIOCGSERIAL, &ss) == 0) {
+    ss.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(HS_fd, TIOCSSERIAL, &ss)) {
+      LOG_D("%s: ASYNC_LOW_LATENCY not accepted\n", HS_device);
+    }
+  }
+
+  tcflush(HS_fd, TCIOFLUSH);
+  HS_baudRate = baudRate;
+  HS_head = HS_tail = 0;
+  LOG_D("%s opened with %u baud\n", HS_device, baudRate);
+  return true;
+}
+
+// end: close the device
+void HardwareSerial::end() {
+  if (HS_fd >= 0) {
+    ::close(HS_fd);
+    HS_fd = -1;
+  }
+  HS_head = HS_tail = 0;
+}
+
+// useRS485: have the kernel driver toggle DE/RE by RTS
+bool HardwareSerial::useRS485(bool onOff, bool rtsOnSend, uint32_t delayBefore, uint32_t delayAfter) {
+  if (HS_fd < 0) return false;
+  struct serial_rs485 rs;
+  memset(&rs, 0, sizeof(rs));
+  if (onOff) {
+    rs.flags = SER_RS485_ENABLED | (rtsOnSend ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
+    rs.delay_rts_before_send = delayBefore;
+    rs.delay_rts_after_send = delayAfter;
+  }
+  if (ioctl(HS_fd, TIOCSRS485, &rs)) {
+    LOG_E("%s: RS485 mode not supported: %s\n", HS_device, strerror(errno));
+    return false;
+  }
+  LOG_D("%s: RS485 mode %s\n", HS_device, onOff ? "ON" : "OFF");
+  return true;
+}
+
+// fill: read what the device has into the buffer
+int HardwareSerial::fill() {
+  if (HS_head < HS_tail) return HS_tail - HS_head;
+  HS_head = HS_tail = 0;
+  if (HS_fd < 0) return 0;
+  ssize_t n = ::read(HS_fd, HS_buffer, sizeof(HS_buffer));
+  if (n > 0) HS_tail = n;
+  return HS_tail;
+}
+
+// available: number of bytes to be read without waiting
+int HardwareSerial::available() {
+  if (HS_head < HS_tail) return HS_tail - HS_head;
+  int n = 0;
+  if (HS_fd < 0 || ioctl(HS_fd, FIONREAD, &n)) return 0;
+  return n;
+}
+
+// read: next byte, -1 if there is none
+int HardwareSerial::read() {
+  if (!fill()) return -1;
+  return HS_buffer[HS_head++];
+}
+
+// peek: next byte without taking it, -1 if there is none
+int HardwareSerial::peek() {
+  if (!fill()) return -1;
+  return HS_buffer[HS_head];
+}
+
+// write: send one byte
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+// write: send size bytes, waiting for room in the driver's buffer as necessary
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  size_t done = 0;
+  while (HS_fd >= 0 && done < size) {
+    ssize_t n = ::write(HS_fd, buffer + done, size - done);
+    if (n > 0) {
+      done += n;
+    } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      LOG_E("Error writing to %s: %s\n", HS_device, strerror(errno));
+      break;
+    } else {
+      struct pollfd p = { HS_fd, POLLOUT, 0 };
+      poll(&p, 1, 100);
+    }
+  }
+  return done;
+}
+
+// flush: wait until all data written has been transmitted
+void HardwareSerial::flush() {
+  if (HS_fd >= 0) tcdrain(HS_fd);
+}
+
+// waitAvailable: sleep in ppoll() until data comes in or timeoutMicros have passed
+bool HardwareSerial::waitAvailable(uint32_t timeoutMicros) {
+  if (HS_head < HS_tail) return true;
+  if (HS_fd < 0) return false;
+  struct pollfd p = { HS_fd, POLLIN, 0 };
+  struct timespec t = { static_cast<time_t>(timeoutMicros / 1000000), static_cast<long>(timeoutMicros % 1000000) * 1000L };
+  return ppoll(&p, 1, &t, NULL) > 0 && (p.revents & POLLIN);
+}
+
+#endif  // IS_LINUX
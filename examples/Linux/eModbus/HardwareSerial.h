@@ -0,0 +1,82 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _HARDWARE_SERIAL_H
+#define _HARDWARE_SERIAL_H
+#include "options.h"
+
+#if IS_LINUX
+#include "Stream.h"
+
+// Serial configurations: data bits, parity (0=none, 1=even, 2=odd) and stop bits
+#define SERIAL_8N1 0x801
+#define SERIAL_8N2 0x802
+#define SERIAL_8E1 0x811
+#define SERIAL_8E2 0x812
+#define SERIAL_8O1 0x821
+#define SERIAL_8O2 0x822
+#define SERIAL_7E1 0x711
+#define SERIAL_7O1 0x721
+
+// HardwareSerial: a serial device driven by termios, to be used by ModbusClientRTU and ModbusServerRTU
+// the way an Arduino HardwareSerial is.
+// The device is set to raw mode without blocking (VMIN = VTIME = 0): VTIME counts in 1/10s, far too
+// coarse for the Modbus gap of 3.5 characters. waitAvailable() is sleeping in ppoll() instead, so
+// RTUutils will detect the gap with microsecond timeouts and is woken up by each byte coming in.
+// ASYNC_LOW_LATENCY is requested from the driver to have the bytes handed up right away.
+class HardwareSerial : public Stream {
+public:
+  explicit HardwareSerial(const char *device);
+  ~HardwareSerial();
+
+  // begin: open the device with baudRate and config. Returns false if that failed
+  bool begin(uint32_t baudRate, uint32_t config = SERIAL_8N1);
+
+  // end: close the device
+  void end();
+
+  // useRS485: have the kernel driver toggle the RS485 DE/RE line by RTS around each transmission.
+  // rtsOnSend is the RTS level while sending, delayBefore/delayAfter are ms to hold it before and after.
+  // Call after begin(). Use the client's or server's constructor without an RTS pin then!
+  // Returns false if the driver does not support TIOCSRS485.
+  bool useRS485(bool onOff = true, bool rtsOnSend = true, uint32_t delayBefore = 0, uint32_t delayAfter = 0);
+
+  // baudRate: the baud rate given to begin()
+  inline uint32_t baudRate() const { return HS_baudRate; }
+
+  // Buffers are the kernel's - these are here for RTUutils::prepareHardwareSerial() only
+  inline size_t setRxBufferSize(size_t size) { return size; }
+  inline size_t setTxBufferSize(size_t size) { return size; }
+
+  // Stream functions
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buffer, size_t size);
+  using Stream::write;
+  // flush: wait until all data written has been transmitted
+  void flush();
+  bool waitAvailable(uint32_t timeoutMicros);
+
+  inline operator bool() const { return HS_fd >= 0; }
+
+protected:
+  // Prevent copy construction or assignment
+  HardwareSerial(const HardwareSerial& other) = delete;
+  HardwareSerial& operator=(const HardwareSerial& other) = delete;
+
+  // fill: read what the device has into the buffer. Returns the number of bytes buffered
+  int fill();
+
+  char *HS_device;            // Device path
+  int HS_fd;                  // File descriptor, -1 if not open
+  uint32_t HS_baudRate;
+  uint8_t HS_buffer[256];     // Bytes read from the device
+  uint16_t HS_head;           // Next byte to take from HS_buffer
+  uint16_t HS_tail;           // End of the bytes in HS_buffer
+};
+
+#endif  // IS_LINUX
+#endif  // _HARDWARE_SERIAL_H
@@ -6,6 +6,7 @@
 
 #if IS_LINUX
 #include "IPAddress.h"
+#include <arpa/inet.h>
 
 // Standard constructor - set to 0.0.0.0
 IPAddress::IPAddress() {
@@ -48,7 +49,7 @@ uint8_t& IPAddress::operator[](int index) {
 }
   
 // operator== for IPAdresses
-bool IPAddress::operator==(IPAddress other) {
+bool IPAddress::operator==(IPAddress other) const {
   return addr.word == other.addr.word;
 }
 
@@ -63,7 +64,7 @@ bool IPAddress::operator==(const char *ip) {
 }
 
 // Same triple for inequality
-bool IPAddress::operator!=(IPAddress other) { 
+bool IPAddress::operator!=(IPAddress other) const {
   return addr.word != other.addr.word; 
 }
 bool IPAddress::operator!=(uint32_t w) { 
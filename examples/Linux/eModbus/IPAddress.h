@@ -22,10 +22,10 @@ public:
   operator uint32_t();
   uint8_t operator[](int index) const;
   uint8_t& operator[](int index);
-  bool operator==(IPAddress other);
+  bool operator==(IPAddress other) const;
   bool operator==(uint32_t w);
   bool operator==(const char *ip);
-  bool operator!=(IPAddress other);
+  bool operator!=(IPAddress other) const;
   bool operator!=(uint32_t w);
   bool operator!=(const char *ip);
   IPAddress& operator=(uint32_t w);
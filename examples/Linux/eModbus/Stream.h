@@ -0,0 +1,39 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _STREAM_H
+#define _STREAM_H
+#include "options.h"
+
+#if IS_LINUX
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+// Stream: the part of the Arduino Stream class RTUutils is using
+class Stream {
+public:
+  virtual ~Stream() { }
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+  inline size_t write(const char *s) { return write(reinterpret_cast<const uint8_t *>(s), strlen(s)); }
+  virtual void flush() = 0;
+
+  // waitAvailable: Linux extension. Sleep until data is available or timeoutMicros have passed.
+  // Returns true if there is data to read. A stream able to poll its device will override this,
+  // the default only sleeps for a millisecond at most.
+  virtual bool waitAvailable(uint32_t timeoutMicros) {
+    if (available()) return true;
+    uint32_t us = timeoutMicros < 1000 ? timeoutMicros : 1000;
+    struct timespec t = { 0, static_cast<long>(us) * 1000L };
+    nanosleep(&t, NULL);
+    return available() > 0;
+  }
+};
+
+#endif  // IS_LINUX
+#endif  // _STREAM_H
@@ -0,0 +1,493 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+
+// Load generator for end-to-end throughput and latency tests.
+// A number of clients send a weighted mix of requests at a given rate each to a server, a bridge or
+// a gateway, for a given time. Each second the throughput is printed, at the end the totals,
+// the latency percentiles from sending to the response and the errors by code.
+// A rate of 0 runs the clients closed loop: each keeps MAXPENDING requests in flight all the time.
+// If a client has MAXPENDING requests in flight when the next one is due, that one is skipped and
+// counted - the server under test is not keeping up then.
+// Without a target given, a local server is started to be tested over the loopback interface.
+//
+// On Linux (see examples/Linux/Makefile):
+//   ./LoadGenerator [IP[:port[:serverID]]|hostname[:port[:serverID]]|- [clients [rate [seconds]]]]
+//   "-" or no target will test the local ModbusServerTCPepoll on port 5020.
+//   Define SHARED_LOOP to have all clients served by one ModbusClientLoop instead of a thread each.
+// On ESP32 the parameters are set by the defines below. Define USE_ASYNC_SERVER to test a local
+// ModbusServerTCPasync instead of the ModbusServerWiFi. Define LOAD_RTU to run the requests through
+// a serial loopback instead: a ModbusClientRTU on Serial1 and a ModbusServerRTU on Serial2, with
+// the TX pin of each wired to the RX pin of the other. There is only one client on the bus then.
+// Let the message pool (MESSAGE_POOL_SIZE) be large enough for all requests in flight, else each
+// one more will be logged as a pool exhaustion.
+
+#include "options.h"
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#if IS_LINUX
+#include "ModbusServerTCPepoll.h"
+#include "parseTarget.h"
+#define Output printf
+#else
+// Includes: <Arduino.h> for Serial etc., WiFi.h for WiFi support
+#include <Arduino.h>
+#include <WiFi.h>
+#if defined(LOAD_RTU)
+#include "ModbusServerRTU.h"
+#include "ModbusClientRTU.h"
+#elif defined(USE_ASYNC_SERVER)
+#include "ModbusServerTCPasync.h"
+#else
+#include "ModbusServerWiFi.h"
+#endif
+#define Output Serial.printf
+#endif
+#include "ModbusClientTCP.h"
+#include "ModbusMessagePool.h"
+
+// Settings. On Linux, these are the defaults for the command line parameters
+#ifndef CLIENTS
+#define CLIENTS 4             // Number of clients
+#endif
+#ifndef RATE
+#define RATE 100              // Requests per second and client, 0 for as many as possible
+#endif
+#ifndef SECONDS
+#define SECONDS 10            // Duration of the test
+#endif
+#ifndef MAXPENDING
+#define MAXPENDING 2          // Requests in flight per client
+#endif
+#ifndef MAXCLIENTS
+#define MAXCLIENTS 16
+#endif
+#ifndef SAMPLES
+#define SAMPLES 1024          // Latency samples kept per client
+#endif
+#define CLIENT_TIMEOUT 2000   // Client timeout in ms
+
+// Target. On ESP32, set TARGET_HOST to a server or bridge in your network to test that instead
+#ifndef TARGET_PORT
+#define TARGET_PORT 5020
+#endif
+#ifndef TARGET_SERVER
+#define TARGET_SERVER 1
+#endif
+#if !IS_LINUX && !defined(LOAD_RTU)
+// WiFi credentials - only needed if testing another host
+#ifndef SSID
+#define SSID "foo"
+#define PASSWORD "bar"
+#endif
+#endif
+
+#if defined(LOAD_RTU)
+// Serial loopback: pins and baud rate
+#define BAUDRATE 115200
+#define CLIENT_RX GPIO_NUM_16
+#define CLIENT_TX GPIO_NUM_17
+#define SERVER_RX GPIO_NUM_18
+#define SERVER_TX GPIO_NUM_19
+#endif
+
+// The request mix: function code, weight, start address and number of registers or value to write
+struct MixEntry {
+  uint8_t functionCode;
+  uint8_t weight;
+  uint16_t address;
+  uint16_t count;
+};
+MixEntry mix[] = {
+  { READ_HOLD_REGISTER,   60, 0,  10 },
+  { READ_INPUT_REGISTER,  20, 20, 40 },
+  { WRITE_HOLD_REGISTER,  15, 5,  0x1234 },
+  { WRITE_MULT_REGISTERS,  5, 50, 16 },
+};
+const uint8_t MIXSIZE = sizeof(mix) / sizeof(MixEntry);
+
+// LoadClient: a client with its own counters and latency samples.
+// The counters and samples are written by the client's handlers only, in the context of its worker
+struct LoadClient {
+  ModbusClient *client;
+  uint32_t nextDue;             // micros() the next request is due at
+  uint32_t sent;                // Requests made
+  uint32_t skipped;             // Requests due while MAXPENDING were in flight
+  uint32_t refused;             // Requests the client did not take
+  volatile uint32_t good;       // Responses without error
+  volatile uint32_t failed;     // Error responses
+  uint32_t seen;                // Latencies seen; the samples are a random choice among them
+  uint32_t maxLatency;
+  uint32_t rng;                 // State of the random generator for the choice of samples
+  uint32_t samples[SAMPLES];
+  LoadClient() : client(nullptr), nextDue(0), sent(0), skipped(0), refused(0), good(0), failed(0),
+    seen(0), maxLatency(0), rng(1), samples{0} {}
+
+  // random: xorshift32 - the samples must not depend on the Arduino/libc random()
+  inline uint32_t random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+  }
+
+  // latency: keep a response time. Reservoir sampling, so each time seen has the same chance to be kept
+  void latency(uint32_t us) {
+    if (us > maxLatency) maxLatency = us;
+    if (seen < SAMPLES) {
+      samples[seen] = us;
+    } else {
+      uint32_t j = random() % (seen + 1);
+      if (j < SAMPLES) samples[j] = us;
+    }
+    seen++;
+  }
+};
+
+LoadClient load[MAXCLIENTS];
+uint8_t clients = CLIENTS;
+uint32_t rate = RATE;
+uint32_t seconds = SECONDS;
+
+// Error responses by code, from all clients
+uint32_t errorCodes[256] = { 0 };
+#if USE_MUTEX
+std::mutex errorLock;
+#endif
+
+// The server to test and the clients' connections
+#if IS_LINUX
+ModbusServerTCPepoll MBserver;
+Client tcp[MAXCLIENTS];
+#elif defined(LOAD_RTU)
+ModbusServerRTU MBserver(2000);
+ModbusClientRTU rtuClient;
+#else
+#if defined(USE_ASYNC_SERVER)
+ModbusServerTCPasync MBserver;
+#else
+ModbusServerWiFi MBserver;
+#endif
+WiFiClient tcp[MAXCLIENTS];
+#endif
+#if !defined(LOAD_RTU)
+ModbusClientTCP *tcpClients[MAXCLIENTS] = { nullptr };
+#endif
+#if IS_LINUX && defined(SHARED_LOOP)
+ModbusClientLoop clientLoop;
+#endif
+
+// Server registers: 100 holding registers, input registers holding their own address
+uint16_t registers[100] = { 0 };
+
+// Worker for FC 0x03 and 0x04
+ModbusMessage FC03(ModbusMessage request) {
+  uint16_t addr = 0;
+  uint16_t words = 0;
+  ModbusMessage response;
+  request.get(2, addr);
+  request.get(4, words);
+  if (!words || words > 125 || addr + words > 100) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+    return response;
+  }
+  response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)(words * 2));
+  for (uint16_t i = addr; i < addr + words; ++i) {
+    response.add((uint16_t)(request.getFunctionCode() == READ_HOLD_REGISTER ? registers[i] : i));
+  }
+  return response;
+}
+
+// Worker for FC 0x06 - the response is the echo of the request
+ModbusMessage FC06(ModbusMessage request) {
+  uint16_t addr = 0;
+  uint16_t value = 0;
+  ModbusMessage response;
+  request.get(2, addr);
+  request.get(4, value);
+  if (addr >= 100) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+    return response;
+  }
+  registers[addr] = value;
+  return ECHO_RESPONSE;
+}
+
+// Worker for FC 0x10
+ModbusMessage FC10(ModbusMessage request) {
+  uint16_t addr = 0;
+  uint16_t words = 0;
+  ModbusMessage response;
+  uint16_t index = request.get(2, addr);
+  index = request.get(index, words);
+  if (!words || words > 123 || addr + words > 100) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+    return response;
+  }
+  index++;            // Skip byte count
+  for (uint16_t i = addr; i < addr + words; ++i) {
+    index = request.get(index, registers[i]);
+  }
+  response.add(request.getServerID(), request.getFunctionCode(), addr, words);
+  return response;
+}
+
+// makeRequest: set up a request chosen by weight from the mix
+void makeRequest(ModbusMessage& request, uint8_t serverID, uint32_t pick) {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < MIXSIZE; ++i) total += mix[i].weight;
+  pick %= total;
+  uint8_t m = 0;
+  while (pick >= mix[m].weight) {
+    pick -= mix[m].weight;
+    m++;
+  }
+  const MixEntry& e = mix[m];
+  if (e.functionCode == WRITE_MULT_REGISTERS) {
+    uint16_t words[123];
+    for (uint16_t i = 0; i < e.count; ++i) words[i] = e.address + i;
+    request.setMessage(serverID, e.functionCode, e.address, e.count, (uint8_t)(e.count * 2), words);
+  } else {
+    request.setMessage(serverID, e.functionCode, e.address, e.count);
+  }
+}
+
+// percentile: the value taking p percent of the sorted samples
+uint32_t percentile(const std::vector<uint32_t>& sorted, uint8_t p) {
+  if (sorted.empty()) return 0;
+  size_t index = (sorted.size() * p + 99) / 100;
+  return sorted[index ? index - 1 : 0];
+}
+
+// report: totals, latency percentiles and errors
+void report(uint32_t elapsed) {
+  uint32_t sent = 0;
+  uint32_t skipped = 0;
+  uint32_t refused = 0;
+  uint32_t good = 0;
+  uint32_t failed = 0;
+  uint32_t maxLatency = 0;
+  std::vector<uint32_t> all;
+  for (uint8_t c = 0; c < clients; ++c) {
+    LoadClient& l = load[c];
+    sent += l.sent;
+    skipped += l.skipped;
+    refused += l.refused;
+    good += l.good;
+    failed += l.failed;
+    if (l.maxLatency > maxLatency) maxLatency = l.maxLatency;
+    all.insert(all.end(), l.samples, l.samples + (l.seen < SAMPLES ? l.seen : SAMPLES));
+  }
+  std::sort(all.begin(), all.end());
+
+  Output("\n%u clients, %u requests in %u.%03us: %.1f responses/s\n", clients, sent,
+    elapsed / 1000, elapsed % 1000, (double)(good + failed) * 1000.0 / (elapsed ? elapsed : 1));
+  Output("  good %u, errors %u (%.2f%%), no response %u, skipped %u, refused %u\n", good, failed,
+    sent ? (double)failed * 100.0 / sent : 0.0, sent - good - failed, skipped, refused);
+  Output("  latency us: p50 %u, p90 %u, p99 %u, max %u (%u samples)\n", percentile(all, 50),
+    percentile(all, 90), percentile(all, 99), maxLatency, (uint32_t)all.size());
+  for (uint16_t e = 0; e < 256; ++e) {
+    if (errorCodes[e]) {
+      Output("  %5u x %02X - %s\n", errorCodes[e], e, (const char *)ModbusError((Error)e));
+    }
+  }
+  Output("  message pool: %u of %u used at most, exhausted %u times\n", ModbusMessagePool::highWaterMark(),
+    ModbusMessagePool::poolSize(), ModbusMessagePool::exhausted());
+}
+
+// runLoad: set up the clients and send requests for the test duration. host 0.0.0.0 is the local server
+void runLoad(IPAddress host, uint16_t port, uint8_t serverID) {
+  // Start the local server
+  if (static_cast<uint32_t>(host) == 0) {
+    MBserver.registerWorker(serverID, READ_HOLD_REGISTER, &FC03);
+    MBserver.registerWorker(serverID, READ_INPUT_REGISTER, &FC03);
+    MBserver.registerWorker(serverID, WRITE_HOLD_REGISTER, &FC06);
+    MBserver.registerWorker(serverID, WRITE_MULT_REGISTERS, &FC10);
+#if defined(LOAD_RTU)
+    RTUutils::prepareHardwareSerial(Serial2);
+    Serial2.begin(BAUDRATE, SERIAL_8N1, SERVER_RX, SERVER_TX);
+    MBserver.begin(Serial2);
+#else
+    MBserver.start(port, clients, CLIENT_TIMEOUT * 2);
+#endif
+    host = IPAddress(127, 0, 0, 1);
+  }
+
+  // Set up the clients. The token of a request is the micros() value it was sent at
+#if defined(LOAD_RTU)
+  clients = 1;
+  RTUutils::prepareHardwareSerial(Serial1);
+  Serial1.begin(BAUDRATE, SERIAL_8N1, CLIENT_RX, CLIENT_TX);
+  rtuClient.setTimeout(CLIENT_TIMEOUT);
+  rtuClient.begin(Serial1);
+  load[0].client = &rtuClient;
+#else
+  for (uint8_t c = 0; c < clients; ++c) {
+    tcp[c].setNoDelay(true);
+    tcpClients[c] = new ModbusClientTCP(tcp[c], MAXPENDING + 2);
+    tcpClients[c]->setTimeout(CLIENT_TIMEOUT, 0);
+    tcpClients[c]->setMaxInflightRequests(MAXPENDING);
+#if IS_LINUX && defined(SHARED_LOOP)
+    // The loop thread is doing the connects for all clients
+    tcp[c].setConnectTimeout(CLIENT_TIMEOUT);
+    tcpClients[c]->begin(clientLoop);
+#else
+    tcpClients[c]->begin();
+#endif
+    tcpClients[c]->setTarget(host, port);
+    load[c].client = tcpClients[c];
+  }
+#endif
+  for (uint8_t c = 0; c < clients; ++c) {
+    LoadClient *l = &load[c];
+    l->rng = 0x2545F491 + c;
+    l->client->onDataHandler([l](ModbusMessage, uint32_t token) {
+      l->latency(micros() - token);
+      l->good++;
+    });
+    l->client->onErrorHandler([l](Error error, uint32_t token) {
+      if (error != TIMEOUT) l->latency(micros() - token);
+      {
+        LOCK_GUARD(lockGuard, errorLock);
+        errorCodes[error]++;
+      }
+      l->failed++;
+    });
+  }
+  delay(100);
+  ModbusMessagePool::resetCounts();
+
+  Output("%u clients, %u requests/s each%s, %us, up to %u in flight per client\n", clients, rate,
+    rate ? "" : " (closed loop)", seconds, MAXPENDING);
+  uint32_t interval = rate ? 1000000 / rate : 0;
+  uint32_t pick = 0x1D872B41;
+  uint32_t start = millis();
+  uint32_t now = micros();
+  for (uint8_t c = 0; c < clients; ++c) {
+    // Spread the clients' requests over the interval
+    load[c].nextDue = now + c * interval / clients;
+  }
+
+  uint32_t lastReport = start;
+  uint32_t lastCount = 0;
+  while (millis() - start < seconds * 1000) {
+    for (uint8_t c = 0; c < clients; ++c) {
+      LoadClient& l = load[c];
+      // Send all requests due
+      while (static_cast<int32_t>(micros() - l.nextDue) >= 0) {
+        if (interval) l.nextDue += interval;
+        if (l.client->pendingRequests() >= MAXPENDING) {
+          if (!interval) break;
+          l.skipped++;
+          continue;
+        }
+        ModbusMessage request;
+        pick = pick * 1103515245 + 12345;
+        makeRequest(request, serverID, pick >> 8);
+        if (l.client->addRequest(request, (uint32_t)micros()) != SUCCESS) {
+          l.refused++;
+          break;
+        }
+        l.sent++;
+      }
+    }
+    // One line per second
+    if (millis() - lastReport >= 1000) {
+      uint32_t count = 0;
+      uint32_t errors = 0;
+      for (uint8_t c = 0; c < clients; ++c) {
+        count += load[c].good + load[c].failed;
+        errors += load[c].failed;
+      }
+      Output("%4us: %6u responses/s, %u errors\n", (uint32_t)(millis() - start) / 1000, count - lastCount, errors);
+      lastCount = count;
+      lastReport += 1000;
+    }
+    delay(1);
+  }
+  uint32_t elapsed = millis() - start;
+
+  // Wait for the requests still in flight
+  uint32_t waitStart = millis();
+  bool pending = true;
+  while (pending && millis() - waitStart < CLIENT_TIMEOUT + 500) {
+    pending = false;
+    for (uint8_t c = 0; c < clients; ++c) {
+      if (load[c].client->pendingRequests()) pending = true;
+    }
+    delay(10);
+  }
+  report(elapsed);
+#if IS_LINUX && defined(SHARED_LOOP)
+  // Leave the loop before it ends with the program
+  for (uint8_t c = 0; c < clients; ++c) {
+    tcpClients[c]->end();
+  }
+#endif
+}
+
+#if IS_LINUX
+// ============= main =============
+int main(int argc, char **argv) {
+  IPAddress host(0, 0, 0, 0);
+  uint16_t port = TARGET_PORT;
+  uint8_t serverID = TARGET_SERVER;
+
+  if (argc > 5) {
+    printf("Usage: %s [IP[:port[:serverID]]|hostname[:port[:serverID]]|- [clients [rate [seconds]]]]\n", argv[0]);
+    return -1;
+  }
+  if (argc > 1 && strcmp(argv[1], "-")) {
+    if (parseTarget(argv[1], host, port, serverID)) {
+      printf("Invalid target descriptor. Must be IP[:port[:serverID]] or hostname[:port[:serverID]]\n");
+      return -1;
+    }
+  }
+  if (argc > 2) clients = atoi(argv[2]);
+  if (argc > 3) rate = atoi(argv[3]);
+  if (argc > 4) seconds = atoi(argv[4]);
+  if (clients < 1 || clients > MAXCLIENTS) {
+    printf("Number of clients must be 1..%u\n", MAXCLIENTS);
+    return -1;
+  }
+
+  runLoad(host, port, serverID);
+  return 0;
+}
+#else
+// Setup() - we will do all in here
+void setup() {
+// Init Serial monitor
+  Serial.begin(115200);
+  while (!Serial) {}
+  Serial.println("__ OK __");
+
+#if defined(LOAD_RTU)
+  runLoad(IPAddress(0, 0, 0, 0), 0, TARGET_SERVER);
+#else
+#if defined(TARGET_HOST)
+// Connect to the network the target is in
+  WiFi.begin(SSID, PASSWORD);
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(200);
+  }
+  IPAddress host;
+  host.fromString(TARGET_HOST);
+  runLoad(host, TARGET_PORT, TARGET_SERVER);
+#else
+// Fake WiFi start to initialize internal loopback
+  WiFi.begin(SSID, PASSWORD);
+  runLoad(IPAddress(0, 0, 0, 0), TARGET_PORT, TARGET_SERVER);
+#endif
+#endif
+}
+
+// loop() - nothing done here
+void loop() {
+  delay(10000);
+}
+#endif
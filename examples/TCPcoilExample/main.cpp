@@ -47,10 +47,13 @@ ModbusMessage FC_01(ModbusMessage request) {
 
 // Are the parameters valid?
   if (start + numCoils <= myCoils.coils()) {
-    // Looks like it. Get the requested coils from our storage
-    vector<uint8_t> coilset = myCoils.slice(start, numCoils);
+    // Looks like it. Get the requested coils from our storage - a view will not copy them
+    CoilDataView coilset = myCoils.view(start, numCoils);
+    uint8_t packed[250];
+    uint16_t numBytes = coilset.copyTo(packed);
     // Set up response according to the specs: serverID, function code, number of bytes to follow, packed coils
-    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)coilset.size(), coilset);
+    response.add(request.getServerID(), request.getFunctionCode(), (uint8_t)numBytes);
+    response.add(packed, numBytes);
   } else {
     // Something was wrong with the parameters
     response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
@@ -106,12 +109,11 @@ ModbusMessage FC_0F(ModbusMessage request) {
   // Check the parameters so far
   if (numCoils && start + numCoils <= myCoils.coils()) {
     // Packed coils will fit in our storage
-    if (numBytes == ((numCoils - 1) >> 3) + 1) {
-      // Byte count seems okay, so get the packed coil bytes now
-      vector<uint8_t> coilset;
-      request.get(offset, coilset, numBytes);
+    if (numBytes == ((numCoils - 1) >> 3) + 1 && request.size() >= offset + numBytes) {
+      // Byte count seems okay, so look at the packed coil bytes in the request
+      CoilDataView coilset(request.data() + offset, numCoils);
       // Now set the coils
-      if (myCoils.set(start, numCoils, coilset)) {
+      if (myCoils.set(start, coilset)) {
         // All fine, return shortened echo response, like the standard says
         response.add(request.getServerID(), request.getFunctionCode(), start, numCoils);
         // Pull trigger
@@ -17,15 +17,12 @@ CoilData::CoilData(uint16_t size, bool initValue) :
   if (size > 2000) size = 2000;
   // Do we have a size?
   if (size) {
-    // Calculate number of bytes needed
-    CDbyteSize = byteIndex(size - 1) + 1;
     // Allocate and init buffer
-    CDbuffer = new uint8_t[CDbyteSize];
+    allocate(size);
     memset(CDbuffer, initValue ? 0xFF : 0, CDbyteSize);
     if (initValue) {
       CDbuffer[CDbyteSize - 1] &= CDfilter[bitIndex(size - 1)];
     }
-    CDsize = size;
   }
 }
 
@@ -40,29 +37,20 @@ CoilData::CoilData(const char *initVector) :
 
 // Destructor: take care of cleaning up
 CoilData::~CoilData() {
-  if (CDbuffer) {
-    delete CDbuffer;
-  }
+  release();
 }
 
 // Assignment operator
 CoilData& CoilData::operator=(const CoilData& m) {
+  // Self-assignment does nothing
+  if (this == &m) return *this;
   // Remove old data
-  if (CDbuffer) {
-    delete CDbuffer;
-  }
+  release();
   // Are coils in source?
   if (m.CDsize > 0) {
     // Yes. Allocate new buffer and copy data
-    CDbuffer = new uint8_t[m.CDbyteSize];
+    allocate(m.CDsize);
     memcpy(CDbuffer, m.CDbuffer, m.CDbyteSize);
-    CDsize = m.CDsize;
-    CDbyteSize = m.CDbyteSize;
-  } else {
-    // No, leave buffer empty
-    CDsize = 0;
-    CDbyteSize = 0;
-    CDbuffer = nullptr;
   }
   return *this;
 }
@@ -75,52 +63,68 @@ CoilData::CoilData(const CoilData& m) :
   // Has the source coils at all?
   if (m.CDsize > 0) {
     // Yes. Allocate new buffer and copy data
-    CDbuffer = new uint8_t[m.CDbyteSize];
+    allocate(m.CDsize);
     memcpy(CDbuffer, m.CDbuffer, m.CDbyteSize);
-    CDsize = m.CDsize;
-    CDbyteSize = m.CDbyteSize;
   }
 }
 
 #ifndef NO_MOVE
 // Move constructor
-CoilData::CoilData(CoilData&& m) {
-  // Copy all data
-  CDbuffer = m.CDbuffer;
-  CDsize = m.CDsize;
-  CDbyteSize = m.CDbyteSize;
-  // Then clear source
-  m.CDbuffer = nullptr;
-  m.CDsize = 0;
-  m.CDbyteSize = 0;
+CoilData::CoilData(CoilData&& m) :
+  CDsize(0),
+  CDbyteSize(0), 
+  CDbuffer(nullptr) {
+  take(m);
 }
 
 // Move assignment
 CoilData& CoilData::operator=(CoilData&& m) {
-  // Remove buffer, if already allocated
-  if (CDbuffer) {
-    delete CDbuffer;
+  if (this != &m) {
+    // Remove buffer, if already allocated
+    release();
+    take(m);
   }
+  return *this;
+}
+
+// take: move over the coils of m, leaving m empty.
+// Inline data has to be copied, heap buffers are taken over as they are
+void CoilData::take(CoilData& m) {
   // Are there coils in the source at all?
   if (m.CDsize > 0) {
-    // Yes. Copy over all data
-    CDbuffer = m.CDbuffer;
-    CDsize = m.CDsize;
-    CDbyteSize = m.CDbyteSize;
+    if (m.CDbuffer == m.CDinline) {
+      allocate(m.CDsize);
+      memcpy(CDbuffer, m.CDbuffer, m.CDbyteSize);
+    } else {
+      CDbuffer = m.CDbuffer;
+      CDsize = m.CDsize;
+      CDbyteSize = m.CDbyteSize;
+    }
     // Then clear source
     m.CDbuffer = nullptr;
     m.CDsize = 0;
     m.CDbyteSize = 0;
-  } else {
-    // No, leave object empty.
-    CDbuffer = nullptr;
-    CDsize = 0;
-    CDbyteSize = 0;
   }
-  return *this;
 }
 #endif
 
+// allocate: get storage for size coils - inside the object, if they will fit
+void CoilData::allocate(uint16_t size) {
+  CDsize = size;
+  CDbyteSize = byteIndex(size - 1) + 1;
+  CDbuffer = (CDbyteSize <= COILDATA_INLINE_BYTES) ? CDinline : new uint8_t[CDbyteSize];
+}
+
+// release: give back the storage and leave the object empty
+void CoilData::release() {
+  if (CDbuffer && CDbuffer != CDinline) {
+    delete[] CDbuffer;
+  }
+  CDbuffer = nullptr;
+  CDsize = 0;
+  CDbyteSize = 0;
+}
+
 // Comparison operators
 bool CoilData::operator==(const CoilData& m) {
   // Self-compare is always true
@@ -175,16 +179,29 @@ CoilData CoilData::slice(uint16_t start, uint16_t length) {
     // Yes, it does. Extend return object
     retval = CoilData(length);
 
-  // Loop over all requested bits
-    for (uint16_t i = start; i < start + length; ++i) {
-      if (CDbuffer[byteIndex(i)] & (1 << bitIndex(i))) {
-        retval.set(i - start, true);
-      }
+    // Copy over the requested bits, up to 32 at a time
+    for (uint16_t done = 0; done < length; done += 32) {
+      uint8_t n = (length - done > 32) ? 32 : length - done;
+      retval.putBits(done, n, getBits(CDbuffer, start + done, n));
     }
   }
   return retval;
 }
 
+// view: return a CoilDataView on a range of coils
+// will return an empty view if illegal parameters are detected
+CoilDataView CoilData::view(uint16_t start, uint16_t length) const {
+  // If start is beyond the available coils, return empty view
+  if (CDsize == 0 || start > CDsize) return CoilDataView();
+
+  // length default is all up to the end
+  if (length == 0) length = CDsize - start;
+
+  // Does the requested range fit in the buffer?
+  if ((start + length) > CDsize) return CoilDataView();
+  return CoilDataView(CDbuffer, length, start);
+}
+
 // operator[]: return value of a single coil
 bool CoilData::operator[](uint16_t index) const {
   if (index < CDsize) {
@@ -231,35 +248,13 @@ bool CoilData::set(uint16_t start, uint16_t length, vector<uint8_t> newValue) {
 // **** Watch out! ****
 // This may be a potential risk if newValue is pointing to an array shorter than required. 
 // Then heap data behind the array may be used to set coils!
-bool CoilData::set(uint16_t start, uint16_t length, uint8_t *newValue) {
+bool CoilData::set(uint16_t start, uint16_t length, const uint8_t *newValue) {
   // Does the requested slice fit in the buffer?
   if (length && (start + length) <= CDsize) {
-    // Yes, it does. 
-    // Prepare pointers to the source byte and the bit within
-    uint8_t *cp = newValue;
-    uint8_t bitPtr = 0;
-
-    // Loop over all bits to be set
-    for (uint16_t i = start; i < start + length; i++) {
-      // Get affected byte
-      uint8_t by = byteIndex(i);
-      // Calculate single-bit mask in target byte
-      uint8_t mask = 1 << bitIndex(i);
-      // Stamp out bit
-      CDbuffer[by] &= ~mask;
-      // is source bit set?
-      if (*cp & (1 << bitPtr)) {
-        // Yes. Set it in target as well
-        CDbuffer[by] |= mask;
-      }
-      // Advance source bit ptr
-      bitPtr++;
-      // Overflow?
-      if (bitPtr >= 8) {
-        // Yes. move pointers to first bit in next source byte
-        bitPtr = 0;
-        cp++;
-      }
+    // Yes, it does. Copy over the bits, up to 32 at a time
+    for (uint16_t done = 0; done < length; done += 32) {
+      uint8_t n = (length - done > 32) ? 32 : length - done;
+      putBits(start + done, n, getBits(newValue, done, n));
     }
     return true;
   }
@@ -270,20 +265,8 @@ bool CoilData::set(uint16_t start, uint16_t length, uint8_t *newValue) {
 // Setting stops when either target storage or source coils are exhausted
 bool CoilData::set(uint16_t index, const CoilData& c) {
   // if source object is empty, return false
-  if (c.empty()) return false;
-
-  // If target is empty, or index is beyond coils, return false
-  if (CDsize == 0 || index >= CDsize) return false;
-
-  // Take the minimum of remaining coils after index and the length of c
-  uint16_t length = CDsize - index;
-  if (c.coils() < length) length = c.coils();
-
-  // Loop over all coils to be copied
-  for (uint16_t i = index; i < index + length; ++i) {
-    set(i, c[i - index]);
-  }
-  return true;
+  if (c.coils() == 0) return false;
+  return set(index, c.view());
 }
 
 // set #5: alter a group of coils, overwriting it by a bit image array
@@ -327,6 +310,27 @@ bool CoilData::set(uint16_t index, const char *initVector) {
   return true;
 }
 
+// set #6: alter a group of coils, overwriting it by the coils of a view
+// Setting stops when either target storage or source coils are exhausted
+bool CoilData::set(uint16_t index, const CoilDataView& v) {
+  // if source view is empty, return false
+  if (v.coils() == 0) return false;
+
+  // If target is empty, or index is beyond coils, return false
+  if (CDsize == 0 || index >= CDsize) return false;
+
+  // Take the minimum of remaining coils after index and the length of v
+  uint16_t length = CDsize - index;
+  if (v.coils() < length) length = v.coils();
+
+  // Copy over the coils, up to 32 at a time
+  for (uint16_t done = 0; done < length; done += 32) {
+    uint8_t n = (length - done > 32) ? 32 : length - done;
+    putBits(index + done, n, getBits(v.CV_data, v.CV_start + done, n));
+  }
+  return true;
+}
+
 // Comparison against bit image array
 bool CoilData::operator==(const char *initVector) {
   const char *cp = initVector;   // pointer to source array
@@ -429,19 +433,12 @@ bool CoilData::setVector(const char *initVector) {
   }
 
   // If there are coils already, trash them.
-  if (CDbuffer) {
-    delete CDbuffer;
-  }
-  CDsize = 0;
-  CDbyteSize = 0;
+  release();
 
   // Did we count a manageable number?
   if (length && length <= 2000) {
-    // Yes. Init the coils
-    CDsize = length;
-    CDbyteSize = byteIndex(length - 1) + 1;
-    // Allocate new coil storage
-    CDbuffer = new uint8_t[CDbyteSize];
+    // Yes. Allocate new coil storage
+    allocate(length);
     memset(CDbuffer, 0, CDbyteSize);
 
     // Prepare second loop
@@ -493,20 +490,20 @@ void CoilData::init(bool value) {
 }
 
 // Return number of coils set to 1 (or not)
-// Uses Brian Kernighan's algorithm!
+// Counts 32 bits at a time - the overhang bits of the last byte are always 0
 uint16_t CoilData::coilsSetON() const {
   uint16_t count = 0;
+  uint8_t i = 0;
 
-  // Do we have coils at all?
-  if (CDbyteSize) {
-    // Yes. Loop over all bytes summing up the '1' bits
-    for (uint8_t i = 0; i < CDbyteSize; ++i) {
-      uint8_t by = CDbuffer[i];
-      while (by) {
-        by &= by - 1; // this clears the LSB-most set bit
-        count++;
-      }
-    }
+  // Loop over all complete 32 bit words
+  for (; i + 4 <= CDbyteSize; i += 4) {
+    uint32_t word;
+    memcpy(&word, CDbuffer + i, 4);
+    count += __builtin_popcount(word);
+  }
+  // Add in the remaining bytes
+  for (; i < CDbyteSize; ++i) {
+    count += __builtin_popcount(CDbuffer[i]);
   }
   return count;
 }
@@ -515,6 +512,35 @@ uint16_t CoilData::coilsSetOFF() const {
   return CDsize - coilsSetON();
 }
 
+// getBits: return count (1..32) bits from the packed bit buffer src, starting with bit number start.
+// Only the bytes holding these bits are read.
+uint32_t CoilData::getBits(const uint8_t *src, uint16_t start, uint8_t count) {
+  const uint8_t *cp = src + byteIndex(start);
+  uint8_t shift = bitIndex(start);
+  uint8_t bytes = (shift + count + 7) >> 3;
+  // Collect the bytes LSB first, then shift the bits into place
+  uint64_t word = 0;
+  for (uint8_t i = 0; i < bytes; ++i) {
+    word |= (uint64_t)cp[i] << (i * 8);
+  }
+  word >>= shift;
+  return (count < 32) ? (uint32_t)word & ((1UL << count) - 1) : (uint32_t)word;
+}
+
+// putBits: overwrite count (1..32) coils starting at start by the lowest bits of value
+void CoilData::putBits(uint16_t start, uint8_t count, uint32_t value) {
+  uint8_t *cp = CDbuffer + byteIndex(start);
+  uint8_t shift = bitIndex(start);
+  uint8_t bytes = (shift + count + 7) >> 3;
+  uint64_t mask = ((count < 32) ? ((1ULL << count) - 1) : 0xFFFFFFFFULL) << shift;
+  uint64_t bits = ((uint64_t)value << shift) & mask;
+  // Merge the bits into the affected bytes only
+  for (uint8_t i = 0; i < bytes; ++i) {
+    uint8_t m = mask >> (i * 8);
+    cp[i] = (cp[i] & ~m) | ((bits >> (i * 8)) & m);
+  }
+}
+
 #if !IS_LINUX
 // Not for Linux for the Print reference!
 
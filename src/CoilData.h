@@ -9,9 +9,15 @@
 #include <vector>
 #include <cstdint>
 #include "options.h"
+#include "CoilDataView.h"
 
 using std::vector;
 
+// Coil sets of up to COILDATA_INLINE_BYTES * 8 coils are held inside the object, larger ones on the heap
+#ifndef COILDATA_INLINE_BYTES
+#define COILDATA_INLINE_BYTES 8
+#endif
+
 // CoilData: representing Modbus coil (=bit) values
 class CoilData {
 public:
@@ -56,6 +62,10 @@ public:
   // Default start is first coil, default length all to the end
   CoilData slice(uint16_t start = 0, uint16_t length = 0);
 
+  // view: like slice, but returning a CoilDataView on the coils instead of a copy.
+  // The view is valid as long as the CoilData object is unchanged.
+  CoilDataView view(uint16_t start = 0, uint16_t length = 0) const;
+
   // operator[]: return value of a single coil
   bool operator[](uint16_t index) const;
 
@@ -69,7 +79,7 @@ public:
   bool set(uint16_t index, uint16_t length, vector<uint8_t> newValue);
 
   // set #3: alter a group of coils, overwriting it by the bits from unit8_t buffer newValue
-  bool set(uint16_t index, uint16_t length, uint8_t *newValue);
+  bool set(uint16_t index, uint16_t length, const uint8_t *newValue);
 
   // set #4: alter a group of coils, overwriting it by the coils in another CoilData object
   // Setting stops when either target storage or source coils are exhausted
@@ -79,6 +89,10 @@ public:
   // Setting stops when either target storage or source bits are exhausted
   bool set(uint16_t index, const char *initVector);
 
+  // set #6: alter a group of coils, overwriting it by the coils of a view
+  // Setting stops when either target storage or source coils are exhausted
+  bool set(uint16_t index, const CoilDataView& v);
+
   // (Re-)init complete coil set to 1 or 0
   void init(bool value = false);
 
@@ -98,7 +112,7 @@ public:
   // Return number of coils set to 0 (or OFF)
   uint16_t coilsSetOFF() const;
 
-#if !ISLINUX
+#if !IS_LINUX
   // Helper function to dump out coils in logical order
   void print(const char *label, Print& s);
 #endif
@@ -107,16 +121,27 @@ protected:
   // bit masks for bits left of a bit index in a byte
   const uint8_t CDfilter[8] = { 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF };
   // Calculate byte index and bit index within that byte
-  inline uint8_t byteIndex(uint16_t index) const { return index >> 3; }
-  inline uint8_t bitIndex(uint16_t index) const { return index & 0x07; }
+  static inline uint8_t byteIndex(uint16_t index) { return index >> 3; }
+  static inline uint8_t bitIndex(uint16_t index) { return index & 0x07; }
   // Calculate reversed bit sequence for a byte (taken from http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith32Bits)
   inline uint8_t reverseBits(uint8_t b) { return ((b * 0x0802LU & 0x22110LU) | (b * 0x8020LU & 0x88440LU)) * 0x10101LU >> 16; }
+  // Word-at-a-time helpers. getBits: return count (1..32) bits from packed bit buffer src, starting at bit start.
+  // putBits: overwrite count (1..32) coils starting at start with the lowest bits of value
+  static uint32_t getBits(const uint8_t *src, uint16_t start, uint8_t count);
+  void putBits(uint16_t start, uint8_t count, uint32_t value);
+  // Storage management. allocate: get a buffer for size coils, release: drop it, take: move over from m
+  void allocate(uint16_t size);
+  void release();
+  void take(CoilData& m);
   // (Re-)init with bit image vector
   bool setVector(const char *initVector);
 
   uint16_t CDsize;         // Size of the CoilData store in bits
   uint8_t  CDbyteSize;     // Size in bytes
-  uint8_t *CDbuffer;       // Pointer to bit storage
+  uint8_t *CDbuffer;       // Pointer to bit storage, either CDinline or on the heap
+  uint8_t CDinline[COILDATA_INLINE_BYTES];  // Storage for small coil sets
+
+  friend class CoilDataView;
 };
 
 #endif
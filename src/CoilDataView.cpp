@@ -0,0 +1,58 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "CoilData.h"
+#undef LOCAL_LOG_LEVEL
+#include "Logging.h"
+
+// operator[]: return value of a single coil
+bool CoilDataView::operator[](uint16_t index) const {
+  if (index < CV_size) {
+    uint16_t bit = CV_start + index;
+    return (CV_data[bit >> 3] & (1 << (bit & 0x07))) ? true : false;
+  }
+  // Wrong parameter -> always return false
+  return false;
+}
+
+// slice: view on a part of this view
+CoilDataView CoilDataView::slice(uint16_t start, uint16_t length) const {
+  // If start is beyond the viewed coils, return empty view
+  if (start > CV_size) return CoilDataView();
+
+  // length default is all up to the end
+  if (length == 0) length = CV_size - start;
+
+  // Does the requested slice fit?
+  if ((start + length) > CV_size) return CoilDataView();
+  return CoilDataView(CV_data, length, CV_start + start);
+}
+
+// copyTo: write the coils shifted leftmost into dest, 32 at a time
+uint16_t CoilDataView::copyTo(uint8_t *dest) const {
+  uint16_t byteCount = bytes();
+  for (uint16_t done = 0; done < CV_size; done += 32) {
+    uint8_t n = (CV_size - done > 32) ? 32 : CV_size - done;
+    uint32_t word = CoilData::getBits(CV_data, CV_start + done, n);
+    // Store the word LSB first, but do not write beyond the bytes needed
+    for (uint8_t i = 0; i < n; i += 8) {
+      *dest++ = (word >> i) & 0xFF;
+    }
+  }
+  return byteCount;
+}
+
+// Return number of coils set to 1, counting 32 at a time
+uint16_t CoilDataView::coilsSetON() const {
+  uint16_t count = 0;
+  for (uint16_t done = 0; done < CV_size; done += 32) {
+    uint8_t n = (CV_size - done > 32) ? 32 : CV_size - done;
+    count += __builtin_popcount(CoilData::getBits(CV_data, CV_start + done, n));
+  }
+  return count;
+}
+
+uint16_t CoilDataView::coilsSetOFF() const {
+  return CV_size - coilsSetON();
+}
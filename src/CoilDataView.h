@@ -0,0 +1,52 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _COILDATA_VIEW_H
+#define _COILDATA_VIEW_H
+
+#include <cstdint>
+#include "options.h"
+
+// CoilDataView: read-only, non-owning look at a range of coils packed LSB first, as in a CoilData
+// object or the data of a FC 0x01 response or FC 0x0F request.
+// Creating a view or a slice of it will not copy any data. The view is only valid as long as the
+// underlying buffer is unchanged.
+class CoilDataView {
+public:
+  // Empty view
+  CoilDataView() : CV_data(nullptr), CV_start(0), CV_size(0) {}
+
+  // View on count coils in packed bit buffer data, beginning with coil number start
+  CoilDataView(const uint8_t *data, uint16_t count, uint16_t start = 0) :
+    CV_data(data), CV_start(start), CV_size(count) {}
+
+  // get size in coils and in bytes needed by copyTo()
+  inline uint16_t coils() const { return CV_size; }
+  inline uint16_t bytes() const { return (CV_size + 7) >> 3; }
+
+  // operator[]: return value of a single coil
+  bool operator[](uint16_t index) const;
+
+  // slice: view on a part of this view. Default start is first coil, default length all to the end
+  // will return an empty view if illegal parameters are detected
+  CoilDataView slice(uint16_t start = 0, uint16_t length = 0) const;
+
+  // copyTo: write the coils shifted leftmost into dest, that must have room for bytes() bytes.
+  // Returns the number of bytes written
+  uint16_t copyTo(uint8_t *dest) const;
+
+  // Return number of coils set to 1 (or ON)
+  uint16_t coilsSetON() const;
+  // Return number of coils set to 0 (or OFF)
+  uint16_t coilsSetOFF() const;
+
+protected:
+  const uint8_t *CV_data;    // Packed bit buffer
+  uint16_t CV_start;         // Number of the first coil viewed in CV_data
+  uint16_t CV_size;          // Number of coils viewed
+
+  friend class CoilData;
+};
+
+#endif
@@ -0,0 +1,106 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _INLINE_BUFFER_H
+#define _INLINE_BUFFER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// InlineBuffer: fixed capacity byte container providing the subset of the std::vector<uint8_t>
+// interface that ModbusMessage is using. All data is held inside the object, so no heap is
+// touched at all. Data exceeding CAPACITY is silently dropped - check size() if in doubt!
+template <uint16_t CAPACITY>
+class InlineBuffer {
+public:
+  typedef uint8_t value_type;
+  typedef uint8_t *iterator;
+  typedef const uint8_t *const_iterator;
+
+  // Default constructor: empty buffer
+  InlineBuffer() : IB_size(0) {}
+
+  // Constructor taking a std::vector<uint8_t> to copy from
+  explicit InlineBuffer(const std::vector<uint8_t>& v) : IB_size(0) {
+    assign(v.data(), v.size());
+  }
+
+  // Copy constructor - will only copy the used part of the buffer
+  InlineBuffer(const InlineBuffer& b) : IB_size(0) {
+    assign(b.IB_data, b.IB_size);
+  }
+
+  // Assignment operator
+  InlineBuffer& operator=(const InlineBuffer& b) {
+    if (this != &b) {
+      assign(b.IB_data, b.IB_size);
+    }
+    return *this;
+  }
+
+  // Exposed std::vector-like methods
+  inline const uint8_t *data() const { return IB_data; }
+  inline uint8_t *data() { return IB_data; }
+  inline size_t size() const { return IB_size; }
+  inline size_t capacity() const { return CAPACITY; }
+  inline bool empty() const { return IB_size == 0; }
+  inline void clear() { IB_size = 0; }
+
+  // reserve() and shrink_to_fit() are no-ops - the capacity is fixed
+  inline void reserve(size_t) {}
+  inline void shrink_to_fit() {}
+
+  // Unchecked element access like std::vector - ModbusMessage is checking the bounds
+  inline uint8_t& operator[](size_t index) { return IB_data[index]; }
+  inline const uint8_t& operator[](size_t index) const { return IB_data[index]; }
+
+  // push_back: add a byte, if there is room left
+  inline void push_back(const uint8_t& val) {
+    if (IB_size < CAPACITY) IB_data[IB_size++] = val;
+  }
+
+  // resize: shorten or extend (with 0x00 bytes) the buffer, limited to CAPACITY
+  void resize(size_t newSize) {
+    if (newSize > CAPACITY) newSize = CAPACITY;
+    if (newSize > IB_size) memset(IB_data + IB_size, 0, newSize - IB_size);
+    IB_size = newSize;
+  }
+
+  // assign: replace the buffer contents by count bytes from src
+  void assign(const uint8_t *src, size_t count) {
+    if (count > CAPACITY) count = CAPACITY;
+    memmove(IB_data, src, count);
+    IB_size = count;
+  }
+
+  // insert: copy the range [first, last) in front of pos, as far as it fits
+  template <typename InputIt>
+  iterator insert(const_iterator pos, InputIt first, InputIt last) {
+    uint16_t at = pos - IB_data;
+    size_t count = 0;
+    for (InputIt it = first; it != last; ++it) count++;
+    // Limit to what is left in the buffer
+    if (count > (size_t)(CAPACITY - IB_size)) count = CAPACITY - IB_size;
+    // Make room for the new data and copy it in
+    memmove(IB_data + at + count, IB_data + at, IB_size - at);
+    for (size_t i = 0; i < count; ++i, ++first) {
+      IB_data[at + i] = *first;
+    }
+    IB_size += count;
+    return IB_data + at;
+  }
+
+  // Iterator interface
+  inline iterator begin() { return IB_data; }
+  inline iterator end() { return IB_data + IB_size; }
+  inline const_iterator begin() const { return IB_data; }
+  inline const_iterator end() const { return IB_data + IB_size; }
+
+protected:
+  uint16_t IB_size;              // Number of bytes used
+  uint8_t IB_data[CAPACITY];     // The data proper
+};
+
+#endif
@@ -9,12 +9,12 @@ int MBUlogLvl = LOG_LEVEL;
 #if IS_LINUX
 #define PrintOut printf
 
-void logHexDump(const char *letter, const char *label, const uint8_t *data, const size_t length) {
+void logHexDump(const char *letter, const char *label, const uint8_t *data, const size_t length, uintptr_t address, size_t total) {
 #else
 Print *LOGDEVICE = &Serial;
 #define PrintOut output->printf
 
-void logHexDump(Print *output, const char *letter, const char *label, const uint8_t *data, const size_t length) {
+void logHexDump(Print *output, const char *letter, const char *label, const uint8_t *data, const size_t length, uintptr_t address, size_t total) {
 #endif
   size_t cnt = 0;
   size_t step = 0;
@@ -27,7 +27,9 @@ void logHexDump(Print *output, const char *letter, const char *label, const uint
   const char HEXDIGIT[] = "0123456789ABCDEF";
 
   // Print out header
-  PrintOut ("[%s] %s: @%" PRIXPTR "/%" PRIu32 ":\n", letter, label, (uintptr_t)data, (uint32_t)(length & 0xFFFFFFFF));
+  if (!address) address = (uintptr_t)data;
+  if (!total) total = length;
+  PrintOut ("[%s] %s: @%" PRIXPTR "/%" PRIu32 ":\n", letter, label, address, (uint32_t)(total & 0xFFFFFFFF));
 
   // loop over data in steps of 16
   for (cnt = 0; cnt < length; ++cnt) {
@@ -49,13 +49,22 @@ constexpr const char* file_name(const char* str) {
     return str_slant(str) ? r_slant(str_end(str)) : str;
 }
 
+// address and total, if given, are shown in the header instead of data and length - for a copy of the data
 #if IS_LINUX
-void logHexDump(const char *letter, const char *label, const uint8_t *data, const size_t length);
+void logHexDump(const char *letter, const char *label, const uint8_t *data, const size_t length, uintptr_t address = 0, size_t total = 0);
 #else
 extern Print *LOGDEVICE;
-void logHexDump(Print *output, const char *letter, const char *label, const uint8_t *data, const size_t length);
+void logHexDump(Print *output, const char *letter, const char *label, const uint8_t *data, const size_t length, uintptr_t address = 0, size_t total = 0);
 #endif
 extern int MBUlogLvl;
+
+// LOG_BUFFERED: log calls only put a record into a ring buffer, a low priority task prints them out
+#ifndef LOG_BUFFERED
+#define LOG_BUFFERED 0
+#endif
+#if LOG_BUFFERED
+#include "ModbusLogBuffer.h"
+#endif
 #endif  // _MODBUS_LOGGING
 
 // The remainder may need to be redefined if LOCAL_LOG_LEVEL was set differently before
@@ -91,7 +100,15 @@ extern int MBUlogLvl;
 #endif
 
 // Now we can define the macros based on LOCAL_LOG_LEVEL
-#if IS_LINUX
+#if LOG_BUFFERED
+#define LOG_LINE_C(level, x, format, ...) if (MBUlogLvl >= level) MBUlogBuffer.line(ModbusLogBuffer::RED, #x[0], format, file_name(__FILE__), __LINE__, __func__, ##__VA_ARGS__)
+#define LOG_LINE_E(level, x, format, ...) if (MBUlogLvl >= level) MBUlogBuffer.line(ModbusLogBuffer::YELLOW, #x[0], format, file_name(__FILE__), __LINE__, __func__, ##__VA_ARGS__)
+#define LOG_LINE_T(level, x, format, ...) if (MBUlogLvl >= level) MBUlogBuffer.line(ModbusLogBuffer::PLAIN, #x[0], format, file_name(__FILE__), __LINE__, __func__, ##__VA_ARGS__)
+#define LOG_RAW_C(level, x, format, ...) if (MBUlogLvl >= level) MBUlogBuffer.raw(ModbusLogBuffer::RED, format, ##__VA_ARGS__)
+#define LOG_RAW_E(level, x, format, ...) if (MBUlogLvl >= level) MBUlogBuffer.raw(ModbusLogBuffer::YELLOW, format, ##__VA_ARGS__)
+#define LOG_RAW_T(level, x, format, ...) if (MBUlogLvl >= level) MBUlogBuffer.raw(ModbusLogBuffer::PLAIN, format, ##__VA_ARGS__)
+#define HEX_DUMP_T(x, level, label, address, length) if (MBUlogLvl >= level) MBUlogBuffer.hexDump(#x, label, address, length)
+#elif IS_LINUX
 #define LOG_LINE_C(level, x, format, ...) if (MBUlogLvl >= level) printf(LL_RED LOG_HEADER(x) format LL_NORM, millis(), file_name(__FILE__), __LINE__, __func__, ##__VA_ARGS__)
 #define LOG_LINE_E(level, x, format, ...) if (MBUlogLvl >= level) printf(LL_YELLOW LOG_HEADER(x) format LL_NORM, millis(), file_name(__FILE__), __LINE__, __func__, ##__VA_ARGS__)
 #define LOG_LINE_T(level, x, format, ...) if (MBUlogLvl >= level) printf(LOG_HEADER(x) format, millis(), file_name(__FILE__), __LINE__, __func__, ##__VA_ARGS__)
@@ -6,9 +6,15 @@
 #define _MODBUS_BRIDGE_TEMP_H
 
 #include <map>
+#include <vector>
 #include <functional>
+#include <atomic>
+#if USE_MUTEX
+#include <mutex>      // NOLINT
+#endif
 #include "ModbusClient.h"
 #include "ModbusClientTCP.h"  // Needed for client.setTarget()
+#include "ModbusReadCache.h"
 #include "RTUutils.h"  // Needed for RTScallback
 
 #undef LOCAL_LOG_LEVEL
@@ -17,6 +23,7 @@
 
 using std::bind;
 using std::placeholders::_1;
+using std::placeholders::_2;
 
 // Known server types: TCP (client, host/port) and RTU (client)
 enum ServerType : uint8_t { TCP_SERVER, RTU_SERVER };
@@ -44,6 +51,25 @@ public:
   // Block a function code (respond with ILLEGAL_FUNCTION error)
   bool denyFunctionCode(uint8_t aliasID, uint8_t functionCode);
 
+  // Limit the number of requests forwarded to a server at the same time. More are answered with
+  // SERVER_DEVICE_BUSY. 0: no limit - the client's queue limit will apply only.
+  bool setMaxInflightRequests(uint8_t aliasID, uint16_t limit);
+
+  // Number of requests forwarded to a server and waiting for their responses
+  uint16_t pendingRequests(uint8_t aliasID);
+
+  // Answer reads (FC 0x01..0x04) of a server from a cache, as long as the data is younger than maxAge ms.
+  // maxEntries: number of address ranges kept. maxAge 0: no caching (the default)
+  // Set it up before the server is started - it may be switched off and on again any time later.
+  bool setReadCache(uint8_t aliasID, uint32_t maxAge, uint16_t maxEntries = 16);
+
+  // Read cache of a server, nullptr if there is none. For its hit and miss counts or to clear() it
+  ModbusReadCache *getReadCache(uint8_t aliasID);
+
+  // Let reads (FC 0x01..0x04) of a server identical to one forwarded already and waiting for its
+  // response wait for that response as well, instead of sending another request.
+  bool mergeReads(uint8_t aliasID, bool onOff = true);
+
 protected:
   // ServerData holds all data necessary to address a single server
   struct ServerData {
@@ -52,6 +78,14 @@ protected:
     ServerType serverType;        // TCP_SERVER or RTU_SERVER
     IPAddress host;               // TCP: host IP address, else 0.0.0.0
     uint16_t port;                // TCP: host port number, else 0
+    std::atomic<uint16_t> inflight;  // Requests forwarded, waiting for their responses
+    uint16_t maxInflight;         // Limit for inflight, 0: none
+    ModbusReadCache *cache;       // Read cache, if set up. Kept until the bridge is gone
+    bool merging;                 // Identical reads shall wait for the one forwarded
+    std::map<uint64_t, std::vector<MBSresponder>> flights;  // Reads forwarded by readKey(), with the ones waiting for them
+#if USE_MUTEX
+    std::mutex flightLock;        // Protects flights
+#endif
 
     // RTU constructor
     ServerData(uint8_t sid, ModbusClient *c) :
@@ -59,7 +93,12 @@ protected:
       client(c),
       serverType(RTU_SERVER),
       host(IPAddress(0, 0, 0, 0)),
-      port(0) {}
+      port(0),
+      inflight(0),
+      maxInflight(0),
+      cache(nullptr),
+      merging(false),
+      flights() {}
     
     // TCP constructor
     ServerData(uint8_t sid, ModbusClient *c, IPAddress h, uint16_t p) :
@@ -67,37 +106,64 @@ protected:
       client(c),
       serverType(TCP_SERVER),
       host(h),
-      port(p) {}
+      port(p),
+      inflight(0),
+      maxInflight(0),
+      cache(nullptr),
+      merging(false),
+      flights() {}
+
+    ~ServerData() { delete cache; }
   };
 
-  // Default worker functions
-  ModbusMessage bridgeWorker(ModbusMessage msg);
+  // Default worker functions. Requests are forwarded without waiting for the response - the
+  // client hands it to the responder whenever it is there, so requests to several servers
+  // and from several upstream connections will proceed in parallel.
+  void bridgeWorker(ModbusMessage msg, MBSresponder respond);
   ModbusMessage bridgeDenyWorker(ModbusMessage msg);
 
+  // readKey: identify a read by FC, address and count. Never 0, as the FC is not
+  static inline uint64_t readKey(ModbusMessage& msg) {
+    uint32_t range = (static_cast<uint32_t>(msg[2]) << 24) | (msg[3] << 16) | (msg[4] << 8) | msg[5];
+    return (static_cast<uint64_t>(msg.getFunctionCode()) << 32) | range;
+  }
+
+  // land: the response to a merged read is there - take the ones waiting for it off the list and respond to them
+  void land(ServerData *sd, uint64_t key, ModbusMessage& response);
+
   // Map of servers attached
   std::map<uint8_t, ServerData *> servers;
+  // Tokens for the forwarded requests. Never used twice, as millis() might be
+  std::atomic<uint32_t> bridgeToken;
 };
 
 // Constructor for TCP variants
 template<typename SERVERCLASS>
 ModbusBridge<SERVERCLASS>::ModbusBridge() :
-  SERVERCLASS() { } 
+  SERVERCLASS(),
+  bridgeToken(0) { } 
 
 // Constructors for RTU variant
 template<typename SERVERCLASS>
 ModbusBridge<SERVERCLASS>::ModbusBridge(HardwareSerial& serial, uint32_t timeout, int rtsPin) :
-  SERVERCLASS(serial, timeout, rtsPin) { }
+  SERVERCLASS(serial, timeout, rtsPin),
+  bridgeToken(0) { }
 
 // Alternate constructors for RTU variant
 template<typename SERVERCLASS>
 ModbusBridge<SERVERCLASS>::ModbusBridge(HardwareSerial& serial, uint32_t timeout, RTScallback rts) :
-  SERVERCLASS(serial, timeout, rts) { }
+  SERVERCLASS(serial, timeout, rts),
+  bridgeToken(0) { }
 
 // Destructor
 template<typename SERVERCLASS>
 ModbusBridge<SERVERCLASS>::~ModbusBridge() { 
   // Release ServerData storage in servers array
   for (auto itr = servers.begin(); itr != servers.end(); itr++) {
+    // The clients will respond to all requests forwarded - at the latest with a timeout
+    while (itr->second->inflight) {
+      delay(1);
+    }
     delete (itr->second);
   }
   servers.clear();
@@ -133,7 +199,7 @@ bool ModbusBridge<SERVERCLASS>::addFunctionCode(uint8_t aliasID, uint8_t functio
   // Is there already an entry for the aliasID?
   if (servers.find(aliasID) != servers.end()) {
     // Yes. Link server to own worker function
-    this->registerWorker(aliasID, functionCode, std::bind(&ModbusBridge<SERVERCLASS>::bridgeWorker, this, std::placeholders::_1));
+    this->registerDeferredWorker(aliasID, functionCode, std::bind(&ModbusBridge<SERVERCLASS>::bridgeWorker, this, std::placeholders::_1, std::placeholders::_2));
     LOG_D("FC %02X added for server %02X\n", functionCode, aliasID);
   } else {
     LOG_E("Server %d not attached to bridge!\n", aliasID);
@@ -156,36 +222,158 @@ bool ModbusBridge<SERVERCLASS>::denyFunctionCode(uint8_t aliasID, uint8_t functi
   return true;
 }
 
+template<typename SERVERCLASS>
+bool ModbusBridge<SERVERCLASS>::setMaxInflightRequests(uint8_t aliasID, uint16_t limit) {
+  auto it = servers.find(aliasID);
+  if (it == servers.end()) {
+    LOG_E("Server %d not attached to bridge!\n", aliasID);
+    return false;
+  }
+  it->second->maxInflight = limit;
+  return true;
+}
+
+template<typename SERVERCLASS>
+uint16_t ModbusBridge<SERVERCLASS>::pendingRequests(uint8_t aliasID) {
+  auto it = servers.find(aliasID);
+  if (it == servers.end()) return 0;
+  return it->second->inflight;
+}
+
+template<typename SERVERCLASS>
+bool ModbusBridge<SERVERCLASS>::setReadCache(uint8_t aliasID, uint32_t maxAge, uint16_t maxEntries) {
+  auto it = servers.find(aliasID);
+  if (it == servers.end()) {
+    LOG_E("Server %d not attached to bridge!\n", aliasID);
+    return false;
+  }
+  // A cache once made is only switched off, as responses on their way may still go there
+  if (it->second->cache) {
+    it->second->cache->setMaxAge(maxAge);
+  } else if (maxAge) {
+    it->second->cache = new ModbusReadCache(maxAge, maxEntries);
+  }
+  return true;
+}
+
+template<typename SERVERCLASS>
+ModbusReadCache *ModbusBridge<SERVERCLASS>::getReadCache(uint8_t aliasID) {
+  auto it = servers.find(aliasID);
+  if (it == servers.end()) return nullptr;
+  return it->second->cache;
+}
+
+template<typename SERVERCLASS>
+bool ModbusBridge<SERVERCLASS>::mergeReads(uint8_t aliasID, bool onOff) {
+  auto it = servers.find(aliasID);
+  if (it == servers.end()) {
+    LOG_E("Server %d not attached to bridge!\n", aliasID);
+    return false;
+  }
+  it->second->merging = onOff;
+  return true;
+}
+
+template<typename SERVERCLASS>
+void ModbusBridge<SERVERCLASS>::land(ServerData *sd, uint64_t key, ModbusMessage& response) {
+  std::vector<MBSresponder> waiting;
+  {
+    LOCK_GUARD(lockGuard, sd->flightLock);
+    auto f = sd->flights.find(key);
+    if (f != sd->flights.end()) {
+      waiting.swap(f->second);
+      sd->flights.erase(f);
+    }
+  }
+  for (auto& r : waiting) {
+    r(response);
+  }
+}
+
 // bridgeWorker: default worker function to process bridge requests
 template<typename SERVERCLASS>
-ModbusMessage ModbusBridge<SERVERCLASS>::bridgeWorker(ModbusMessage msg) {
+void ModbusBridge<SERVERCLASS>::bridgeWorker(ModbusMessage msg, MBSresponder respond) {
   uint8_t aliasID = msg.getServerID();
   uint8_t functionCode = msg.getFunctionCode();
   ModbusMessage response;
 
   // Find the (alias) serverID
-  if (servers.find(aliasID) != servers.end()) {
-    // Found it. We may use servers[aliasID] now without allocating a new map slot
+  auto it = servers.find(aliasID);
+  if (it == servers.end()) {
+    // If we get here, something has gone wrong internally. We send back an error response anyway.
+    response.setError(aliasID, functionCode, INVALID_SERVER);
+    respond(std::move(response));
+    return;
+  }
+  ServerData *sd = it->second;
+  ModbusReadCache *cache = sd->cache;
+  uint32_t generation = 0;
 
-    // Set real target server ID
-    msg.setServerID(servers[aliasID]->serverID);
+  // Can the cache answer it?
+  if (cache) {
+    if (cache->get(msg, response)) {
+      respond(std::move(response));
+      return;
+    }
+    // No. A write will make cached reads stale
+    cache->invalidate(msg);
+    generation = cache->generation();
+  }
 
-    // Issue the request
-    LOG_D("Request (%02X/%02X) sent\n", servers[aliasID]->serverID, functionCode);
-    // TCP servers have a target host/port that needs to be set in the client
-    if (servers[aliasID]->serverType == TCP_SERVER) {
-      response = reinterpret_cast<ModbusClientTCP *>(servers[aliasID]->client)->syncRequestMT(msg, (uint32_t)millis(), servers[aliasID]->host, servers[aliasID]->port);
-    } else {
-      response = servers[aliasID]->client->syncRequestM(msg, (uint32_t)millis());
+  // Is the same read on its way already? Then wait for its response, else be the one to send it
+  uint64_t key = 0;
+  if (sd->merging && ModbusReadCache::isRead(msg)) {
+    key = readKey(msg);
+    LOCK_GUARD(lockGuard, sd->flightLock);
+    auto f = sd->flights.find(key);
+    if (f != sd->flights.end()) {
+      LOG_D("Read merged for %02X/%02X\n", aliasID, functionCode);
+      f->second.push_back(respond);
+      return;
     }
+    sd->flights[key];
+  }
+
+  // Count it in. Too many requests on their way to the server already?
+  if (sd->inflight++ >= sd->maxInflight && sd->maxInflight) {
+    sd->inflight--;
+    LOG_D("Server %02X busy\n", aliasID);
+    response.setError(aliasID, functionCode, SERVER_DEVICE_BUSY);
+    respond(response);
+    if (key) land(sd, key, response);
+    return;
+  }
 
-    // Re-set the requested server ID
-    response.setServerID(aliasID);
+  // Set real target server ID
+  msg.setServerID(sd->serverID);
+
+  // The response will come back on the client's task. Re-set the requested server ID and pass it on
+  uint32_t token = bridgeToken++;
+  SyncHandle completion = std::make_shared<SyncCompletion>([this, sd, aliasID, respond, msg, cache, generation, key](ModbusMessage r, uint32_t) mutable {
+    if (cache) cache->put(msg, r, generation);
+    r.setServerID(aliasID);
+    respond(r);
+    if (key) land(sd, key, r);
+    sd->inflight--;
+  }, token);
+
+  // Issue the request
+  LOG_D("Request (%02X/%02X) sent\n", sd->serverID, functionCode);
+  Error rc = SUCCESS;
+  // TCP servers have a target host/port that needs to be set in the client
+  if (sd->serverType == TCP_SERVER) {
+    rc = reinterpret_cast<ModbusClientTCP *>(sd->client)->addRequestHT(std::move(msg), token, completion, sd->host, sd->port);
   } else {
-    // If we get here, something has gone wrong internally. We send back an error response anyway.
-    response.setError(aliasID, functionCode, INVALID_SERVER);
+    rc = sd->client->addRequestH(std::move(msg), token, completion);
+  }
+
+  // Could not queue it? Then the completion will never be called - respond with the error
+  if (rc != SUCCESS) {
+    sd->inflight--;
+    response.setError(aliasID, functionCode, rc);
+    respond(response);
+    if (key) land(sd, key, response);
   }
-  return response;
 }
 
 // bridgeDenyWorker: worker function to block function codes
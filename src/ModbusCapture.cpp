@@ -0,0 +1,206 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusCapture.h"
+#include <string.h>
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// pcapng block types and link types
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define LINKTYPE_USER0 147
+#define LINKTYPE_USER1 148
+
+// Constructor: allocate a buffer of size bytes
+ModbusCapture::ModbusCapture(uint32_t size) :
+  MC_buffer(nullptr),
+  MC_size(size & ~3),
+  MC_head(0),
+  MC_tail(0),
+  MC_count(0),
+  MC_lost(0),
+  MC_lastMicros(0),
+  MC_time(0),
+  MC_running(true),
+  MC_exporting(false) {
+  MC_buffer = new uint8_t[MC_size];
+  MC_lastMicros = micros();
+  MC_time = MC_lastMicros;
+}
+
+// Destructor
+ModbusCapture::~ModbusCapture() {
+  delete[] MC_buffer;
+}
+
+// add: record a frame made of len bytes at data, followed by len2 bytes at data2
+void ModbusCapture::add(Frame f, const uint8_t *data, uint16_t len, const uint8_t *data2, uint16_t len2, uint32_t time) {
+  if (!MC_running) return;
+  if (!time) time = micros();
+  LOCK_GUARD(lockGuard, MC_lock);
+  if (MC_exporting) {
+    MC_lost++;
+    return;
+  }
+  // Extend the timestamp to 64 bits. A frame may have been seen before the latest recorded
+  int32_t delta = static_cast<int32_t>(time - MC_lastMicros);
+  uint64_t stamp = MC_time + delta;
+  if (delta > 0) {
+    MC_lastMicros = time;
+    MC_time = stamp;
+  }
+  uint16_t length = len + (data2 ? len2 : 0);
+  uint8_t *cp = reserve(recordSize(length));
+  if (!cp) {
+    MC_lost++;
+    return;
+  }
+  Record *r = reinterpret_cast<Record *>(cp);
+  r->length = length;
+  r->frame = f;
+  r->reserved = 0;
+  r->timeLow = stamp & 0xFFFFFFFF;
+  r->timeHigh = stamp >> 32;
+  cp += sizeof(Record);
+  memcpy(cp, data, len);
+  if (data2 && len2) memcpy(cp + len, data2, len2);
+}
+
+// reserve: make room for need bytes at MC_head, dropping the oldest records as necessary
+uint8_t *ModbusCapture::reserve(uint32_t need) {
+  if (need > MC_size) return nullptr;
+  while (true) {
+    // Empty: start over at the beginning
+    if (!MC_count) {
+      MC_head = 0;
+      MC_tail = 0;
+      break;
+    }
+    if (MC_head > MC_tail) {
+      // Records are in [MC_tail, MC_head). Will it fit behind?
+      if (MC_size - MC_head >= need) break;
+      // No. Leave the rest of the buffer and go on at the beginning
+      if (MC_size - MC_head >= sizeof(Record)) reinterpret_cast<Record *>(MC_buffer + MC_head)->frame = SKIP;
+      MC_head = 0;
+    } else {
+      // Records are in [MC_tail, end) and [0, MC_head). Will it fit in between?
+      if (MC_tail - MC_head >= need) break;
+      // No. Drop the oldest record
+      MC_tail = next(MC_tail);
+      MC_count--;
+      MC_lost++;
+    }
+  }
+  uint8_t *cp = MC_buffer + MC_head;
+  MC_head += need;
+  if (MC_head >= MC_size) MC_head = 0;
+  MC_count++;
+  return cp;
+}
+
+// next: the position of the record following that at pos
+uint32_t ModbusCapture::next(uint32_t pos) {
+  pos += recordSize(reinterpret_cast<Record *>(MC_buffer + pos)->length);
+  return (pos >= MC_size) ? 0 : wrapped(pos);
+}
+
+// clear: drop all frames recorded
+void ModbusCapture::clear() {
+  LOCK_GUARD(lockGuard, MC_lock);
+  if (MC_exporting) return;
+  MC_head = 0;
+  MC_tail = 0;
+  MC_count = 0;
+  MC_lost = 0;
+}
+
+// frames: number of frames held
+uint32_t ModbusCapture::frames() {
+  LOCK_GUARD(lockGuard, MC_lock);
+  return MC_count;
+}
+
+// lost: number of frames overwritten or missed during an export since the last clear()
+uint32_t ModbusCapture::lost() {
+  LOCK_GUARD(lockGuard, MC_lock);
+  return MC_lost;
+}
+
+// pcapSize: size of the pcapng file exportPcap() would write now
+uint32_t ModbusCapture::pcapSize() {
+  LOCK_GUARD(lockGuard, MC_lock);
+  // Section header and two interface descriptions
+  uint32_t size = 28 + 2 * 20;
+  uint32_t pos = MC_tail;
+  for (uint32_t i = 0; i < MC_count; ++i) {
+    // Enhanced packet block with flags option
+    size += 44 + ((reinterpret_cast<Record *>(MC_buffer + pos)->length + 3) & ~3);
+    pos = next(pos);
+  }
+  return size;
+}
+
+// exportPcap: write all frames held as a pcapng file, oldest first
+size_t ModbusCapture::exportPcap(MBCaptureWriter writer) {
+  uint32_t pos = 0;
+  uint32_t count = 0;
+  {
+    LOCK_GUARD(lockGuard, MC_lock);
+    if (MC_exporting) return 0;
+    // Have add() keep its hands off the buffer - we do not need the lock any more then
+    MC_exporting = true;
+    pos = MC_tail;
+    count = MC_count;
+  }
+  size_t written = 0;
+  bool ok = true;
+  // Write a block, counting the bytes
+  auto put = [&](const void *data, size_t length) {
+    if (ok && length) {
+      ok = writer(static_cast<const uint8_t *>(data), length);
+      if (ok) written += length;
+    }
+  };
+
+  // Section header block: native byte order, version 1.0, section length unknown
+  uint32_t shb[7] = { PCAPNG_SHB, 28, 0x1A2B3C4D, 0x00000001, 0xFFFFFFFF, 0xFFFFFFFF, 28 };
+  put(shb, sizeof(shb));
+  // Interface description blocks: 0 for RTU, 1 for TCP frames. Default time resolution of us
+  uint32_t idb[5] = { PCAPNG_IDB, 20, LINKTYPE_USER0, 0, 20 };
+  // Snap length: the largest RTU frame with CRC
+  idb[3] = 256;
+  put(idb, sizeof(idb));
+  idb[2] = LINKTYPE_USER1;
+  idb[3] = 260;
+  put(idb, sizeof(idb));
+
+  // Enhanced packet blocks
+  const uint32_t zero = 0;
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    Record *r = reinterpret_cast<Record *>(MC_buffer + pos);
+    uint32_t padded = (r->length + 3) & ~3;
+    uint32_t total = 44 + padded;
+    bool tcp = (r->frame == TCP_RX || r->frame == TCP_TX);
+    bool out = (r->frame == RTU_TX || r->frame == TCP_TX);
+    uint32_t head[7] = { PCAPNG_EPB, total, tcp ? 1U : 0U, r->timeHigh, r->timeLow, r->length, r->length };
+    put(head, sizeof(head));
+    put(MC_buffer + pos + sizeof(Record), r->length);
+    put(&zero, padded - r->length);
+    // epb_flags option: inbound 1, outbound 2. Then end of options and the block length again
+    uint32_t tail[4] = { 0x00040002, out ? 2U : 1U, 0, total };
+    put(tail, sizeof(tail));
+    pos = next(pos);
+  }
+
+  LOCK_GUARD(lockGuard, MC_lock);
+  MC_exporting = false;
+  if (!ok) {
+    LOG_W("Capture export aborted after %u bytes\n", (unsigned int)written);
+  }
+  return written;
+}
@@ -0,0 +1,113 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_CAPTURE_H
+#define _MODBUS_CAPTURE_H
+
+#include "options.h"
+#include <functional>
+#if USE_MUTEX
+#include <mutex>      // NOLINT
+#endif
+
+// Default size of the capture buffer in bytes
+#ifndef MODBUS_CAPTURE_SIZE
+#define MODBUS_CAPTURE_SIZE 8192
+#endif
+
+// Writer for exportPcap(): takes length bytes at data. Return false to abort the export
+typedef std::function<bool(const uint8_t *data, size_t length)> MBCaptureWriter;
+
+// ModbusCapture: records the raw frames sent and received by clients and servers with a micros()
+// timestamp, to be exported as a pcapng file for Wireshark or tcpdump.
+// The frames are copied into a ring buffer allocated once by the constructor. If it is full, the
+// oldest frames are overwritten - the capture always holds the latest traffic. Nothing is formatted
+// or printed while recording, so the bus timing is left as it is.
+// RTU frames are kept with their CRC, TCP frames with their MBAP header. ASCII frames are not recorded.
+// In the pcapng file, RTU frames are on interface 0 with link type LINKTYPE_USER0 (147), TCP frames on
+// interface 1 with LINKTYPE_USER1 (148). Wireshark will decode them with "mbrtu" and "mbtcp" assigned
+// to these in its DLT_USER preferences. The direction is in the inbound/outbound packet flags.
+// Attach a capture to any number of clients and servers with their useCapture() call.
+class ModbusCapture {
+public:
+  // Frame kinds
+  enum Frame : uint8_t { RTU_RX = 0, RTU_TX, TCP_RX, TCP_TX };
+
+  // Constructor: allocate a buffer of size bytes
+  explicit ModbusCapture(uint32_t size = MODBUS_CAPTURE_SIZE);
+
+  // Destructor
+  ~ModbusCapture();
+
+  // add: record a frame made of len bytes at data, followed by len2 bytes at data2.
+  // time is the micros() value the frame was seen at, 0 for now
+  void add(Frame f, const uint8_t *data, uint16_t len, const uint8_t *data2 = nullptr, uint16_t len2 = 0, uint32_t time = 0);
+
+  // start, stop: resume or pause recording. A new capture is recording right away
+  inline void start() { MC_running = true; }
+  inline void stop() { MC_running = false; }
+  inline bool isRunning() const { return MC_running; }
+
+  // clear: drop all frames recorded
+  void clear();
+
+  // frames: number of frames held
+  uint32_t frames();
+
+  // lost: number of frames overwritten or missed during an export since the last clear()
+  uint32_t lost();
+
+  // pcapSize: size of the pcapng file exportPcap() would write now
+  uint32_t pcapSize();
+
+  // exportPcap: write all frames held as a pcapng file, oldest first. Returns the number of bytes written.
+  // Recording is paused meanwhile, so the writer may take its time without blocking the Modbus tasks
+  size_t exportPcap(MBCaptureWriter writer);
+
+protected:
+  // Prevent copy construction or assignment
+  ModbusCapture(const ModbusCapture& other) = delete;
+  ModbusCapture& operator=(const ModbusCapture& other) = delete;
+
+  // Record header in the buffer. Records are aligned to 4 bytes
+  struct Record {
+    uint16_t length;        // Frame length
+    uint8_t frame;          // Frame kind or SKIP
+    uint8_t reserved;
+    uint32_t timeLow;       // Timestamp in us
+    uint32_t timeHigh;
+  };
+  static const uint8_t SKIP = 0xFF;     // Marks the rest of the buffer as unused
+
+  // recordSize: bytes taken by a record of length bytes
+  static inline uint32_t recordSize(uint16_t length) { return sizeof(Record) + ((length + 3) & ~3); }
+
+  // reserve: make room for need bytes at MC_head, dropping the oldest records as necessary.
+  // Returns a pointer to the room or nullptr if need is too large
+  uint8_t *reserve(uint32_t need);
+
+  // next: the position of the record following that at pos
+  uint32_t next(uint32_t pos);
+
+  // wrapped: pos if a record may start there, 0 else
+  inline uint32_t wrapped(uint32_t pos) {
+    return (MC_size - pos < sizeof(Record) || reinterpret_cast<Record *>(MC_buffer + pos)->frame == SKIP) ? 0 : pos;
+  }
+
+  uint8_t *MC_buffer;             // The frames
+  uint32_t MC_size;               // Size of MC_buffer
+  uint32_t MC_head;               // Position for the next record
+  uint32_t MC_tail;               // Position of the oldest record
+  uint32_t MC_count;              // Number of records held
+  uint32_t MC_lost;               // Records overwritten or missed
+  uint32_t MC_lastMicros;         // Latest timestamp seen
+  uint64_t MC_time;               // MC_lastMicros extended to 64 bits
+  volatile bool MC_running;       // Recording, if true
+  bool MC_exporting;              // exportPcap() has recording paused
+#if USE_MUTEX
+  std::mutex MC_lock;             // Protects all of the above
+#endif
+};
+
+#endif  // _MODBUS_CAPTURE_H
@@ -0,0 +1,164 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusChangeFilter.h"
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Constructor
+ModbusChangeFilter::ModbusChangeFilter(MBOnChange onChange, uint16_t maxBlocks) :
+  CF_onChange(onChange),
+  CF_blocks(),
+  CF_deadbands(),
+  CF_maxBlocks(maxBlocks),
+  CF_responses(0),
+  CF_changes(0) { }
+
+// setDeadband: set the deadband for a range of registers
+void ModbusChangeFilter::setDeadband(uint8_t serverID, uint8_t functionCode, uint16_t address, uint16_t count, uint16_t deadband) {
+  if (functionCode != READ_HOLD_REGISTER && functionCode != READ_INPUT_REGISTER) return;
+  if (!count) return;
+  LOCK_GUARD(lockGuard, CF_lock);
+  CF_deadbands.push_back({ serverID, functionCode, address, count, deadband });
+  // Blocks kept already will need to know
+  for (auto& b : CF_blocks) {
+    if (b.serverID == serverID && b.functionCode == functionCode) applyDeadbands(b);
+  }
+}
+
+// applyDeadbands: fill in the deadbands of b's registers from the ranges set
+void ModbusChangeFilter::applyDeadbands(Block& b) {
+  b.deadbands.clear();
+  for (auto& d : CF_deadbands) {
+    if (d.serverID != b.serverID || d.functionCode != b.functionCode) continue;
+    // Overlap of both ranges
+    uint32_t from = d.address > b.address ? d.address : b.address;
+    uint32_t to = d.address + d.count < b.address + b.count ? d.address + d.count : b.address + b.count;
+    if (from >= to) continue;
+    if (b.deadbands.empty()) b.deadbands.assign(b.count, 0);
+    for (uint32_t a = from; a < to; ++a) {
+      b.deadbands[a - b.address] = d.deadband;
+    }
+  }
+}
+
+// report: hand a range of b to onChange
+void ModbusChangeFilter::report(Block& b, uint16_t from, uint16_t count, uint32_t token) {
+  CF_changes++;
+  if (!CF_onChange) return;
+  ModbusChange c;
+  c.host = b.host;
+  c.port = b.port;
+  c.serverID = b.serverID;
+  c.functionCode = b.functionCode;
+  c.address = b.address + from;
+  c.count = count;
+  if (b.functionCode <= READ_DISCR_INPUT) {
+    c.coils = b.bits.slice(from, count);
+  } else {
+    c.values = b.words.data() + from;
+  }
+  CF_onChange(c, token);
+}
+
+// update: compare the response's values to those reported last and report the changed ranges
+bool ModbusChangeFilter::update(const ModbusMessage& response, uint16_t address, uint16_t count, uint32_t token, uint32_t host, uint16_t port) {
+  if (response.size() < 3 || !count) return false;
+  uint8_t serverID = response.getServerID();
+  uint8_t fc = response.getFunctionCode();
+  bool isCoil = false;
+  uint16_t bytes = 0;
+  switch (fc) {
+  case READ_COIL:
+  case READ_DISCR_INPUT:
+    isCoil = true;
+    bytes = (count + 7) >> 3;
+    break;
+  case READ_HOLD_REGISTER:
+  case READ_INPUT_REGISTER:
+    bytes = count * 2;
+    break;
+  default:
+    return false;
+  }
+  // The data must match the read
+  if (response[2] != bytes || response.size() != bytes + 3) return false;
+  const uint8_t *data = response.data() + 3;
+
+  LOCK_GUARD(lockGuard, CF_lock);
+  CF_responses++;
+
+  // Do we know the range already?
+  Block *b = nullptr;
+  for (auto& bl : CF_blocks) {
+    if (bl.host == host && bl.port == port && bl.serverID == serverID && bl.functionCode == fc
+     && bl.address == address && bl.count == count) {
+      b = &bl;
+      break;
+    }
+  }
+
+  if (!b) {
+    // No. Take over all values and report them completely
+    Block nb(host, port, serverID, fc, address, count);
+    if (isCoil) {
+      nb.bits = CoilData(count);
+      nb.bits.set(0, count, data);
+    } else {
+      nb.words.resize(count);
+      for (uint16_t i = 0; i < count; ++i) {
+        nb.words[i] = (data[2 * i] << 8) | data[2 * i + 1];
+      }
+    }
+    if (CF_blocks.size() < CF_maxBlocks) {
+      applyDeadbands(nb);
+      CF_blocks.push_back(std::move(nb));
+      report(CF_blocks.back(), 0, count, token);
+    } else {
+      LOG_D("Change filter full, range %02X/%02X/%d not kept\n", serverID, fc, address);
+      report(nb, 0, count, token);
+    }
+    return true;
+  }
+
+  // Scan for runs of changed values. These are taken over and reported
+  uint16_t runStart = 0;
+  bool inRun = false;
+  for (uint16_t i = 0; i < count; ++i) {
+    bool changed = false;
+    if (isCoil) {
+      bool v = (data[i >> 3] >> (i & 0x07)) & 0x01;
+      if (v != b->bits[i]) {
+        b->bits.set(i, v);
+        changed = true;
+      }
+    } else {
+      uint16_t v = (data[2 * i] << 8) | data[2 * i + 1];
+      // Difference with wrap-around, taken absolute
+      int16_t d = static_cast<int16_t>(v - b->words[i]);
+      uint16_t delta = d < 0 ? -static_cast<int32_t>(d) : d;
+      if (delta > (b->deadbands.empty() ? 0 : b->deadbands[i])) {
+        b->words[i] = v;
+        changed = true;
+      }
+    }
+    if (changed && !inRun) {
+      runStart = i;
+      inRun = true;
+    } else if (!changed && inRun) {
+      report(*b, runStart, i - runStart, token);
+      inRun = false;
+    }
+  }
+  if (inRun) report(*b, runStart, count - runStart, token);
+  return true;
+}
+
+// clear: forget all values kept
+void ModbusChangeFilter::clear() {
+  LOCK_GUARD(lockGuard, CF_lock);
+  CF_blocks.clear();
+}
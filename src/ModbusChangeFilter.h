@@ -0,0 +1,113 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_CHANGE_FILTER_H
+#define _MODBUS_CHANGE_FILTER_H
+
+#include "options.h"
+#include <vector>
+#include <functional>
+#if USE_MUTEX
+#include <mutex>      // NOLINT
+#endif
+#include "ModbusMessage.h"
+#include "CoilData.h"
+
+// ModbusChange: a range of coils or registers read with other values than reported before
+struct ModbusChange {
+  uint32_t host;                // Target host of a TCP client, 0 for RTU
+  uint16_t port;                // Target port of a TCP client, 0 for RTU
+  uint8_t serverID;
+  uint8_t functionCode;         // FC of the read, 0x01..0x04
+  uint16_t address;             // First coil or register of the range
+  uint16_t count;               // Number of coils or registers in the range
+  const uint16_t *values;       // Register values (FC 0x03, 0x04), nullptr for coils
+  CoilData coils;               // Coil values (FC 0x01, 0x02), empty for registers
+
+  ModbusChange() : host(0), port(0), serverID(0), functionCode(0), address(0), count(0), values(nullptr), coils() {}
+};
+
+typedef std::function<void(const ModbusChange& change, uint32_t token)> MBOnChange;
+
+// ModbusChangeFilter: report by exception for polled reads (FC 0x01..0x04).
+// Given to a ModbusClientRTU, ModbusClientTCP or ModbusClientTCPasync by useChangeFilter(), it takes
+// the data responses to the client's asynchronous reads instead of the onData/onResponse handlers.
+// The values of each range read (target host and port, server, FC, address and count) are kept, and
+// only the ranges of coils or registers that changed since are handed to onChange - the first
+// response to a range is reported completely.
+// A register counts as changed if it differs from the value reported last by more than its deadband.
+// Values within the deadband are not taken over, so slow drifts will be reported as well eventually.
+// Error responses and syncRequests are not affected.
+// Ranges beyond maxBlocks are not kept - their responses are reported completely every time.
+// onChange is called with the filter locked: do not call the filter's methods from within it!
+class ModbusChangeFilter {
+public:
+  // Constructor: onChange gets the changed ranges, maxBlocks ranges are kept at most
+  explicit ModbusChangeFilter(MBOnChange onChange, uint16_t maxBlocks = 32);
+
+  // setDeadband: changes of registers of FC 0x03 or 0x04 in the range given up to deadband are
+  // not reported. Registers are compared as 16 bit values with wrap-around, so it will work for
+  // signed and unsigned values alike. Later ranges override earlier ones where they overlap.
+  // The deadband applies to the server on all target hosts.
+  void setDeadband(uint8_t serverID, uint8_t functionCode, uint16_t address, uint16_t count, uint16_t deadband);
+
+  // update: take the data response to a read of count coils or registers from address.
+  // host and port tell apart the targets of a TCP client, RTU clients leave them 0.
+  // Returns false if the response does not fit - it should be delivered as it is then.
+  bool update(const ModbusMessage& response, uint16_t address, uint16_t count, uint32_t token, uint32_t host = 0, uint16_t port = 0);
+
+  // clear: forget all values. The next response to each range will be reported completely
+  void clear();
+
+  // Counts of responses taken and of changed ranges reported
+  inline uint32_t getResponseCount() { return CF_responses; }
+  inline uint32_t getChangeCount() { return CF_changes; }
+
+protected:
+  // Block: the values of a range as reported last
+  struct Block {
+    uint32_t host;
+    uint16_t port;
+    uint8_t serverID;
+    uint8_t functionCode;
+    uint16_t address;
+    uint16_t count;
+    std::vector<uint16_t> words;      // Register values
+    std::vector<uint16_t> deadbands;  // Deadband by register, empty if there is none
+    CoilData bits;                    // Coil values
+    Block(uint32_t h, uint16_t p, uint8_t s, uint8_t fc, uint16_t a, uint16_t c) :
+      host(h), port(p), serverID(s), functionCode(fc), address(a), count(c), words(), deadbands(), bits() {}
+  };
+
+  // Deadband: a range given to setDeadband()
+  struct Deadband {
+    uint8_t serverID;
+    uint8_t functionCode;
+    uint16_t address;
+    uint16_t count;
+    uint16_t deadband;
+  };
+
+  // Prevent copy construction and assignment
+  ModbusChangeFilter(const ModbusChangeFilter&) = delete;
+  ModbusChangeFilter& operator=(const ModbusChangeFilter&) = delete;
+
+  // applyDeadbands: set up the deadbands of a block of registers. Needs CF_lock!
+  void applyDeadbands(Block& b);
+
+  // report: hand count values of b from index from to onChange. Needs CF_lock!
+  void report(Block& b, uint16_t from, uint16_t count, uint32_t token);
+
+  MBOnChange CF_onChange;              // Change handler
+  std::vector<Block> CF_blocks;        // Ranges kept
+  std::vector<Deadband> CF_deadbands;  // Deadbands set
+  uint16_t CF_maxBlocks;               // Limit for CF_blocks
+  uint32_t CF_responses;               // Responses taken
+  uint32_t CF_changes;                 // Ranges reported
+#if USE_MUTEX
+  std::mutex CF_lock;                  // Protects all of the above
+#endif
+};
+
+#endif
@@ -19,7 +19,19 @@ ModbusClient::ModbusClient() :
   #endif
   onData(nullptr),
   onError(nullptr),
-  onResponse(nullptr) { instanceCounter++; }
+  onResponse(nullptr),
+  onTrace(nullptr),
+  capture(nullptr),
+  changes(nullptr),
+  coalescing(false),
+  coalesceHold(0),
+  adaptive(false) {
+  for (uint8_t p = 0; p < MODBUS_PRIORITIES; ++p) {
+    laneLimits[p] = 0;
+  }
+  memset(fuseIDs, 0, sizeof(fuseIDs));
+  instanceCounter++;
+}
 
 // onDataHandler: register callback for data responses
 bool ModbusClient::onDataHandler(MBOnData handler) {
@@ -55,6 +67,16 @@ bool ModbusClient::onResponseHandler(MBOnResponse handler) {
   return true;
 }
 
+// onTraceHandler: register callback for transaction traces
+bool ModbusClient::onTraceHandler(MBOnTrace handler) {
+  if (onTrace) {
+    LOG_W("onTrace handler was already claimed\n");
+    return false;
+  }
+  onTrace = handler;
+  return true;
+}
+
 // getMessageCount: return message counter value
 uint32_t ModbusClient::getMessageCount() {
   return messageCount;
@@ -67,37 +89,371 @@ uint32_t ModbusClient::getErrorCount() {
 
 // resetCounts: Set both message and error counts to zero
 void ModbusClient::resetCounts() {
-  {
-    LOCK_GUARD(cntLock, countAccessM);
-    messageCount = 0;
-    errorCount = 0;
+  messageCount = 0;
+  errorCount = 0;
+  statistics.reset();
+  latency.reset();
+}
+
+// coalesceReads: merge queued reads to the same server with adjacent ranges
+void ModbusClient::coalesceReads(bool onOff, uint32_t holdTime) {
+  coalescing = onOff;
+  coalesceHold = onOff ? holdTime : 0;
+  LOG_D("Read coalescing = %s, hold time %u\n", onOff ? "ON" : "OFF", holdTime);
+}
+
+// fuseWriteRead: fuse writes and reads queued back to back for a server supporting FC 0x17
+void ModbusClient::fuseWriteRead(uint8_t serverID, bool onOff) {
+  if (onOff) {
+    fuseIDs[serverID >> 3] |= (1 << (serverID & 7));
+  } else {
+    fuseIDs[serverID >> 3] &= ~(1 << (serverID & 7));
   }
+  LOG_D("Write/read fusing for server %d = %s\n", serverID, onOff ? "ON" : "OFF");
+}
+
+// useAdaptiveTimeouts: adapt the timeout to each server's response times and back off dead ones
+void ModbusClient::useAdaptiveTimeouts(bool onOff, uint32_t minTimeout, uint8_t failures, uint32_t maxBackoff) {
+  health.setLimits(minTimeout, failures, maxBackoff);
+  adaptive = onOff;
+  LOG_D("Adaptive timeouts = %s, min %u, back off after %u\n", onOff ? "ON" : "OFF", minTimeout, failures);
+}
+
+// requestTimeout: ms to wait for the response of device
+uint32_t ModbusClient::requestTimeout(const ModbusDevice& device, uint32_t fixed) {
+  return adaptive ? health.timeout(device, fixed) : fixed;
+}
+
+// admitted: may a request to device be sent?
+bool ModbusClient::admitted(const ModbusDevice& device) {
+  return !adaptive || health.admit(device);
+}
+
+// learn: take the outcome of a transaction with device into its response time statistics
+void ModbusClient::learn(const ModbusDevice& device, const ModbusTrace& trace, Error error) {
+  if (!adaptive) return;
+  // An unreachable TCP server is as dead as one not responding
+  if (error == TIMEOUT || error == IP_CONNECTION_FAILED) {
+    health.failure(device);
+  // Data and exception responses tell how fast the server is. Other errors do not count either way
+  } else if (error < TIMEOUT && trace.passed(TracePoint::SEND_END) && trace.passed(TracePoint::FRAME_COMPLETE)) {
+    health.success(device, trace.span(TracePoint::SEND_END, TracePoint::FRAME_COMPLETE));
+  }
+}
+
+// setQueueLimit: maximum number of requests queued in a priority lane
+void ModbusClient::setQueueLimit(RequestPriority p, uint16_t limit) {
+  uint8_t lane = static_cast<uint8_t>(p);
+  if (lane < MODBUS_PRIORITIES) laneLimits[lane] = limit;
+}
+
+// expired: a request queued at queuedTime has outlived its ttl
+bool ModbusClient::expired(unsigned long queuedTime, uint32_t ttl) {
+  return ttl && millis() - queuedTime >= ttl;
+}
+
+// mergeTTL: ttl of a queued request that now has to serve another one with a ttl of its own as well
+// The merged request will live as long as the longer living of both. No limit on either means none for both.
+uint32_t ModbusClient::mergeTTL(unsigned long queuedTime, uint32_t ttl, uint32_t otherTTL) {
+  if (!ttl || !otherTTL) return 0;
+  // The other one is queued just now, so its ttl counts from now on
+  uint32_t other = (millis() - queuedTime) + otherTTL;
+  return (other > ttl) ? other : ttl;
+}
+
+// claim: count n more requests in a lane, if that keeps it within limit
+bool ModbusClient::claim(std::atomic<uint16_t>& queued, uint16_t n, uint16_t limit) {
+  uint16_t q = queued.load();
+  do {
+    if (q + n > limit) return false;
+    // Another task may have changed it meanwhile - then q is updated and we try again
+  } while (!queued.compare_exchange_weak(q, q + n));
+  return true;
+}
+
+// countResponse: count a response in errorCount and statistics
+void ModbusClient::countResponse(const ModbusMessage& request, const ModbusMessage& response) {
+  Error e = response.getError();
+  if (e != SUCCESS) errorCount++;
+  // Only data and exception responses were received from the server
+  // Expired requests and those to backed off servers never went out
+  statistics.count(request.getServerID(), request.getFunctionCode(), e, e < TIMEOUT ? response.size() : 0,
+                   (e == REQUEST_EXPIRED || e == SERVER_BACKED_OFF) ? 0 : request.size());
+}
+
+// traceDone: a transaction is done - add its trace to the latency histograms and hand it to onTrace
+void ModbusClient::traceDone(ModbusTrace& trace, uint32_t token, const ModbusMessage& request, Error error) {
+  trace.token = token;
+  trace.serverID = request.getServerID();
+  trace.functionCode = request.getFunctionCode();
+  trace.error = error;
+  latency.add(trace);
+  if (onTrace) onTrace(trace);
+}
+
+// deliver: hand over a response to the waiting syncRequest or the user callbacks.
+// The response is moved on, it is empty afterwards
+void ModbusClient::deliver(uint32_t token, SyncHandle& sync, ModbusMessage& response) {
+  // Was it a synchronous request?
+  if (sync) {
+    // Yes. Hand it over to the waiting caller
+    sync->complete(std::move(response));
+  // No, an async request. Do we have an onResponse handler?
+  } else if (onResponse) {
+    // Yes. Call it
+    onResponse(std::move(response), token);
+  // No. Data response and an onData handler registered?
+  } else if (response.getError() == SUCCESS) {
+    if (onData) {
+      // Yes. call it
+      onData(std::move(response), token);
+    } else {
+      LOG_D("No handler for response!\n");
+    }
+  // No, error response. Do we have an onError handler?
+  } else if (onError) {
+    // Yes. Forward the error code to it
+    onError(response.getError(), token);
+  } else {
+    LOG_D("No onError handler\n");
+  }
+}
+
+// filtered: hand the data response to an async read to the change filter, if there is one
+bool ModbusClient::filtered(const ModbusDevice& device, uint32_t token, const SyncHandle& sync, uint16_t address, uint16_t count, const ModbusMessage& response) {
+  if (!changes || sync || response.getError() != SUCCESS) return false;
+  return changes->update(response, address, count, token, device.host, device.port);
+}
+
+bool ModbusClient::filtered(const ModbusDevice& device, uint32_t token, const SyncHandle& sync, const ModbusMessage& request, const ModbusMessage& response) {
+  if (!changes || !isCoalescable(request)) return false;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  request.get(2, address, count);
+  return filtered(device, token, sync, address, count, response);
 }
 
-// waitSync: wait for response on syncRequest to arrive
-ModbusMessage ModbusClient::waitSync(uint8_t serverID, uint8_t functionCode, uint32_t token) {
+// isCoalescable: request may be merged with others - reads of coils, discrete inputs or registers
+bool ModbusClient::isCoalescable(const ModbusMessage& msg) {
+  if (msg.size() != 6) return false;
+  uint8_t fc = msg.getFunctionCode();
+  return fc >= READ_COIL && fc <= READ_INPUT_REGISTER;
+}
+
+// coalesce: try to merge request msg into the queued one. Returns true if done.
+bool ModbusClient::coalesce(ModbusMessage& queued, uint32_t queuedToken, SyncHandle& queuedSync, CoalescedParts& parts,
+                            const ModbusMessage& msg, uint32_t token, SyncHandle sync) {
+  // Same kind of read for the same server?
+  if (!isCoalescable(queued) || !isCoalescable(msg)) return false;
+  if (queued.getServerID() != msg.getServerID() || queued.getFunctionCode() != msg.getFunctionCode()) return false;
+
+  uint16_t qStart = 0;
+  uint16_t qCount = 0;
+  uint16_t mStart = 0;
+  uint16_t mCount = 0;
+  queued.get(2, qStart, qCount);
+  msg.get(2, mStart, mCount);
+  uint32_t qEnd = qStart + qCount;
+  uint32_t mEnd = mStart + mCount;
+  // Do the ranges touch or overlap?
+  if (mStart > qEnd || qStart > mEnd) return false;
+  // Yes. Will the merged range fit into one response?
+  uint16_t start = (mStart < qStart) ? mStart : qStart;
+  uint32_t end = (mEnd > qEnd) ? mEnd : qEnd;
+  uint16_t limit = (msg.getFunctionCode() <= READ_DISCR_INPUT) ? 2000 : 125;
+  if (end - start > limit) return false;
+
+  // First merge? Then the queued request will become the first part
+  if (parts.empty()) {
+    parts.push_back(CoalescedPart(queuedToken, queuedSync, 0, qCount));
+    queuedSync = nullptr;
+  }
+  // Extended to lower addresses? Then all parts have moved up
+  if (start < qStart) {
+    for (auto& p : parts) p.offset += qStart - start;
+  }
+  parts.push_back(CoalescedPart(token, sync, mStart - start, mCount));
+  queued.setMessage(queued.getServerID(), queued.getFunctionCode(), start, (uint16_t)(end - start));
+  LOG_D("Coalesced %02X/%02X %u/%u into %u/%u, %u parts\n", msg.getServerID(), msg.getFunctionCode(),
+    mStart, mCount, start, (uint16_t)(end - start), parts.size());
+  return true;
+}
+
+// fuse: try to fuse the read msg into the queued write, making it a FC 0x17 request. Returns true if done.
+bool ModbusClient::fuse(ModbusMessage& queued, uint32_t queuedToken, SyncHandle& queuedSync, CoalescedParts& parts,
+                        const ModbusMessage& msg, uint32_t token, SyncHandle sync) {
+  // A plain read of holding registers to the same server?
+  if (!parts.empty() || msg.size() != 6 || msg.getFunctionCode() != READ_HOLD_REGISTER) return false;
+  if (queued.getServerID() != msg.getServerID()) return false;
+  uint16_t rStart = 0;
+  uint16_t rCount = 0;
+  msg.get(2, rStart, rCount);
+
+  // Queued is a write of registers?
+  uint16_t wStart = 0;
+  uint16_t wCount = 0;
+  uint16_t words[0x79];
+  queued.get(2, wStart);
+  if (queued.getFunctionCode() == WRITE_HOLD_REGISTER && queued.size() == 6) {
+    wCount = 1;
+    queued.get(4, words[0]);
+  } else if (queued.getFunctionCode() == WRITE_MULT_REGISTERS && queued.size() > 7) {
+    queued.get(4, wCount);
+    if (wCount > 0x79 || queued.size() != 7 + wCount * 2) return false;
+    for (uint16_t i = 0; i < wCount; ++i) {
+      queued.get(7 + i * 2, words[i]);
+    }
+  } else {
+    return false;
+  }
+
+  // Yes. Both will fit into FC 0x17?
+  ModbusMessage fused;
+  if (fused.setMessage(msg.getServerID(), R_W_MULT_REGISTERS, rStart, rCount, wStart, wCount, (uint8_t)(wCount * 2), words) != SUCCESS) return false;
+  parts.push_back(CoalescedPart(queuedToken, queuedSync, wStart, wCount, queued.getFunctionCode()));
+  queuedSync = nullptr;
+  parts.push_back(CoalescedPart(token, sync, rStart, rCount, READ_HOLD_REGISTER));
+  LOG_D("Fused %02X write %u/%u and read %u/%u\n", msg.getServerID(), wStart, wCount, rStart, rCount);
+  queued = fused;
+  return true;
+}
+
+// deliverParts: split the response to a coalesced or fused request and deliver the pieces
+void ModbusClient::deliverParts(const ModbusDevice& device, CoalescedParts& parts, ModbusMessage& request, ModbusMessage& response) {
+  uint8_t serverID = request.getServerID();
+  uint8_t functionCode = request.getFunctionCode();
+  // Fused write and read? Then make up the responses to both
+  if (functionCode == R_W_MULT_REGISTERS) {
+    uint16_t rCount = 0;
+    request.get(4, rCount);
+    Error error = response.getError();
+    if (error == SUCCESS && (response.size() != rCount * 2 + 3 || response[2] != rCount * 2)) error = PACKET_LENGTH_ERROR;
+    for (auto& p : parts) {
+      ModbusMessage piece;
+      if (error != SUCCESS) {
+        piece.setError(serverID, p.functionCode, error);
+      } else if (p.functionCode == READ_HOLD_REGISTER) {
+        piece.add(serverID, p.functionCode, (uint8_t)(p.count * 2));
+        piece.add(response.data() + 3, p.count * 2);
+        if (filtered(device, p.token, p.sync, p.offset, p.count, piece)) continue;
+      } else if (p.functionCode == WRITE_HOLD_REGISTER) {
+        // FC 0x06 echoes address and value - the value is the first one written
+        uint16_t value = 0;
+        request.get(11, value);
+        piece.add(serverID, p.functionCode, p.offset, value);
+      } else {
+        piece.add(serverID, p.functionCode, p.offset, p.count);
+      }
+      deliver(p.token, p.sync, piece);
+    }
+    return;
+  }
+  bool bits = (functionCode <= READ_DISCR_INPUT);
+  uint16_t start = 0;
+  uint16_t count = 0;
+  request.get(2, start, count);
+  // Error responses and responses of the wrong length go to all parts as they are
+  uint16_t bytes = bits ? (count + 7) / 8 : count * 2;
+  bool valid = (response.getError() == SUCCESS);
+  if (valid && (response.size() != bytes + 3 || response[2] != bytes)) {
+    response.setError(serverID, functionCode, PACKET_LENGTH_ERROR);
+    valid = false;
+  }
+
+  for (auto& p : parts) {
+    ModbusMessage piece;
+    if (!valid) {
+      piece = response;
+    } else if (bits) {
+      // Coils or discrete inputs: shift the bits requested down to bit 0
+      uint8_t pieceBytes = (p.count + 7) / 8;
+      uint8_t buffer[250];
+      memset(buffer, 0, pieceBytes);
+      for (uint16_t i = 0; i < p.count; ++i) {
+        uint16_t bit = p.offset + i;
+        if (response[3 + bit / 8] & (1 << (bit % 8))) buffer[i / 8] |= (1 << (i % 8));
+      }
+      piece.add(serverID, functionCode, pieceBytes);
+      piece.add(buffer, pieceBytes);
+    } else {
+      // Registers: copy the words requested
+      piece.add(serverID, functionCode, (uint8_t)(p.count * 2));
+      piece.add(response.data() + 3 + p.offset * 2, p.count * 2);
+    }
+    if (valid && filtered(device, p.token, p.sync, start + p.offset, p.count, piece)) continue;
+    deliver(p.token, p.sync, piece);
+  }
+}
+
+// waitSync: wait for the response to a syncRequest to arrive, but no longer than timeout ms after it was sent
+ModbusMessage ModbusClient::waitSync(uint8_t serverID, uint8_t functionCode, SyncHandle completion, uint32_t timeout) {
   ModbusMessage response;
-  unsigned long lostPatience = millis();
- 
-  // Default response is TIMEOUT
-  response.setError(serverID, functionCode, TIMEOUT);
 
-  // Loop 60 seconds, if unlucky
-  while (millis() - lostPatience < 60000) {
+  // Did we get a response in time?
+  if (!completion->wait(timeout, response)) {
+    // No. Default response is TIMEOUT
+    response.setError(serverID, functionCode, TIMEOUT);
+  }
+  return response;
+}
+
+SyncCompletion::SyncCompletion(MBOnResponse callback, uint32_t token) :
+  SC_sent(false),
+  SC_complete(false),
+  SC_sentTime(0),
+  SC_response(),
+  SC_callback(callback),
+  SC_token(token) { }
+
+// sent: the request has gone out - the caller's timeout is counted from now on
+void SyncCompletion::sent() {
+  LOCK_GUARD(lock, SC_lock);
+  SC_sent = true;
+  SC_sentTime = millis();
+}
+
+// complete: the response (or an error) is there. Wakes up the caller
+void SyncCompletion::complete(ModbusMessage response) {
+  // Is there a callback to take the response?
+  if (SC_callback) {
+    // Yes. Call it once - outside the lock, it may queue another request right away
     {
-      LOCK_GUARD(lg, syncRespM);
-      // Look for the token
-      auto sR = syncResponse.find(token);
-      // Is it there?
-      if (sR != syncResponse.end()) {
-        // Yes. get the response, delete it from the map and return
-        response = sR->second;
-        syncResponse.erase(sR);
-        break;
-      }
+      LOCK_GUARD(lock, SC_lock);
+      if (SC_complete) return;
+      SC_complete = true;
     }
+    SC_callback(std::move(response), SC_token);
+    return;
+  }
+  {
+    LOCK_GUARD(lock, SC_lock);
+    SC_response = std::move(response);
+    SC_complete = true;
+  }
+#if USE_MUTEX
+  SC_cv.notify_one();
+#endif
+}
+
+// wait: block until complete() was called or timeout ms have passed after sent(). Returns true if completed
+// Time spent in the queue before the request was sent does not count - the worker will take care
+// of each request it has accepted, so there is no need for an arbitrary upper limit here.
+bool SyncCompletion::wait(uint32_t timeout, ModbusMessage& response) {
+#if USE_MUTEX
+  std::unique_lock<std::mutex> lock(SC_lock);
+  while (!SC_complete) {
+    // Request sent and out of time?
+    if (SC_sent && millis() - SC_sentTime >= timeout) break;
+    // No. Sleep for the time left, or a full timeout if not sent yet
+    uint32_t timeLeft = SC_sent ? timeout - (millis() - SC_sentTime) : timeout;
+    SC_cv.wait_for(lock, std::chrono::milliseconds(timeLeft));
+  }
+#else
+  while (!SC_complete && !(SC_sent && millis() - SC_sentTime >= timeout)) {
     // Give the watchdog time to act
-    delay(10);
+    delay(1);
   }
-  return response;
+#endif
+  if (SC_complete) response = std::move(SC_response);
+  return SC_complete;
 }
@@ -7,8 +7,16 @@
 
 #include <functional> 
 #include <map>
+#include <memory>
+#include <atomic>
+#include <vector>
 #include "options.h"
 #include "ModbusMessage.h"
+#include "ModbusStatistics.h"
+#include "ModbusTrace.h"
+#include "ModbusCapture.h"
+#include "ModbusHealth.h"
+#include "ModbusChangeFilter.h"
 
 #if HAS_FREERTOS
 extern "C" {
@@ -21,14 +29,79 @@ extern "C" {
 
 #if USE_MUTEX
 #include <mutex>                    // NOLINT
+#include <condition_variable>       // NOLINT
 using std::mutex;
 using std::lock_guard;
 #endif
 
+// The handlers get the response by value, moved in by the client - no copy is made. Handlers
+// taking a const ModbusMessage& or a ModbusMessage will both fit.
 typedef std::function<void(ModbusMessage msg, uint32_t token)> MBOnData;
 typedef std::function<void(Modbus::Error errorCode, uint32_t token)> MBOnError;
 typedef std::function<void(ModbusMessage msg, uint32_t token)> MBOnResponse;
 
+// SyncCompletion: hands over the response to one syncRequest from the worker to the waiting caller.
+// With a callback it will call that instead, for a request that shall have a response handler of its own.
+class SyncCompletion {
+public:
+  explicit SyncCompletion(MBOnResponse callback = nullptr, uint32_t token = 0);
+  // sent: the request has gone out - the caller's timeout is counted from now on
+  void sent();
+  // complete: the response (or an error) is there. Wakes up the caller.
+  // Pass the response by std::move() if it is not needed any more
+  void complete(ModbusMessage response);
+  // wait: block until complete() was called or timeout ms have passed after sent(). Returns true if completed
+  bool wait(uint32_t timeout, ModbusMessage& response);
+
+protected:
+  bool SC_sent;                    // sent() was called
+  bool SC_complete;                // complete() was called
+  unsigned long SC_sentTime;       // Time the request was sent
+  ModbusMessage SC_response;       // The response proper
+  MBOnResponse SC_callback;        // Handler to call instead of waking up a caller
+  uint32_t SC_token;               // Token to give to SC_callback
+#if USE_MUTEX
+  std::mutex SC_lock;              // Protects all of the above
+  std::condition_variable SC_cv;   // The caller is sleeping on this one
+#endif
+};
+
+// Shared by the caller and the request queue entry, so either may go first
+typedef std::shared_ptr<SyncCompletion> SyncHandle;
+
+// CoalescedPart: one of the original read requests merged into a coalesced request,
+// or the write or the read fused into a FC 0x17 request
+struct CoalescedPart {
+  uint32_t token;             // Token of the original request
+  SyncHandle sync;            // Completion if it was a syncRequest
+  uint16_t offset;            // Start of the original range, relative to that of the coalesced request
+  uint16_t count;             // Number of registers or coils requested originally
+  uint8_t functionCode;       // Original function code of a fused request, 0 for coalesced reads
+  CoalescedPart(uint32_t t, SyncHandle s, uint16_t o, uint16_t c, uint8_t fc = 0) :
+    token(t), sync(s), offset(o), count(c), functionCode(fc) {}
+};
+typedef std::vector<CoalescedPart> CoalescedParts;
+
+// RequestPriority: request queue lanes. The worker will always serve the highest lane with requests
+// first. Requests made without a priority go into the BULK lane.
+// A scoped enum, so addRequest(RequestPriority::CONTROL, token, ...) can not be taken for a token.
+enum class RequestPriority : uint8_t {
+  CONTROL = 0,                // Operator initiated requests
+  ALARM,                      // Alarm and event reads
+  BULK,                       // Background polling
+};
+#define MODBUS_PRIORITIES 3
+
+// RequestOptions: how to queue a request. A RequestPriority alone will do as well.
+// ttl: ms the request may wait in the queue. If it was not sent by then, it is dropped and
+// reported with a REQUEST_EXPIRED error. 0: no limit
+struct RequestOptions {
+  RequestPriority priority;
+  uint32_t ttl;
+  RequestOptions(RequestPriority p = RequestPriority::BULK, uint32_t t = 0) :  // NOLINT
+    priority(p), ttl(t) {}
+};
+
 class ModbusClient {
 public:
   bool onDataHandler(MBOnData handler);   // Accept onData handler 
@@ -36,9 +109,41 @@ public:
   bool onResponseHandler(MBOnResponse handler); // Accept onResponse handler 
   uint32_t getMessageCount();             // Informative: return number of messages created
   uint32_t getErrorCount();              // Informative: return number of errors received
-  void resetCounts();                    // Set both message and error counts to zero
-  inline Error addRequest(ModbusMessage m, uint32_t token) { return addRequestM(m, token); }
-  inline ModbusMessage syncRequest(ModbusMessage m, uint32_t token) { return syncRequestM(m, token); }
+  void resetCounts();                    // Set message and error counts and statistics to zero
+  virtual uint32_t pendingRequests() = 0; // Number of requests queued or waiting for their responses
+  // Informative: transaction statistics by serverID/function code
+  inline const ModbusStatistics& getStatistics() { return statistics; }
+  // Informative: latency histograms by transaction phase, see ModbusTrace.h
+  inline const ModbusLatency& getLatency() { return latency; }
+  bool onTraceHandler(MBOnTrace handler); // Accept handler to get the trace of each transaction done
+  // Record the frames sent and received in capture, see ModbusCapture.h. nullptr: stop recording
+  inline void useCapture(ModbusCapture *c) { capture = c; }
+  // Report by exception: data responses to async reads go to changes, that will hand on only the
+  // values changed since, see ModbusChangeFilter.h. nullptr: deliver all responses again
+  inline void useChangeFilter(ModbusChangeFilter *c) { changes = c; }
+  // Merge queued read requests (FC 0x01..0x04) to the same server with touching or overlapping
+  // ranges into one request. The response is split up again for the original requests.
+  // holdTime: ms to hold back a read waiting for others to merge with. 0: merge only while queued
+  void coalesceReads(bool onOff = true, uint32_t holdTime = 0);
+  // Server serverID supports FC 0x17 (read/write multiple registers): a write of registers (FC 0x06
+  // or 0x10) still queued and a read of holding registers (FC 0x03) to it queued right behind it
+  // are fused into one FC 0x17 request. Both get a response of their own made up from its response.
+  void fuseWriteRead(uint8_t serverID, bool onOff = true);
+  // Adapt the timeout to each server's response times, see ModbusHealth.h. The client's timeout
+  // stays the upper limit, minTimeout the lower one. A server timing out failures times in a row
+  // is backed off: its requests are answered with SERVER_BACKED_OFF at once, but for a probe
+  // each back-off period. The period starts at 1s and doubles with each failed probe up to maxBackoff.
+  void useAdaptiveTimeouts(bool onOff = true, uint32_t minTimeout = 50, uint8_t failures = 3, uint32_t maxBackoff = 60000);
+  // Informative: response times, timeouts and back-off by server
+  inline ModbusHealth& getHealth() { return health; }
+  inline Error addRequest(ModbusMessage m, uint32_t token) { return addRequestM(std::move(m), token); }
+  inline ModbusMessage syncRequest(ModbusMessage m, uint32_t token) { return syncRequestM(std::move(m), token); }
+  // Same with a priority lane and/or a time to live
+  inline Error addRequest(RequestOptions o, ModbusMessage m, uint32_t token) { return addRequestP(std::move(m), token, o); }
+  inline ModbusMessage syncRequest(RequestOptions o, ModbusMessage m, uint32_t token) { return syncRequestP(std::move(m), token, o); }
+
+  // setQueueLimit: maximum number of requests queued in a priority lane. 0: the client's queue limit
+  void setQueueLimit(RequestPriority p, uint16_t limit);
 
   // Template function to generate syncRequest functions as long as there is a 
   // matching ModbusMessage::setMessage() call
@@ -51,12 +156,24 @@ public:
 
     // Add it to the queue and wait for a response, if valid
     if (rc == SUCCESS) {
-      return syncRequestM(m, token);
+      return syncRequestM(std::move(m), token);
     } 
     // Else return the error as a message
     return buildErrorMsg(rc, std::forward<Args>(args) ...);
   }
 
+  // Same with a priority lane and/or a time to live
+  // The token has to be integral, else a ModbusMessage might be taken for it
+  template <typename T, typename... Args, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+  ModbusMessage syncRequest(RequestOptions o, T token, Args&&... args) {
+    ModbusMessage m;
+    Error rc = m.setMessage(std::forward<Args>(args) ...);
+    if (rc == SUCCESS) {
+      return syncRequestP(std::move(m), token, o);
+    }
+    return buildErrorMsg(rc, std::forward<Args>(args) ...);
+  }
+
   // Template function to create an error response message from a variadic pattern
   template <typename... Args>
   ModbusMessage buildErrorMsg(Error e, uint8_t serverID, uint8_t functionCode, Args&&... args) {
@@ -77,26 +194,101 @@ public:
 
     // Add it to the queue, if valid
     if (rc == SUCCESS) {
-      return addRequestM(m, token);
+      return addRequestM(std::move(m), token);
     }
     // Else return the error
     return rc;
   }
 
+  // Same with a priority lane and/or a time to live
+  // The token has to be integral, else a ModbusMessage might be taken for it
+  template <typename T, typename... Args, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+  Error addRequest(RequestOptions o, T token, Args&&... args) {
+    ModbusMessage m;
+    Error rc = m.setMessage(std::forward<Args>(args) ...);
+    if (rc == SUCCESS) {
+      return addRequestP(std::move(m), token, o);
+    }
+    return rc;
+  }
+
 protected:
   ModbusClient();             // Default constructor
   virtual void isInstance() = 0;   // Make class abstract
-  ModbusMessage waitSync(uint8_t serverID, uint8_t functionCode, uint32_t token); // wait for syncRequest response to arrive
+  // waitSync: wait for the response to a syncRequest to arrive, but no longer than timeout ms after it was sent
+  ModbusMessage waitSync(uint8_t serverID, uint8_t functionCode, SyncHandle completion, uint32_t timeout);
+
   // Virtual addRequest variant needed internally. All others done by template!
   virtual Error addRequestM(ModbusMessage msg, uint32_t token) = 0;
   // Virtual syncRequest variant following the same pattern
   virtual ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token) = 0;
+  // Variants with queue options. Clients without lanes or expiry will ignore them
+  virtual Error addRequestP(ModbusMessage msg, uint32_t token, RequestOptions o) { return addRequestM(std::move(msg), token); }
+  virtual ModbusMessage syncRequestP(ModbusMessage msg, uint32_t token, RequestOptions o) { return syncRequestM(std::move(msg), token); }
+  // Variant with a completion of its own. The response will go to completion instead of the
+  // client's handlers - give it a callback to get it. Used by the bridge.
+  virtual Error addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion) = 0;
+  // laneLimit: queue limit of a priority lane, or the client's queue limit if 0.
+  // With MODBUS_STATIC_ALLOCATION the lanes cannot hold more than the client's queue limit
+#ifdef MODBUS_STATIC_ALLOCATION
+  inline uint16_t laneLimit(uint8_t p, uint16_t qLimit) { return (laneLimits[p] && laneLimits[p] < qLimit) ? laneLimits[p] : qLimit; }
+#else
+  inline uint16_t laneLimit(uint8_t p, uint16_t qLimit) { return laneLimits[p] ? laneLimits[p] : qLimit; }
+#endif
+  // claim: count n more requests in a lane, if that keeps it within limit. Lock-free, any task may call it
+  static bool claim(std::atomic<uint16_t>& queued, uint16_t n, uint16_t limit);
   // Prevent copy construction or assignment
   ModbusClient(ModbusClient& other) = delete;
   ModbusClient& operator=(ModbusClient& other) = delete;
 
-  uint32_t messageCount;           // Number of requests generated. Used for transactionID in TCPhead
-  uint32_t errorCount;             // Number of errors received
+  // countResponse: count a response in errorCount and statistics
+  void countResponse(const ModbusMessage& request, const ModbusMessage& response);
+
+  // traceDone: a transaction is done - add its trace to the latency histograms and hand it to onTrace
+  void traceDone(ModbusTrace& trace, uint32_t token, const ModbusMessage& request, Error error);
+
+  // Request expiry - see RequestOptions
+  // expired: a request queued at queuedTime has outlived its ttl
+  static bool expired(unsigned long queuedTime, uint32_t ttl);
+  // mergeTTL: ttl of a queued request that now has to serve another one with a ttl of its own as well
+  static uint32_t mergeTTL(unsigned long queuedTime, uint32_t ttl, uint32_t otherTTL);
+
+  // Adaptive timeouts - see useAdaptiveTimeouts()
+  // requestTimeout: ms to wait for the response of device. fixed if adaptive timeouts are off
+  uint32_t requestTimeout(const ModbusDevice& device, uint32_t fixed);
+  // admitted: may a request to device be sent? Always true if adaptive timeouts are off
+  bool admitted(const ModbusDevice& device);
+  // learn: take the outcome of a transaction with device into its response time statistics
+  void learn(const ModbusDevice& device, const ModbusTrace& trace, Error error);
+
+  // deliver: hand over a response to the waiting syncRequest or the user callbacks. response is moved on
+  void deliver(uint32_t token, SyncHandle& sync, ModbusMessage& response);
+  // filtered: give the response of device to an async read of count values from address to the change filter.
+  // Returns true if it was taken - it must not be delivered then
+  bool filtered(const ModbusDevice& device, uint32_t token, const SyncHandle& sync, uint16_t address, uint16_t count, const ModbusMessage& response);
+  bool filtered(const ModbusDevice& device, uint32_t token, const SyncHandle& sync, const ModbusMessage& request, const ModbusMessage& response);
+
+  // Read request coalescing - see coalesceReads()
+  // isCoalescable: request may be merged with others
+  static bool isCoalescable(const ModbusMessage& msg);
+  // coalesce: try to merge request msg into the queued one. Returns true if done.
+  // The queued request's token and sync will go into parts with the first merge.
+  static bool coalesce(ModbusMessage& queued, uint32_t queuedToken, SyncHandle& queuedSync, CoalescedParts& parts,
+                       const ModbusMessage& msg, uint32_t token, SyncHandle sync);
+  // fusing: is fusing of writes and reads on for serverID?
+  inline bool fusing(uint8_t serverID) const { return fuseIDs[serverID >> 3] & (1 << (serverID & 7)); }
+  // fuse: try to fuse the read msg into the queued write, making it a FC 0x17 request. Returns true if done.
+  // The queued request's token and sync will go into parts, followed by those of msg.
+  static bool fuse(ModbusMessage& queued, uint32_t queuedToken, SyncHandle& queuedSync, CoalescedParts& parts,
+                   const ModbusMessage& msg, uint32_t token, SyncHandle sync);
+  // deliverParts: split the response to a coalesced or fused request and deliver the pieces
+  void deliverParts(const ModbusDevice& device, CoalescedParts& parts, ModbusMessage& request, ModbusMessage& response);
+
+  std::atomic<uint32_t> messageCount;  // Number of requests generated. Used for transactionID in TCPhead
+  std::atomic<uint32_t> errorCount;    // Number of errors received
+  ModbusStatistics statistics;     // Transaction counts by serverID/function code
+  ModbusLatency latency;           // Transaction times by phase
+  ModbusHealth health;             // Response times by server, for adaptive timeouts
 #if HAS_FREERTOS
   TaskHandle_t worker;             // Interface instance worker task
 #elif IS_LINUX
@@ -105,12 +297,15 @@ protected:
   MBOnData onData;                 // Data response handler
   MBOnError onError;               // Error response handler
   MBOnResponse onResponse;         // Uniform response handler
+  MBOnTrace onTrace;               // Transaction trace handler
+  ModbusCapture *capture;          // Frame capture, if any
+  ModbusChangeFilter *changes;     // Change filter for async reads, if any
+  bool coalescing;                 // true: merge adjacent reads, see coalesceReads()
+  uint32_t coalesceHold;           // ms to hold back reads for merging
+  uint8_t fuseIDs[32];             // Bit set of the servers to fuse writes and reads for, see fuseWriteRead()
+  bool adaptive;                   // true: adaptive timeouts, see useAdaptiveTimeouts()
+  uint16_t laneLimits[MODBUS_PRIORITIES];  // Queue limits by priority, 0: the client's queue limit
   static uint16_t instanceCounter; // Number of ModbusClients created
-  std::map<uint32_t, ModbusMessage> syncResponse; // Map to hold response messages on synchronous requests
-#if USE_MUTEX
-  std::mutex syncRespM;            // Mutex protecting syncResponse map against race conditions
-  std::mutex countAccessM;         // Mutex protecting access to the message and error counts
-#endif
 
   // Let any ModbusBridge class use protected members
   template<typename SERVERCLASS> friend class ModbusBridge;
@@ -0,0 +1,276 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusClientLoop.h"
+#include "ModbusClientTCP.h"
+
+#if IS_LINUX
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Number of handleRequests() calls a client may have in a row before the others get theirs
+static const uint8_t TURNS_IN_A_ROW = 8;
+
+// Constructor: set up the event loop. The thread will be started with the first client
+ModbusClientLoop::ModbusClientLoop() :
+  ML_epoll(epoll_create1(EPOLL_CLOEXEC)),
+  ML_wake(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  ML_timer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+  ML_stopping(false),
+  ML_thread(0),
+  ML_members(),
+  ML_sockets(),
+  ML_woken(),
+  ML_turns(0) {
+  bool ok = (ML_epoll >= 0 && ML_wake >= 0 && ML_timer >= 0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  if (ok) {
+    ev.data.fd = ML_wake;
+    ok = (epoll_ctl(ML_epoll, EPOLL_CTL_ADD, ML_wake, &ev) == 0);
+  }
+  if (ok) {
+    ev.data.fd = ML_timer;
+    ok = (epoll_ctl(ML_epoll, EPOLL_CTL_ADD, ML_timer, &ev) == 0);
+  }
+  if (!ok) {
+    LOG_E("Could not set up client event loop: %s\n", strerror(errno));
+  }
+}
+
+// Destructor: stops the loop thread
+ModbusClientLoop::~ModbusClientLoop() {
+  if (ML_thread) {
+    ML_stopping = true;
+    uint64_t one = 1;
+    if (write(ML_wake, &one, sizeof(one)) < 0) {
+      LOG_E("Could not signal client loop thread: %s\n", strerror(errno));
+    }
+    pthread_join(ML_thread, NULL);
+    ML_thread = 0;
+  }
+  if (!ML_members.empty()) {
+    LOG_W("Client loop ended with %d clients still using it\n", ML_members.size());
+  }
+  if (ML_timer >= 0) close(ML_timer);
+  if (ML_wake >= 0) close(ML_wake);
+  if (ML_epoll >= 0) close(ML_epoll);
+}
+
+// clients: number of clients served
+uint16_t ModbusClientLoop::clients() {
+  std::lock_guard<std::mutex> lock(ML_lock);
+  return ML_members.size();
+}
+
+// turns: number of times handleRequests() was called for any client
+uint32_t ModbusClientLoop::turns() {
+  return ML_turns;
+}
+
+// add: take a client, starting the loop thread if necessary
+bool ModbusClientLoop::add(ModbusClientTCP *client) {
+  if (ML_epoll < 0 || ML_wake < 0 || ML_timer < 0) return false;
+  {
+    std::lock_guard<std::mutex> lock(ML_lock);
+    if (find(client)) return false;
+    if (!ML_thread) {
+      int rc = pthread_create(&ML_thread, NULL, &serve, this);
+      if (rc) {
+        LOG_E("Error creating client loop thread: %d\n", rc);
+        ML_thread = 0;
+        return false;
+      }
+      LOG_D("Client loop thread started\n");
+    }
+    ML_members.push_back(Member(client));
+  }
+  // Requests may have been queued before
+  wake(client);
+  return true;
+}
+
+// remove: forget about a client
+void ModbusClientLoop::remove(ModbusClientTCP *client) {
+  // The loop holds ML_lock while clients have their turns, so it is not using client after this
+  std::lock_guard<std::mutex> lock(ML_lock);
+  for (auto it = ML_members.begin(); it != ML_members.end(); ++it) {
+    if (it->client == client) {
+      for (auto fd : it->fds) {
+        epoll_ctl(ML_epoll, EPOLL_CTL_DEL, fd, NULL);
+        ML_sockets.erase(fd);
+      }
+      ML_members.erase(it);
+      break;
+    }
+  }
+  std::lock_guard<std::mutex> wakeLock(ML_wakeLock);
+  ML_woken.erase(std::remove(ML_woken.begin(), ML_woken.end(), client), ML_woken.end());
+}
+
+// wake: have the loop give a client a turn
+void ModbusClientLoop::wake(ModbusClientTCP *client) {
+  {
+    std::lock_guard<std::mutex> lock(ML_wakeLock);
+    if (std::find(ML_woken.begin(), ML_woken.end(), client) != ML_woken.end()) return;
+    ML_woken.push_back(client);
+  }
+  uint64_t one = 1;
+  if (write(ML_wake, &one, sizeof(one)) < 0) {
+    LOG_E("Could not signal client loop thread: %s\n", strerror(errno));
+  }
+}
+
+// serve: thread function running the event loop
+void *ModbusClientLoop::serve(void *p) {
+  (static_cast<ModbusClientLoop *>(p))->loop();
+  return nullptr;
+}
+
+// loop: wait for events and give the clients concerned their turns until the destructor is called
+void ModbusClientLoop::loop() {
+  struct epoll_event events[64];
+  std::vector<ModbusClientTCP *> ready;
+
+  while (!ML_stopping) {
+    int n = epoll_wait(ML_epoll, events, 64, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      LOG_E("epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+
+    std::lock_guard<std::mutex> lock(ML_lock);
+    ready.clear();
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      uint64_t count;
+      if (fd == ML_wake) {
+        // Requests queued
+        if (read(ML_wake, &count, sizeof(count)) < 0) {
+          LOG_W("Could not read wakeup: %s\n", strerror(errno));
+        }
+        std::lock_guard<std::mutex> wakeLock(ML_wakeLock);
+        ready.insert(ready.end(), ML_woken.begin(), ML_woken.end());
+        ML_woken.clear();
+      } else if (fd == ML_timer) {
+        // Timeouts, intervals etc. are due
+        if (read(ML_timer, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+          LOG_W("Could not read timer: %s\n", strerror(errno));
+        }
+        unsigned long now = millis();
+        for (auto& m : ML_members) {
+          if (m.timed && static_cast<long>(now - m.due) >= 0) ready.push_back(m.client);
+        }
+      } else {
+        // Responses coming in
+        auto it = ML_sockets.find(fd);
+        if (it != ML_sockets.end()) ready.push_back(it->second);
+      }
+    }
+    if (ML_stopping) break;
+
+    // Give each client concerned its turn once
+    std::sort(ready.begin(), ready.end());
+    ready.erase(std::unique(ready.begin(), ready.end()), ready.end());
+    for (auto c : ready) {
+      Member *m = find(c);
+      if (m) turn(*m);
+    }
+    setTimer();
+  }
+  LOG_D("Client loop thread stopped\n");
+}
+
+// turn: let a member handle its requests, then update its sockets and due time
+void ModbusClientLoop::turn(Member& m) {
+  // Repeat while there was something to do - a response received may let the next request go.
+  // But not forever, the other clients are waiting as well.
+  uint8_t turns = 0;
+  bool busy = true;
+  while (busy && turns < TURNS_IN_A_ROW) {
+    busy = m.client->handleRequests();
+    turns++;
+  }
+  ML_turns += turns;
+  updateSockets(m);
+  // Still busy? Then come back right after the others. Else when the client needs it.
+  uint32_t left = busy ? 0 : m.client->nextDue();
+  m.timed = (left != UINT32_MAX);
+  m.due = millis() + left;
+}
+
+// updateSockets: register the sockets a member is waiting on with epoll
+void ModbusClientLoop::updateSockets(Member& m) {
+  std::vector<int> fds;
+  m.client->sockets(fds);
+  // Drop those not waited on any more
+  for (auto fd : m.fds) {
+    if (std::find(fds.begin(), fds.end(), fd) == fds.end()) {
+      epoll_ctl(ML_epoll, EPOLL_CTL_DEL, fd, NULL);
+      auto it = ML_sockets.find(fd);
+      if (it != ML_sockets.end() && it->second == m.client) ML_sockets.erase(it);
+    }
+  }
+  // Register the others. A socket closed and opened again with the same number has left
+  // the epoll set when it was closed, so a known one has to be added again if it is not there
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  for (auto fd : fds) {
+    ev.data.fd = fd;
+    bool known = std::find(m.fds.begin(), m.fds.end(), fd) != m.fds.end();
+    if (!known || epoll_ctl(ML_epoll, EPOLL_CTL_MOD, fd, &ev) < 0) {
+      if (epoll_ctl(ML_epoll, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST) {
+        LOG_E("Could not watch socket %d: %s\n", fd, strerror(errno));
+      }
+    }
+    ML_sockets[fd] = m.client;
+  }
+  m.fds.swap(fds);
+}
+
+// setTimer: arm the timerfd for the earliest due member
+void ModbusClientLoop::setTimer() {
+  bool timed = false;
+  long left = 0;
+  unsigned long now = millis();
+  for (auto& m : ML_members) {
+    if (!m.timed) continue;
+    long l = static_cast<long>(m.due - now);
+    if (!timed || l < left) left = l;
+    timed = true;
+  }
+  struct itimerspec t;
+  memset(&t, 0, sizeof(t));
+  if (timed) {
+    // A zero time would disarm the timer - make it the shortest possible instead
+    if (left <= 0) {
+      t.it_value.tv_nsec = 1;
+    } else {
+      t.it_value.tv_sec = left / 1000;
+      t.it_value.tv_nsec = (left % 1000) * 1000000L;
+    }
+  }
+  if (timerfd_settime(ML_timer, 0, &t, NULL) < 0) {
+    LOG_E("Could not set timer: %s\n", strerror(errno));
+  }
+}
+
+// find: the member entry of a client, nullptr if there is none
+ModbusClientLoop::Member *ModbusClientLoop::find(ModbusClientTCP *client) {
+  for (auto& m : ML_members) {
+    if (m.client == client) return &m;
+  }
+  return nullptr;
+}
+
+#endif  // IS_LINUX
@@ -0,0 +1,99 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_CLIENT_LOOP_H
+#define _MODBUS_CLIENT_LOOP_H
+
+#include "options.h"
+
+#if IS_LINUX
+#include <map>
+#include <vector>
+#include <atomic>
+#include <mutex>    // NOLINT
+#include <pthread.h>
+
+class ModbusClientTCP;
+
+// ModbusClientLoop: event loop thread serving any number of ModbusClientTCP instances on Linux.
+// A client started with begin(loop) instead of begin() will not get a worker thread of its own.
+// The loop sleeps in epoll_wait() on the sockets of all its clients that are waiting for responses,
+// an eventfd woken up by each request queued and a timerfd set to the earliest time a client has
+// to look at its requests again - for timeouts, intervals, coalescing and idle connections.
+// So hundreds of clients will not need hundreds of threads waking up every millisecond.
+// All clients' handlers are called from the loop thread - a slow handler will hold up all clients.
+// Connects are done by the loop thread as well, so give each Client a connect timeout with
+// Client::setConnectTimeout(), else an unreachable target will stall the loop for minutes.
+// More loops may be used to spread the clients over more threads.
+// Do not call end() of a client from a handler - the loop is busy with the clients then.
+class ModbusClientLoop {
+public:
+  ModbusClientLoop();
+
+  // Destructor: stops the loop thread. end() all clients before!
+  ~ModbusClientLoop();
+
+  // clients: number of clients served
+  uint16_t clients();
+
+  // turns: number of times handleRequests() was called for any client
+  uint32_t turns();
+
+protected:
+  friend class ModbusClientTCP;
+
+  // Member: a client served by the loop
+  struct Member {
+    ModbusClientTCP *client;
+    std::vector<int> fds;       // Sockets registered with epoll for the client
+    unsigned long due;          // millis() the client needs a turn again
+    bool timed;                 // due is set
+    explicit Member(ModbusClientTCP *c) : client(c), fds(), due(0), timed(false) {}
+  };
+
+  // Prevent copy construction and assignment
+  ModbusClientLoop(const ModbusClientLoop&) = delete;
+  ModbusClientLoop& operator=(const ModbusClientLoop&) = delete;
+
+  // add: take a client, starting the loop thread if necessary. Returns false if that failed
+  bool add(ModbusClientTCP *client);
+
+  // remove: forget about a client. Will wait until the loop is done with it
+  void remove(ModbusClientTCP *client);
+
+  // wake: have the loop give a client a turn, as it has queued a request
+  void wake(ModbusClientTCP *client);
+
+  // serve: thread function running the event loop
+  static void *serve(void *p);
+  void loop();
+
+  // turn: let a member handle its requests, then update its sockets and due time
+  void turn(Member& m);
+
+  // updateSockets: register the sockets a member is waiting on with epoll
+  void updateSockets(Member& m);
+
+  // setTimer: arm the timerfd for the earliest due member
+  void setTimer();
+
+  // find: the member entry of a client, nullptr if there is none. ML_lock must be held
+  Member *find(ModbusClientTCP *client);
+
+  int ML_epoll;                         // epoll instance
+  int ML_wake;                          // eventfd woken up by wake() and the destructor
+  int ML_timer;                         // timerfd for the earliest due member
+  std::atomic<bool> ML_stopping;        // Destructor was called
+  pthread_t ML_thread;                  // Event loop thread, 0 if not running
+  std::vector<Member> ML_members;       // Clients served. Protected by ML_lock
+  std::map<int, ModbusClientTCP *> ML_sockets;  // Registered sockets and their clients
+  std::mutex ML_lock;                   // Held by the loop while clients have their turns
+  std::vector<ModbusClientTCP *> ML_woken;  // Clients wake() was called for
+  std::mutex ML_wakeLock;               // Protects ML_woken
+  std::atomic<uint32_t> ML_turns;       // Number of turns given
+};
+
+#endif  // IS_LINUX
+
+#endif  // _MODBUS_CLIENT_LOOP_H
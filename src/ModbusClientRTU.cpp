@@ -3,8 +3,10 @@
 //               MIT license - see license.md for details
 // =================================================================================================
 #include "ModbusClientRTU.h"
+#include "ModbusRTUscheduler.h"
+#include "ModbusMessagePool.h"
 
-#if HAS_FREERTOS
+#if HAS_FREERTOS || IS_LINUX
 
 #undef LOCAL_LOG_LEVEL
 // #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
@@ -13,6 +15,7 @@
 // Constructor takes an optional DE/RE pin and queue size
 ModbusClientRTU::ModbusClientRTU(int8_t rtsPin, uint16_t queueLimit) :
   ModbusClient(),
+  MR_inbox(queueLimit),
   MR_serial(nullptr),
   MR_lastMicros(micros()),
   MR_interval(2000),
@@ -20,13 +23,48 @@ ModbusClientRTU::ModbusClientRTU(int8_t rtsPin, uint16_t queueLimit) :
   MR_qLimit(queueLimit),
   MR_timeoutValue(DEFAULTTIMEOUT),
   MR_useASCII(false),
-  MR_skipLeadingZeroByte(false) {
+  MR_skipLeadingZeroByte(false),
+  MR_earlyEnd(false),
+  #if HAS_UART_EVENTS
+  MR_uart(nullptr),
+  #endif
+  MR_useEvents(false),
+  MR_hwRS485(false),
+  #if IS_LINUX
+  MR_stopping(false),
+  #endif
+  MR_scheduler(nullptr),
+  MR_notify(&MR_wakeup),
+  MR_charMicros(0),
+  MR_lane(0),
+  MR_state(MRS_IDLE),
+  MR_stateMicros(0),
+  MR_stateMillis(0),
+  MR_rxTimeout(0),
+  MR_txMicros(0),
+  MR_rxBuffer(nullptr),
+  MR_rxCount(0),
+  MR_rxCRC(0xFFFF),
+  MR_rxFirst(0),
+  MR_rxExpected(0xFFFF) {
+  for (auto& q : MR_queued) q = 0;
+#ifdef MODBUS_STATIC_ALLOCATION
+  // Take the memory for the queues right away
+  for (auto& lane : requests) lane.reserve(MR_qLimit);
+#endif
   if (MR_rtsPin >= 0) {
+#if IS_LINUX && !IS_RASPBERRY
+    // No GPIOs here - have the kernel driver toggle DE/RE, see HardwareSerial::useRS485()
+    LOG_W("RTS pin not supported, use the RS485 mode of the serial device or an RTS callback\n");
+    MR_rtsPin = -1;
+    MTRSrts = RTUutils::RTSauto;
+#else
     pinMode(MR_rtsPin, OUTPUT);
     MTRSrts = [this](bool level) {
       digitalWrite(MR_rtsPin, level);
     };
     MTRSrts(LOW);
+#endif
   } else {
     MTRSrts = RTUutils::RTSauto;
   }
@@ -35,6 +73,7 @@ ModbusClientRTU::ModbusClientRTU(int8_t rtsPin, uint16_t queueLimit) :
 // Alternative constructor takes an RTS callback function
 ModbusClientRTU::ModbusClientRTU(RTScallback rts, uint16_t queueLimit) :
   ModbusClient(),
+  MR_inbox(queueLimit),
   MR_serial(nullptr),
   MR_lastMicros(micros()),
   MR_interval(2000),
@@ -42,14 +81,44 @@ ModbusClientRTU::ModbusClientRTU(RTScallback rts, uint16_t queueLimit) :
   MR_qLimit(queueLimit),
   MR_timeoutValue(DEFAULTTIMEOUT),
   MR_useASCII(false),
-  MR_skipLeadingZeroByte(false) {
+  MR_skipLeadingZeroByte(false),
+  MR_earlyEnd(false),
+  #if HAS_UART_EVENTS
+  MR_uart(nullptr),
+  #endif
+  MR_useEvents(false),
+  MR_hwRS485(false),
+  #if IS_LINUX
+  MR_stopping(false),
+  #endif
+  MR_scheduler(nullptr),
+  MR_notify(&MR_wakeup),
+  MR_charMicros(0),
+  MR_lane(0),
+  MR_state(MRS_IDLE),
+  MR_stateMicros(0),
+  MR_stateMillis(0),
+  MR_rxTimeout(0),
+  MR_txMicros(0),
+  MR_rxBuffer(nullptr),
+  MR_rxCount(0),
+  MR_rxCRC(0xFFFF),
+  MR_rxFirst(0),
+  MR_rxExpected(0xFFFF) {
+  for (auto& q : MR_queued) q = 0;
+#ifdef MODBUS_STATIC_ALLOCATION
+  // Take the memory for the queues right away
+  for (auto& lane : requests) lane.reserve(MR_qLimit);
+#endif
   MR_rtsPin = -1;
   MTRSrts(LOW);
 }
 
+#if !IS_LINUX
 // Constructor takes Serial reference and optional DE/RE pin
 ModbusClientRTU::ModbusClientRTU(SoftwareSerial& serial, int8_t rtsPin, uint16_t queueLimit) :
   ModbusClient(),
+  MR_inbox(queueLimit),
   MR_serial(serial),
   MR_lastMicros(micros()),
   MR_interval(2000),
@@ -59,7 +128,35 @@ ModbusClientRTU::ModbusClientRTU(SoftwareSerial& serial, int8_t rtsPin, uint16_t
   MR_timeBetweenValue(DEFAULTTIMEBETWEEN),
   MR_useASCII(false),
   MR_skipLeadingZeroByte(false),
+  MR_earlyEnd(false),
+  #if HAS_UART_EVENTS
+  MR_uart(nullptr),
+  #endif
+  MR_useEvents(false),
+  MR_hwRS485(false),
+  #if IS_LINUX
+  MR_stopping(false),
+  #endif
+  MR_scheduler(nullptr),
+  MR_notify(&MR_wakeup),
+  MR_charMicros(0),
+  MR_lane(0),
+  MR_state(MRS_IDLE),
+  MR_stateMicros(0),
+  MR_stateMillis(0),
+  MR_rxTimeout(0),
+  MR_txMicros(0),
+  MR_rxBuffer(nullptr),
+  MR_rxCount(0),
+  MR_rxCRC(0xFFFF),
+  MR_rxFirst(0),
+  MR_rxExpected(0xFFFF),
   MR_sw(true) {
+  for (auto& q : MR_queued) q = 0;
+#ifdef MODBUS_STATIC_ALLOCATION
+  // Take the memory for the queues right away
+  for (auto& lane : requests) lane.reserve(MR_qLimit);
+#endif
   if (MR_rtsPin >= 0) {
     pinMode(MR_rtsPin, OUTPUT);
     MTRSrts = [this](bool level) {
@@ -74,6 +171,7 @@ ModbusClientRTU::ModbusClientRTU(SoftwareSerial& serial, int8_t rtsPin, uint16_t
 // Alternative constructor takes Serial reference and RTS callback function
 ModbusClientRTU::ModbusClientRTU(SoftwareSerial& serial, RTScallback rts, uint16_t queueLimit) :
   ModbusClient(),
+  MR_inbox(queueLimit),
   MR_serial(serial),
   MR_lastMicros(micros()),
   MR_interval(2000),
@@ -83,11 +181,41 @@ ModbusClientRTU::ModbusClientRTU(SoftwareSerial& serial, RTScallback rts, uint16
   MR_timeBetweenValue(DEFAULTTIMEBETWEEN),
   MR_useASCII(false),
   MR_skipLeadingZeroByte(false),
+  MR_earlyEnd(false),
+  #if HAS_UART_EVENTS
+  MR_uart(nullptr),
+  #endif
+  MR_useEvents(false),
+  MR_hwRS485(false),
+  #if IS_LINUX
+  MR_stopping(false),
+  #endif
+  MR_scheduler(nullptr),
+  MR_notify(&MR_wakeup),
+  MR_charMicros(0),
+  MR_lane(0),
+  MR_state(MRS_IDLE),
+  MR_stateMicros(0),
+  MR_stateMillis(0),
+  MR_rxTimeout(0),
+  MR_txMicros(0),
+  MR_rxBuffer(nullptr),
+  MR_rxCount(0),
+  MR_rxCRC(0xFFFF),
+  MR_rxFirst(0),
+  MR_rxExpected(0xFFFF),
   MR_sw(true) {
+  for (auto& q : MR_queued) q = 0;
+#ifdef MODBUS_STATIC_ALLOCATION
+  // Take the memory for the queues right away
+  for (auto& lane : requests) lane.reserve(MR_qLimit);
+#endif
   MR_rtsPin = -1;
   MTRSrts(LOW);
 }
 
+#endif
+
 // Destructor: clean up queue, task etc.
 ModbusClientRTU::~ModbusClientRTU() {
   // Kill worker task and clean up request queue
@@ -104,8 +232,22 @@ void ModbusClientRTU::begin(Stream& serial, uint32_t baudRate, int coreID) {
 void ModbusClientRTU::begin(HardwareSerial& serial, int coreID) {
   MR_serial = &serial;
   uint32_t baudRate = serial.baudRate();
+#if !IS_LINUX
   serial.setRxFIFOFull(1);
+#endif
+#if HAS_UART_RS485
+  // Shall the UART switch DE/RE? Then we must not do it as well
+  if (MR_hwRS485 && RTUutils::enableRS485(serial, MR_rtsPin)) {
+    MTRSrts = RTUutils::RTSauto;
+  }
+#endif
   doBegin(baudRate, coreID);
+#if HAS_UART_EVENTS
+  // Shall the UART driver tell us about frame ends? Until this is done, the worker will poll
+  if (MR_useEvents && RTUutils::enableFrameEvents(serial, MR_interval, MR_frameEvent)) {
+    MR_uart = &serial;
+  }
+#endif
 }
 
 void ModbusClientRTU::doBegin(uint32_t baudRate, int coreID) {
@@ -118,32 +260,91 @@ void ModbusClientRTU::doBegin(uint32_t baudRate, int coreID) {
   // Set minimum interval time
   MR_interval = RTUutils::calculateInterval(baudRate);
 
+#if IS_LINUX
+  int rc = pthread_create(&worker, NULL, &pHandle, this);
+  if (rc) {
+    LOG_E("Error creating RTU client thread: %d\n", rc);
+    worker = 0;
+    return;
+  }
+#else
   // Create unique task name
   char taskName[18];
   snprintf(taskName, 18, "Modbus%02XRTU", instanceCounter);
   // Start task to handle the queue
+#ifdef MODBUS_STATIC_ALLOCATION
+  worker = xTaskCreateStaticPinnedToCore((TaskFunction_t)&handleConnection, taskName, 4096, this, 6, MR_stack, &MR_taskBuffer, coreID >= 0 ? coreID : NULL);
+#else
   xTaskCreatePinnedToCore((TaskFunction_t)&handleConnection, taskName, 4096, this, 6, &worker, coreID >= 0 ? coreID : NULL);
+#endif
+#endif
 
   LOG_D("Client task %d started. Interval=%d\n", (uint32_t)worker, MR_interval);
 }
 
+#if IS_LINUX
+void *ModbusClientRTU::pHandle(void *p) {
+  handleConnection((ModbusClientRTU *)p);
+  return nullptr;
+}
+#endif
+
 // end: stop worker task
 void ModbusClientRTU::end() {
+  // Driven by a scheduler? Then leave it
+  bool scheduled = (MR_scheduler != nullptr);
+#if HAS_FREERTOS
+  if (scheduled) MR_scheduler->remove(*this);
+#endif
+  bool running = (worker || scheduled);
+#if IS_LINUX
+  // Have the worker thread leave first - it may be working on the front request.
+  // This will take until a response being waited for has come in or timed out
   if (worker) {
-    // Clean up queue
+    MR_stopping = true;
+    MR_wakeup.signal();
+    pthread_join(worker, NULL);
+    LOG_D("Client thread stopped.\n");
+    worker = 0;
+    MR_stopping = false;
+  }
+#endif
+#if HAS_FREERTOS
+  // Kill the task first as well - it works on the front request in its lane
+  if (worker) {
+    vTaskDelete(worker);
+    LOG_D("Client task %d killed.\n", (uint32_t)worker);
+    worker = nullptr;
+  }
+#endif
+  if (running) {
+    // Clean up queue. The worker is gone, so we may take over the requests still in the inbox
     {
-      // Safely lock access
-      LOCK_GUARD(lockGuard, qLock);
+      takeInbox();
       // Get all queue entries one by one
-      while (!requests.empty()) {
-        // Remove front entry
-        requests.pop();
+      for (uint8_t l = 0; l < MODBUS_PRIORITIES; ++l) {
+        while (!requests[l].empty()) {
+          // Do not leave a syncRequest caller waiting
+          RequestEntry& request = requests[l].front();
+          ModbusMessage response;
+          response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), UNDEFINED_ERROR);
+          if (request.sync) request.sync->complete(response);
+          for (auto& p : request.parts) {
+            if (p.sync) p.sync->complete(response);
+          }
+          // Remove front entry
+          popLane(l);
+        }
       }
     }
-    // Kill task
-    vTaskDelete(worker);
-    LOG_D("Client task %d killed.\n", (uint32_t)worker);
   }
+#if HAS_UART_EVENTS
+  // No more frame events
+  if (MR_uart) {
+    RTUutils::disableFrameEvents(*MR_uart);
+    MR_uart = nullptr;
+  }
+#endif
 }
 
 // setTimeOut: set/change the default interface timeout
@@ -176,13 +377,48 @@ void ModbusClientRTU::skipLeading0x00(bool onOff) {
   LOG_D("Skip leading 0x00 mode = %s\n", onOff ? "ON" : "OFF");
 }
 
+// Toggle UART event driven receive
+void ModbusClientRTU::useUARTevents(bool onOff) {
+#if HAS_UART_EVENTS
+  MR_useEvents = onOff;
+  LOG_D("UART event mode = %s\n", onOff ? "ON" : "OFF");
+#else
+  LOG_W("UART events not available - using polling\n");
+#endif
+}
+
+// Toggle early frame end by expected length
+void ModbusClientRTU::earlyFrameEnd(bool onOff) {
+  MR_earlyEnd = onOff;
+  LOG_D("Early frame end mode = %s\n", onOff ? "ON" : "OFF");
+}
+
+// Toggle DE/RE switching by the UART
+void ModbusClientRTU::useHardwareRS485(bool onOff) {
+#if HAS_UART_RS485
+  MR_hwRS485 = onOff;
+  LOG_D("UART RS485 mode = %s\n", onOff ? "ON" : "OFF");
+#else
+  LOG_W("UART RS485 mode not available - using the RTS callback\n");
+#endif
+}
+
 // Return number of unprocessed requests in queue
 uint32_t ModbusClientRTU::pendingRequests() {
-  return requests.size();
+  uint32_t pending = 0;
+  for (auto& q : MR_queued) {
+    pending += q;
+  }
+  return pending;
 }
 
 // Base addRequest taking a preformatted data buffer and length as parameters
 Error ModbusClientRTU::addRequestM(ModbusMessage msg, uint32_t token) {
+  return addRequestP(std::move(msg), token, RequestOptions());
+}
+
+// addRequest with queue options
+Error ModbusClientRTU::addRequestP(ModbusMessage msg, uint32_t token, RequestOptions o) {
   Error rc = SUCCESS;        // Return value
 
   LOG_D("request for %02X/%02X\n", msg.getServerID(), msg.getFunctionCode());
@@ -190,7 +426,7 @@ Error ModbusClientRTU::addRequestM(ModbusMessage msg, uint32_t token) {
   // Add it to the queue, if valid
   if (msg) {
     // Queue add successful?
-    if (!addToQueue(token, msg)) {
+    if (!addToQueue(token, std::move(msg), nullptr, o)) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -200,21 +436,36 @@ Error ModbusClientRTU::addRequestM(ModbusMessage msg, uint32_t token) {
   return rc;
 }
 
+// addRequest with a completion of its own, taking the response instead of the handlers
+Error ModbusClientRTU::addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion) {
+  if (!msg) return EMPTY_MESSAGE;
+  return addToQueue(token, std::move(msg), completion) ? SUCCESS : REQUEST_QUEUE_FULL;
+}
+
 // Base syncRequest follows the same pattern
 ModbusMessage ModbusClientRTU::syncRequestM(ModbusMessage msg, uint32_t token) {
+  return syncRequestP(std::move(msg), token, RequestOptions());
+}
+
+// syncRequest with queue options
+ModbusMessage ModbusClientRTU::syncRequestP(ModbusMessage msg, uint32_t token, RequestOptions o) {
   ModbusMessage response;
+  // Keep what is needed for an error response - msg is moved into the queue
+  uint8_t serverID = msg.getServerID();
+  uint8_t functionCode = msg.getFunctionCode();
 
   if (msg) {
+    SyncHandle sync = std::make_shared<SyncCompletion>();
     // Queue add successful?
-    if (!addToQueue(token, msg, true)) {
+    if (!addToQueue(token, std::move(msg), sync, o)) {
       // No. Return error after deleting the allocated request.
-      response.setError(msg.getServerID(), msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
     } else {
       // Request is queued - wait for the result.
-      response = waitSync(msg.getServerID(), msg.getFunctionCode(), token);
+      response = waitSync(serverID, functionCode, sync, MR_timeoutValue);
     }
   } else {
-    response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
+    response.setError(serverID, functionCode, EMPTY_MESSAGE);
   }
   return response;
 }
@@ -237,7 +488,7 @@ Error ModbusClientRTU::addBroadcastMessage(const uint8_t* data, uint8_t len) {
     msg.add(data, len);
 
     // Queue add successful?
-    if (!addToQueue(token, msg)) {
+    if (!addToQueue(token, std::move(msg))) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -249,23 +500,130 @@ Error ModbusClientRTU::addBroadcastMessage(const uint8_t* data, uint8_t len) {
   return rc;
 }
 
+// BatchState: collects the results of the requests of a batch write
+// The requests are completed by the worker one after the other, so there is no lock needed
+struct BatchState {
+  std::vector<Error> results;                // One for each BatchWrite
+  std::vector<std::vector<uint16_t>> parts;  // The BatchWrites served by each request
+  uint16_t open;                             // Number of requests not done yet
+  MBOnBatch done;                            // Handler for the results
+  uint32_t token;
+  BatchState(uint16_t writes, MBOnBatch d, uint32_t t) :
+    results(writes, SUCCESS), parts(), open(0), done(d), token(t) {}
+  // complete: request index is done. A write keeps the first error of the requests serving it
+  void complete(uint16_t index, Error error) {
+    for (auto w : parts[index]) {
+      if (results[w] == SUCCESS) results[w] = error;
+    }
+    if (--open == 0 && done) done(results, token);
+  }
+};
+
+// addBatchWrite: write registers to a number of servers, back to back
+Error ModbusClientRTU::addBatchWrite(const std::vector<BatchWrite>& writes, MBOnBatch done, uint32_t token, RequestOptions o) {
+  if (writes.empty()) return PARAMETER_COUNT_ERROR;
+  for (auto& w : writes) {
+    if (w.serverID > 247) return INVALID_SERVER;
+    if (w.values.empty()) return PARAMETER_COUNT_ERROR;
+    if (w.address + w.values.size() > 0x10000) return PARAMETER_LIMIT_ERROR;
+  }
+
+  // Collect the registers by server, in the order the servers come up first. Later writes override
+  std::vector<uint8_t> servers;
+  std::map<uint8_t, std::map<uint16_t, uint16_t>> registers;
+  for (auto& w : writes) {
+    if (!registers.count(w.serverID)) servers.push_back(w.serverID);
+    std::map<uint16_t, uint16_t>& regs = registers[w.serverID];
+    for (uint16_t i = 0; i < w.values.size(); ++i) {
+      regs[w.address + i] = w.values[i];
+    }
+  }
+
+  // Cut each server's registers into runs of consecutive addresses, one request each
+  std::shared_ptr<BatchState> state = std::make_shared<BatchState>(writes.size(), done, token);
+  std::vector<RequestEntry> entries;
+  for (auto serverID : servers) {
+    std::map<uint16_t, uint16_t>& regs = registers[serverID];
+    auto it = regs.begin();
+    while (it != regs.end()) {
+      uint16_t start = it->first;
+      std::vector<uint16_t> values;
+      do {
+        values.push_back(it->second);
+        ++it;
+      } while (it != regs.end() && it->first == start + values.size() && values.size() < 123);
+
+      ModbusMessage msg;
+      uint16_t count = values.size();
+      if (count == 1) {
+        msg.add(serverID, WRITE_HOLD_REGISTER, start, values[0]);
+      } else {
+        msg.add(serverID, WRITE_MULT_REGISTERS, start, count, static_cast<uint8_t>(count * 2));
+        for (auto v : values) {
+          msg.add(v);
+        }
+      }
+
+      // Note the writes served by the request
+      std::vector<uint16_t> served;
+      for (uint16_t w = 0; w < writes.size(); ++w) {
+        if (writes[w].serverID == serverID && writes[w].address < start + count
+         && writes[w].address + writes[w].values.size() > start) {
+          served.push_back(w);
+        }
+      }
+      uint16_t index = state->parts.size();
+      state->parts.push_back(std::move(served));
+
+      SyncHandle sync = std::make_shared<SyncCompletion>([state, index](ModbusMessage response, uint32_t) {
+        state->complete(index, response.getError());
+      }, token);
+      // Broadcasts need the broadcast token, else a response would be waited for
+      uint32_t t = serverID ? token : ((token & 0xFFFFFF) | 0xBC000000);
+      entries.push_back(RequestEntry(t, std::move(msg), sync, o.ttl));
+    }
+  }
+  state->open = entries.size();
 
-// addToQueue: send freshly created request to queue
-bool ModbusClientRTU::addToQueue(uint32_t token, ModbusMessage request, bool syncReq) {
+  // Queue them all or none
+  uint8_t l = static_cast<uint8_t>(o.priority);
+  if (l >= MODBUS_PRIORITIES) l = static_cast<uint8_t>(RequestPriority::BULK);
+  if (!claim(MR_queued[l], entries.size(), laneLimit(l, MR_qLimit))) return REQUEST_QUEUE_FULL;
+  for (auto& re : entries) {
+    re.lane = l;
+    re.trace.mark(TracePoint::ENQUEUE);
+  }
+  if (!MR_inbox.push(entries.data(), entries.size())) {
+    MR_queued[l] -= entries.size();
+    return REQUEST_QUEUE_FULL;
+  }
+  messageCount += entries.size();
+  MR_notify->signal();
+  LOG_D("Batch of %u writes queued as %u requests\n", (unsigned int)writes.size(), (unsigned int)entries.size());
+  return SUCCESS;
+}
+
+// addToQueue: send freshly created request to the queue of its priority lane
+// The request goes into the inbox, for the worker to put it into its lane. No lock is taken,
+// so callers will not wait for each other or for the worker.
+bool ModbusClientRTU::addToQueue(uint32_t token, ModbusMessage request, SyncHandle sync, RequestOptions o) {
   bool rc = false;
   // Did we get one?
+  uint8_t l = static_cast<uint8_t>(o.priority);
+  if (l >= MODBUS_PRIORITIES) l = static_cast<uint8_t>(RequestPriority::BULK);
   if (request) {
-    RequestEntry re(token, request, syncReq);
-    if (requests.size() < MR_qLimit) {
-      // Yes. Safely lock queue and push request to queue
-      rc = true;
-      LOCK_GUARD(lockGuard, qLock);
-      requests.push(re);
-    }
-    {
-      LOCK_GUARD(cntLock, countAccessM);
-      messageCount++;
+    // Yes. Is there room in the lane?
+    if (claim(MR_queued[l], 1, laneLimit(l, MR_qLimit))) {
+      RequestEntry re(token, std::move(request), sync, o.ttl);
+      re.lane = l;
+      re.trace.mark(TracePoint::ENQUEUE);
+      rc = MR_inbox.push(std::move(re));
+      // Inbox full? Then give back the room claimed
+      if (!rc) MR_queued[l]--;
     }
+    // Tell the worker there is something to do
+    if (rc) MR_notify->signal();
+    messageCount++;
   }
 
   LOG_D("RC=%02X\n", rc);
@@ -283,15 +641,66 @@ void ModbusClientRTU::handleConnection(ModbusClientRTU* instance) {
 
   // Loop forever - or until task is killed
   while (1) {
-    // Do we have a reuest in queue?
-    if (!instance->requests.empty()) {
-      // Yes. pull it.
-      RequestEntry request = instance->requests.front();
-
+#if IS_LINUX
+    // end() wants us to leave
+    if (instance->MR_stopping) return;
+#endif
+    // An expired request is taken off its lane, one to be sent is worked on in the lane
+    RequestEntry expiredRequest(0, ModbusMessage());
+    RequestEntry *current = nullptr;
+    uint32_t hold = 0;
+    bool dropped = false;
+    instance->takeInbox();
+    {
+      // Do we have a request in queue? Take the one of the highest priority lane
+      uint8_t lane = instance->pickLane();
+      if (lane < MODBUS_PRIORITIES) {
+        RequestEntry& front = instance->requests[lane].front();
+        // Has it waited too long? Then take it off the queue unsent
+        if (expired(front.queuedTime, front.ttl)) {
+          expiredRequest = std::move(front);
+          instance->popLane(lane);
+          dropped = true;
+        } else {
+          // Yes. pull it - unless it is a read to be held back for others to be merged into it
+          hold = instance->holdTime(front);
+          if (!hold) {
+            front.taken = true;
+            front.trace.mark(TracePoint::DEQUEUE);
+            instance->MR_lane = lane;
+            current = &front;
+          }
+        }
+      }
+    }
+    if (dropped) {
+      instance->expire(expiredRequest);
+      continue;
+    }
+    if (hold) {
+      delay(hold);
+      continue;
+    }
+    // Server backed off after timeouts? Then do not waste the bus on it
+    if (current && !instance->admitted(ModbusDevice(current->msg.getServerID()))) {
+      instance->refuse(*current);
+      instance->popLane(instance->MR_lane);
+      continue;
+    }
+    if (current) {
+      // Only we will change the lane, so the entry stays put until we pop it
+      RequestEntry& request = *current;
       LOG_D("Pulled request from queue\n");
 
+#if HAS_UART_EVENTS
+      // Forget about frame ends signalled before - we want to see the one of the response
+      if (instance->MR_uart) instance->MR_frameEvent.wait(0);
+#endif
       // Send it via Serial
-      RTUutils::send(*(instance->MR_serial), instance->MR_lastMicros, instance->MR_interval, instance->MTRSrts, request.msg, instance->MR_useASCII);
+      request.trace.mark(TracePoint::SEND_START);
+      RTUutils::send(*(instance->MR_serial), instance->MR_lastMicros, instance->MR_interval, instance->MTRSrts, request.msg, instance->MR_useASCII, instance->capture);
+      request.trace.mark(TracePoint::SEND_END);
+      sent(request);
 
       LOG_D("Request sent.\n");
       // HEXDUMP_V("Data", request.msg.data(), request.msg.size());
@@ -299,85 +708,344 @@ void ModbusClientRTU::handleConnection(ModbusClientRTU* instance) {
       // For a broadcast, we will not wait for a response
       if (request.msg.getServerID() != 0 || ((request.token & 0xFF000000) != 0xBC000000)) {
         // This is a regular request, Get the response - if any
+        uint32_t firstByte = 0;
         ModbusMessage response = RTUutils::receive(
                                    'C',
                                    *(instance->MR_serial),
-                                   instance->MR_timeoutValue,
+                                   instance->requestTimeout(ModbusDevice(request.msg.getServerID()), instance->MR_timeoutValue),
                                    instance->MR_lastMicros,
                                    instance->MR_interval,
                                    instance->MR_useASCII,
-                                   instance->MR_skipLeadingZeroByte);
-
-        LOG_D("%s response (%d bytes) received.\n", response.size() > 1 ? "Data" : "Error", response.size());
-        HEXDUMP_V("Data", response.data(), response.size());
-
-        // No error in receive()?
-        if (response.size() > 1) {
-          // No. Check message contents
-          // Does the serverID match the requested?
-          if (request.msg.getServerID() != response.getServerID()) {
-            // No. Return error response
-            response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), SERVER_ID_MISMATCH);
-            // ServerID ok, but does the FC match as well?
-          } else if (request.msg.getFunctionCode() != (response.getFunctionCode() & 0x7F)) {
-            // No. Return error response
-            response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), FC_MISMATCH);
-          }
-        } else {
-          // No, we got an error code from receive()
-          // Return it as error response
-          response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), static_cast<Error>(response[0]));
-        }
+                                   instance->MR_skipLeadingZeroByte,
+                                   instance->MR_earlyEnd,
+#if HAS_UART_EVENTS
+                                   instance->MR_uart ? &instance->MR_frameEvent : nullptr,
+#else
+                                   nullptr,
+#endif
+                                   &firstByte,
+                                   instance->capture);
+        if (firstByte) request.trace.mark(TracePoint::FIRST_BYTE, firstByte);
+        request.trace.mark(TracePoint::FRAME_COMPLETE);
+
+        instance->handleResponse(request, response);
+      } else {
+        broadcastSent(request);
+      }
+      // Clean-up time. Remove the front queue entry
+      instance->popLane(instance->MR_lane);
+    } else {
+      // Nothing to do - sleep until the next request is queued
+      instance->MR_wakeup.wait(1000);
+    }
+  }
+}
+
+// handleResponse: check a response against its request and hand it over to the caller
+// response is the result of RTUutils::receive() - a single byte is an error code
+void ModbusClientRTU::handleResponse(RequestEntry& request, ModbusMessage& response) {
+  LOG_D("%s response (%d bytes) received.\n", response.size() > 1 ? "Data" : "Error", response.size());
+  HEXDUMP_V("Data", response.data(), response.size());
 
-        LOG_D("Response generated.\n");
-        HEXDUMP_V("Response packet", response.data(), response.size());
+  // No error in receive()?
+  if (response.size() > 1) {
+    // No. Check message contents
+    // Does the serverID match the requested?
+    if (request.msg.getServerID() != response.getServerID()) {
+      // No. Return error response
+      response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), SERVER_ID_MISMATCH);
+      // ServerID ok, but does the FC match as well?
+    } else if (request.msg.getFunctionCode() != (response.getFunctionCode() & 0x7F)) {
+      // No. Return error response
+      response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), FC_MISMATCH);
+    }
+  } else {
+    // No, we got an error code from receive()
+    // Return it as error response
+    response.setError(request.msg.getServerID(), request.msg.getFunctionCode(), static_cast<Error>(response[0]));
+  }
+
+  LOG_D("Response generated.\n");
+  HEXDUMP_V("Response packet", response.data(), response.size());
+
+  // Count the response, and the error if we got one
+  countResponse(request.msg, response);
+
+  // Hand it over - split up again, if it was coalesced from several reads
+  Error error = response.getError();
+  ModbusDevice device(request.msg.getServerID());
+  learn(device, request.trace, error);
+  request.trace.mark(TracePoint::DISPATCH);
+  if (request.parts.empty()) {
+    if (!filtered(device, request.token, request.sync, request.msg, response)) deliver(request.token, request.sync, response);
+  } else {
+    deliverParts(device, request.parts, request.msg, response);
+  }
+  traceDone(request.trace, request.token, request.msg, error);
+}
 
-        // If we got an error, count it
-        if (response.getError() != SUCCESS) {
-          instance->errorCount++;
+// expire: report a request taken off the queue unsent, since it has outlived its ttl
+void ModbusClientRTU::expire(RequestEntry& request) {
+  LOG_D("Request %08X expired\n", request.token);
+  // Hand it over like an error from receive()
+  ModbusMessage response;
+  response.push_back(REQUEST_EXPIRED);
+  handleResponse(request, response);
+}
+
+// refuse: report a request taken off the queue unsent, since its server is backed off
+void ModbusClientRTU::refuse(RequestEntry& request) {
+  LOG_D("Server %d backed off, request %08X refused\n", request.msg.getServerID(), request.token);
+  ModbusMessage response;
+  response.push_back(SERVER_BACKED_OFF);
+  handleResponse(request, response);
+}
+
+// pickLane: highest priority lane with requests, MODBUS_PRIORITIES if all are empty
+uint8_t ModbusClientRTU::pickLane() {
+  uint8_t lane = 0;
+  while (lane < MODBUS_PRIORITIES && requests[lane].empty()) lane++;
+  return lane;
+}
+
+// takeInbox: move the requests queued since into their lanes. Only the worker may call it
+// Reads are merged here into those waiting in the lane, if coalescing is on, or fused with a write
+void ModbusClientRTU::takeInbox() {
+  RequestEntry re(0, ModbusMessage());
+  while (MR_inbox.pop(re)) {
+    ModbusLane<RequestEntry>& lane = requests[re.lane];
+    bool merged = false;
+    // Read back from a server taking FC 0x17, right behind a write to it?
+    if (fusing(re.msg.getServerID()) && !lane.empty() && !lane.back().taken) {
+      RequestEntry& last = lane.back();
+      if (fuse(last.msg, last.token, last.sync, last.parts, re.msg, re.token, re.sync)) {
+        last.ttl = mergeTTL(last.queuedTime, last.ttl, re.ttl);
+        merged = true;
+      }
+    }
+    // May it be merged with a read waiting in the queue?
+    if (!merged && coalescing && isCoalescable(re.msg)) {
+      // Look from the latest backwards, but not beyond other requests to the same server
+      for (auto it = lane.rbegin(); it != lane.rend(); ++it) {
+        if (it->taken) break;
+        if (coalesce(it->msg, it->token, it->sync, it->parts, re.msg, re.token, re.sync)) {
+          // The merged request has to live as long as the new one needs
+          it->ttl = mergeTTL(it->queuedTime, it->ttl, re.ttl);
+          merged = true;
+          break;
         }
+        if (it->msg.getServerID() == re.msg.getServerID() && !isCoalescable(it->msg)) break;
+      }
+    }
+    if (merged) {
+      // It does not take room in the lane any more
+      MR_queued[re.lane]--;
+    } else {
+      lane.push_back(std::move(re));
+    }
+  }
+}
 
-        // Was it a synchronous request?
-        if (request.isSyncRequest) {
-          // Yes. Put it into the response map
-          {
-            LOCK_GUARD(sL, instance->syncRespM);
-            instance->syncResponse[request.token] = response;
-          }
-          // No, an async request. Do we have an onResponse handler?
-        } else if (instance->onResponse) {
-          // Yes. Call it
-          instance->onResponse(response, request.token);
+// popLane: remove the front request of a lane
+void ModbusClientRTU::popLane(uint8_t lane) {
+  requests[lane].pop_front();
+  MR_queued[lane]--;
+}
+
+// holdTime: ms left to hold back a request for reads to be merged into
+uint32_t ModbusClientRTU::holdTime(RequestEntry& request) {
+  if (!coalesceHold || request.taken || !isCoalescable(request.msg)) return 0;
+  uint32_t waited = millis() - request.queuedTime;
+  return (waited < coalesceHold) ? coalesceHold - waited : 0;
+}
+
+// sent: tell waiting syncRequest callers their request is out
+void ModbusClientRTU::sent(RequestEntry& request) {
+  if (request.sync) request.sync->sent();
+  for (auto& p : request.parts) {
+    if (p.sync) p.sync->sent();
+  }
+}
+
+// broadcastSent: a broadcast is out. A batch waiting for it is told so
+void ModbusClientRTU::broadcastSent(RequestEntry& request) {
+  if (request.sync) {
+    ModbusMessage response;
+    response.add(request.msg.getServerID(), request.msg.getFunctionCode());
+    request.sync->complete(response);
+  }
+}
+
+// step: one non-blocking turn of sending and receiving, if driven by a ModbusRTUscheduler
+// The request being worked on stays at the front of the queue until it is done.
+// Returns STEP_IDLE if there is nothing to do, STEP_WAIT while waiting for the bus or a response
+// and STEP_ACTIVE if anything was sent or received.
+uint8_t ModbusClientRTU::step() {
+  switch (MR_state) {
+  // MRS_IDLE: look for a request to send
+  case MRS_IDLE:
+    {
+      RequestEntry request(0, ModbusMessage());
+      bool refused = false;
+      takeInbox();
+      {
+        uint8_t lane = pickLane();
+        if (lane >= MODBUS_PRIORITIES) return STEP_IDLE;
+        RequestEntry& front = requests[lane].front();
+        // Has it waited too long? Then take it off the queue unsent
+        if (expired(front.queuedTime, front.ttl)) {
+          request = std::move(front);
+          popLane(lane);
         } else {
-          // No, but we may have onData or onError handlers
-          // Did we get a normal response?
-          if (response.getError() == SUCCESS) {
-            // Yes. Do we have an onData handler registered?
-            if (instance->onData) {
-              // Yes. call it
-              instance->onData(response, request.token);
-            }
+          // Hold back reads for others to be merged into
+          if (holdTime(front)) return STEP_WAIT;
+          // Server backed off? Then take it off the queue unsent as well
+          if (!admitted(ModbusDevice(front.msg.getServerID()))) {
+            request = std::move(front);
+            popLane(lane);
+            refused = true;
           } else {
-            // No, something went wrong. All we have is an error
-            // Do we have an onError handler?
-            if (instance->onError) {
-              // Yes. Forward the error code to it
-              instance->onError(response.getError(), request.token);
-            }
+            front.taken = true;
+            front.trace.mark(TracePoint::DEQUEUE);
+            MR_lane = lane;
           }
         }
       }
-      // Clean-up time.
+      if (refused) {
+        refuse(request);
+        return STEP_ACTIVE;
+      }
+      if (request.msg) {
+        expire(request);
+        return STEP_ACTIVE;
+      }
+    }
+    MR_state = MRS_GAP;
+    // Fall through - we may start right away
+  // MRS_GAP: wait for the bus quiet time, then start sending
+  case MRS_GAP:
+    if (micros() - MR_lastMicros < MR_interval) return STEP_WAIT;
+    // Drop anything trailing a previous response
+    while (MR_serial->available()) {
+      MR_serial->read();
+    }
+    {
+      RequestEntry& request = requests[MR_lane].front();
+      request.trace.mark(TracePoint::SEND_START);
+      RTUutils::sendStart(*MR_serial, MTRSrts, request.msg, capture);
+      // The UART will need this long to get the request out, including the CRC
+      MR_txMicros = (request.msg.size() + 2) * MR_charMicros;
+    }
+    MR_stateMicros = micros();
+    MR_state = MRS_SENDING;
+    return STEP_ACTIVE;
+  // MRS_SENDING: wait until the request should be out, then finish sending
+  case MRS_SENDING:
+    if (micros() - MR_stateMicros < MR_txMicros) return STEP_WAIT;
+    RTUutils::sendEnd(*MR_serial, MR_lastMicros, MTRSrts);
+    {
+      RequestEntry broadcast(0, ModbusMessage());
       {
-        // Safely lock the queue
-        LOCK_GUARD(lockGuard, instance->qLock);
-        // Remove the front queue entry
-        instance->requests.pop();
+        RequestEntry& request = requests[MR_lane].front();
+        request.trace.mark(TracePoint::SEND_END);
+        sent(request);
+        MR_rxTimeout = requestTimeout(ModbusDevice(request.msg.getServerID()), MR_timeoutValue);
+        LOG_D("Request sent.\n");
+        // For a broadcast, we will not wait for a response
+        if (request.msg.getServerID() == 0 && ((request.token & 0xFF000000) == 0xBC000000)) {
+          broadcast = std::move(request);
+          popLane(MR_lane);
+          MR_state = MRS_IDLE;
+        }
       }
-    } else {
-      delay(1);
+      if (broadcast.msg) {
+        broadcastSent(broadcast);
+        return STEP_ACTIVE;
+      }
+    }
+    // Prepare for the response
+    MR_rxBuffer = ModbusMessagePool::acquire();
+    MR_rxCount = 0;
+    MR_rxCRC = 0xFFFF;
+    MR_rxExpected = MR_earlyEnd ? 0 : 0xFFFF;
+    MR_stateMillis = millis();
+    MR_state = MRS_RECEIVING;
+    return STEP_ACTIVE;
+  // MRS_RECEIVING: collect the response until the gap, the expected length or the timeout
+  case MRS_RECEIVING:
+    {
+      bool hadData = false;
+      bool done = false;
+      Error error = SUCCESS;
+      while (!done && MR_serial->available()) {
+        int b = MR_serial->read();
+        if (b < 0) break;
+        hadData = true;
+        MR_lastMicros = micros();
+        if (!MR_rxCount) MR_rxFirst = MR_lastMicros;
+        // Skip a leading 0x00 byte, if required
+        if (!MR_rxCount && b == 0 && MR_skipLeadingZeroByte) continue;
+        MR_rxBuffer->push_back(b);
+        MR_rxCRC = RTUutils::updateCRC(MR_rxCRC, b);
+        MR_rxCount++;
+        // Buffer full? (a fixed size buffer may have dropped the byte)
+        if (MR_rxCount >= 512 || MR_rxCount > MR_rxBuffer->size()) {
+          error = PACKET_LENGTH_ERROR;
+          done = true;
+        // Looking for an early frame end?
+        } else if (MR_rxExpected != 0xFFFF) {
+          // Yes. Do we know the length already?
+          if (!MR_rxExpected) MR_rxExpected = RTUutils::frameLength('C', MR_rxBuffer->data(), MR_rxCount);
+          // Is the frame complete? If the CRC is correct, we are done. Else we will wait for the gap
+          if (MR_rxCount == MR_rxExpected) {
+            if (MR_rxCRC == 0) {
+              done = true;
+            } else {
+              MR_rxExpected = 0xFFFF;
+            }
+          }
+        }
+      }
+      if (!done) {
+        if (MR_rxCount) {
+          // Are we past the interval gap?
+          if (micros() - MR_lastMicros < MR_interval) return hadData ? STEP_ACTIVE : STEP_WAIT;
+        } else {
+          // No data yet. Just check the timeout period
+          if (millis() - MR_stateMillis < MR_rxTimeout) return hadData ? STEP_ACTIVE : STEP_WAIT;
+          error = TIMEOUT;
+        }
+      }
+      // We are done. Prepare the response in the format of RTUutils::receive()
+      ModbusMessage response;
+      HEXDUMP_V("Raw buffer received", MR_rxBuffer->data(), MR_rxCount);
+      if (capture && MR_rxCount) capture->add(ModbusCapture::RTU_RX, MR_rxBuffer->data(), MR_rxCount, nullptr, 0, MR_rxFirst);
+      if (error != SUCCESS) {
+        response.push_back(error);
+      } else if (MR_rxCount < 4) {
+        response.push_back(PACKET_LENGTH_ERROR);
+      } else if (MR_rxCRC != 0) {
+        response.push_back(CRC_ERROR);
+      } else {
+        response.add(MR_rxBuffer->data(), MR_rxCount - 2);
+      }
+      ModbusMessagePool::release(MR_rxBuffer);
+      MR_rxBuffer = nullptr;
+      // Clear serial buffer in case something is left trailing
+      while (MR_serial->available()) {
+        MR_serial->read();
+      }
+      // Take the request off the queue and hand over the response
+      RequestEntry request(std::move(requests[MR_lane].front()));
+      popLane(MR_lane);
+      if (MR_rxCount) request.trace.mark(TracePoint::FIRST_BYTE, MR_rxFirst);
+      request.trace.mark(TracePoint::FRAME_COMPLETE);
+      MR_state = MRS_IDLE;
+      handleResponse(request, response);
     }
+    return STEP_ACTIVE;
   }
+  return STEP_IDLE;
 }
 
-#endif  // HAS_FREERTOS
+#endif  // HAS_FREERTOS || IS_LINUX
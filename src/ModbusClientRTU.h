@@ -7,19 +7,35 @@
 
 #include "options.h"
 
-#if HAS_FREERTOS
+#if HAS_FREERTOS || IS_LINUX
 
 #include "ModbusClient.h"
-#include "Stream.h"
 #include "RTUutils.h"
+#include "ModbusWakeup.h"
+#include "ModbusRing.h"
 #include <queue>
+#include <deque>
 #include <vector>
 
 using std::queue;
 
+class ModbusRTUscheduler;
+
 #define DEFAULTTIMEOUT 2000
 #define DEFAULTTIMEBETWEEN 0
 
+// BatchWrite: holding registers to write to one server, see ModbusClientRTU::addBatchWrite()
+struct BatchWrite {
+  uint8_t serverID;                // Server to write to, 0 for a broadcast
+  uint16_t address;                // First register
+  std::vector<uint16_t> values;    // Values to write from there on
+  BatchWrite(uint8_t s, uint16_t a, std::vector<uint16_t> v) :
+    serverID(s), address(a), values(std::move(v)) {}
+};
+
+// MBOnBatch: handler for the results of a batch - an Error for each BatchWrite, in the order given
+typedef std::function<void(const std::vector<Error>& results, uint32_t token)> MBOnBatch;
+
 class ModbusClientRTU : public ModbusClient {
 public:
   // Constructor takes an optional DE/RE pin and queue limit
@@ -28,15 +44,20 @@ public:
   // Alternative Constructor takes an RTS line toggle callback
   explicit ModbusClientRTU(RTScallback rts, uint16_t queueLimit = 100);
 
+  // Destructor: stop the worker and clean up the queue
+  ~ModbusClientRTU();
+
+#if !IS_LINUX
     // Same constructors for SoftwareSerial
     // Constructor takes Serial reference and optional DE/RE pin and queue limit
     explicit ModbusClientRTU(SoftwareSerial& serial, int8_t rtsPin = -1, uint16_t queueLimit = 100);
     // Alternative Constructor takes Serial reference and RTS line toggle callback
     explicit ModbusClientRTU(SoftwareSerial& serial, RTScallback rts, uint16_t queueLimit = 100);
+#endif
 
   // begin: start worker task
   void begin(Stream& serial, uint32_t baudrate, int coreID = -1);
-  // Special variant for HardwareSerial
+  // Special variant for HardwareSerial. On Linux, this is the termios device of examples/Linux
   void begin(HardwareSerial& serial, int coreID = -1);
 
     // begin: start worker task
@@ -60,41 +81,113 @@ public:
     // Toggle skipping of leading 0x00 byte
     void skipLeading0x00(bool onOff = true);
 
+    // Toggle early frame end: return responses as soon as their expected length has arrived with a valid CRC
+    void earlyFrameEnd(bool onOff = true);
+
+    // Toggle UART event driven receive. Only effective for a HardwareSerial and before begin()!
+    // The worker will sleep until the UART driver reports a complete frame instead of polling.
+    void useUARTevents(bool onOff = true);
+
+    // Toggle DE/RE switching by the UART. Only effective for a HardwareSerial and before begin()!
+    // On ESP32 the UART's RS485 half duplex mode drives the rtsPin given to the constructor, on Linux
+    // the kernel driver the device's RTS line. DE/RE is released right after the last stop bit then.
+    // If the UART will not do it, the RTS line is switched as before.
+    void useHardwareRS485(bool onOff = true);
+
     // Return number of unprocessed requests in queue
     uint32_t pendingRequests();
 
     // addBroadcastMessage: create a fire-and-forget message to all servers on the RTU bus
     Error addBroadcastMessage(const uint8_t* data, uint8_t len);
 
+    // addBatchWrite: write registers to a number of servers, back to back.
+    // Writes to the same server with touching or overlapping ranges are merged into FC 0x10 requests
+    // of up to 123 registers, where ranges overlap the later write wins. A single register is written
+    // by FC 0x06. All requests go into the lane in one go, so no other request of it will come between.
+    // done is called once with the results of all writes. Broadcasts are SUCCESS once they are sent.
+    Error addBatchWrite(const std::vector<BatchWrite>& writes, MBOnBatch done, uint32_t token, RequestOptions o = RequestOptions());
+
     // protected:
     struct RequestEntry {
       uint32_t token;
       ModbusMessage msg;
-      bool isSyncRequest;
-      RequestEntry(uint32_t t, ModbusMessage m, bool syncReq = false) :
+      SyncHandle sync;            // Completion for syncRequests, empty for all others
+      CoalescedParts parts;       // Original requests, if reads were merged into this one
+      unsigned long queuedTime;   // Time the request was queued
+      uint32_t ttl;               // ms the request may wait to be sent, 0: no limit
+      bool taken;                 // Worker has started on it, no more merging
+      uint8_t lane;               // Priority lane it is queued in
+      ModbusTrace trace;          // Times of the transaction points passed
+      RequestEntry(uint32_t t, ModbusMessage m, SyncHandle s = nullptr, uint32_t l = 0) :
         token(t),
-        msg(m),
-        isSyncRequest(syncReq) {}
+        msg(std::move(m)),
+        sync(s),
+        parts(),
+        queuedTime(millis()),
+        ttl(l),
+        taken(false),
+        lane(0),
+        trace() {}
     };
 
     // Base addRequest and syncRequest must be present
     Error addRequestM(ModbusMessage msg, uint32_t token);
     ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token);
+    // Variants with queue options
+    Error addRequestP(ModbusMessage msg, uint32_t token, RequestOptions o);
+    ModbusMessage syncRequestP(ModbusMessage msg, uint32_t token, RequestOptions o);
+    // Variant with a completion of its own
+    Error addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion);
+
+    // addToQueue: send freshly created request to the queue of its priority lane
+    bool addToQueue(uint32_t token, ModbusMessage msg, SyncHandle sync = nullptr, RequestOptions o = RequestOptions());
 
-    // addToQueue: send freshly created request to queue
-    bool addToQueue(uint32_t token, ModbusMessage msg, bool syncReq = false);
+    // pickLane: highest priority lane with requests, MODBUS_PRIORITIES if all are empty
+    uint8_t pickLane();
+
+    // takeInbox: move the requests queued since into their lanes, merging reads on the way. Worker only!
+    void takeInbox();
+
+    // popLane: remove the front request of a lane
+    void popLane(uint8_t lane);
 
     // handleConnection: worker task method
     static void handleConnection(ModbusClientRTU* instance);
+#if IS_LINUX
+    static void *pHandle(void *p);
+#endif
+
+    // handleResponse: check a response against its request and hand it over to the caller
+    void handleResponse(RequestEntry& request, ModbusMessage& response);
+
+    // expire: report a request taken off the queue unsent, since it has outlived its ttl
+    void expire(RequestEntry& request);
+
+    // refuse: report a request taken off the queue unsent, since its server is backed off
+    void refuse(RequestEntry& request);
+
+    // holdTime: ms left to hold back a request for reads to be merged into
+    uint32_t holdTime(RequestEntry& request);
+
+    // sent: tell waiting syncRequest callers their request is out
+    static void sent(RequestEntry& request);
+
+    // broadcastSent: a broadcast is out. A batch waiting for it is told so
+    static void broadcastSent(RequestEntry& request);
+
+    // step: one non-blocking turn of sending and receiving, if driven by a ModbusRTUscheduler
+    enum StepResult : uint8_t { STEP_IDLE = 0, STEP_WAIT, STEP_ACTIVE };
+    uint8_t step();
+    friend class ModbusRTUscheduler;
 
   // start background task
   void doBegin(uint32_t baudRate, int coreID);
 
   void isInstance() { return; }   // make class instantiable
-  queue<RequestEntry> requests;   // Queue to hold requests to be processed
-  #if USE_MUTEX
-  mutex qLock;                    // Mutex to protect queue
-  #endif
+  ModbusLane<RequestEntry> requests[MODBUS_PRIORITIES];  // Queues to hold requests to be processed, by priority
+  ModbusInbox<RequestEntry> MR_inbox;  // Requests on their way from the callers to the lanes
+  std::atomic<uint16_t> MR_queued[MODBUS_PRIORITIES];  // Requests in the inbox and the lanes, by priority
+  ModbusWakeup MR_wakeup;         // Wakes up the worker task when a request was queued
   Stream *MR_serial;              // Ptr to the serial interface used
   unsigned long MR_lastMicros;    // Microseconds since last bus activity
   uint32_t MR_interval;           // Modbus RTU bus quiet time
@@ -104,9 +197,39 @@ public:
   uint32_t MR_timeoutValue;       // Interface default timeout
   bool MR_useASCII;               // true=ModbusASCII, false=ModbusRTU
   bool MR_skipLeadingZeroByte;    // true=skip the first byte if it is 0x00, false=accept all bytes
+  bool MR_earlyEnd;               // true=end frames by expected length, false=by the interval gap only
+#if HAS_UART_EVENTS
+  HardwareSerial *MR_uart;        // HardwareSerial signalling frame ends, nullptr if not active
+  ModbusWakeup MR_frameEvent;     // Signalled by the UART driver on a frame end
+#endif
+  bool MR_useEvents;              // true=UART event driven receive requested
+  bool MR_hwRS485;                // true=DE/RE to be switched by the UART
+#if IS_LINUX
+  std::atomic<bool> MR_stopping;  // true: end() is waiting for the worker thread to leave
+#endif
+  // Scheduler driven operation - see step()
+  enum StepState : uint8_t { MRS_IDLE = 0, MRS_GAP, MRS_SENDING, MRS_RECEIVING };
+  ModbusRTUscheduler *MR_scheduler; // Scheduler driving this client, nullptr if it has its own task
+  ModbusWakeup *MR_notify;        // Wakeup to signal for a new request: MR_wakeup or the scheduler's
+  uint32_t MR_charMicros;         // Transmission time of one character on the bus
+  uint8_t MR_lane;                // Priority lane of the request being worked on
+  uint8_t MR_state;               // State of step()
+  unsigned long MR_stateMicros;   // Start of transmission
+  unsigned long MR_stateMillis;   // Start of the response timeout
+  uint32_t MR_rxTimeout;          // Timeout for the response being waited for
+  uint32_t MR_txMicros;           // Transmission time of the request being sent
+  ModbusMessage *MR_rxBuffer;     // Response being received, drawn from the message pool
+  uint16_t MR_rxCount;            // Number of bytes received
+  uint16_t MR_rxCRC;              // Running CRC of the bytes received
+  uint32_t MR_rxFirst;            // micros() the first byte of the response came in at
+  uint16_t MR_rxExpected;         // Expected frame length for earlyEnd, 0xFFFF if not looking for it
+#if HAS_FREERTOS && defined(MODBUS_STATIC_ALLOCATION)
+  StackType_t MR_stack[4096];     // Stack of the worker task, see ModbusRing.h
+  StaticTask_t MR_taskBuffer;     // Control block of the worker task
+#endif
 
 };
 
-#endif  // HAS_FREERTOS
+#endif  // HAS_FREERTOS || IS_LINUX
 
 #endif  // INCLUDE GUARD
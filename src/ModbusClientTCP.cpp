@@ -3,6 +3,7 @@
 //               MIT license - see license.md for details
 // =================================================================================================
 #include "ModbusClientTCP.h"
+#include "TCPutils.h"
 
 #if HAS_FREERTOS || IS_LINUX
 
@@ -13,24 +14,70 @@
 // Constructor takes reference to Client (EthernetClient or WiFiClient)
 ModbusClientTCP::ModbusClientTCP(Client& client, uint16_t queueLimit) :
   ModbusClient(),
+  MT_queues(),
+  MT_nextQueue(0),
+  MT_inbox(queueLimit),
+  MT_wakeup(),
   MT_client(client),
+  MT_pool(),
+  MT_connector(),
+  MT_idleTimeout(0),
   MT_lastTarget(IPAddress(0, 0, 0, 0), 0, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_target(IPAddress(0, 0, 0, 0), 0, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_defaultTimeout(DEFAULTTIMEOUT),
   MT_defaultInterval(TARGETHOSTINTERVAL),
-  MT_qLimit(queueLimit)
-  { }
+  MT_qLimit(queueLimit),
+  #ifdef MODBUS_STATIC_ALLOCATION
+  MT_slots(queueLimit),
+  #endif
+  #if IS_LINUX
+  MT_loop(nullptr),
+  #endif
+  MT_maxInflight(1) {
+    MT_pool.emplace_back(&client);
+    for (auto& q : MT_queued) q = 0;
+#ifdef MODBUS_STATIC_ALLOCATION
+    // Set up all target queues right away. They are reused for other targets, once empty
+    MT_queues.reserve(MODBUS_TCP_TARGETS);
+    for (uint16_t i = 0; i < MODBUS_TCP_TARGETS; ++i) {
+      MT_queues.push_back(TargetQueue(TargetHost(), queueLimit));
+    }
+#endif
+  }
 
 // Alternative Constructor takes reference to Client (EthernetClient or WiFiClient) plus initial target host
 ModbusClientTCP::ModbusClientTCP(Client& client, IPAddress host, uint16_t port, uint16_t queueLimit) :
   ModbusClient(),
+  MT_queues(),
+  MT_nextQueue(0),
+  MT_inbox(queueLimit),
+  MT_wakeup(),
   MT_client(client),
+  MT_pool(),
+  MT_connector(),
+  MT_idleTimeout(0),
   MT_lastTarget(IPAddress(0, 0, 0, 0), 0, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_target(host, port, DEFAULTTIMEOUT, TARGETHOSTINTERVAL),
   MT_defaultTimeout(DEFAULTTIMEOUT),
   MT_defaultInterval(TARGETHOSTINTERVAL),
-  MT_qLimit(queueLimit)
-  { }
+  MT_qLimit(queueLimit),
+  #ifdef MODBUS_STATIC_ALLOCATION
+  MT_slots(queueLimit),
+  #endif
+  #if IS_LINUX
+  MT_loop(nullptr),
+  #endif
+  MT_maxInflight(1) {
+    MT_pool.emplace_back(&client);
+    for (auto& q : MT_queued) q = 0;
+#ifdef MODBUS_STATIC_ALLOCATION
+    // Set up all target queues right away. They are reused for other targets, once empty
+    MT_queues.reserve(MODBUS_TCP_TARGETS);
+    for (uint16_t i = 0; i < MODBUS_TCP_TARGETS; ++i) {
+      MT_queues.push_back(TargetQueue(TargetHost(), queueLimit));
+    }
+#endif
+  }
 
 // Destructor: clean up queue, task etc.
 ModbusClientTCP::~ModbusClientTCP() {
@@ -39,24 +86,60 @@ ModbusClientTCP::~ModbusClientTCP() {
 
 // end: stop worker task
 void ModbusClientTCP::end() {
-  // Clean up queue
-  {
-    // Safely lock access
-    LOCK_GUARD(lockGuard, qLock);
-    // Get all queue entries one by one
-    while (!requests.empty()) {
-      requests.pop();
-    }
+  // Stop the connectors first. This will wait for connects still running
+  MT_connector.end();
+#if IS_LINUX
+  // Leave the shared event loop - it will not touch us any more afterwards
+  if (MT_loop) {
+    MT_loop->remove(this);
+    MT_loop = nullptr;
+    LOG_D("TCP client left event loop.\n");
   }
-  LOG_D("TCP client worker killed.\n");
-  // Kill task
+#endif
+  // Kill task first - it may be working on one of the requests
   if (worker) {
 #if IS_LINUX
     pthread_cancel(worker);
+    worker = 0;
 #else
     vTaskDelete(worker);
-#endif
     worker = nullptr;
+#endif
+  }
+  LOG_D("TCP client worker killed.\n");
+  // Clean up queues. The worker is gone, so we may take over the requests still in the inbox
+  {
+    RequestEntry *re = nullptr;
+    while (MT_inbox.pop(re)) {
+      drop(re);
+    }
+    // Get all queue entries one by one
+    for (auto& q : MT_queues) {
+      for (auto& lane : q.requests) {
+        while (!lane.empty()) {
+          drop(lane.front());
+          lane.pop_front();
+        }
+      }
+    }
+#ifndef MODBUS_STATIC_ALLOCATION
+    MT_queues.clear();
+#endif
+    MT_nextQueue = 0;
+    for (auto& q : MT_queued) q = 0;
+  }
+  // Drop requests still waiting for a response or a connection
+  for (auto& slot : MT_pool) {
+    for (auto it = slot.inflight.begin(); it != slot.inflight.end(); ++it) {
+      drop(it->second);
+    }
+    slot.inflight.clear();
+    if (slot.waiting) {
+      drop(slot.waiting);
+      slot.waiting = nullptr;
+    }
+    slot.connecting = false;
+    slot.rxPtr = 0;
   }
 }
 
@@ -69,7 +152,15 @@ void *ModbusClientTCP::pHandle(void *p) {
 #endif
 
 void ModbusClientTCP::begin(int coreID) {
+#if IS_LINUX
+  if (MT_loop) {
+    LOG_E("Client is served by an event loop already!");
+    return;
+  }
+#endif
   if (!worker) {
+    // One connector for each pooled connection, so none will have to wait for another's connect
+    MT_connector.begin(MT_pool.size(), MT_pool.size(), coreID);
 #if IS_LINUX
     int rc = pthread_create(&worker, NULL, &pHandle, this);
     if (rc) {
@@ -83,7 +174,11 @@ void ModbusClientTCP::begin(int coreID) {
     char taskName[18];
     snprintf(taskName, 18, "Modbus%02XTCP", instanceCounter);
     // Start task to handle the queue
+#ifdef MODBUS_STATIC_ALLOCATION
+    worker = xTaskCreateStaticPinnedToCore((TaskFunction_t)&handleConnection, taskName, 4096, this, 5, MT_stack, &MT_taskBuffer, coreID >= 0 ? coreID : NULL);
+#else
     xTaskCreatePinnedToCore((TaskFunction_t)&handleConnection, taskName, 4096, this, 5, &worker, coreID >= 0 ? coreID : NULL);
+#endif
     LOG_D("TCP client worker %s started\n", taskName);
 #endif
   } else {
@@ -91,6 +186,26 @@ void ModbusClientTCP::begin(int coreID) {
   }
 }
 
+#if IS_LINUX
+// begin: have the client served by a shared event loop instead of a worker thread of its own
+bool ModbusClientTCP::begin(ModbusClientLoop& loop) {
+  if (worker || MT_loop) {
+    LOG_E("Worker thread has been already started!");
+    return false;
+  }
+  MT_connector.begin(MT_pool.size(), MT_pool.size());
+  MT_loop = &loop;
+  if (!loop.add(this)) {
+    LOG_E("Event loop did not take the client\n");
+    MT_loop = nullptr;
+    MT_connector.end();
+    return false;
+  }
+  LOG_D("TCP client served by event loop.\n");
+  return true;
+}
+#endif
+
 // Set default timeout value (and interval)
 void ModbusClientTCP::setTimeout(uint32_t timeout, uint32_t interval) {
   MT_defaultTimeout = timeout;
@@ -111,17 +226,57 @@ bool ModbusClientTCP::setTarget(IPAddress host, uint16_t port, uint32_t timeout,
 
 // Return number of unprocessed requests in queue
 uint32_t ModbusClientTCP::pendingRequests() {
-  return requests.size();
+  uint32_t pending = queued();
+  for (auto& slot : MT_pool) {
+    pending += slot.inflight.size();
+    if (slot.waiting) pending++;
+  }
+  return pending;
+}
+
+// Set maximum number of requests sent on a connection without having received their responses
+void ModbusClientTCP::setMaxInflightRequests(uint32_t maxInflightRequests) {
+  MT_maxInflight = maxInflightRequests ? maxInflightRequests : 1;
+}
+
+// Add another Client object to the connection pool
+bool ModbusClientTCP::addConnection(Client& client) {
+  // Not while the worker is using the pool
+#if IS_LINUX
+  if (worker || MT_loop) {
+#else
+  if (worker) {
+#endif
+    LOG_E("Connections must be added before begin()\n");
+    return false;
+  }
+  // Refuse duplicates
+  for (auto& slot : MT_pool) {
+    if (slot.client == &client) return false;
+  }
+  MT_pool.emplace_back(&client);
+  LOG_D("Connection pool size now %d\n", MT_pool.size());
+  return true;
+}
+
+// Set time in ms after which connections without traffic are closed
+void ModbusClientTCP::setIdleTimeout(uint32_t idleTimeout) {
+  MT_idleTimeout = idleTimeout;
 }
 
 // Base addRequest for preformatted ModbusMessage and last set target
 Error ModbusClientTCP::addRequestM(ModbusMessage msg, uint32_t token) {
+  return addRequestP(std::move(msg), token, RequestOptions());
+}
+
+// addRequest with queue options
+Error ModbusClientTCP::addRequestP(ModbusMessage msg, uint32_t token, RequestOptions o) {
   Error rc = SUCCESS;        // Return value
 
   // Add it to the queue, if valid
   if (msg) {
     // Queue add successful?
-    if (!addToQueue(token, msg, MT_target)) {
+    if (!addToQueue(token, std::move(msg), MT_target, nullptr, o)) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -140,7 +295,7 @@ Error ModbusClientTCP::addRequestMT(ModbusMessage msg, uint32_t token, IPAddress
     // Set up adhoc target 
     TargetHost adhocTarget(targetHost, targetPort, MT_defaultTimeout, MT_defaultInterval);
     // Queue add successful?
-    if (!addToQueue(token, msg, adhocTarget, true)) {
+    if (!addToQueue(token, std::move(msg), adhocTarget)) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -150,18 +305,41 @@ Error ModbusClientTCP::addRequestMT(ModbusMessage msg, uint32_t token, IPAddress
   return rc;
 }
 
+// addRequest with a completion of its own, taking the response instead of the handlers
+Error ModbusClientTCP::addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion) {
+  if (!msg) return EMPTY_MESSAGE;
+  return addToQueue(token, std::move(msg), MT_target, completion) ? SUCCESS : REQUEST_QUEUE_FULL;
+}
+
+// Same for an adhoc target - used by the bridge
+Error ModbusClientTCP::addRequestHT(ModbusMessage msg, uint32_t token, SyncHandle completion, IPAddress targetHost, uint16_t targetPort) {
+  if (!msg) return EMPTY_MESSAGE;
+  TargetHost adhocTarget(targetHost, targetPort, MT_defaultTimeout, MT_defaultInterval);
+  return addToQueue(token, std::move(msg), adhocTarget, completion) ? SUCCESS : REQUEST_QUEUE_FULL;
+}
+
 // Base syncRequest follows the same pattern
 ModbusMessage ModbusClientTCP::syncRequestM(ModbusMessage msg, uint32_t token) {
+  return syncRequestP(std::move(msg), token, RequestOptions());
+}
+
+// syncRequest with queue options
+ModbusMessage ModbusClientTCP::syncRequestP(ModbusMessage msg, uint32_t token, RequestOptions o) {
   ModbusMessage response;
 
   if (msg) {
+    SyncHandle sync = std::make_shared<SyncCompletion>();
+    TargetHost target(MT_target);
+    // The request is moved into the queue - keep what we need of it
+    uint8_t serverID = msg.getServerID();
+    uint8_t functionCode = msg.getFunctionCode();
     // Queue add successful?
-    if (!addToQueue(token, msg, MT_target, true)) {
+    if (!addToQueue(token, std::move(msg), target, sync, o)) {
       // No. Return error after deleting the allocated request.
-      response.setError(msg.getServerID(), msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
     } else {
       // Request is queued - wait for the result.
-      response = waitSync(msg.getServerID(), msg.getFunctionCode(), token);
+      response = waitSync(serverID, functionCode, sync, target.timeout);
     }
   } else {
     response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
@@ -176,13 +354,17 @@ ModbusMessage ModbusClientTCP::syncRequestMT(ModbusMessage msg, uint32_t token,
   if (msg) {
     // Set up adhoc target 
     TargetHost adhocTarget(targetHost, targetPort, MT_defaultTimeout, MT_defaultInterval);
+    SyncHandle sync = std::make_shared<SyncCompletion>();
+    // The request is moved into the queue - keep what we need of it
+    uint8_t serverID = msg.getServerID();
+    uint8_t functionCode = msg.getFunctionCode();
     // Queue add successful?
-    if (!addToQueue(token, msg, adhocTarget, true)) {
+    if (!addToQueue(token, std::move(msg), adhocTarget, sync)) {
       // No. Return error after deleting the allocated request.
-      response.setError(msg.getServerID(), msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
     } else {
       // Request is queued - wait for the result.
-      response = waitSync(msg.getServerID(), msg.getFunctionCode(), token);
+      response = waitSync(serverID, functionCode, sync, adhocTarget.timeout);
     }
   } else {
     response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
@@ -190,24 +372,42 @@ ModbusMessage ModbusClientTCP::syncRequestMT(ModbusMessage msg, uint32_t token,
   return response;
 }
 
-// addToQueue: send freshly created request to queue
-bool ModbusClientTCP::addToQueue(uint32_t token, ModbusMessage request, TargetHost target, bool syncReq) {
+// addToQueue: send freshly created request to the queue of its target and priority lane
+// The request goes into the inbox, for the worker to put it into its target's queue. No lock is
+// taken, so callers will not wait for each other or for the worker.
+bool ModbusClientTCP::addToQueue(uint32_t token, ModbusMessage request, TargetHost target, SyncHandle sync, RequestOptions o) {
   bool rc = false;
+  uint8_t l = static_cast<uint8_t>(o.priority);
+  if (l >= MODBUS_PRIORITIES) l = static_cast<uint8_t>(RequestPriority::BULK);
   // Did we get one?
-  LOG_D("Queue size: %d\n", (uint32_t)requests.size());
+  LOG_D("Queue size: %d\n", queued());
   HEXDUMP_D("Enqueue", request.data(), request.size());
   if (request) {
-    if (requests.size()<MT_qLimit) {
-      RequestEntry *re = new RequestEntry(token, request, target, syncReq);
-      // inject proper transactionID
-      re->head.transactionID = messageCount++;
-      re->head.len = request.size();
-      // Safely lock queue and push request to queue
-      rc = true;
-      LOCK_GUARD(lockGuard, qLock);
-      requests.push(re);
+    // Room left in the lane, for all targets?
+    if (claim(MT_queued[l], 1, laneLimit(l, MT_qLimit))) {
+#ifdef MODBUS_STATIC_ALLOCATION
+      RequestEntry *re = MT_slots.create(token, std::move(request), target, sync, o.ttl);
+#else
+      RequestEntry *re = new RequestEntry(token, std::move(request), target, sync, o.ttl);
+#endif
+      if (re) {
+        // inject proper transactionID
+        re->head.transactionID = messageCount++;
+        re->head.len = re->msg.size();
+        re->lane = l;
+        rc = MT_inbox.push(re);
+        if (!rc) discard(re);
+      }
+      // No request slot or inbox full? Then give back the room claimed
+      if (!rc) MT_queued[l]--;
     }
   }
+  // Tell the worker there is something to do
+  if (rc) MT_wakeup.signal();
+#if IS_LINUX
+  // The event loop has a wakeup of its own
+  if (rc && MT_loop) MT_loop->wake(this);
+#endif
 
   return rc;
 }
@@ -215,206 +415,584 @@ bool ModbusClientTCP::addToQueue(uint32_t token, ModbusMessage request, TargetHo
 // handleConnection: worker task
 // This was created in begin() to handle the queue entries
 void ModbusClientTCP::handleConnection(ModbusClientTCP *instance) {
-  bool doNotPop;
-  unsigned long lastRequest = millis();
-
+#if IS_LINUX
+  std::vector<int> fds;
+#endif
   // Loop forever - or until task is killed
   while (1) {
-    // Do we have a request in queue?
-    if (!instance->requests.empty()) {
-      // Yes. pull it.
-      RequestEntry *request = instance->requests.front();
-      doNotPop = false;
-      LOG_D("Got request from queue\n");
-
-      // Do we have a connection open?
-      if (instance->MT_client.connected()) {
-        // Empty the RX buffer in case there is a stray response left
-        while (instance->MT_client.read() != -1) {}
-        // check if lastHost/lastPort!=host/port off the queued request
-        if (instance->MT_lastTarget != request->target) {
-          // It is different. Disconnect it.
-          instance->MT_client.stop();
-          LOG_D("Target different, disconnect\n");
-          delay(1);  // Give scheduler room to breathe
-        } else {
-          // it is the same host/port.
-          // Give it some slack to get ready again
-          while (millis() - lastRequest < request->target.interval) { delay(1); }
+    // Do one round of sending and receiving
+    if (!instance->handleRequests()) {
+      // Nothing done. Sleep until a request comes in, a connect is done or the next timeout,
+      // queue interval or idle close is due
+      uint32_t due = instance->nextDue();
+      if (due > 1000) due = 1000;
+#if IS_LINUX
+      // A response coming in will wake us up as well
+      fds.clear();
+      instance->sockets(fds);
+      instance->MT_wakeup.wait(due, fds);
+#else
+      // The Client interface has no handle to wait on - look for responses again after a tick
+      if (due > 1 && instance->isBusy()) due = 1;
+      instance->MT_wakeup.wait(due);
+#endif
+    }
+  }
+}
+
+// handleRequests: one turn of the worker loop. Returns true if anything was done
+bool ModbusClientTCP::handleRequests() {
+  bool didSomething = false;
+
+  // Close connections that have been idle for too long
+  closeIdleConnections();
+
+  // Take over the requests queued since the last turn
+  takeInbox();
+
+  // 1. Send the requests that were waiting for their connections to be opened
+  if (finishConnects()) didSomething = true;
+
+  // 2. Send the next request of each target, as far as connections are available
+  if (dispatchRequests()) didSomething = true;
+
+  // 3. Collect responses and check timeouts on all connections with requests in flight
+  for (auto& slot : MT_pool) {
+    if (slot.inflight.empty()) continue;
+    // The connector has the client while it is opening the connection again
+    if (!slot.waiting && receive(slot)) didSomething = true;
+    if (checkTimeouts(slot)) didSomething = true;
+  }
+
+#ifndef MODBUS_STATIC_ALLOCATION
+  // 4. Drop the queues of targets that have nothing left to send
+  for (uint16_t i = 0; i < MT_queues.size();) {
+    if (MT_queues[i].lane() >= MODBUS_PRIORITIES) {
+      MT_queues.erase(MT_queues.begin() + i);
+      // Keep the round robin position on the same queue
+      if (i < MT_nextQueue) MT_nextQueue--;
+    } else {
+      ++i;
+    }
+  }
+  if (MT_nextQueue >= MT_queues.size()) MT_nextQueue = 0;
+#endif
+  return didSomething;
+}
+
+// takeInbox: move the requests queued since into their target queues. Only the worker may call it
+// Reads are merged here into those waiting in the queue, if coalescing is on, or fused with a write
+void ModbusClientTCP::takeInbox() {
+  RequestEntry *re = nullptr;
+  while (MT_inbox.pop(re)) {
+    uint8_t l = re->lane;
+    // Find the queue of the target
+    auto q = MT_queues.begin();
+    for (; q != MT_queues.end(); ++q) {
+      if (q->target == re->target) break;
+    }
+    bool merged = false;
+    // Read back from a server taking FC 0x17, right behind a write to it?
+    if (fusing(re->msg.getServerID()) && q != MT_queues.end() && !q->requests[l].empty()) {
+      RequestEntry *last = q->requests[l].back();
+      if (fuse(last->msg, last->token, last->sync, last->parts, re->msg, re->token, re->sync)) {
+        last->head.len = last->msg.size();
+        last->ttl = mergeTTL(last->queuedTime, last->ttl, re->ttl);
+        merged = true;
+      }
+    }
+    // May it be merged with a read waiting in the queue?
+    if (!merged && coalescing && q != MT_queues.end() && isCoalescable(re->msg)) {
+      // Look from the latest backwards, but not beyond other requests to the same server
+      for (auto it = q->requests[l].rbegin(); it != q->requests[l].rend(); ++it) {
+        RequestEntry *qe = *it;
+        if (coalesce(qe->msg, qe->token, qe->sync, qe->parts, re->msg, re->token, re->sync)) {
+          qe->head.len = qe->msg.size();
+          // The merged request has to live as long as the new one needs
+          qe->ttl = mergeTTL(qe->queuedTime, qe->ttl, re->ttl);
+          merged = true;
+          break;
         }
+        if (qe->msg.getServerID() == re->msg.getServerID() && !isCoalescable(qe->msg)) break;
       }
-      // if client is disconnected (we will have to switch hosts)
-      if (!instance->MT_client.connected()) {
-        // Serial.println("Client reconnecting");
-        // It is disconnected. connect to host/port from queue
-        instance->MT_client.connect(request->target.host, request->target.port);
-        LOG_D("Target connect (%d.%d.%d.%d:%d).\n", request->target.host[0], request->target.host[1], request->target.host[2], request->target.host[3], request->target.port);
-
-        delay(1);  // Give scheduler room to breathe
+    }
+    if (merged) {
+      // It does not take room in the lane any more
+      MT_queued[l]--;
+      discard(re);
+      continue;
+    }
+    // No queue for this target yet?
+    if (q == MT_queues.end()) {
+#ifdef MODBUS_STATIC_ALLOCATION
+      // Take over an empty one
+      for (q = MT_queues.begin(); q != MT_queues.end(); ++q) {
+        if (q->lane() >= MODBUS_PRIORITIES) break;
       }
-      ModbusMessage response;
-      // Are we connected (again)?
-      if (instance->MT_client.connected()) {
-        LOG_D("Is connected. Send request.\n");
-        // Yes. Send the request via IP
-        instance->send(request);
-
-        // Get the response - if any
-        response = instance->receive(request);
-
-        // Did we get a normal response?
-        if (response.getError()==SUCCESS) {
-          LOG_D("Data response.\n");
-          // Yes. Is it a synchronous request?
-          if (request->isSyncRequest) {
-            // Yes. Put the response into the response map
-            {
-              LOCK_GUARD(sL, instance->syncRespM);
-              instance->syncResponse[request->token] = response;
-            }
-          // No, async request. Do we have an onResponse handler?
-          } else if (instance->onResponse) {
-            // Yes. Call it.
-            instance->onResponse(response, request->token);
-          // No, but do we have an onData handler registered?
-          } else if (instance->onData) {
-            // Yes. call it
-            instance->onData(response, request->token);
-          } else {
-            LOG_D("No handler for response!\n");
-          }
+      if (q == MT_queues.end()) {
+        // All are busy with other targets - refuse the request
+        MT_queued[l]--;
+        ModbusMessage response;
+        response.setError(re->msg.getServerID(), re->msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+        respond(re, response);
+        discard(re);
+        continue;
+      }
+      q->target = re->target;
+#else
+      // Create one
+      MT_queues.push_back(TargetQueue(re->target));
+      q = MT_queues.end() - 1;
+#endif
+    }
+    q->requests[l].push_back(re);
+  }
+}
+
+// queued: number of requests not sent yet
+uint32_t ModbusClientTCP::queued() {
+  uint32_t n = 0;
+  for (auto& q : MT_queued) {
+    n += q;
+  }
+  return n;
+}
+
+// isBusy: return true if there are requests waiting for a response
+bool ModbusClientTCP::isBusy() {
+  for (auto& slot : MT_pool) {
+    if (!slot.inflight.empty() || slot.waiting) return true;
+  }
+  return false;
+}
+
+// dispatchRequests: send the next request of each target queue, round robin. Returns true if any was sent
+// Each target will get one request per pass, so a busy or unresponsive target will not hold back
+// the requests for others. Passes are repeated until no connection will take another request.
+// Each target's request is taken from its highest priority lane, and the targets with requests of
+// higher priority are served first in each pass.
+bool ModbusClientTCP::dispatchRequests() {
+  bool didSomething = false;
+  bool sent = true;
+
+  while (sent) {
+    sent = false;
+    uint16_t queues = MT_queues.size();
+
+    for (uint16_t n = 0; n < queues * MODBUS_PRIORITIES; ++n) {
+      RequestEntry *request = nullptr;
+      ConnectionSlot *slot = nullptr;
+      RequestEntry *expiredRequest = nullptr;
+      uint8_t lane = n / queues;
+      {
+        // Queues only are touched by this task, so the indexes are stable while we are here
+        TargetQueue& q = MT_queues[(MT_nextQueue + n) % queues];
+        if (q.lane() != lane) continue;
+        RequestEntry *front = q.requests[lane].front();
+        // Has it waited too long? Then take it off the queue unsent
+        if (expired(front->queuedTime, front->ttl)) {
+          q.requests[lane].pop_front();
+          MT_queued[lane]--;
+          expiredRequest = front;
         } else {
-          // No, something went wrong. All we have is an error
-          LOG_D("Error response.\n");
-          // Count it
-          {
-            LOCK_GUARD(responseCnt, instance->countAccessM);
-            instance->errorCount++;
-          }
-          // Is it a synchronous request?
-          if (request->isSyncRequest) {
-            // Yes. Put the response into the response map
-            {
-              LOCK_GUARD(sL, instance->syncRespM);
-              instance->syncResponse[request->token] = response;
-            }
-          // No, but do we have an onResponse handler?
-          } else if (instance->onResponse) {
-            // Yes, call it.
-            instance->onResponse(response, request->token);
-          // No, but do we have an onError handler?
-          } else if (instance->onError) {
-            // Yes. Forward the error code to it
-            instance->onError(response.getError(), request->token);
-          } else {
-            LOG_D("No onError handler\n");
-          }
+          // Hold back a read for a while, others may be merged into it
+          if (coalesceHold && isCoalescable(front->msg) && millis() - front->queuedTime < coalesceHold) continue;
+          // Is there a connection we may use for this target?
+          slot = getConnection(q.target);
+          if (!slot) continue;
+          // Yes. Is it taking another request right now?
+          if (slot->waiting || slot->inflight.size() >= MT_maxInflight) continue;
+          // Same target connected? Then give it some slack to get ready again
+          if (slot->target == q.target && slot->client->connected()
+           && millis() - slot->lastUsed < q.target.interval) continue;
+          // All set - take the request off the queue
+          request = front;
+          request->trace.mark(TracePoint::DEQUEUE);
+          q.requests[lane].pop_front();
+          MT_queued[lane]--;
         }
-        //   set lastHost/lastPort tp host/port
-        instance->MT_lastTarget = request->target;
-      } else {
-        // Oops. Connection failed
-        response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), IP_CONNECTION_FAILED);
-        // Is it a synchronous request?
-        if (request->isSyncRequest) {
-          // Yes. Put the response into the response map
-          {
-            LOCK_GUARD(sL, instance->syncRespM);
-            instance->syncResponse[request->token] = response;
-          }
-        // No, but do we have an onResponse handler?
-        } else if (instance->onResponse) {
-          // Yes, call it.
-          instance->onResponse(response, request->token);
-        // Finally, do we have an onError handler?
-        } else if (instance->onError) {
-          // Yes. Forward the error code to it
-          instance->onError(IP_CONNECTION_FAILED, request->token);
+      }
+      sent = true;
+
+      // Expired? Report it instead of sending
+      if (expiredRequest) {
+        LOG_D("Request %04X expired\n", expiredRequest->head.transactionID);
+        ModbusMessage response;
+        response.setError(expiredRequest->msg.getServerID(), expiredRequest->msg.getFunctionCode(), REQUEST_EXPIRED);
+        respond(expiredRequest, response);
+        discard(expiredRequest);
+        continue;
+      }
+
+      // Server backed off after timeouts? Then refuse the request instead of sending
+      if (!admitted(deviceOf(request))) {
+        LOG_D("Server %d backed off, request %04X refused\n", request->msg.getServerID(), request->head.transactionID);
+        ModbusMessage response;
+        response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), SERVER_BACKED_OFF);
+        respond(request, response);
+        discard(request);
+        continue;
+      }
+
+      // Switching the connection to another target?
+      if (slot->target != request->target) {
+        // Yes. Evict the old connection, if still open
+        if (slot->client->connected()) {
+          slot->client->stop();
+          LOG_D("Target different, disconnect\n");
+          delay(1);  // Give scheduler room to breathe
         }
+        slot->target = request->target;
       }
-      // Clean-up time. 
-      if (!doNotPop)
-      {
-        // Safely lock the queue
-        LOCK_GUARD(lockGuard, instance->qLock);
-        // Remove the front queue entry
-        instance->requests.pop();
-        // Delete request
-        delete request;
-        LOG_D("Request popped from queue.\n");
+      // Not connected (any more)?
+      if (!slot->client->connected()) {
+        // Drop what may be left in the receive buffer and connect to host/port of the target
+        slot->rxPtr = 0;
+        LOG_D("Target connect (%d.%d.%d.%d:%d).\n", request->target.host[0], request->target.host[1], request->target.host[2], request->target.host[3], request->target.port);
+        // The connector will do it, the request will be sent in finishConnects() then
+        if (openConnection(*slot, request)) continue;
+        // No connector - we will have to wait for the connect here
+        slot->client->connect(request->target.host, request->target.port);
+        delay(1);  // Give scheduler room to breathe
       }
-      lastRequest = millis();
-    } else {
-      delay(1);  // Give scheduler room to breathe
+      transmit(*slot, request);
     }
+    if (sent) didSomething = true;
   }
+
+  // Start the next turn with the following queue
+  if (!MT_queues.empty()) MT_nextQueue = (MT_nextQueue + 1) % MT_queues.size();
+  return didSomething;
 }
 
-// send: send request via Client connection
-void ModbusClientTCP::send(RequestEntry *request) {
-  // We have a established connection here, so we can write right away.
-  // Move tcpHead and request into one continuous buffer, since the very first request tends to 
-  // take too long to be sent to be recognized.
-  ModbusMessage m;
-  m.add((const uint8_t *)request->head, 6);
-  m.append(request->msg);
+// getConnection: find the pooled connection to use for target. Returns nullptr if all are busy
+ModbusClientTCP::ConnectionSlot *ModbusClientTCP::getConnection(const TargetHost& target) {
+  ConnectionSlot *use = nullptr;
+  unsigned long longestIdle = 0;
 
-  MT_client.write(m.data(), m.size());
-  // Done. Are we?
-  MT_client.flush();
-  HEXDUMP_V("Request packet", m.data(), m.size());
-}
-
-// receive: get response via Client connection
-ModbusMessage ModbusClientTCP::receive(RequestEntry *request) {
-  unsigned long lastMillis = millis();     // Timer to check for timeout
-  bool hadData = false;               // flag data received
-  const uint16_t dataLen(300);        // Modbus Packet supposedly will fit (260<300)
-  uint8_t data[dataLen];              // Local buffer to collect received data
-  uint16_t dataPtr = 0;               // Pointer into data
-  ModbusMessage response;             // Response structure to be returned
-
-  // wait for packet data, overflow or timeout
-  while (millis() - lastMillis < request->target.timeout && dataPtr < dataLen && !hadData) {
-    // Is there data waiting?
-    if (MT_client.available()) {
-      // Yes. catch as much as is there and fits into buffer
-      while (MT_client.available() && dataPtr < dataLen) {
-        data[dataPtr++] = MT_client.read();
+  for (auto& slot : MT_pool) {
+    // Is there a connection to the target already, one being opened or one waiting for its responses?
+    if (slot.target == target && (slot.waiting || !slot.inflight.empty() || slot.client->connected())) {
+      return &slot;
+    }
+  }
+  // No. Take a closed one or else the least recently used, as long as no responses are awaited on it
+  for (auto& slot : MT_pool) {
+    if (slot.waiting || !slot.inflight.empty()) continue;
+    if (!slot.client->connected()) return &slot;
+    if (!use || millis() - slot.lastUsed > longestIdle) {
+      use = &slot;
+      longestIdle = millis() - slot.lastUsed;
+    }
+  }
+  return use;
+}
+
+// openConnection: hand the connect for request to the connector, to keep the worker free for the others
+bool ModbusClientTCP::openConnection(ConnectionSlot& slot, RequestEntry *request) {
+  if (!MT_connector.isRunning()) return false;
+  slot.waiting = request;
+  slot.connecting = true;
+  ConnectionSlot *s = &slot;
+  bool rc = MT_connector.submit([this, s]() {
+    // The target will not change while the request is waiting
+    s->client->connect(s->target.host, s->target.port);
+    s->connecting = false;
+    // Tell the worker the connect is done
+    MT_wakeup.signal();
+#if IS_LINUX
+    if (MT_loop) MT_loop->wake(this);
+#endif
+  });
+  if (!rc) {
+    slot.waiting = nullptr;
+    slot.connecting = false;
+  }
+  return rc;
+}
+
+// finishConnects: send the requests that were waiting for the connector
+bool ModbusClientTCP::finishConnects() {
+  bool didSomething = false;
+  for (auto& slot : MT_pool) {
+    if (!slot.waiting || slot.connecting) continue;
+    RequestEntry *request = slot.waiting;
+    slot.waiting = nullptr;
+    transmit(slot, request);
+    didSomething = true;
+  }
+  return didSomething;
+}
+
+// transmit: send request on the slot's connection, or report it as failed if the connect did not work
+void ModbusClientTCP::transmit(ConnectionSlot& slot, RequestEntry *request) {
+  slot.lastUsed = millis();
+
+  // Are we connected (again)?
+  if (slot.client->connected()) {
+    // Yes. Send the request and keep it for the response to come
+    request->trace.mark(TracePoint::SEND_START);
+    send(slot, request);
+    request->trace.mark(TracePoint::SEND_END);
+    request->sentTime = millis();
+    request->timeout = requestTimeout(deviceOf(request), request->target.timeout);
+    if (request->sync) request->sync->sent();
+    for (auto& p : request->parts) {
+      if (p.sync) p.sync->sent();
+    }
+    slot.inflight[request->head.transactionID] = request;
+    MT_lastTarget = request->target;
+    LOG_D("Request %04X sent, %d in flight\n", request->head.transactionID, slot.inflight.size());
+  } else {
+    // Oops. Connection failed
+    ModbusMessage response;
+    response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), IP_CONNECTION_FAILED);
+    respond(request, response);
+    discard(request);
+  }
+}
+
+// closeIdleConnections: close pooled connections without traffic for longer than the idle timeout
+void ModbusClientTCP::closeIdleConnections() {
+  if (!MT_idleTimeout) return;
+  for (auto& slot : MT_pool) {
+    // Do not close connections while responses are awaited on them or the connector has them
+    if (slot.waiting || !slot.inflight.empty()) continue;
+    if (slot.client->connected() && millis() - slot.lastUsed > MT_idleTimeout) {
+      LOG_D("Closing idle connection to %d.%d.%d.%d:%d\n", slot.target.host[0], slot.target.host[1], slot.target.host[2], slot.target.host[3], slot.target.port);
+      slot.client->stop();
+    }
+  }
+}
+
+// nextDue: ms until handleRequests() has to be called again, if no response comes in before
+uint32_t ModbusClientTCP::nextDue() {
+  uint32_t due = UINT32_MAX;
+  unsigned long now = millis();
+
+  for (auto& slot : MT_pool) {
+    // Responses to time out
+    for (auto& it : slot.inflight) {
+      uint32_t waited = now - it.second->sentTime;
+      uint32_t left = (waited < it.second->timeout) ? it.second->timeout - waited : 0;
+      if (left < due) due = left;
+    }
+    // Idle connections to be closed. A closed one has been idle at least that long already.
+    // Those being opened will wake us up when done
+    if (MT_idleTimeout && !slot.waiting && slot.inflight.empty() && now - slot.lastUsed <= MT_idleTimeout) {
+      uint32_t left = MT_idleTimeout - (now - slot.lastUsed) + 1;
+      if (left < due) due = left;
+    }
+  }
+
+  // Requests held back in the queues. Those waiting for a connection to take them will
+  // be sent after a response came in or timed out
+  for (auto& q : MT_queues) {
+    uint8_t l = q.lane();
+    if (l >= MODBUS_PRIORITIES) continue;
+    RequestEntry *front = q.requests[l].front();
+    uint32_t queued = now - front->queuedTime;
+    // Expiry
+    if (front->ttl) {
+      uint32_t left = (queued < front->ttl) ? front->ttl - queued : 0;
+      if (left < due) due = left;
+    }
+    // Hold for coalescing
+    if (coalesceHold && isCoalescable(front->msg) && queued < coalesceHold) {
+      uint32_t left = coalesceHold - queued;
+      if (left < due) due = left;
+    }
+    // Interval to the target's connection
+    if (q.target.interval) {
+      for (auto& slot : MT_pool) {
+        if (slot.target == q.target && now - slot.lastUsed < q.target.interval) {
+          uint32_t left = q.target.interval - (now - slot.lastUsed);
+          if (left < due) due = left;
+        }
       }
-      // Register data received
-      hadData = true;
-      // Rewind EOT and timeout timers
-      lastMillis = millis();
-    }
-    delay(1); // Give scheduler room to breathe
-  }
-  // Did we get some data?
-  if (hadData) {
-    LOG_D("Received response.\n");
-    HEXDUMP_V("Response packet", data, dataPtr);
-    // Yes. check it for validity
-    // First transactionID and protocolID shall be identical, length has to match the remainder.
-    ModbusTCPhead head(request->head.transactionID, request->head.protocolID, dataPtr - 6);
-    // Matching head?
-    if (memcmp((const uint8_t *)head, data, 6)) {
-      // No. return Error response
-      response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), TCP_HEAD_MISMATCH);
+    }
+  }
+  return due;
+}
+
+#if IS_LINUX
+// sockets: add the sockets of the connections waiting for responses to fds
+void ModbusClientTCP::sockets(std::vector<int>& fds) {
+  for (auto& slot : MT_pool) {
+    // A connection closed by the server would be readable all the time - leave that to the timeouts
+    if (!slot.waiting && !slot.inflight.empty() && slot.client->fd() >= 0 && slot.client->connected()) {
+      fds.push_back(slot.client->fd());
+    }
+  }
+}
+#endif
+
+// drop: discard a request that will not be processed any more
+void ModbusClientTCP::drop(RequestEntry *request) {
+  // Do not leave a syncRequest caller waiting
+  ModbusMessage response;
+  response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), UNDEFINED_ERROR);
+  if (request->sync) request->sync->complete(response);
+  for (auto& p : request->parts) {
+    if (p.sync) p.sync->complete(response);
+  }
+  discard(request);
+}
+
+// discard: free a request that is done with
+void ModbusClientTCP::discard(RequestEntry *request) {
+#ifdef MODBUS_STATIC_ALLOCATION
+  MT_slots.destroy(request);
+#else
+  delete request;
+#endif
+}
+
+// respond: hand over the response to a request to the waiting syncRequest or the user callbacks
+void ModbusClientTCP::respond(RequestEntry *request, ModbusMessage& response) {
+  // Did we get a normal response?
+  if (response.getError() == SUCCESS) {
+    LOG_D("Data response.\n");
+  } else {
+    // No, something went wrong. All we have is an error
+    LOG_D("Error response.\n");
+  }
+  // Count it
+  countResponse(request->msg, response);
+  // Hand it over - split up again, if it was coalesced from several reads
+  Error error = response.getError();
+  ModbusDevice device = deviceOf(request);
+  learn(device, request->trace, error);
+  request->trace.mark(TracePoint::DISPATCH);
+  if (request->parts.empty()) {
+    if (!filtered(device, request->token, request->sync, request->msg, response)) deliver(request->token, request->sync, response);
+  } else {
+    deliverParts(device, request->parts, request->msg, response);
+  }
+  traceDone(request->trace, request->token, request->msg, error);
+}
+
+// deviceOf: the server a request is going to, for the adaptive timeouts
+ModbusDevice ModbusClientTCP::deviceOf(const RequestEntry *request) {
+  const IPAddress& h = request->target.host;
+  uint32_t host = (static_cast<uint32_t>(h[0]) << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+  return ModbusDevice(request->msg.getServerID(), host, request->target.port);
+}
+
+// checkTimeouts: report requests on a pooled connection that did not get a response in time
+bool ModbusClientTCP::checkTimeouts(ConnectionSlot& slot) {
+  bool didSomething = false;
+
+  for (auto it = slot.inflight.begin(); it != slot.inflight.end();) {
+    RequestEntry *request = it->second;
+    if (millis() - request->sentTime >= request->timeout) {
+      LOG_D("Request %04X timed out\n", it->first);
+      ModbusMessage response;
+      response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), TIMEOUT);
+      respond(request, response);
+      discard(request);
+      it = slot.inflight.erase(it);
+      didSomething = true;
+    } else {
+      ++it;
+    }
+  }
+  return didSomething;
+}
+
+// receive: collect data from a pooled connection and process all complete responses
+// Responses may come in pieces or several at once - the MBAP length tells where each one ends.
+bool ModbusClientTCP::receive(ConnectionSlot& slot) {
+  bool hadData = false;
+
+  // Collect what is there and fits into the buffer
+  while (slot.rxPtr < sizeof(slot.rxBuffer)) {
+    int avail = slot.client->available();
+    if (avail <= 0) break;
+    uint16_t room = sizeof(slot.rxBuffer) - slot.rxPtr;
+    int got = slot.client->read(slot.rxBuffer + slot.rxPtr, (avail < room) ? avail : room);
+    if (got <= 0) break;
+    slot.rxLast = micros();
+    slot.rxLastStart = slot.rxPtr;
+    if (!slot.rxPtr) slot.rxFirst = slot.rxLast;
+    slot.rxPtr += got;
+    hadData = true;
+  }
+  if (hadData) slot.lastUsed = millis();
+
+  // Process all complete responses in the buffer
+  uint16_t pos = 0;
+  while (pos < slot.rxPtr) {
+    const uint8_t *frame = slot.rxBuffer + pos;
+    uint16_t frameLength = TCPutils::frameLength(frame, slot.rxPtr - pos);
+    // Sane MBAP header?
+    if (frameLength == TCPutils::INVALID_FRAME) {
+      // No. We have lost synchronization - drop all data
+      LOG_W("Invalid TCP head, dropping %d bytes\n", slot.rxPtr - pos);
+      pos = slot.rxPtr;
+      break;
+    }
+    // Is the response complete?
+    if (!frameLength || slot.rxPtr - pos < frameLength) break;
+
+    HEXDUMP_V("Response packet", frame, frameLength);
+    // A frame starting in the latest read came with that, all others were there with the first
+    uint32_t firstByte = (pos >= slot.rxLastStart) ? slot.rxLast : slot.rxFirst;
+    if (capture) capture->add(ModbusCapture::TCP_RX, frame, frameLength, nullptr, 0, firstByte);
+    uint16_t transactionID = (frame[0] << 8) | frame[1];
+    // Yes. Find the matching request
+    auto it = slot.inflight.find(transactionID);
+    if (it != slot.inflight.end()) {
+      RequestEntry *request = it->second;
+      request->trace.mark(TracePoint::FIRST_BYTE, firstByte);
+      request->trace.mark(TracePoint::FRAME_COMPLETE);
+      ModbusMessage response;
       // If the server id does not match that of the request, report error
-    } else if (data[6] != request->msg.getServerID()) {
-      response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), SERVER_ID_MISMATCH);
+      if (frame[6] != request->msg.getServerID()) {
+        response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), SERVER_ID_MISMATCH);
       // If the function code does not match that of the request, report error
-    } else if ((data[7] & 0x7F) != request->msg.getFunctionCode()) {
-      response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), FC_MISMATCH);
+      } else if ((frame[7] & 0x7F) != request->msg.getFunctionCode()) {
+        response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), FC_MISMATCH);
+      } else {
+        // Looks good.
+        response.add(frame + 6, frameLength - 6);
+      }
+      respond(request, response);
+      discard(request);
+      slot.inflight.erase(it);
     } else {
-      // Looks good.
-      response.add(data + 6, dataPtr - 6);
+      // Late or stray response - ignore it
+      LOG_W("No request for transaction ID %04X\n", transactionID);
     }
-  } else {
-    // No, timeout must have struck
-    response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), TIMEOUT);
+    pos += frameLength;
   }
-  return response;
+  // Keep the incomplete rest for the next turn
+  if (pos) {
+    slot.rxPtr -= pos;
+    if (slot.rxPtr) memmove(slot.rxBuffer, slot.rxBuffer + pos, slot.rxPtr);
+    // Keep the read times in line. A rest starting before the latest read keeps the time of the first one
+    if (slot.rxLastStart >= pos) {
+      slot.rxLastStart -= pos;
+    } else {
+      slot.rxFirst = slot.rxLast;
+      slot.rxLastStart = 0;
+    }
+  }
+  return hadData;
+}
+
+// send: send request via a pooled connection
+void ModbusClientTCP::send(ConnectionSlot& slot, RequestEntry *request) {
+  // We have a established connection here, so we can write right away.
+  // tcpHead and request have to go out together, since the very first request tends to
+  // take too long to be sent to be recognized. TCPutils will take care of that.
+  const uint8_t *head = (const uint8_t *)request->head;
+  if (capture) capture->add(ModbusCapture::TCP_TX, head, 6, request->msg.data(), request->msg.size());
+  TCPutils::writeFrame(*(slot.client), head, request->msg.data(), request->msg.size());
+  // Done. Are we?
+  slot.client->flush();
+  HEXDUMP_V("Request head", head, 6);
+  HEXDUMP_V("Request packet", request->msg.data(), request->msg.size());
 }
 
 #endif
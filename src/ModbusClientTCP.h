@@ -13,9 +13,17 @@
 #endif
 
 #include "ModbusClient.h"
+#include "ModbusWakeup.h"
+#include "ModbusRing.h"
+#include "ModbusWorkerPool.h"
 #include "Client.h"
+#if IS_LINUX
+#include "ModbusClientLoop.h"
+#endif
 #include <queue>
+#include <deque>
 #include <vector>
+#include <map>
 using std::queue;
 
 #define TARGETHOSTINTERVAL 10
@@ -35,6 +43,12 @@ public:
   // begin: start worker task
   void begin(int coreID = -1);
 
+#if IS_LINUX
+  // begin: have the client served by a shared event loop instead of a worker thread of its own.
+  // Returns false if the loop could not take it
+  bool begin(ModbusClientLoop& loop);
+#endif
+
   // end: stop worker task
   void end();
 
@@ -47,6 +61,23 @@ public:
   // Return number of unprocessed requests in queue
   uint32_t pendingRequests();
 
+  // Set maximum number of requests sent on a connection without having received their responses.
+  // 1 (default) is the plain send-and-wait mode. Higher values will pipeline requests to the
+  // same target host and match the responses by their transaction IDs. A response with an unknown
+  // transaction ID is dropped as a late or stray one - the request it may have been meant for will time out.
+  void setMaxInflightRequests(uint32_t maxInflightRequests);
+
+  // Add another Client object to the connection pool. Requests to a target host that already has
+  // an open connection in the pool will reuse it. If all are in use, the least recently used idle
+  // connection will be closed for the new target. Different target hosts are served in parallel,
+  // as far as there are connections available. Connections are opened by a connector task of
+  // their own, so a target that is slow to answer the connect will not hold up the others.
+  // Add all clients before calling begin()!
+  bool addConnection(Client& client);
+
+  // Set time in ms after which connections without traffic are closed. 0 (default) keeps them open
+  void setIdleTimeout(uint32_t idleTimeout);
+
 protected:
   // class describing a target server
   struct TargetHost {
@@ -55,7 +86,7 @@ protected:
     uint32_t      timeout;      // Time in ms waiting for a response
     uint32_t      interval;     // Time in ms to wait between requests
     
-    inline TargetHost& operator=(TargetHost& t) {
+    inline TargetHost& operator=(const TargetHost& t) {
       host = t.host;
       port = t.port;
       timeout = t.timeout;
@@ -63,7 +94,7 @@ protected:
       return *this;
     }
     
-    inline TargetHost(TargetHost& t) :
+    inline TargetHost(const TargetHost& t) :
       host(t.host),
       port(t.port),
       timeout(t.timeout),
@@ -83,13 +114,13 @@ protected:
       interval(interval)
     { }
 
-    inline bool operator==(TargetHost& t) {
+    inline bool operator==(const TargetHost& t) const {
       if (host != t.host) return false;
       if (port != t.port) return false;
       return true;
     }
 
-    inline bool operator!=(TargetHost& t) {
+    inline bool operator!=(const TargetHost& t) const {
       if (host != t.host) return true;
       if (port != t.port) return true;
       return false;
@@ -135,29 +166,103 @@ protected:
     uint8_t headRoom[6];        // Buffer to hold MSB-first TCP header
   };
 
+  // RequestEntry: queued request. It owns the request message, which is moved in
   struct RequestEntry {
     uint32_t token;
     ModbusMessage msg;
     TargetHost target;
     ModbusTCPhead head;
-    bool isSyncRequest;
-    RequestEntry(uint32_t t, ModbusMessage m, TargetHost tg, bool syncReq = false) :
+    uint32_t sentTime;
+    uint32_t timeout;           // ms to wait for the response, set when sent
+    SyncHandle sync;            // Completion for syncRequests, empty for all others
+    CoalescedParts parts;       // Original requests, if reads were merged into this one
+    uint32_t queuedTime;        // Time the request was queued
+    uint32_t ttl;               // ms the request may wait to be sent, 0: no limit
+    uint8_t lane;               // Priority lane it is queued in
+    ModbusTrace trace;          // Times of the transaction points passed
+    RequestEntry(uint32_t t, ModbusMessage m, TargetHost tg, SyncHandle s = nullptr, uint32_t l = 0) :
       token(t),
-      msg(m),
+      msg(std::move(m)),
       target(tg),
       head(ModbusTCPhead()),
-      isSyncRequest(syncReq) {}
+      sentTime(0),
+      timeout(0),
+      sync(s),
+      parts(),
+      queuedTime(millis()),
+      ttl(l),
+      lane(0),
+      trace() {
+        trace.mark(TracePoint::ENQUEUE);
+      }
+    // Not copyable - entries are handed around by pointer only
+    RequestEntry(const RequestEntry&) = delete;
+    RequestEntry& operator=(const RequestEntry&) = delete;
+  };
+
+  // TargetQueue: requests waiting to be sent to one target host, by priority lane
+  struct TargetQueue {
+    TargetHost target;                 // Target host the requests are addressed to
+    ModbusLane<RequestEntry *> requests[MODBUS_PRIORITIES];  // Requests in order of arrival
+    explicit TargetQueue(const TargetHost& t, uint16_t capacity = 0) :
+      target(t),
+      requests() {
+#ifdef MODBUS_STATIC_ALLOCATION
+      for (auto& lane : requests) lane.reserve(capacity);
+#endif
+    }
+    // lane: highest priority lane with requests, MODBUS_PRIORITIES if all are empty
+    inline uint8_t lane() const {
+      uint8_t l = 0;
+      while (l < MODBUS_PRIORITIES && requests[l].empty()) l++;
+      return l;
+    }
+  };
+
+  // ConnectionSlot: a pooled Client object, the target host it was connected to and
+  // the requests sent on that connection still waiting for their responses.
+  // While waiting is set, the connector task owns the client - the worker must not touch it then!
+  struct ConnectionSlot {
+    Client       *client;       // Client object for the connection
+    TargetHost    target;       // Target host the client was connected to last
+    unsigned long lastUsed;     // Time of last traffic on the connection
+    std::map<uint16_t, RequestEntry *> inflight;  // Sent requests by transactionID
+    RequestEntry *waiting;      // Request to be sent once the connection is open, nullptr if none
+    std::atomic<bool> connecting;  // Connector is still working on the connection
+    uint8_t       rxBuffer[300];  // Receive buffer to collect responses
+    uint16_t      rxPtr;        // Number of bytes in rxBuffer
+    uint32_t      rxFirst;      // micros() of the read that brought in the start of rxBuffer
+    uint32_t      rxLast;       // micros() of the latest read
+    uint16_t      rxLastStart;  // Position in rxBuffer the latest read went to
+    explicit ConnectionSlot(Client *c) :
+      client(c),
+      target(),
+      lastUsed(0),
+      inflight(),
+      waiting(nullptr),
+      connecting(false),
+      rxPtr(0),
+      rxFirst(0),
+      rxLast(0),
+      rxLastStart(0) {}
   };
 
   // Base addRequest and syncRequest must be present
   Error addRequestM(ModbusMessage msg, uint32_t token);
   ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token);
+  // Variants with a priority lane
+  Error addRequestP(ModbusMessage msg, uint32_t token, RequestOptions o);
+  ModbusMessage syncRequestP(ModbusMessage msg, uint32_t token, RequestOptions o);
   // TCP-specific addition "...MT()" including adhoc target - used by bridge 
   Error addRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort);
   ModbusMessage syncRequestMT(ModbusMessage msg, uint32_t token, IPAddress targetHost, uint16_t targetPort);
+  // Variants with a completion of its own, taking the response instead of the handlers
+  Error addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion);
+  Error addRequestHT(ModbusMessage msg, uint32_t token, SyncHandle completion, IPAddress targetHost, uint16_t targetPort);
 
-  // addToQueue: send freshly created request to queue
-  bool addToQueue(uint32_t token, ModbusMessage request, TargetHost target, bool syncReq = false);
+  // addToQueue: send freshly created request to the queue of its target and priority lane.
+  // The request is moved into the queue entry - pass it by std::move()
+  bool addToQueue(uint32_t token, ModbusMessage request, TargetHost target, SyncHandle sync = nullptr, RequestOptions o = RequestOptions());
 
   // handleConnection: worker task method
   static void handleConnection(ModbusClientTCP *instance);
@@ -165,26 +270,101 @@ protected:
   static void *pHandle(void *p);
 #endif
 
-  // send: send request via Client connection
-  void send(RequestEntry *request);
+  // handleRequests: one turn of the worker loop. Returns true if anything was done
+  bool handleRequests();
+
+  // takeInbox: move the requests queued since into their target queues, merging reads on the way
+  void takeInbox();
+
+  // queued: number of requests not sent yet
+  uint32_t queued();
+
+  // isBusy: return true if there are requests waiting for a response
+  bool isBusy();
+
+  // dispatchRequests: send the next request of each target queue, round robin. Returns true if any was sent
+  bool dispatchRequests();
+
+  // getConnection: find the pooled connection to use for target. Returns nullptr if all are busy
+  ConnectionSlot *getConnection(const TargetHost& target);
+
+  // openConnection: have the connector open slot's connection for request. Returns false if
+  // the connector is not running - the caller has to connect by itself then
+  bool openConnection(ConnectionSlot& slot, RequestEntry *request);
+
+  // finishConnects: send the requests waiting for connections the connector is done with.
+  // Returns true if there were any
+  bool finishConnects();
+
+  // transmit: send request on slot's connection, if open, and keep it for the response.
+  // If the connection could not be opened, the request is answered with IP_CONNECTION_FAILED
+  void transmit(ConnectionSlot& slot, RequestEntry *request);
+
+  // send: send request via a pooled connection
+  void send(ConnectionSlot& slot, RequestEntry *request);
+
+  // receive: collect data from a pooled connection and process all complete responses
+  bool receive(ConnectionSlot& slot);
+
+  // checkTimeouts: report requests on a pooled connection that did not get a response in time
+  bool checkTimeouts(ConnectionSlot& slot);
+
+  // closeIdleConnections: close pooled connections without traffic for longer than the idle timeout
+  void closeIdleConnections();
+
+  // nextDue: ms until handleRequests() has to be called again, if no response comes in before.
+  // UINT32_MAX if there is nothing to wait for
+  uint32_t nextDue();
+
+#if IS_LINUX
+  friend class ModbusClientLoop;
+
+  // sockets: add the sockets of the connections waiting for responses to fds
+  void sockets(std::vector<int>& fds);
+#endif
+
+  // drop: discard a request that will not be processed any more
+  void drop(RequestEntry *request);
+
+  // discard: free a request that is done with
+  void discard(RequestEntry *request);
 
-  // receive: get response via Client connection
-  ModbusMessage receive(RequestEntry *request);
+  // respond: hand over the response to a request to the waiting syncRequest or the user callbacks
+  void respond(RequestEntry *request, ModbusMessage& response);
+
+  // deviceOf: the server a request is going to, for the adaptive timeouts
+  static ModbusDevice deviceOf(const RequestEntry *request);
 
   void isInstance() { return; }   // make class instantiable
-  queue<RequestEntry *> requests;   // Queue to hold requests to be processed
-  #if USE_MUTEX
-  mutex qLock;                    // Mutex to protect queue
-  #endif
+  std::vector<TargetQueue> MT_queues;  // Queues to hold requests to be processed, one per target host
+  uint16_t MT_nextQueue;          // Index of the queue to be served first in the next round
+  std::atomic<uint16_t> MT_queued[MODBUS_PRIORITIES];  // Requests in the inbox and all queues, by priority lane
+  ModbusInbox<RequestEntry *> MT_inbox;  // Requests on their way from the callers to the target queues
+  ModbusWakeup MT_wakeup;         // Wakes up the worker task when a request was queued
   Client& MT_client;              // Client reference for Internet connections (EthernetClient or WifiClient)
+  std::deque<ConnectionSlot> MT_pool;  // Connection pool. MT_client is the first entry
+  ModbusWorkerPool MT_connector;  // Connector tasks, one for each pooled connection
+  uint32_t MT_idleTimeout;        // Time in ms to close idle connections. 0: never
   TargetHost MT_lastTarget;       // last used server
   TargetHost MT_target;           // Description of target server
   uint32_t MT_defaultTimeout;     // Standard timeout value taken if no dedicated was set
   uint32_t MT_defaultInterval;    // Standard interval value taken if no dedicated was set
   uint16_t MT_qLimit;             // Maximum number of requests to accept in queue
+#ifdef MODBUS_STATIC_ALLOCATION
+  ModbusSlots<RequestEntry> MT_slots;  // Preallocated requests, see ModbusRing.h
+#endif
+#if IS_LINUX
+  ModbusClientLoop *MT_loop;      // Shared event loop serving us instead of the worker, if any
+#endif
+  uint32_t MT_maxInflight;        // Maximum number of requests sent without response per connection
+#if HAS_FREERTOS && defined(MODBUS_STATIC_ALLOCATION)
+  StackType_t MT_stack[4096];     // Stack of the worker task
+  StaticTask_t MT_taskBuffer;     // Control block of the worker task
+#endif
 
   // Let any ModbusBridge class use protected members
   template<typename SERVERCLASS> friend class ModbusBridge;
+  friend class ModbusFanOut;
 };
 
 #endif  // HAS_FREERTOS
@@ -18,8 +18,24 @@ ModbusClientTCPasync::ModbusClientTCPasync(IPAddress address, uint16_t port, uin
   MTA_maxInflightRequests(queueLimit),
   MTA_lastActivity(0),
   MTA_state(DISCONNECTED),
+  MTA_rxPtr(0),
+  MTA_rxFirst(0),
+  MTA_timers(),
+#if defined ESP32
+  MTA_ticker(nullptr),
+  MTA_ticking(false),
+  MTA_reconnector(nullptr),
+#endif
   MTA_host(address),
-  MTA_port(port)
+  MTA_port(port),
+  MTA_keepAlive(false),
+  MTA_stayDown(false),
+  MTA_keepIdle(10000),
+  MTA_maxBackoff(30000),
+  MTA_backoff(0),
+  MTA_heartbeatInterval(0),
+  MTA_heartbeat(),
+  MTA_heartbeatPending(false)
     {
       // attach all handlers on async tcp events
       MTA_client.onConnect([](void* i, AsyncClient* c) { (static_cast<ModbusClientTCPasync*>(i))->onConnected(); }, this);
@@ -32,10 +48,42 @@ ModbusClientTCPasync::ModbusClientTCPasync(IPAddress address, uint16_t port, uin
 
       // disable nagle algorithm ref Modbus spec
       MTA_client.setNoDelay(true);
+
+#if defined ESP32
+      // onPoll is called only every 500ms - a timer of its own will catch the timeouts in time
+      esp_timer_create_args_t tickerArgs = {};
+      tickerArgs.callback = [](void* i) { (static_cast<ModbusClientTCPasync*>(i))->handleTimeouts(); };
+      tickerArgs.arg = this;
+      tickerArgs.name = "MBasyncTO";
+      if (esp_timer_create(&tickerArgs, &MTA_ticker) != ESP_OK) {
+        LOG_E("Could not create timeout timer\n");
+        MTA_ticker = nullptr;
+      }
+      // Reconnects in keepAlive mode are timed by another one
+      tickerArgs.callback = [](void* i) { (static_cast<ModbusClientTCPasync*>(i))->reconnect(); };
+      tickerArgs.name = "MBasyncRC";
+      if (esp_timer_create(&tickerArgs, &MTA_reconnector) != ESP_OK) {
+        LOG_E("Could not create reconnect timer\n");
+        MTA_reconnector = nullptr;
+      }
+#endif
     }
 
 // Destructor: clean up queue, task etc.
 ModbusClientTCPasync::~ModbusClientTCPasync() {
+  // No more reconnects when the connection is closed below
+  MTA_keepAlive = false;
+#if defined ESP32
+  // No more timeouts to handle
+  if (MTA_ticker) {
+    esp_timer_stop(MTA_ticker);
+    esp_timer_delete(MTA_ticker);
+  }
+  if (MTA_reconnector) {
+    esp_timer_stop(MTA_reconnector);
+    esp_timer_delete(MTA_reconnector);
+  }
+#endif
   // Clean up queue
   {
     // Safely lock access
@@ -43,10 +91,14 @@ ModbusClientTCPasync::~ModbusClientTCPasync() {
     LOCK_GUARD(lock2, sLock);
     // Delete all elements from queues
     while (!txQueue.empty()) {
+      // Do not leave a syncRequest caller waiting
+      if (txQueue.front()->sync) respondError(txQueue.front(), UNDEFINED_ERROR);
       delete txQueue.front();
       txQueue.pop_front();
     }
     for (auto it = rxQueue.cbegin(); it != rxQueue.cend();/* no increment */) {
+      MTA_timers.stop(it->second);
+      if (it->second->sync) respondError(it->second, UNDEFINED_ERROR);
       delete it->second;
       it = rxQueue.erase(it);
     }
@@ -59,10 +111,16 @@ ModbusClientTCPasync::~ModbusClientTCPasync() {
 void ModbusClientTCPasync::connect() {
   LOG_D("connecting\n");
   LOCK_GUARD(lock1, sLock);
+  MTA_stayDown = false;
   // only connect if disconnected
   if (MTA_state == DISCONNECTED) {
     MTA_state = CONNECTING;
-    MTA_client.connect(MTA_host, MTA_port);
+    if (!MTA_client.connect(MTA_host, MTA_port)) {
+      // Failed right away - there will be no callback telling us
+      LOG_W("connect failed\n");
+      MTA_state = DISCONNECTED;
+      if (MTA_keepAlive) scheduleReconnect();
+    }
   }
 }
 
@@ -79,6 +137,10 @@ void ModbusClientTCPasync::connect(IPAddress host, uint16_t port) {
 // manually disconnect from modbus server. Connection will also auto close after idle time
 void ModbusClientTCPasync::disconnect(bool force) {
   LOG_D("disconnecting\n");
+  {
+    LOCK_GUARD(lock1, sLock);
+    MTA_stayDown = true;
+  }
   MTA_client.close(force);
 }
 
@@ -96,6 +158,35 @@ void ModbusClientTCPasync::setMaxInflightRequests(uint32_t maxInflightRequests)
   MTA_maxInflightRequests = maxInflightRequests;
 }
 
+// keepAlive: keep the connection up, making it again in the background if it was lost
+void ModbusClientTCPasync::keepAlive(bool onOff, uint32_t idle, uint32_t maxBackoff) {
+  {
+    LOCK_GUARD(lock1, sLock);
+    MTA_keepAlive = onOff;
+    MTA_keepIdle = idle;
+    MTA_maxBackoff = maxBackoff ? maxBackoff : 1;
+#if defined ESP32
+    if (MTA_state == CONNECTED) MTA_client.setKeepAlive(onOff ? MTA_keepIdle : 0, onOff ? 3 : 0);
+    if (!onOff && MTA_reconnector) esp_timer_stop(MTA_reconnector);
+#endif
+  }
+  // Connect right away, so the first request will find the connection made already
+  if (onOff) connect();
+}
+
+// setHeartbeat: send request after interval ms without traffic in keepAlive mode
+void ModbusClientTCPasync::setHeartbeat(uint32_t interval, ModbusMessage request) {
+  LOCK_GUARD(lock1, sLock);
+  MTA_heartbeatInterval = request ? interval : 0;
+  MTA_heartbeat = std::move(request);
+}
+
+// Return number of requests queued or waiting for their responses
+uint32_t ModbusClientTCPasync::pendingRequests() {
+  LOCK_GUARD(lock, qLock);
+  return txQueue.size() + rxQueue.size();
+}
+
 // Base addRequest for preformatted ModbusMessage and last set target
 Error ModbusClientTCPasync::addRequestM(ModbusMessage msg, uint32_t token) {
   Error rc = SUCCESS;        // Return value
@@ -103,7 +194,7 @@ Error ModbusClientTCPasync::addRequestM(ModbusMessage msg, uint32_t token) {
   // Add it to the queue, if valid
   if (msg) {
     // Queue add successful?
-    if (!addToQueue(token, msg)) {
+    if (!addToQueue(token, std::move(msg))) {
       // No. Return error after deleting the allocated request.
       rc = REQUEST_QUEUE_FULL;
     }
@@ -113,42 +204,52 @@ Error ModbusClientTCPasync::addRequestM(ModbusMessage msg, uint32_t token) {
   return rc;
 }
 
+// addRequest with a completion of its own, taking the response instead of the handlers
+Error ModbusClientTCPasync::addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion) {
+  if (!msg) return EMPTY_MESSAGE;
+  return addToQueue(token, std::move(msg), completion) ? SUCCESS : REQUEST_QUEUE_FULL;
+}
+
 // Base syncRequest follows the same pattern
 ModbusMessage ModbusClientTCPasync::syncRequestM(ModbusMessage msg, uint32_t token) {
   ModbusMessage response;
+  // Keep what is needed for an error response - msg is moved into the queue
+  uint8_t serverID = msg.getServerID();
+  uint8_t functionCode = msg.getFunctionCode();
 
   if (msg) {
+    SyncHandle sync = std::make_shared<SyncCompletion>();
     // Queue add successful?
-    if (!addToQueue(token, msg, true)) {
+    if (!addToQueue(token, std::move(msg), sync)) {
       // No. Return error after deleting the allocated request.
-      response.setError(msg.getServerID(), msg.getFunctionCode(), REQUEST_QUEUE_FULL);
+      response.setError(serverID, functionCode, REQUEST_QUEUE_FULL);
     } else {
       // Request is queued - wait for the result.
-      response = waitSync(msg.getServerID(), msg.getFunctionCode(), token);
+      response = waitSync(serverID, functionCode, sync, MTA_timeout);
     }
   } else {
-    response.setError(msg.getServerID(), msg.getFunctionCode(), EMPTY_MESSAGE);
+    response.setError(serverID, functionCode, EMPTY_MESSAGE);
   }
   return response;
 }
 
 // addToQueue: send freshly created request to queue
-bool ModbusClientTCPasync::addToQueue(int32_t token, ModbusMessage request, bool syncReq) {
+bool ModbusClientTCPasync::addToQueue(int32_t token, ModbusMessage request, SyncHandle sync) {
   // Did we get one?
   if (request) {
     LOCK_GUARD(lock1, qLock);
     if (txQueue.size() + rxQueue.size() < MTA_qLimit) {
       HEXDUMP_V("Enqueue", request.data(), request.size());
-      RequestEntry *re = new RequestEntry(token, request, syncReq);
+      RequestEntry *re = new RequestEntry(token, std::move(request), sync);
       if (!re) return false;  //TODO: proper error returning in case allocation fails
+      re->trace.mark(TracePoint::ENQUEUE);
       // inject proper transactionID
       re->head.transactionID = messageCount++;
-      re->head.len = request.size();
+      re->head.len = re->msg.size();
       // if we're already connected, try to send and push to rxQueue
       // or else push to txQueue and (re)connect
       if (MTA_state == CONNECTED && send(re)) {
-        re->sentTime = millis();
-        rxQueue[re->head.transactionID] = re;
+        sent(re);
       } else {
         txQueue.push_back(re);
         if (MTA_state == DISCONNECTED) {
@@ -167,6 +268,11 @@ void ModbusClientTCPasync::onConnected() {
   LOCK_GUARD(lock1, sLock);
   MTA_state = CONNECTED;
   MTA_lastActivity = millis();
+  // Reconnects will start over with the shortest back-off time
+  MTA_backoff = 0;
+#if defined ESP32
+  if (MTA_keepAlive) MTA_client.setKeepAlive(MTA_keepIdle, 3);
+#endif
   // from now on onPoll will be called every 500 msec
 }
 
@@ -174,25 +280,83 @@ void ModbusClientTCPasync::onDisconnected() {
   LOG_D("disconnected\n");
   LOCK_GUARD(lock1, sLock);
   MTA_state = DISCONNECTED;
+  // A frame split over packets will not be completed any more
+  MTA_rxPtr = 0;
 
   // empty queue on disconnect, calling errorcode on every waiting request
   LOCK_GUARD(lock2, qLock);
   while (!txQueue.empty()) {
     RequestEntry* r = txQueue.front();
-    if (onError) {
-      onError(IP_CONNECTION_FAILED, r->token);
-    }
+    respondError(r, IP_CONNECTION_FAILED);
     delete r;
     txQueue.pop_front();
   }
   while (!rxQueue.empty()) {
     RequestEntry *r = rxQueue.begin()->second;
-    if (onError) {
-      onError(IP_CONNECTION_FAILED, r->token);
-    }
+    MTA_timers.stop(r);
+    respondError(r, IP_CONNECTION_FAILED);
     delete r;
     rxQueue.erase(rxQueue.begin());
   }
+
+  // In keepAlive mode connect again - unless we were told to disconnect
+  if (MTA_keepAlive && !MTA_stayDown) scheduleReconnect();
+}
+
+// scheduleReconnect: start the reconnect timer. The back-off time doubles with each call until
+// the next connect succeeds. The timer is set to a random point in the second half of it.
+void ModbusClientTCPasync::scheduleReconnect() {
+  // ATTENTION: This method does not have a lock guard.
+  // Calling sites must assure shared resources are protected
+  // by mutex.
+  if (!MTA_backoff) {
+    MTA_backoff = 1000;
+  } else {
+    MTA_backoff = (MTA_backoff < MTA_maxBackoff / 2) ? MTA_backoff * 2 : MTA_maxBackoff;
+  }
+  uint32_t half = MTA_backoff / 2;
+  uint32_t wait = half + micros() % (half + 1);
+  LOG_D("reconnect in %u ms\n", wait);
+#if defined ESP32
+  if (MTA_reconnector) {
+    esp_timer_stop(MTA_reconnector);
+    esp_timer_start_once(MTA_reconnector, (uint64_t)wait * 1000);
+  }
+#endif
+}
+
+// reconnect: the reconnect timer has struck
+void ModbusClientTCPasync::reconnect() {
+  {
+    LOCK_GUARD(lock1, sLock);
+    if (!MTA_keepAlive || MTA_stayDown) return;
+  }
+  connect();
+}
+
+// heartbeat: send the heartbeat request after MTA_heartbeatInterval ms without traffic
+void ModbusClientTCPasync::heartbeat() {
+  // Requests underway are traffic enough
+  if (pendingRequests()) return;
+  ModbusMessage request;
+  {
+    LOCK_GUARD(lock1, sLock);
+    if (!MTA_keepAlive || !MTA_heartbeatInterval || MTA_state != CONNECTED || MTA_heartbeatPending) return;
+    if (millis() - MTA_lastActivity < MTA_heartbeatInterval) return;
+    request = MTA_heartbeat;
+    MTA_heartbeatPending = true;
+  }
+  LOG_D("heartbeat\n");
+  // The response goes to a handler of its own, not to the user's
+  SyncHandle completion = std::make_shared<SyncCompletion>([this](ModbusMessage response, uint32_t token) {
+    MTA_heartbeatPending = false;
+    // No response in time: the connection is dead, whatever TCP thinks of it
+    if (response.getError() == TIMEOUT) {
+      LOG_W("heartbeat timed out, closing connection\n");
+      MTA_client.close(true);
+    }
+  });
+  if (addRequestH(std::move(request), 0, completion) != SUCCESS) MTA_heartbeatPending = false;
 }
 
 
@@ -210,103 +374,62 @@ void onAck(size_t len, uint32_t time) {
   // assuming we don't need this
 }
 */
+// onPacket: process the data of a TCP packet. Frames completely in the packet are taken from it
+// directly, frames split over packets are reassembled in MTA_rxBuffer.
 void ModbusClientTCPasync::onPacket(uint8_t* data, size_t length) {
   LOG_D("packet received (len:%d)\n", length);
   // reset idle timeout
   MTA_lastActivity = millis();
+  uint32_t packetTime = micros();
 
-  if (length) {
-    LOG_D("parsing (len:%d)\n", length + 1);
-  }
   while (length > 0) {
-    RequestEntry* request = nullptr;
-    ModbusMessage* response = nullptr;
-    uint16_t transactionID = 0;
-    uint16_t protocolID = 0;
-    uint16_t messageLength = 0;
-    bool isOkay = false;
-
-    // 1. Check for valid modbus message
-
-    // MBAP header is 6 bytes, we can't do anything with less
-    // total message should fit MBAP plus remaining bytes (in data[4], data[5])
-    if (length > 6) {
-      transactionID = (data[0] << 8) | data[1];
-      protocolID = (data[2] << 8) | data[3];
-      messageLength = (data[4] << 8) | data[5];
-      if (protocolID == 0 &&
-        length >= (uint32_t)messageLength + 6 &&
-        messageLength < 256) {
-        response = new ModbusMessage(messageLength);
-        response->add(&data[6], messageLength);
-        LOG_D("packet validated (len:%d)\n", messageLength);
-
-        // on next iteration: adjust remaining length and pointer to data
-        length -= 6 + messageLength;
-        data += 6 + messageLength;
-        isOkay = true;
+    const uint8_t *frame = nullptr;
+    uint16_t frameLength = 0;
+    uint32_t firstByte = 0;
+
+    // 1. Find the next complete frame
+    // Nothing left over from the last packet? Then the frame may be in data completely
+    if (!MTA_rxPtr) {
+      frameLength = TCPutils::frameLength(data, length < 0xFFFF ? length : 0xFFFF);
+      if (frameLength != TCPutils::INVALID_FRAME && frameLength && frameLength <= length) {
+        frame = data;
+        firstByte = packetTime;
+        data += frameLength;
+        length -= frameLength;
       }
     }
-
-    if (!isOkay) {
+    if (!frame && frameLength != TCPutils::INVALID_FRAME) {
+      // Split frame. Collect the MBAP header first, then the rest of the frame
+      frameLength = TCPutils::frameLength(MTA_rxBuffer, MTA_rxPtr);
+      if (frameLength != TCPutils::INVALID_FRAME) {
+        uint16_t want = (frameLength ? frameLength : 6) - MTA_rxPtr;
+        uint16_t take = (length < want) ? length : want;
+        if (!MTA_rxPtr) MTA_rxFirst = packetTime;
+        memcpy(MTA_rxBuffer + MTA_rxPtr, data, take);
+        MTA_rxPtr += take;
+        data += take;
+        length -= take;
+        frameLength = TCPutils::frameLength(MTA_rxBuffer, MTA_rxPtr);
+        // Header just completed, or still more to come?
+        if (frameLength != TCPutils::INVALID_FRAME && (!frameLength || MTA_rxPtr < frameLength)) {
+          LOG_D("frame incomplete (%d), waiting for next TCP packet\n", MTA_rxPtr);
+          continue;
+        }
+        frame = MTA_rxBuffer;
+        firstByte = MTA_rxFirst;
+        MTA_rxPtr = 0;
+      }
+    }
+    if (frameLength == TCPutils::INVALID_FRAME) {
       // invalid packet, abort function
       LOG_W("packet invalid\n");
+      MTA_rxPtr = 0;
       return;
-    } else {
-      // 2. we got a valid response, match with a request
-      LOCK_GUARD(lock1, qLock);
-      auto i = rxQueue.find(transactionID);
-      if (i != rxQueue.end()) {
-        // found it, handle it and stop iterating
-        request = i->second;
-        i = rxQueue.erase(i);
-        LOG_D("matched request\n");
-      } else {
-        // TCP packet did not yield valid modbus response, abort function
-        LOG_W("no matching request found\n");
-        return;
-      }
     }
+    LOG_D("packet validated (len:%d)\n", frameLength - 6);
 
-    // 3. we have a valid request and a valid response, call appropriate callback
-    if (request) {
-      // compare request with response
-      Error error = SUCCESS;
-      if (request->msg.getFunctionCode() != (response->getFunctionCode() & 0x7F)) {
-        error = FC_MISMATCH;
-      } else if (request->msg.getServerID() != response->getServerID()) {
-        error = SERVER_ID_MISMATCH;
-      } else {
-        error = response->getError();
-      }
-
-      if (error != SUCCESS) {
-        LOCK_GUARD(errorCntLock, countAccessM);
-        errorCount++;
-      }
-
-      if (request->isSyncRequest) {
-        {
-          LOCK_GUARD(sL ,syncRespM);
-          syncResponse[request->token] = *response;
-        }
-      } else if (onResponse) {
-        onResponse(*response, request->token);
-      } else {
-        if (error == SUCCESS) {
-          if (onData) {
-            onData(*response, request->token);
-          }
-        } else {
-          if (onError) {
-            onError(response->getError(), request->token);
-          }
-        }
-      }
-      delete request;
-    }
-    delete response;
-
+    // 2. we got a valid response, hand it over
+    handleResponse(frame, frameLength, firstByte);
   }  // end processing of incoming data
 
   // check if we have to send the next request
@@ -314,32 +437,87 @@ void ModbusClientTCPasync::onPacket(uint8_t* data, size_t length) {
   handleSendingQueue();
 }
 
-void ModbusClientTCPasync::onPoll() {
+// handleResponse: match a complete frame with its request and hand over the response
+void ModbusClientTCPasync::handleResponse(const uint8_t *frame, uint16_t frameLength, uint32_t firstByte) {
+  RequestEntry* request = nullptr;
+  uint16_t transactionID = (frame[0] << 8) | frame[1];
+  if (capture) capture->add(ModbusCapture::TCP_RX, frame, frameLength, nullptr, 0, firstByte);
   {
-  LOCK_GUARD(lock1, qLock);
+    LOCK_GUARD(lock1, qLock);
+    auto i = rxQueue.find(transactionID);
+    if (i == rxQueue.end()) {
+      // TCP packet did not yield valid modbus response
+      LOG_W("no matching request found\n");
+      return;
+    }
+    request = i->second;
+    rxQueue.erase(i);
+    MTA_timers.stop(request);
+    LOG_D("matched request\n");
+  }
+  request->trace.mark(TracePoint::FIRST_BYTE, firstByte);
+  request->trace.mark(TracePoint::FRAME_COMPLETE);
 
-  // try to send whatever is waiting
-  handleSendingQueue();
+  // The response is built once and moved on from here
+  ModbusMessage response;
+  response.add(frame + 6, frameLength - 6);
+
+  // compare request with response
+  Error error = SUCCESS;
+  if (request->msg.getFunctionCode() != (response.getFunctionCode() & 0x7F)) {
+    error = FC_MISMATCH;
+  } else if (request->msg.getServerID() != response.getServerID()) {
+    error = SERVER_ID_MISMATCH;
+  } else {
+    error = response.getError();
+  }
 
-  // next check if timeout has struck for oldest request
-  if (!rxQueue.empty()) {
-    RequestEntry* request = rxQueue.begin()->second;
-    if (millis() - request->sentTime > MTA_timeout) {
-      LOG_D("request timeouts (now:%lu-sent:%u)\n", millis(), request->sentTime);
-      // oldest element timeouts, call onError and clean up
+  if (error != SUCCESS) {
+    errorCount++;
+  }
+  // Count it. Mismatched responses still were received
+  statistics.count(request->msg.getServerID(), request->msg.getFunctionCode(), error, response.size(), request->msg.size());
+
+  request->trace.mark(TracePoint::DISPATCH);
+  ModbusDevice device(request->msg.getServerID(),
+    (static_cast<uint32_t>(MTA_host[0]) << 24) | (MTA_host[1] << 16) | (MTA_host[2] << 8) | MTA_host[3], MTA_port);
+  if (error == SUCCESS && filtered(device, request->token, request->sync, request->msg, response)) {
+    // Taken by the change filter
+  } else if (request->sync) {
+    request->sync->complete(std::move(response));
+  } else if (onResponse) {
+    onResponse(std::move(response), request->token);
+  } else {
+    if (error == SUCCESS) {
+      if (onData) {
+        onData(std::move(response), request->token);
+      }
+    } else {
       if (onError) {
-        // Handle timeout error
-        onError(TIMEOUT, request->token);
+        onError(error, request->token);
       }
-      delete request;
-      rxQueue.erase(rxQueue.begin());
     }
   }
-    
+  traceDone(request->trace, request->token, request->msg, error);
+  delete request;
+}
+
+void ModbusClientTCPasync::onPoll() {
+  {
+  LOCK_GUARD(lock1, qLock);
+
+  // try to send whatever is waiting
+  handleSendingQueue();
   }  // end lockguard scope
 
-  // if nothing happened during idle timeout, gracefully close connection
-  if (millis() - MTA_lastActivity > MTA_idleTimeout) {
+  // next check if timeouts have struck. Without a timer of our own this is the only place to do it
+  handleTimeouts();
+
+  // In keepAlive mode, see if a heartbeat is due.
+  // Else, if nothing happened during idle timeout, gracefully close connection
+  if (MTA_keepAlive) {
+    heartbeat();
+  } else if (millis() - MTA_lastActivity > MTA_idleTimeout) {
     disconnect();
   }
 }
@@ -354,9 +532,8 @@ void ModbusClientTCPasync::handleSendingQueue() {
   while (it != txQueue.end()) {
     // get the actual element
     if (send(*it)) {
-      // after sending, update timeout value, add to other queue and remove from this queue
-      (*it)->sentTime = millis();
-      rxQueue[(*it)->head.transactionID] = (*it);      // push request to other queue
+      // after sending, start timeout, add to other queue and remove from this queue
+      sent(*it);
       it = txQueue.erase(it);  // remove from toSend queue and point i to next request
     } else {
       // sending didn't succeed, try next request
@@ -365,6 +542,48 @@ void ModbusClientTCPasync::handleSendingQueue() {
   }
 }
 
+// sent: request was sent - move it to rxQueue and start its timeout
+void ModbusClientTCPasync::sent(RequestEntry *request) {
+  // ATTENTION: This method does not have a lock guard.
+  // Calling sites must assure shared resources are protected
+  // by mutex.
+  if (request->sync) request->sync->sent();
+  rxQueue[request->head.transactionID] = request;
+  MTA_timers.start(request, MTA_timeout, millis());
+#if defined ESP32
+  if (MTA_ticker && !MTA_ticking) {
+    MTA_ticking = (esp_timer_start_periodic(MTA_ticker, MTA_timers.tick() * 1000) == ESP_OK);
+  }
+#endif
+}
+
+// handleTimeouts: report all requests whose timeout has struck
+void ModbusClientTCPasync::handleTimeouts() {
+  ModbusTimerWheel::Timer *expired = nullptr;
+  {
+    LOCK_GUARD(lock1, qLock);
+    expired = MTA_timers.expire(millis());
+    for (ModbusTimerWheel::Timer *t = expired; t; t = t->next()) {
+      rxQueue.erase(static_cast<RequestEntry *>(t)->head.transactionID);
+    }
+#if defined ESP32
+    // Nothing left to wait for - stop ticking
+    if (MTA_ticking && MTA_timers.empty()) {
+      esp_timer_stop(MTA_ticker);
+      MTA_ticking = false;
+    }
+#endif
+  }
+  // The requests are ours now - report them outside the lock, the handlers may place new requests
+  while (expired) {
+    RequestEntry *request = static_cast<RequestEntry *>(expired);
+    expired = expired->next();
+    LOG_D("request timeouts (msgid:%d)\n", request->head.transactionID);
+    respondError(request, TIMEOUT);
+    delete request;
+  }
+}
+
 bool ModbusClientTCPasync::send(RequestEntry* re) {
   // ATTENTION: This method does not have a lock guard.
   // Calling sites must assure shared resources are protected
@@ -376,14 +595,32 @@ bool ModbusClientTCPasync::send(RequestEntry* re) {
 
   // check if TCP client is able to send
   if (MTA_client.space() > ((uint32_t)re->msg.size() + 6)) {
+    re->trace.mark(TracePoint::DEQUEUE);
+    re->trace.mark(TracePoint::SEND_START);
+    if (capture) capture->add(ModbusCapture::TCP_TX, (const uint8_t *)(re->head), 6, re->msg.data(), re->msg.size());
     // Write TCP header first
     MTA_client.add(reinterpret_cast<const char *>((const uint8_t *)(re->head)), 6, ASYNC_WRITE_FLAG_COPY);
     // Request comes next
     MTA_client.add(reinterpret_cast<const char*>(re->msg.data()), re->msg.size(), ASYNC_WRITE_FLAG_COPY);
     // done
     MTA_client.send();
+    re->trace.mark(TracePoint::SEND_END);
     LOG_D("request sent (msgid:%d)\n", re->head.transactionID);
     return true;
   }
   return false;
 }
+
+// respondError: report an error for a request to the waiting syncRequest or the onError handler
+void ModbusClientTCPasync::respondError(RequestEntry *request, Error error) {
+  ModbusMessage response;
+  response.setError(request->msg.getServerID(), request->msg.getFunctionCode(), error);
+  countResponse(request->msg, response);
+  request->trace.mark(TracePoint::DISPATCH);
+  if (request->sync) {
+    request->sync->complete(response);
+  } else if (onError) {
+    onError(error, request->token);
+  }
+  traceDone(request->trace, request->token, request->msg, error);
+}
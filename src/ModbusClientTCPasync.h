@@ -13,12 +13,19 @@
 #include "options.h"
 #include "ModbusMessage.h"
 #include "ModbusClient.h"
+#include "ModbusMessagePool.h"
+#include "TCPutils.h"
+#include "ModbusTimerWheel.h"
 #include <list>
 #include <map>
 #include <vector>
+#include <atomic>
 #if USE_MUTEX
 #include <mutex>      // NOLINT
 #endif
+#if defined ESP32
+#include <esp_timer.h>
+#endif
 
 using std::vector;
 
@@ -50,6 +57,21 @@ public:
   // Set maximum amount of messages awaiting a response. Subsequent messages will be queued.
   void setMaxInflightRequests(uint32_t maxInflightRequests);
 
+  // Keep the connection up: it is made right away and will not be closed after the idle time.
+  // TCP keepalive probes are sent after idle ms without traffic. A connection lost is made again
+  // in the background, the first time after 0.5..1s, doubling with each failed attempt up to
+  // maxBackoff ms. The times are jittered, so a number of clients will not come back all at once.
+  // Only a disconnect() will stop the reconnects until the next connect() or request.
+  // ESP32 only for the keepalive probes and reconnects - elsewhere the next request will connect.
+  void keepAlive(bool onOff = true, uint32_t idle = 10000, uint32_t maxBackoff = 30000);
+
+  // Heartbeat while keepAlive is on: send request after interval ms without traffic. Its response
+  // is dropped, but a timeout will close the connection to have it made again. 0: no heartbeat
+  void setHeartbeat(uint32_t interval, ModbusMessage request);
+
+  // Return number of requests queued or waiting for their responses
+  uint32_t pendingRequests();
+
 protected:
 
   // class describing the TCP header of Modbus packets
@@ -91,30 +113,36 @@ protected:
     uint8_t headRoom[6];        // Buffer to hold MSB-first TCP header
   };
 
-  struct RequestEntry {
+  // Requests are timed on MTA_timers while waiting for their response
+  struct RequestEntry : public ModbusTimerWheel::Timer {
     uint32_t token;
     ModbusMessage msg;
     ModbusTCPhead head;
-    uint32_t sentTime;
-    bool isSyncRequest;
-    RequestEntry(uint32_t t, ModbusMessage m, bool syncReq = false) :
+    SyncHandle sync;              // Completion for syncRequests, empty for all others
+    ModbusTrace trace;            // Times of the transaction points passed
+    RequestEntry(uint32_t t, ModbusMessage m, SyncHandle s = nullptr) :
       token(t),
-      msg(m),
+      msg(std::move(m)),
       head(ModbusTCPhead()),
-      sentTime(0),
-      isSyncRequest(syncReq) {}
+      sync(s),
+      trace() {}
   };
 
   // Base addRequest and syncRequest both must be present
   Error addRequestM(ModbusMessage msg, uint32_t token);
   ModbusMessage syncRequestM(ModbusMessage msg, uint32_t token);
+  // Variant with a completion of its own, taking the response instead of the handlers
+  Error addRequestH(ModbusMessage msg, uint32_t token, SyncHandle completion);
 
   // addToQueue: send freshly created request to queue
-  bool addToQueue(int32_t token, ModbusMessage request, bool syncReq = false);
+  bool addToQueue(int32_t token, ModbusMessage request, SyncHandle sync = nullptr);
 
   // send: send request via Client connection
   bool send(RequestEntry *request);
 
+  // respondError: report an error for a request to the waiting syncRequest or the onError handler
+  void respondError(RequestEntry *request, Error error);
+
   // receive: get response via Client connection
   // TCPResponse* receive(uint8_t* data, size_t length);
 
@@ -127,8 +155,21 @@ protected:
   // void onTimeout(uint32_t time);
   // void onAck(size_t len, uint32_t time);
   void onPacket(uint8_t* data, size_t length);
+  // handleResponse: match a complete frame with its request and hand over the response.
+  // firstByte is the micros() time the packet with the start of the frame came in at
+  void handleResponse(const uint8_t *frame, uint16_t frameLength, uint32_t firstByte);
   void onPoll();
   void handleSendingQueue();
+  // sent: request was sent - move it to rxQueue and start its timeout
+  void sent(RequestEntry *request);
+  // handleTimeouts: report all requests whose timeout has struck
+  void handleTimeouts();
+  // scheduleReconnect: start the reconnect timer with the next back-off time. Needs sLock!
+  void scheduleReconnect();
+  // reconnect: reconnect timer has struck
+  void reconnect();
+  // heartbeat: send the heartbeat request, if one is due
+  void heartbeat();
 
   std::list<RequestEntry*> txQueue;           // Queue to hold requests to be sent
   std::map<uint16_t, RequestEntry*> rxQueue;  // Queue to hold requests to be processed
@@ -148,8 +189,25 @@ protected:
     CONNECTING,
     CONNECTED
   } MTA_state;                      // TCP connection state
+  uint16_t MTA_rxPtr;               // Number of bytes in MTA_rxBuffer
+  uint32_t MTA_rxFirst;             // micros() the packet with the start of MTA_rxBuffer came in at
+  uint8_t MTA_rxBuffer[TCPutils::MAX_ADU];  // Reassembly buffer for frames split over TCP packets
+  ModbusTimerWheel MTA_timers;      // Timeouts of the requests in rxQueue
+#if defined ESP32
+  esp_timer_handle_t MTA_ticker;    // Timer driving MTA_timers while requests are waiting
+  bool MTA_ticking;                 // MTA_ticker is running
+  esp_timer_handle_t MTA_reconnector;  // One-shot timer for the reconnects in keepAlive mode
+#endif
   IPAddress MTA_host;
   uint16_t MTA_port;
+  bool MTA_keepAlive;               // true: keepAlive mode, see keepAlive()
+  bool MTA_stayDown;                // disconnect() was called - no reconnects
+  uint32_t MTA_keepIdle;            // ms without traffic before TCP keepalive probes are sent
+  uint32_t MTA_maxBackoff;          // Upper limit for MTA_backoff
+  uint32_t MTA_backoff;             // Current reconnect back-off time, 0: connected
+  uint32_t MTA_heartbeatInterval;   // ms without traffic before a heartbeat is sent, 0: none
+  ModbusMessage MTA_heartbeat;      // Heartbeat request
+  std::atomic<bool> MTA_heartbeatPending;  // Heartbeat was sent and not answered yet
 };
 
 #endif
@@ -123,6 +123,12 @@ private:
     case BROADCAST_ERROR       : // 0xF0,
       return "Broadcast data invalid";
       break;
+    case REQUEST_EXPIRED       : // 0xF1,
+      return "Request expired before sending";
+      break;
+    case SERVER_BACKED_OFF     : // 0xF2,
+      return "Server backed off after timeouts";
+      break;
     case UNDEFINED_ERROR       : // 0xFF  // otherwise uncovered communication error
     default:
       return "Unspecified error";
@@ -0,0 +1,148 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusFanOut.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Constructor takes the client to send the requests on
+ModbusFanOut::ModbusFanOut(ModbusClientTCP& client, uint16_t maxParallel) :
+  FO_client(client),
+  FO_targets(),
+  FO_maxParallel(maxParallel ? maxParallel : 1),
+  FO_onTarget(nullptr),
+  FO_onDone(nullptr),
+  FO_request(),
+  FO_token(0),
+  FO_next(0),
+  FO_underway(0),
+  FO_running(false),
+  FO_responses() { }
+
+// addTarget: add a target host to the group
+bool ModbusFanOut::addTarget(IPAddress host, uint16_t port, uint8_t serverID) {
+  LOCK_GUARD(lockGuard, FO_lock);
+  if (FO_running) return false;
+  FO_targets.push_back({ host, port, serverID });
+  return true;
+}
+
+// clear: remove all targets
+bool ModbusFanOut::clear() {
+  LOCK_GUARD(lockGuard, FO_lock);
+  if (FO_running) return false;
+  FO_targets.clear();
+  return true;
+}
+
+// targets: number of targets in the group
+uint16_t ModbusFanOut::targets() {
+  LOCK_GUARD(lockGuard, FO_lock);
+  return FO_targets.size();
+}
+
+void ModbusFanOut::onTargetResponse(MBOnTargetResponse handler) {
+  LOCK_GUARD(lockGuard, FO_lock);
+  FO_onTarget = handler;
+}
+
+void ModbusFanOut::onSweepDone(MBOnSweepDone handler) {
+  LOCK_GUARD(lockGuard, FO_lock);
+  FO_onDone = handler;
+}
+
+// running: true while a sweep is underway
+bool ModbusFanOut::running() {
+  LOCK_GUARD(lockGuard, FO_lock);
+  return FO_running;
+}
+
+// sweep: send request to all targets
+Error ModbusFanOut::sweep(ModbusMessage request, uint32_t token) {
+  if (!request) return EMPTY_MESSAGE;
+  {
+    LOCK_GUARD(lockGuard, FO_lock);
+    if (FO_running) return REQUEST_QUEUE_FULL;
+    if (FO_targets.empty()) return PARAMETER_COUNT_ERROR;
+    FO_request = std::move(request);
+    FO_token = token;
+    FO_next = 0;
+    FO_underway = 0;
+    FO_running = true;
+    FO_responses.assign(FO_targets.size(), ModbusMessage());
+  }
+  LOG_D("Sweep %u started\n", token);
+  issue();
+  return SUCCESS;
+}
+
+// issue: send the request to the next targets
+void ModbusFanOut::issue() {
+  while (true) {
+    uint16_t index = 0;
+    uint32_t token = 0;
+    ModbusMessage msg;
+    Target target;
+    {
+      LOCK_GUARD(lockGuard, FO_lock);
+      if (!FO_running || FO_underway >= FO_maxParallel || FO_next >= FO_targets.size()) return;
+      index = FO_next++;
+      FO_underway++;
+      target = FO_targets[index];
+      token = FO_token;
+      msg = FO_request;
+    }
+    msg.setServerID(target.serverID);
+    uint8_t functionCode = msg.getFunctionCode();
+    // The response is handed to us directly - the client's handlers will not see it
+    SyncHandle completion = std::make_shared<SyncCompletion>([this, index](ModbusMessage response, uint32_t) {
+      complete(index, std::move(response));
+      issue();
+    });
+    Error e = FO_client.addRequestHT(std::move(msg), token, completion, target.host, target.port);
+    if (e != SUCCESS) {
+      // Not queued - this target is done already
+      ModbusMessage response;
+      response.setError(target.serverID, functionCode, e);
+      complete(index, std::move(response));
+    }
+  }
+}
+
+// complete: take the response of a target and see if the sweep is done.
+// The caller has to issue() the next request
+void ModbusFanOut::complete(uint16_t index, ModbusMessage response) {
+  MBOnTargetResponse onTarget;
+  MBOnSweepDone onDone;
+  uint32_t token = 0;
+  std::vector<ModbusMessage> responses;
+  bool done = false;
+  {
+    LOCK_GUARD(lockGuard, FO_lock);
+    if (index >= FO_responses.size()) return;
+    FO_responses[index] = response;
+    FO_underway--;
+    onTarget = FO_onTarget;
+    token = FO_token;
+    if (FO_next >= FO_targets.size() && !FO_underway) {
+      // All there. Hand over the responses - a new sweep may be started from onDone already
+      done = true;
+      onDone = FO_onDone;
+      responses = std::move(FO_responses);
+      FO_responses.clear();
+      FO_running = false;
+    }
+  }
+  if (onTarget) onTarget(index, std::move(response), token);
+  if (done) {
+    LOG_D("Sweep %u done\n", token);
+    if (onDone) onDone(responses, token);
+  }
+}
+
+#endif  // HAS_FREERTOS || IS_LINUX
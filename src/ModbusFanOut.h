@@ -0,0 +1,91 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_FAN_OUT_H
+#define _MODBUS_FAN_OUT_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include <vector>
+#include <functional>
+#if USE_MUTEX
+#include <mutex>      // NOLINT
+#endif
+#include "ModbusClientTCP.h"
+
+// Handler for each target's response: index of the target as added, response and sweep token
+typedef std::function<void(uint16_t target, ModbusMessage response, uint32_t token)> MBOnTargetResponse;
+// Handler for the end of a sweep: the responses of all targets by index, and the sweep token
+typedef std::function<void(const std::vector<ModbusMessage>& responses, uint32_t token)> MBOnSweepDone;
+
+// ModbusFanOut: sends one request to a group of TCP target hosts on a ModbusClientTCP and
+// collects the responses. Up to maxParallel requests are underway at the same time - as soon as
+// one is answered, the next target gets its request. Give the client a connection for each
+// request to run in parallel by addConnection(), else the targets will be served one after the other.
+// Each response goes to onTargetResponse when it comes in, the whole set to onSweepDone in the end.
+// Failed requests are in as error responses. The handlers are called by the client's worker task.
+// The client's onData/onError/onResponse handlers do not see the sweep's responses.
+class ModbusFanOut {
+public:
+  explicit ModbusFanOut(ModbusClientTCP& client, uint16_t maxParallel = 8);
+
+  // addTarget: add a target host to the group. serverID replaces that of the request for it.
+  // Returns false while a sweep is running.
+  bool addTarget(IPAddress host, uint16_t port = 502, uint8_t serverID = 1);
+
+  // clear: remove all targets. Returns false while a sweep is running
+  bool clear();
+
+  // Number of targets in the group
+  uint16_t targets();
+
+  // Set the response handlers
+  void onTargetResponse(MBOnTargetResponse handler);
+  void onSweepDone(MBOnSweepDone handler);
+
+  // sweep: send request to all targets. Returns REQUEST_QUEUE_FULL if a sweep is still running,
+  // PARAMETER_COUNT_ERROR if there are no targets
+  Error sweep(ModbusMessage request, uint32_t token = 0);
+
+  // running: true while a sweep waits for responses
+  bool running();
+
+protected:
+  struct Target {
+    IPAddress host;
+    uint16_t port;
+    uint8_t serverID;
+  };
+
+  // Prevent copy construction and assignment
+  ModbusFanOut(const ModbusFanOut&) = delete;
+  ModbusFanOut& operator=(const ModbusFanOut&) = delete;
+
+  // issue: send the next requests of the sweep, as long as there are less than maxParallel underway
+  void issue();
+
+  // complete: the response for target index is there. Hands it on, and the whole set if it was the last
+  void complete(uint16_t index, ModbusMessage response);
+
+  ModbusClientTCP& FO_client;       // Client to send the requests on
+  std::vector<Target> FO_targets;   // The group
+  uint16_t FO_maxParallel;          // Maximum number of requests underway
+  MBOnTargetResponse FO_onTarget;   // Per target response handler
+  MBOnSweepDone FO_onDone;          // Sweep completion handler
+  ModbusMessage FO_request;         // Request of the running sweep
+  uint32_t FO_token;                // Token of the running sweep
+  uint16_t FO_next;                 // Index of the next target to send the request to
+  uint16_t FO_underway;             // Number of requests sent and not answered yet
+  bool FO_running;                  // A sweep is running
+  std::vector<ModbusMessage> FO_responses;  // Responses of the running sweep
+#if USE_MUTEX
+  std::mutex FO_lock;               // Protects all of the above
+#endif
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // _MODBUS_FAN_OUT_H
@@ -0,0 +1,158 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusHealth.h"
+
+// Constructor: no devices known, limits at their defaults
+ModbusHealth::ModbusHealth() :
+  MH_minTimeout(50),
+  MH_failures(3),
+  MH_maxBackoff(60000) {
+  reset();
+}
+
+// setLimits: minimum timeout and maximum back-off period, timeouts in a row to back off after
+void ModbusHealth::setLimits(uint32_t minTimeout, uint8_t failures, uint32_t maxBackoff) {
+  LOCK_GUARD(lockGuard, MH_lock);
+  MH_minTimeout = minTimeout;
+  MH_failures = failures;
+  MH_maxBackoff = (maxBackoff < MODBUS_BACKOFF_START) ? MODBUS_BACKOFF_START : maxBackoff;
+}
+
+// timeout: ms to wait for a response of device
+uint32_t ModbusHealth::timeout(const ModbusDevice& device, uint32_t maxTimeout) {
+  LOCK_GUARD(lockGuard, MH_lock);
+  Slot *s = findSlot(device, true);
+  if (!s) return maxTimeout;
+  s->maxTimeout = maxTimeout;
+  return currentTimeout(*s, maxTimeout);
+}
+
+// admit: may a request to device go out now?
+bool ModbusHealth::admit(const ModbusDevice& device) {
+  LOCK_GUARD(lockGuard, MH_lock);
+  Slot *s = findSlot(device, false);
+  if (!s || !s->backoff) return true;
+  unsigned long now = millis();
+  if (now - s->backoffStart < s->backoff) return false;
+  // Probe is due. Hold back all others until we know how it went
+  s->backoffStart = now;
+  return true;
+}
+
+// success: device responded after responseMicros
+void ModbusHealth::success(const ModbusDevice& device, uint32_t responseMicros) {
+  LOCK_GUARD(lockGuard, MH_lock);
+  Slot *s = findSlot(device, true);
+  if (!s) return;
+  if (!s->srtt) {
+    // First sample
+    s->srtt = responseMicros ? responseMicros : 1;
+    s->rttvar = responseMicros / 2;
+  } else {
+    int32_t err = static_cast<int32_t>(responseMicros - s->srtt);
+    uint32_t absErr = (err < 0) ? -err : err;
+    s->srtt += err / 8;
+    if (!s->srtt) s->srtt = 1;
+    s->rttvar += (static_cast<int32_t>(absErr) - static_cast<int32_t>(s->rttvar)) / 4;
+  }
+  s->failures = 0;
+  s->backoff = 0;
+}
+
+// failure: device did not respond in time
+void ModbusHealth::failure(const ModbusDevice& device) {
+  LOCK_GUARD(lockGuard, MH_lock);
+  Slot *s = findSlot(device, true);
+  if (!s) return;
+  if (s->failures < 0xFFFF) s->failures++;
+  if (MH_failures && s->failures >= MH_failures) {
+    // Start backing off, or back off longer after a failed probe
+    if (!s->backoff) {
+      s->backoff = MODBUS_BACKOFF_START;
+    } else {
+      s->backoff = (s->backoff > MH_maxBackoff / 2) ? MH_maxBackoff : s->backoff * 2;
+    }
+    s->backoffStart = millis();
+  }
+}
+
+// snapshot: get copies of all devices seen so far
+std::vector<ModbusHealthEntry> ModbusHealth::snapshot() {
+  LOCK_GUARD(lockGuard, MH_lock);
+  std::vector<ModbusHealthEntry> list;
+  for (uint16_t i = 0; i < MODBUS_HEALTH_SLOTS; ++i) {
+    if (!MH_slot[i].used) continue;
+    ModbusHealthEntry e;
+    copySlot(MH_slot[i], e);
+    list.push_back(e);
+  }
+  return list;
+}
+
+// get: copy what is known about device
+bool ModbusHealth::get(const ModbusDevice& device, ModbusHealthEntry& entry) {
+  LOCK_GUARD(lockGuard, MH_lock);
+  Slot *s = findSlot(device, false);
+  if (!s) return false;
+  copySlot(*s, entry);
+  return true;
+}
+
+// reset: forget all devices
+void ModbusHealth::reset() {
+  LOCK_GUARD(lockGuard, MH_lock);
+  for (uint16_t i = 0; i < MODBUS_HEALTH_SLOTS; ++i) {
+    Slot& s = MH_slot[i];
+    s.device = ModbusDevice();
+    s.used = false;
+    s.srtt = 0;
+    s.rttvar = 0;
+    s.failures = 0;
+    s.backoffStart = 0;
+    s.backoff = 0;
+    s.maxTimeout = 0;
+  }
+}
+
+// findSlot: get the slot for a device, claiming a free one if create is set. Needs MH_lock!
+ModbusHealth::Slot *ModbusHealth::findSlot(const ModbusDevice& device, bool create) {
+  Slot *freeSlot = nullptr;
+  for (uint16_t i = 0; i < MODBUS_HEALTH_SLOTS; ++i) {
+    Slot& s = MH_slot[i];
+    if (s.used) {
+      if (s.device == device) return &s;
+    } else if (!freeSlot) {
+      freeSlot = &s;
+    }
+  }
+  if (!create || !freeSlot) return nullptr;
+  freeSlot->used = true;
+  freeSlot->device = device;
+  return freeSlot;
+}
+
+// currentTimeout: srtt + 4 * rttvar in ms, doubled with each timeout in a row, within the limits
+uint32_t ModbusHealth::currentTimeout(const Slot& s, uint32_t maxTimeout) {
+  // Nothing learned yet? Then we have to wait as long as the client would
+  if (!s.srtt) return maxTimeout;
+  uint32_t t = (s.srtt + 4 * s.rttvar + 999) / 1000;
+  if (t < MH_minTimeout) t = MH_minTimeout;
+  for (uint16_t i = 0; i < s.failures && t < maxTimeout; ++i) {
+    t *= 2;
+  }
+  return (t < maxTimeout) ? t : maxTimeout;
+}
+
+// copySlot: fill entry from a slot. Needs MH_lock!
+void ModbusHealth::copySlot(const Slot& s, ModbusHealthEntry& entry) {
+  entry.device = s.device;
+  entry.srtt = s.srtt;
+  entry.rttvar = s.rttvar;
+  entry.timeout = currentTimeout(s, s.maxTimeout);
+  entry.failures = s.failures;
+  entry.backedOff = s.backoff != 0;
+  unsigned long waited = millis() - s.backoffStart;
+  entry.probeIn = (s.backoff && waited < s.backoff) ? s.backoff - waited : 0;
+}
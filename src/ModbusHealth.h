@@ -0,0 +1,124 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_HEALTH_H
+#define _MODBUS_HEALTH_H
+
+#include <vector>
+#include "options.h"
+#include "ModbusTypeDefs.h"
+
+#if USE_MUTEX
+#include <mutex>    // NOLINT
+#endif
+
+using namespace Modbus;  // NOLINT
+
+// Number of devices tracked per client
+#ifndef MODBUS_HEALTH_SLOTS
+#define MODBUS_HEALTH_SLOTS 16
+#endif
+
+// First back-off period in ms. Each further timeout of a backed off device doubles it
+#ifndef MODBUS_BACKOFF_START
+#define MODBUS_BACKOFF_START 1000
+#endif
+
+// ModbusDevice: a server as seen by a client. RTU clients will leave host and port 0
+struct ModbusDevice {
+  uint32_t host;
+  uint16_t port;
+  uint8_t serverID;
+  explicit ModbusDevice(uint8_t s = 0, uint32_t h = 0, uint16_t p = 0) : host(h), port(p), serverID(s) {}
+  inline bool operator==(const ModbusDevice& d) const { return host == d.host && port == d.port && serverID == d.serverID; }
+};
+
+// ModbusHealthEntry: copy of what is known about one device
+struct ModbusHealthEntry {
+  ModbusDevice device;
+  uint32_t srtt;                 // Smoothed response time in us, 0 if no response was seen yet
+  uint32_t rttvar;               // Mean deviation of the response time in us
+  uint32_t timeout;              // ms to wait for the next response
+  uint16_t failures;             // Consecutive timeouts
+  bool backedOff;                // Requests are refused until the next probe is due
+  uint32_t probeIn;              // ms until the next probe may go out, if backed off
+
+  ModbusHealthEntry() :
+    device(), srtt(0), rttvar(0), timeout(0), failures(0), backedOff(false), probeIn(0) {}
+};
+
+// ModbusHealth: response times and timeouts by device, for the clients' adaptive timeouts.
+// Response times are smoothed the way TCP does for its retransmission timeout (RFC 6298):
+// srtt follows each new sample by 1/8, rttvar - the mean deviation - by 1/4 of the difference.
+// The timeout is srtt + 4 * rttvar, not below the minimum and not above the client's timeout.
+// Each timeout doubles it until a response comes in again.
+// After failures timeouts in a row a device is backed off: requests to it are refused right away.
+// Once the back-off period has passed, the next request is let through as a probe. If that times
+// out as well, the period is doubled, up to maxBackoff. The first response ends the back-off.
+// Devices beyond MODBUS_HEALTH_SLOTS are not tracked and will always get the client's timeout.
+class ModbusHealth {
+public:
+  ModbusHealth();
+
+  // setLimits: minimum timeout and maximum back-off period in ms, timeouts in a row to back off after
+  void setLimits(uint32_t minTimeout, uint8_t failures, uint32_t maxBackoff);
+
+  // timeout: ms to wait for a response of device. maxTimeout if nothing is known about it yet
+  uint32_t timeout(const ModbusDevice& device, uint32_t maxTimeout);
+
+  // admit: may a request to device go out now? false while it is backed off.
+  // Letting a probe through starts another back-off period, so until its outcome is known
+  // no other request will get through.
+  bool admit(const ModbusDevice& device);
+
+  // success: device responded after responseMicros
+  void success(const ModbusDevice& device, uint32_t responseMicros);
+
+  // failure: device did not respond in time
+  void failure(const ModbusDevice& device);
+
+  // snapshot: get copies of all devices seen so far
+  std::vector<ModbusHealthEntry> snapshot();
+
+  // get: copy what is known about device. Returns false if it was not seen yet
+  bool get(const ModbusDevice& device, ModbusHealthEntry& entry);
+
+  // reset: forget all devices
+  void reset();
+
+protected:
+  struct Slot {
+    ModbusDevice device;
+    bool used;
+    uint32_t srtt;               // us
+    uint32_t rttvar;             // us
+    uint16_t failures;           // Consecutive timeouts
+    unsigned long backoffStart;  // millis() the current back-off period started at
+    uint32_t backoff;            // Length of the current back-off period in ms, 0: not backed off
+    uint32_t maxTimeout;         // Most recent client timeout asked for
+  };
+
+  // Prevent copy construction or assignment
+  ModbusHealth(const ModbusHealth& other) = delete;
+  ModbusHealth& operator=(const ModbusHealth& other) = delete;
+
+  // findSlot: get the slot for a device, claiming a free one if create is set. nullptr if there is none
+  Slot *findSlot(const ModbusDevice& device, bool create);
+
+  // currentTimeout: the timeout of a slot, not above maxTimeout
+  uint32_t currentTimeout(const Slot& s, uint32_t maxTimeout);
+
+  // copySlot: fill entry from a slot
+  void copySlot(const Slot& s, ModbusHealthEntry& entry);
+
+  Slot MH_slot[MODBUS_HEALTH_SLOTS];
+  uint32_t MH_minTimeout;          // Lower limit for adaptive timeouts in ms
+  uint8_t MH_failures;             // Timeouts in a row to back off after
+  uint32_t MH_maxBackoff;          // Upper limit for the back-off period in ms
+#if USE_MUTEX
+  std::mutex MH_lock;              // Protects all of the above
+#endif
+};
+
+#endif
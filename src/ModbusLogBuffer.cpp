@@ -0,0 +1,367 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "Logging.h"
+
+#if LOG_BUFFERED
+#include <stdio.h>
+
+ModbusLogBuffer MBUlogBuffer;
+
+// Longest line put out in one go - longer ones are cut
+#define LOG_BUFFER_LINE 256
+
+// Constructor: empty buffer. All words are 0, so no record is seen as committed
+ModbusLogBuffer::ModbusLogBuffer() :
+  LB_head(0),
+  LB_tail(0),
+  LB_dropped(0),
+  LB_reported(0),
+#if HAS_FREERTOS
+  LB_task(nullptr) {
+#elif IS_LINUX
+  LB_task(0) {
+#else
+  {
+#endif
+  for (uint32_t i = 0; i < WORDS; ++i) {
+    LB_ring[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+// Destructor: stop the task
+ModbusLogBuffer::~ModbusLogBuffer() {
+  end();
+}
+
+// Cursor::put: append len bytes, storing each word as it is filled
+void ModbusLogBuffer::Cursor::put(const void *data, size_t len) {
+  const uint8_t *cp = static_cast<const uint8_t *>(data);
+  while (len--) {
+    acc |= static_cast<uint32_t>(*cp++) << (fill * 8);
+    if (++fill == 4) {
+      ring[pos++ & (WORDS - 1)].store(acc, std::memory_order_relaxed);
+      acc = 0;
+      fill = 0;
+    }
+  }
+}
+
+// Cursor::flush: store a word filled in part
+void ModbusLogBuffer::Cursor::flush() {
+  if (fill) {
+    ring[pos++ & (WORDS - 1)].store(acc, std::memory_order_relaxed);
+    acc = 0;
+    fill = 0;
+  }
+}
+
+// Cursor::get: take len bytes, loading a word as needed
+void ModbusLogBuffer::Cursor::get(void *data, size_t len) {
+  uint8_t *cp = static_cast<uint8_t *>(data);
+  while (len--) {
+    if (!fill) {
+      acc = ring[pos++ & (WORDS - 1)].load(std::memory_order_relaxed);
+      fill = 4;
+    }
+    *cp++ = acc & 0xFF;
+    acc >>= 8;
+    fill--;
+  }
+}
+
+// argSize: a string is kept with its terminating 0, up to LOG_BUFFER_MAX_STRING characters
+size_t ModbusLogBuffer::argSize(const char *s) {
+  size_t len = s ? strlen(s) : 6;
+  return 2 + (len < LOG_BUFFER_MAX_STRING ? len : LOG_BUFFER_MAX_STRING);
+}
+
+// putArg: copy a string. Must match argSize()!
+void ModbusLogBuffer::putArg(Cursor& c, const char *s) {
+  if (!s) s = "(null)";
+  size_t len = strlen(s);
+  if (len > LOG_BUFFER_MAX_STRING) len = LOG_BUFFER_MAX_STRING;
+  uint8_t tag = T_STRING;
+  uint8_t end = 0;
+  c.put(&tag, 1);
+  c.put(s, len);
+  c.put(&end, 1);
+}
+
+// putTagged: write a tag and a 64 bit value
+void ModbusLogBuffer::putTagged(Cursor& c, uint8_t tag, uint64_t value) {
+  c.put(&tag, 1);
+  c.put(&value, 8);
+}
+
+// reserve: claim room for a record of bytes following its length word. Counts a drop if it fails
+bool ModbusLogBuffer::reserve(uint32_t bytes, uint32_t& pos) {
+  uint32_t words = 1 + (bytes + 3) / 4;
+  uint32_t head = LB_head.load(std::memory_order_relaxed);
+  do {
+    if (words > WORDS / 2 || head + words - LB_tail.load(std::memory_order_acquire) > WORDS) {
+      LB_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!LB_head.compare_exchange_weak(head, head + words, std::memory_order_acquire, std::memory_order_relaxed));
+  pos = head;
+  return true;
+}
+
+// commit: the record at pos is complete and may be drained
+void ModbusLogBuffer::commit(uint32_t pos, uint32_t bytes) {
+  LB_ring[pos & (WORDS - 1)].store(COMMITTED | bytes, std::memory_order_release);
+}
+
+// hexDump: record a hex dump of length bytes at data. letter and label are copied
+void ModbusLogBuffer::hexDump(const char *letter, const char *label, const uint8_t *data, size_t length) {
+  uint16_t len = (length < LOG_BUFFER_MAX_DUMP) ? length : LOG_BUFFER_MAX_DUMP;
+  uint32_t total = length;
+  uint64_t address = reinterpret_cast<uintptr_t>(data);
+  Header h = { DUMP, PLAIN, letter ? *letter : ' ', len, total, nullptr, nullptr, nullptr };
+  uint32_t bytes = sizeof(Header) + argSize(label) + 8 + len;
+  uint32_t pos = 0;
+  if (!reserve(bytes, pos)) return;
+  Cursor c(LB_ring, pos + 1);
+  c.put(&h, sizeof(Header));
+  putArg(c, label);
+  c.put(&address, 8);
+  c.put(data, len);
+  c.flush();
+  commit(pos, bytes);
+}
+
+// drain: print out all records in the buffer. Returns true if there were any
+bool ModbusLogBuffer::drain() {
+  LOCK_GUARD(lockGuard, LB_drainLock);
+  bool any = false;
+  uint32_t tail = LB_tail.load(std::memory_order_relaxed);
+  while (true) {
+    uint32_t lenWord = LB_ring[tail & (WORDS - 1)].load(std::memory_order_acquire);
+    if (!(lenWord & COMMITTED)) break;
+    uint32_t bytes = lenWord & ~COMMITTED;
+    uint32_t words = 1 + (bytes + 3) / 4;
+    Cursor c(LB_ring, tail + 1);
+    Header h;
+    c.get(&h, sizeof(Header));
+    if (h.kind == DUMP) {
+      dump(c, h);
+    } else {
+      format(c, h);
+    }
+    // Clear the words, so a record reserved but not yet committed will never look committed
+    for (uint32_t i = 0; i < words; ++i) {
+      LB_ring[(tail + i) & (WORDS - 1)].store(0, std::memory_order_relaxed);
+    }
+    tail += words;
+    LB_tail.store(tail, std::memory_order_release);
+    any = true;
+  }
+  // Tell about records lost
+  uint32_t lost = LB_dropped.load(std::memory_order_relaxed);
+  if (lost != LB_reported) {
+    char text[64];
+    snprintf(text, sizeof(text), LL_YELLOW "[W] %u log records dropped" LL_NORM "\n", (unsigned int)(lost - LB_reported));
+    output(text);
+    LB_reported = lost;
+  }
+  return any;
+}
+
+// format: print one LINE or RAW record
+void ModbusLogBuffer::format(Cursor& c, const Header& h) {
+  char text[LOG_BUFFER_LINE];
+  size_t used = 0;
+  uint8_t count = 0;
+  c.get(&count, 1);
+
+  // Append to text as far as there is room
+  auto add = [&](int n) { if (n > 0) used += n; if (used >= sizeof(text)) used = sizeof(text) - 1; };
+
+  if (h.colour == RED) add(snprintf(text + used, sizeof(text) - used, LL_RED));
+  if (h.colour == YELLOW) add(snprintf(text + used, sizeof(text) - used, LL_YELLOW));
+  if (h.kind == LINE) {
+    add(snprintf(text + used, sizeof(text) - used, "[%c] %lu| %-20s [%4d] %s: ",
+                 h.letter, static_cast<unsigned long>(h.time), h.file, h.lineNo, h.func));
+  }
+
+  // Go through the format, taking an argument for each conversion
+  const char *fp = h.format;
+  while (*fp) {
+    if (*fp != '%') {
+      if (used < sizeof(text) - 1) text[used++] = *fp;
+      fp++;
+      continue;
+    }
+    if (fp[1] == '%') {
+      if (used < sizeof(text) - 1) text[used++] = '%';
+      fp += 2;
+      continue;
+    }
+    // Collect flags, width and precision. A '*' takes an argument
+    char spec[24];
+    uint8_t sp = 0;
+    spec[sp++] = *fp++;
+    while (*fp && strchr("-+ #0123456789.*", *fp) && sp < sizeof(spec) - 4) {
+      if (*fp == '*') {
+        uint8_t tag = 0;
+        uint64_t v = 0;
+        if (count) {
+          c.get(&tag, 1);
+          c.get(&v, 8);
+          count--;
+        }
+        sp += snprintf(spec + sp, sizeof(spec) - 4 - sp, "%d", static_cast<int>(v));
+        if (sp > sizeof(spec) - 4) sp = sizeof(spec) - 4;
+      } else {
+        spec[sp++] = *fp;
+      }
+      fp++;
+    }
+    // Skip the length modifiers - the argument brings its own size
+    while (*fp && strchr("hljztL", *fp)) fp++;
+    char conv = *fp;
+    if (!conv) break;
+    fp++;
+
+    // Take the argument
+    if (!count) break;
+    count--;
+    uint8_t tag = 0;
+    c.get(&tag, 1);
+    char str[LOG_BUFFER_MAX_STRING + 1];
+    uint64_t v = 0;
+    if (tag == T_STRING) {
+      uint8_t i = 0;
+      do {
+        c.get(&str[i], 1);
+      } while (str[i] && ++i < sizeof(str));
+      str[sizeof(str) - 1] = 0;
+    } else {
+      c.get(&v, 8);
+    }
+
+    // Print it with the conversion asked for
+    if (conv == 's' && tag == T_STRING) {
+      spec[sp++] = 's';
+      spec[sp] = 0;
+      add(snprintf(text + used, sizeof(text) - used, spec, str));
+    } else if (strchr("fFeEgGaA", conv) && tag == T_DOUBLE) {
+      double d;
+      memcpy(&d, &v, 8);
+      spec[sp++] = conv;
+      spec[sp] = 0;
+      add(snprintf(text + used, sizeof(text) - used, spec, d));
+    } else if (conv == 'p' && tag != T_STRING && tag != T_DOUBLE) {
+      spec[sp++] = 'p';
+      spec[sp] = 0;
+      add(snprintf(text + used, sizeof(text) - used, spec, reinterpret_cast<void *>(static_cast<uintptr_t>(v))));
+    } else if (conv == 'c' && tag != T_STRING && tag != T_DOUBLE) {
+      spec[sp++] = 'c';
+      spec[sp] = 0;
+      add(snprintf(text + used, sizeof(text) - used, spec, static_cast<int>(v)));
+    } else if (strchr("diuxXo", conv) && tag != T_STRING && tag != T_DOUBLE) {
+      spec[sp++] = 'l';
+      spec[sp++] = 'l';
+      spec[sp++] = conv;
+      spec[sp] = 0;
+      if (conv == 'd' || conv == 'i') {
+        add(snprintf(text + used, sizeof(text) - used, spec, static_cast<long long>(v)));
+      } else {
+        add(snprintf(text + used, sizeof(text) - used, spec, static_cast<unsigned long long>(v)));
+      }
+    } else {
+      // Argument does not fit the conversion
+      add(snprintf(text + used, sizeof(text) - used, "<?>"));
+    }
+  }
+  if (h.colour != PLAIN) add(snprintf(text + used, sizeof(text) - used, LL_NORM));
+  text[used] = 0;
+  output(text);
+}
+
+// dump: print one DUMP record
+void ModbusLogBuffer::dump(Cursor& c, const Header& h) {
+  char label[LOG_BUFFER_MAX_STRING + 1];
+  uint8_t tag = 0;
+  c.get(&tag, 1);
+  uint8_t i = 0;
+  do {
+    c.get(&label[i], 1);
+  } while (label[i] && ++i < sizeof(label));
+  label[sizeof(label) - 1] = 0;
+  uint64_t address = 0;
+  c.get(&address, 8);
+  uint8_t data[LOG_BUFFER_MAX_DUMP];
+  c.get(data, h.lineNo);
+  char letter[2] = { h.letter, 0 };
+  // The original address and length are shown, the dump may have been cut
+#if IS_LINUX
+  logHexDump(letter, label, data, h.lineNo, address, h.time);
+#else
+  logHexDump(LOGDEVICE, letter, label, data, h.lineNo, address, h.time);
+#endif
+}
+
+// output: print a buffer
+void ModbusLogBuffer::output(const char *text) {
+#if IS_LINUX
+  printf("%s", text);
+#else
+  LOGDEVICE->print(text);
+#endif
+}
+
+#if HAS_FREERTOS
+// run: task draining the buffer
+void ModbusLogBuffer::run(ModbusLogBuffer *instance) {
+  while (true) {
+    if (!instance->drain()) delay(10);
+  }
+}
+#elif IS_LINUX
+// pHandle: thread draining the buffer
+void *ModbusLogBuffer::pHandle(void *p) {
+  ModbusLogBuffer *instance = static_cast<ModbusLogBuffer *>(p);
+  while (true) {
+    if (!instance->drain()) delay(10);
+  }
+  return nullptr;
+}
+#endif
+
+// begin: start the task draining the buffer, pinned to coreID
+void ModbusLogBuffer::begin(int coreID) {
+#if HAS_FREERTOS
+  if (!LB_task) {
+    // Lowest priority above the idle task - printing out must not get in the way of the Modbus tasks
+    xTaskCreatePinnedToCore((TaskFunction_t)&run, "ModbusLOG", 4096, this, 1, &LB_task, coreID >= 0 ? coreID : NULL);
+  }
+#elif IS_LINUX
+  if (!LB_task) {
+    if (pthread_create(&LB_task, NULL, &pHandle, this)) LB_task = 0;
+  }
+#endif
+}
+
+// end: stop the draining task. Records will stay in the buffer until drain() is called
+void ModbusLogBuffer::end() {
+#if HAS_FREERTOS
+  if (LB_task) {
+    // Do not kill it in the middle of a drain()
+    LOCK_GUARD(lockGuard, LB_drainLock);
+    vTaskDelete(LB_task);
+    LB_task = nullptr;
+  }
+#elif IS_LINUX
+  if (LB_task) {
+    LOCK_GUARD(lockGuard, LB_drainLock);
+    pthread_cancel(LB_task);
+    pthread_join(LB_task, NULL);
+    LB_task = 0;
+  }
+#endif
+}
+
+#endif  // LOG_BUFFERED
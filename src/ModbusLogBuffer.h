@@ -0,0 +1,214 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_LOG_BUFFER_H
+#define _MODBUS_LOG_BUFFER_H
+
+#include "options.h"
+#include <atomic>
+#include <type_traits>
+#include <string.h>
+#if USE_MUTEX
+#include <mutex>      // NOLINT
+#endif
+#if HAS_FREERTOS
+extern "C" {
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+}
+#elif IS_LINUX
+#include <pthread.h>
+#endif
+
+// Size of the ring buffer in bytes - must be a power of 2
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 4096
+#endif
+
+// Longest string argument kept - longer ones are cut
+#ifndef LOG_BUFFER_MAX_STRING
+#define LOG_BUFFER_MAX_STRING 64
+#endif
+
+// Largest hex dump kept - longer ones are cut
+#ifndef LOG_BUFFER_MAX_DUMP
+#define LOG_BUFFER_MAX_DUMP 264
+#endif
+
+// ModbusLogBuffer: backend for the LOG_*, LOGRAW_* and HEXDUMP_* macros with LOG_BUFFERED set.
+// The calling task only puts a binary record into a ring buffer: the addresses of the format string,
+// file and function name, and the arguments as they are. String arguments and dumped data are copied.
+// Formatting and printing out is done by a task of low priority started by begin() - or by calling
+// drain() periodically, from loop() for instance.
+// Any number of tasks may log at the same time without taking a lock. If the buffer is full,
+// the record is dropped and counted - the next drain() will tell how many were lost.
+// The format has to be a string literal, as only its address is kept!
+class ModbusLogBuffer {
+public:
+  // Colours of a record
+  enum Colour : uint8_t { PLAIN = 0, RED, YELLOW };
+
+  ModbusLogBuffer();
+  ~ModbusLogBuffer();
+
+  // line: record a log line with the LOG_HEADER contents
+  template <typename... Args>
+  void line(Colour colour, char letter, const char *format, const char *file, int lineNo, const char *func, Args... args) {
+    Header h = { LINE, colour, letter, static_cast<uint16_t>(lineNo), static_cast<uint32_t>(millis()), format, file, func };
+    record(h, args...);
+  }
+
+  // raw: record a log line without header
+  template <typename... Args>
+  void raw(Colour colour, const char *format, Args... args) {
+    Header h = { RAW, colour, 0, 0, 0, format, nullptr, nullptr };
+    record(h, args...);
+  }
+
+  // hexDump: record a hex dump of length bytes at data. letter and label are copied
+  void hexDump(const char *letter, const char *label, const uint8_t *data, size_t length);
+
+  // drain: print out all records in the buffer. Returns true if there were any
+  bool drain();
+
+  // begin: start the task draining the buffer, pinned to coreID
+  void begin(int coreID = -1);
+
+  // end: stop the draining task. Records will stay in the buffer until drain() is called
+  void end();
+
+  // dropped: number of records lost since the start, as the buffer was full
+  inline uint32_t dropped() const { return LB_dropped.load(std::memory_order_relaxed); }
+
+protected:
+  // Prevent copy construction or assignment
+  ModbusLogBuffer(const ModbusLogBuffer& other) = delete;
+  ModbusLogBuffer& operator=(const ModbusLogBuffer& other) = delete;
+
+  // Record types and argument tags
+  enum Kind : uint8_t { LINE = 0, RAW, DUMP };
+  enum Tag : uint8_t { T_INT = 'i', T_UINT = 'u', T_DOUBLE = 'd', T_STRING = 's', T_POINTER = 'p' };
+
+  static const uint32_t WORDS = LOG_BUFFER_SIZE / 4;
+  static const uint32_t COMMITTED = 0x80000000;
+
+  // Header: the fixed part of a record
+  // For a DUMP, lineNo is the length kept and time the original length
+  struct Header {
+    uint8_t kind;
+    uint8_t colour;
+    char letter;
+    uint16_t lineNo;
+    uint32_t time;
+    const char *format;
+    const char *file;
+    const char *func;
+  };
+
+  // Cursor: writes or reads bytes to or from the words of a record, wrapping around the buffer end
+  struct Cursor {
+    std::atomic<uint32_t> *ring;
+    uint32_t pos;                 // Word index, counting up
+    uint32_t acc;                 // Word being filled or emptied
+    uint8_t fill;                 // Bytes in acc
+    Cursor(std::atomic<uint32_t> *r, uint32_t p) : ring(r), pos(p), acc(0), fill(0) {}
+    void put(const void *data, size_t len);
+    void flush();
+    void get(void *data, size_t len);
+  };
+
+  // Argument sizes and writers, by type
+  template <typename T>
+  static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, size_t>::type argSize(T) { return 9; }
+  template <typename T>
+  static typename std::enable_if<std::is_floating_point<T>::value, size_t>::type argSize(T) { return 9; }
+  static size_t argSize(const char *s);
+  static size_t argSize(char *s) { return argSize(static_cast<const char *>(s)); }
+  static size_t argSize(const void *) { return 9; }
+  static size_t argSize(std::nullptr_t) { return 9; }
+
+  template <typename T>
+  static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type putArg(Cursor& c, T v) {
+    putTagged(c, std::is_signed<T>::value ? T_INT : T_UINT, static_cast<uint64_t>(v));
+  }
+  template <typename T>
+  static typename std::enable_if<std::is_floating_point<T>::value>::type putArg(Cursor& c, T v) {
+    double d = v;
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    putTagged(c, T_DOUBLE, bits);
+  }
+  static void putArg(Cursor& c, const char *s);
+  static void putArg(Cursor& c, char *s) { putArg(c, static_cast<const char *>(s)); }
+  static void putArg(Cursor& c, const void *p) { putTagged(c, T_POINTER, reinterpret_cast<uintptr_t>(p)); }
+  static void putArg(Cursor& c, std::nullptr_t) { putTagged(c, T_POINTER, 0); }
+  static void putTagged(Cursor& c, uint8_t tag, uint64_t value);
+
+  // Sum up the argument sizes
+  static inline size_t argsSize() { return 0; }
+  template <typename T, typename... Args>
+  static size_t argsSize(T first, Args... rest) { return argSize(first) + argsSize(rest...); }
+
+  // Write the arguments
+  static inline void putArgs(Cursor&) { }
+  template <typename T, typename... Args>
+  static void putArgs(Cursor& c, T first, Args... rest) {
+    putArg(c, first);
+    putArgs(c, rest...);
+  }
+
+  // record: put a header and arguments into the buffer
+  template <typename... Args>
+  void record(const Header& h, Args... args) {
+    uint8_t count = sizeof...(args);
+    uint32_t bytes = sizeof(Header) + 1 + argsSize(args...);
+    uint32_t pos = 0;
+    if (!reserve(bytes, pos)) return;
+    Cursor c(LB_ring, pos + 1);
+    c.put(&h, sizeof(Header));
+    c.put(&count, 1);
+    putArgs(c, args...);
+    c.flush();
+    commit(pos, bytes);
+  }
+
+  // reserve: claim room for a record of bytes following its length word. Counts a drop if it fails
+  bool reserve(uint32_t bytes, uint32_t& pos);
+
+  // commit: the record at pos is complete and may be drained
+  void commit(uint32_t pos, uint32_t bytes);
+
+  // format: print one LINE or RAW record
+  void format(Cursor& c, const Header& h);
+
+  // dump: print one DUMP record
+  void dump(Cursor& c, const Header& h);
+
+  // output: print a buffer
+  static void output(const char *text);
+
+#if HAS_FREERTOS
+  static void run(ModbusLogBuffer *instance);
+#elif IS_LINUX
+  static void *pHandle(void *p);
+#endif
+
+  std::atomic<uint32_t> LB_ring[WORDS];   // Records: a length word with COMMITTED flag, then the data
+  std::atomic<uint32_t> LB_head;          // Next word to be reserved
+  std::atomic<uint32_t> LB_tail;          // Next word to be drained
+  std::atomic<uint32_t> LB_dropped;       // Records lost
+  uint32_t LB_reported;                   // Drops reported already
+#if USE_MUTEX
+  std::mutex LB_drainLock;                // Only one may drain at a time
+#endif
+#if HAS_FREERTOS
+  TaskHandle_t LB_task;
+#elif IS_LINUX
+  pthread_t LB_task;
+#endif
+};
+
+extern ModbusLogBuffer MBUlogBuffer;
+
+#endif  // _MODBUS_LOG_BUFFER_H
@@ -34,12 +34,11 @@ ModbusMessage& ModbusMessage::operator=(const ModbusMessage& m) {
 
 #ifndef NO_MOVE
   // Move constructor
-ModbusMessage::ModbusMessage(ModbusMessage&& m) {
-  MM_data = std::move(m.MM_data);
-}
+ModbusMessage::ModbusMessage(ModbusMessage&& m) noexcept :
+  MM_data(std::move(m.MM_data)) { }
   
 	// Move assignment
-ModbusMessage& ModbusMessage::operator=(ModbusMessage&& m) {
+ModbusMessage& ModbusMessage::operator=(ModbusMessage&& m) noexcept {
   MM_data = std::move(m.MM_data);
   return *this;
 }
@@ -50,7 +49,7 @@ ModbusMessage::ModbusMessage(const ModbusMessage& m) :
   MM_data(m.MM_data) { }
 
 // Equality comparison
-bool ModbusMessage::operator==(const ModbusMessage& m) {
+bool ModbusMessage::operator==(const ModbusMessage& m) const {
   // Prevent self-compare
   if (this == &m) return true;
   // If size is different, we assume inequality
@@ -66,19 +65,19 @@ bool ModbusMessage::operator==(const ModbusMessage& m) {
 }
 
 // Inequality comparison
-bool ModbusMessage::operator!=(const ModbusMessage& m) {
+bool ModbusMessage::operator!=(const ModbusMessage& m) const {
   return (!(*this == m));
 }
 
 // Conversion to bool
-ModbusMessage::operator bool() {
+ModbusMessage::operator bool() const {
   if (MM_data.size() >= 2) return true;
   return false;
 }
 
 // Exposed methods of std::vector
-const uint8_t *ModbusMessage::data() { return MM_data.data(); }
-uint16_t       ModbusMessage::size() { return MM_data.size(); }
+const uint8_t *ModbusMessage::data() const { return MM_data.data(); }
+uint16_t       ModbusMessage::size() const { return MM_data.size(); }
 void           ModbusMessage::push_back(const uint8_t& val) { MM_data.push_back(val); }
 void           ModbusMessage::clear() { MM_data.clear(); }
 // provide restricted operator[] interface
@@ -94,14 +93,18 @@ uint16_t ModbusMessage::resize(uint16_t newSize) {
   MM_data.resize(newSize); 
   return MM_data.size(); 
 }
+// Room MM_data has without reallocation
+uint16_t ModbusMessage::capacity() const {
+  return MM_data.capacity();
+}
 
 // Add append() for two ModbusMessages or a std::vector<uint8_t> to be appended
-void ModbusMessage::append(ModbusMessage& m) { 
+void ModbusMessage::append(const ModbusMessage& m) { 
   MM_data.reserve(size() + m.size()); 
   MM_data.insert(MM_data.end(), m.begin(), m.end()); 
 }
 
-void ModbusMessage::append(std::vector<uint8_t>& m) { 
+void ModbusMessage::append(const std::vector<uint8_t>& m) { 
   MM_data.reserve(size() + m.size()); 
   MM_data.insert(MM_data.end(), m.begin(), m.end()); 
 }
@@ -379,7 +382,7 @@ uint16_t ModbusMessage::get(uint16_t index, float& v, int swapRule) const {
   if (determineFloatOrder()) {
     // If we get here, the floatOrder is known
     // Will it fit?
-    if (index <= MM_data.size() - sizeof(float)) {
+    if (index + sizeof(float) <= MM_data.size()) {
       // Yes. Get the bytes of v in normalized sequence
       uint8_t *bytes = (uint8_t *)&v;
       for (uint8_t i = 0; i < sizeof(float); ++i) {
@@ -404,7 +407,7 @@ uint16_t ModbusMessage::get(uint16_t index, double& v, int swapRule) const {
   if (determineDoubleOrder()) {
     // If we get here, the doubleOrder is known
     // Will it fit?
-    if (index <= MM_data.size() - sizeof(double)) {
+    if (index + sizeof(double) <= MM_data.size()) {
       // Yes. Get the bytes of v in normalized sequence
       uint8_t *bytes = (uint8_t *)&v;
       for (uint8_t i = 0; i < sizeof(double); ++i) {
@@ -555,13 +558,31 @@ Error ModbusMessage::checkData(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     FCType ft = FCT::getType(functionCode);
-    if (ft != FCUSER && ft != FCGENERIC) {
+    // FC 0x17 requests were built from preformatted data before #9 came along
+    if (ft != FCUSER && ft != FCGENERIC && ft != FC17_TYPE) {
       returnCode = PARAMETER_COUNT_ERROR;
     } 
   }
   return returnCode;
 }
 
+// 9. four uint16_t parameters, a uint8_t length byte and a uint16_t* pointer to array of words (FC 0x17)
+Error ModbusMessage::checkData(uint8_t serverID, uint8_t functionCode, uint16_t p1, uint16_t p2, uint16_t p3, uint16_t p4, uint8_t count, uint16_t *arrayOfWords) {
+  LOG_V("Check data #9\n");
+  Error returnCode = checkServerFC(serverID, functionCode);
+  if (returnCode == SUCCESS)
+  {
+    FCType ft = FCT::getType(functionCode);
+    if (ft != FC17_TYPE && ft != FCUSER && ft != FCGENERIC) {
+      returnCode = PARAMETER_COUNT_ERROR;
+    } else {
+      if ((p2 == 0) || (p2 > 0x7d) || (p4 == 0) || (p4 > 0x79)) returnCode = PARAMETER_LIMIT_ERROR;
+      else if (count != (p4 * 2)) returnCode = ILLEGAL_DATA_VALUE;
+    }
+  }
+  return returnCode;
+}
+
 // Factory methods to create valid Modbus messages from the parameters
 // 1. no additional parameter (FCs 0x07, 0x0b, 0x0c, 0x11)
 Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode) {
@@ -571,9 +592,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode) {
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(2);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(2 + MODBUS_TAILROOM);
     add(serverID, functionCode);
   }
   return returnCode;
@@ -587,9 +608,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(4);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(4 + MODBUS_TAILROOM);
     add(serverID, functionCode, p1);
   }
   return returnCode;
@@ -603,9 +624,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(6);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(6 + MODBUS_TAILROOM);
     add(serverID, functionCode, p1, p2);
   }
   return returnCode;
@@ -619,9 +640,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(8);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(8 + MODBUS_TAILROOM);
     add(serverID, functionCode, p1, p2, p3);
   }
   return returnCode;
@@ -635,9 +656,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(7 + count * 2);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(7 + count * 2 + MODBUS_TAILROOM);
     add(serverID, functionCode, p1, p2);
     add(count);
     for (uint8_t i = 0; i < (count >> 1); ++i) {
@@ -655,9 +676,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(7 + count);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(7 + count + MODBUS_TAILROOM);
     add(serverID, functionCode, p1, p2);
     add(count);
     for (uint8_t i = 0; i < count; ++i) {
@@ -675,9 +696,9 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
   if (returnCode == SUCCESS)
   {
     // Yes, all fine. Create new ModbusMessage
-    MM_data.reserve(2 + count);
-    MM_data.shrink_to_fit();
     MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(2 + count + MODBUS_TAILROOM);
     add(serverID, functionCode);
     for (uint8_t i = 0; i < count; ++i) {
       add(arrayOfBytes[i]);
@@ -689,13 +710,33 @@ Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t
 // 8. Error response generator
 Error ModbusMessage::setError(uint8_t serverID, uint8_t functionCode, Error errorCode) {
   // No error checking for server ID or function code here, as both may be the cause for the message!? 
-  MM_data.reserve(3);
-  MM_data.shrink_to_fit();
   MM_data.clear();
+  MM_data.shrink_to_fit();
+  MM_data.reserve(3 + MODBUS_TAILROOM);
   add(serverID, static_cast<uint8_t>((functionCode | 0x80) & 0xFF), static_cast<uint8_t>(errorCode));
   return SUCCESS;
 }
 
+// 9. four uint16_t parameters, a uint8_t length byte and a uint16_t* pointer to array of words (FC 0x17)
+Error ModbusMessage::setMessage(uint8_t serverID, uint8_t functionCode, uint16_t p1, uint16_t p2, uint16_t p3, uint16_t p4, uint8_t count, uint16_t *arrayOfWords) {
+  // Check parameter for validity
+  Error returnCode = checkData(serverID, functionCode, p1, p2, p3, p4, count, arrayOfWords);
+  // No error? 
+  if (returnCode == SUCCESS)
+  {
+    // Yes, all fine. Create new ModbusMessage
+    MM_data.clear();
+    MM_data.shrink_to_fit();
+    MM_data.reserve(11 + count + MODBUS_TAILROOM);
+    add(serverID, functionCode, p1, p2);
+    add(p3, p4, count);
+    for (uint8_t i = 0; i < (count >> 1); ++i) {
+      add(arrayOfWords[i]);
+    }
+  }
+  return returnCode;
+}
+
 // Error output in case a message constructor will fail
 void ModbusMessage::printError(const char *file, int lineNo, Error e, uint8_t serverID, uint8_t functionCode) {
   LOG_E("(%s, line %d) Error in constructor: %02X - %s (%02X/%02X)\n", file_name(file), lineNo, e, (const char *)(ModbusError(e)), serverID, functionCode);
@@ -9,6 +9,22 @@
 #include <type_traits>
 #include <vector>
 
+// Compile with INLINE_MESSAGE defined to have ModbusMessage keep its data inside the object
+// instead of a heap-allocated std::vector. INLINE_MESSAGE_SIZE sets the capacity; the
+// default covers the maximum RTU ADU. Data beyond the capacity will be dropped!
+// Be aware that all ModbusMessage objects will use the full size then - on task stacks as well.
+#ifdef INLINE_MESSAGE
+#include "InlineBuffer.h"
+#ifndef INLINE_MESSAGE_SIZE
+#define INLINE_MESSAGE_SIZE 260
+#endif
+#endif
+
+// Room setMessage() keeps behind the message, for RTUutils to put the CRC there without copying
+#ifndef MODBUS_TAILROOM
+#define MODBUS_TAILROOM 2
+#endif
+
 using Modbus::Error;
 using Modbus::FCType;
 using Modbus::FCT;
@@ -16,6 +32,13 @@ using std::vector;
 
 class ModbusMessage {
 public:
+  // Storage type for the message data - selected at compile time
+#ifdef INLINE_MESSAGE
+  typedef InlineBuffer<INLINE_MESSAGE_SIZE> MessageData;
+#else
+  typedef std::vector<uint8_t> MessageData;
+#endif
+
   // Default empty message Constructor - optionally takes expected size of MM_data
   explicit ModbusMessage(uint16_t dataLen = 0);
 
@@ -43,33 +66,34 @@ public:
 
 #ifndef NO_MOVE
   // Move constructor
-	ModbusMessage(ModbusMessage&& m);
+	ModbusMessage(ModbusMessage&& m) noexcept;
   
 	// Move assignment
-	ModbusMessage& operator=(ModbusMessage&& m);
+	ModbusMessage& operator=(ModbusMessage&& m) noexcept;
 #endif
 
   // Comparison operators
-  bool operator==(const ModbusMessage& m);
-  bool operator!=(const ModbusMessage& m);
-  operator bool();
+  bool operator==(const ModbusMessage& m) const;
+  bool operator!=(const ModbusMessage& m) const;
+  operator bool() const;
   
   // Exposed methods of std::vector
-  const uint8_t   *data();  // address of MM_data
-  uint16_t   size();  // used length in MM_data
+  const uint8_t   *data() const;  // address of MM_data
+  uint16_t   size() const;  // used length in MM_data
   uint8_t    operator[](uint16_t index) const; // provide restricted operator[] interface
   void push_back(const uint8_t& val); // add a byte at the end of MM_data
   void clear();             // delete message contents
   uint16_t resize(uint16_t newSize);  // resize MM_data
+  uint16_t capacity() const;  // size MM_data may grow to without reallocation
 
   // provide iterator interface on MM_data
-  typedef std::vector<uint8_t>::const_iterator const_iterator;
+  typedef MessageData::const_iterator const_iterator;
   const_iterator begin() const { return MM_data.begin(); }
   const_iterator end() const   { return MM_data.end(); }
 
   // Add append() for two ModbusMessages or a std::vector<uint8_t> to be appended
-  void append(ModbusMessage& m);
-  void append(std::vector<uint8_t>& m);
+  void append(const ModbusMessage& m);
+  void append(const std::vector<uint8_t>& m);
 
   // Modbus data extraction
   uint8_t getServerID() const;      // returns Server ID or 0 if MM_data is shorter than 3
@@ -112,7 +136,7 @@ inline uint16_t get(uint16_t index) const { return index; }
 
 // Template function to extend getOne(index, A&) to get(index, A&, B&, C&, ...)
 template <class T, class... Args>
-typename std::enable_if<!std::is_pointer<T>::value, uint16_t>::type
+typename std::enable_if<!std::is_pointer<T>::value && !std::is_array<T>::value, uint16_t>::type
 get(uint16_t index, T& v, Args&... args) const {
   uint16_t pos = getOne(index, v);
   return get(pos, args...);
@@ -129,6 +153,59 @@ uint16_t add(double v, int swapRules = 0);
 uint16_t get(uint16_t index, float& v, int swapRules = 0) const;
 uint16_t get(uint16_t index, double& v, int swapRules = 0) const;
 
+  // Bulk add() for arrays of integral values: append count values MSB first. Returns updated size
+  template <class T>
+  typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, uint16_t>::type
+  add(const T *values, uint16_t count) {
+    typedef typename std::make_unsigned<T>::type U;
+    uint8_t *dst = grow(count, sizeof(T));
+    for (uint16_t i = 0; i < count; ++i) {
+      U v = static_cast<U>(values[i]);
+      for (uint8_t sz = sizeof(T); sz;) {
+        sz--;
+        *dst++ = (v >> (sz << 3)) & 0xFF;
+      }
+    }
+    return MM_data.size();
+  }
+
+  // Bulk get() for arrays of integral values: read count MSB-first values starting at byte index.
+  // Returns updated index, or index unchanged if not all values are in the message
+  template <class T>
+  typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, uint16_t>::type
+  get(uint16_t index, T *values, uint16_t count) const {
+    typedef typename std::make_unsigned<T>::type U;
+    if (index + (size_t)count * sizeof(T) > MM_data.size()) return index;
+    const uint8_t *src = MM_data.data() + index;
+    for (uint16_t i = 0; i < count; ++i) {
+      U v = 0;
+      for (uint8_t sz = 0; sz < sizeof(T); ++sz) {
+        v = (v << 8) | *src++;
+      }
+      values[i] = static_cast<T>(v);
+    }
+    return index + count * sizeof(T);
+  }
+
+  // Bulk add() and get() for float and double arrays. The swap rule is a template parameter,
+  // as in add<SWAP_REGISTERS>(values, count), so only the byte order has to be looked up per call.
+  template <int SWAPRULE = 0>
+  uint16_t add(const float *values, uint16_t count) {
+    return addSwapped<float, SWAPRULE & 0x0B>(values, count, floatOrder, determineFloatOrder());
+  }
+  template <int SWAPRULE = 0>
+  uint16_t add(const double *values, uint16_t count) {
+    return addSwapped<double, SWAPRULE & 0x0F>(values, count, doubleOrder, determineDoubleOrder());
+  }
+  template <int SWAPRULE = 0>
+  uint16_t get(uint16_t index, float *values, uint16_t count) const {
+    return getSwapped<float, SWAPRULE & 0x0B>(index, values, count, floatOrder, determineFloatOrder());
+  }
+  template <int SWAPRULE = 0>
+  uint16_t get(uint16_t index, double *values, uint16_t count) const {
+    return getSwapped<double, SWAPRULE & 0x0F>(index, values, count, doubleOrder, determineDoubleOrder());
+  }
+
   // Message generation methods
   // 1. no additional parameter (FCs 0x07, 0x0b, 0x0c, 0x11)
   Error setMessage(uint8_t serverID, uint8_t functionCode);
@@ -153,6 +230,10 @@ uint16_t get(uint16_t index, double& v, int swapRules = 0) const;
 
   // 8. error response
   Error setError(uint8_t serverID, uint8_t functionCode, Error errorCode);
+
+  // 9. four uint16_t parameters, a uint8_t length byte and a uint16_t* pointer to array of words (FC 0x17)
+  // p1/p2: read address and number of registers, p3/p4: write address and number of registers
+  Error setMessage(uint8_t serverID, uint8_t functionCode, uint16_t p1, uint16_t p2, uint16_t p3, uint16_t p4, uint8_t count, uint16_t *arrayOfWords);
   
 protected:
   // Data validation methods - used by the above!
@@ -180,10 +261,13 @@ protected:
   // 7. generic constructor for preformatted data ==> count is counting bytes!
   static Error checkData(uint8_t serverID, uint8_t functionCode, uint16_t count, uint8_t *arrayOfBytes);
 
+  // 9. four uint16_t parameters, a uint8_t length byte and a uint16_t* pointer to array of words (FC 0x17)
+  static Error checkData(uint8_t serverID, uint8_t functionCode, uint16_t p1, uint16_t p2, uint16_t p3, uint16_t p4, uint8_t count, uint16_t *arrayOfWords);
+
   // Error output in case a message constructor will fail
   static void printError(const char *file, int lineNo, Error e, uint8_t serverID, uint8_t functionCode);
 
-  std::vector<uint8_t> MM_data;  // Message data buffer
+  MessageData MM_data;           // Message data buffer
 
   static uint8_t floatOrder[sizeof(float)]; // order of bytes in a float variable
   static uint8_t doubleOrder[sizeof(double)]; // order of bytes in a double variable
@@ -194,6 +278,61 @@ protected:
   static float swapFloat(float& f, int swapRule);
   static double swapDouble(double& f, int swapRule);
 
+  // grow: extend MM_data by count values of size bytes each. Returns the address of the first new byte.
+  // An inline buffer may have less room - count is cut down then.
+  uint8_t *grow(uint16_t& count, uint8_t size) {
+    size_t pos = MM_data.size();
+    MM_data.resize(pos + (size_t)count * size);
+    if (MM_data.size() < pos + (size_t)count * size) count = (MM_data.size() - pos) / size;
+    return MM_data.data() + pos;
+  }
+
+  // swapOrder: combine the native byte order and a swap rule into one byte permutation
+  template <typename T, int SWAPRULE>
+  static void swapOrder(uint8_t *perm, const uint8_t *order) {
+    for (uint8_t i = 0; i < sizeof(T); ++i) {
+      perm[i] = order[swapTables[SWAPRULE & (sizeof(T) == 4 ? 0x03 : 0x07)][i]];
+    }
+  }
+
+  // nibbles: swap the nibbles of a byte if the swap rule says so
+  template <int SWAPRULE>
+  static inline uint8_t nibbles(uint8_t b) {
+    return (SWAPRULE & SWAP_NIBBLES) ? ((b & 0x0F) << 4) | ((b >> 4) & 0x0F) : b;
+  }
+
+  // addSwapped, getSwapped: the workers for the bulk float and double add() and get()
+  template <typename T, int SWAPRULE>
+  uint16_t addSwapped(const T *values, uint16_t count, const uint8_t *order, uint8_t known) {
+    if (!known) return MM_data.size();
+    uint8_t perm[sizeof(T)];
+    swapOrder<T, SWAPRULE>(perm, order);
+    uint8_t *dst = grow(count, sizeof(T));
+    for (uint16_t i = 0; i < count; ++i) {
+      const uint8_t *src = reinterpret_cast<const uint8_t *>(values + i);
+      for (uint8_t j = 0; j < sizeof(T); ++j) {
+        *dst++ = nibbles<SWAPRULE>(src[perm[j]]);
+      }
+    }
+    return MM_data.size();
+  }
+
+  template <typename T, int SWAPRULE>
+  uint16_t getSwapped(uint16_t index, T *values, uint16_t count, const uint8_t *order, uint8_t known) const {
+    if (!known || index + (size_t)count * sizeof(T) > MM_data.size()) return index;
+    uint8_t perm[sizeof(T)];
+    swapOrder<T, SWAPRULE>(perm, order);
+    const uint8_t *src = MM_data.data() + index;
+    for (uint16_t i = 0; i < count; ++i) {
+      uint8_t *dst = reinterpret_cast<uint8_t *>(values + i);
+      for (uint8_t j = 0; j < sizeof(T); ++j) {
+        dst[j] = nibbles<SWAPRULE>(src[perm[j]]);
+      }
+      src += sizeof(T);
+    }
+    return index + count * sizeof(T);
+  }
+
   // getOne() - read a MSB-first value starting at byte index. Returns updated index
   template <typename T> uint16_t getOne(uint16_t index, T& retval) const {
     uint16_t sz = sizeof(retval);    // Size of value to be read
@@ -201,7 +340,7 @@ protected:
     retval = 0;                      // return value
 
     // Will it fit?
-    if (index <= MM_data.size() - sz) {
+    if (index + sz <= MM_data.size()) {
       // Yes. Copy it MSB first
       while (sz) {
         sz--;
@@ -0,0 +1,89 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusMessagePool.h"
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Static members
+ModbusMessage *ModbusMessagePool::MP_slot[MESSAGE_POOL_SIZE] = { nullptr };
+bool ModbusMessagePool::MP_used[MESSAGE_POOL_SIZE] = { false };
+uint16_t ModbusMessagePool::MP_inUse = 0;
+uint16_t ModbusMessagePool::MP_highWater = 0;
+uint32_t ModbusMessagePool::MP_exhausted = 0;
+#if USE_MUTEX
+mutex ModbusMessagePool::MP_lock;
+#endif
+
+// acquire: get an empty message buffer
+ModbusMessage *ModbusMessagePool::acquire() {
+  {
+    LOCK_GUARD(lockGuard, MP_lock);
+    // Look for a free slot
+    for (uint16_t i = 0; i < MESSAGE_POOL_SIZE; ++i) {
+      if (!MP_used[i]) {
+        // Found one. Is the buffer allocated already?
+        if (!MP_slot[i]) {
+          // No. Do it now - it will stay with the pool from now on
+          MP_slot[i] = new ModbusMessage(MESSAGE_POOL_BLOCKSIZE);
+        }
+        MP_used[i] = true;
+        MP_inUse++;
+        if (MP_inUse > MP_highWater) MP_highWater = MP_inUse;
+        return MP_slot[i];
+      }
+    }
+    // Pool is exhausted. Count it.
+    MP_exhausted++;
+  }
+  LOG_W("Message pool exhausted!\n");
+  return new ModbusMessage(MESSAGE_POOL_BLOCKSIZE);
+}
+
+// release: give back a message buffer. Messages not from the pool are deleted.
+void ModbusMessagePool::release(ModbusMessage *m) {
+  if (!m) return;
+  {
+    LOCK_GUARD(lockGuard, MP_lock);
+    for (uint16_t i = 0; i < MESSAGE_POOL_SIZE; ++i) {
+      if (MP_slot[i] == m) {
+        // It is ours. Empty it, but keep the allocated capacity
+        m->clear();
+        if (MP_used[i]) {
+          MP_used[i] = false;
+          MP_inUse--;
+        }
+        return;
+      }
+    }
+  }
+  // Not a pool buffer - must have been a heap fallback
+  delete m;
+}
+
+// Number of pool buffers currently in use
+uint16_t ModbusMessagePool::inUse() {
+  LOCK_GUARD(lockGuard, MP_lock);
+  return MP_inUse;
+}
+
+// Maximum number of pool buffers used at the same time
+uint16_t ModbusMessagePool::highWaterMark() {
+  LOCK_GUARD(lockGuard, MP_lock);
+  return MP_highWater;
+}
+
+// Number of acquire() calls that had to use the heap
+uint32_t ModbusMessagePool::exhausted() {
+  LOCK_GUARD(lockGuard, MP_lock);
+  return MP_exhausted;
+}
+
+// Reset highWaterMark and exhausted counters
+void ModbusMessagePool::resetCounts() {
+  LOCK_GUARD(lockGuard, MP_lock);
+  MP_highWater = MP_inUse;
+  MP_exhausted = 0;
+}
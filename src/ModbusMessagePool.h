@@ -0,0 +1,67 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_MESSAGE_POOL_H
+#define _MODBUS_MESSAGE_POOL_H
+
+#include "options.h"
+#include "ModbusMessage.h"
+#if USE_MUTEX
+#include <mutex>    // NOLINT
+using std::mutex;
+using std::lock_guard;
+#endif
+
+// Number of message buffers held in the pool
+#ifndef MESSAGE_POOL_SIZE
+#define MESSAGE_POOL_SIZE 8
+#endif
+
+// Initial capacity of each pooled buffer. 264 will fit a TCP ADU (260) plus some slack
+#ifndef MESSAGE_POOL_BLOCKSIZE
+#define MESSAGE_POOL_BLOCKSIZE 264
+#endif
+
+// ModbusMessagePool: a bounded set of reusable ModbusMessage buffers.
+// Buffers are created on first demand and never freed again, so their capacity is kept
+// from one transaction to the next. If all buffers are in use, acquire() will fall back
+// to a heap allocated message and count that as an exhaustion event.
+// All functions are static!
+class ModbusMessagePool {
+public:
+  // acquire: get an empty message buffer
+  static ModbusMessage *acquire();
+
+  // release: give back a message buffer. Messages not from the pool are deleted.
+  static void release(ModbusMessage *m);
+
+  // Number of buffers the pool is holding
+  static inline uint16_t poolSize() { return MESSAGE_POOL_SIZE; }
+
+  // Number of pool buffers currently in use
+  static uint16_t inUse();
+
+  // Maximum number of pool buffers used at the same time
+  static uint16_t highWaterMark();
+
+  // Number of acquire() calls that had to use the heap
+  static uint32_t exhausted();
+
+  // Reset highWaterMark and exhausted counters
+  static void resetCounts();
+
+protected:
+  ModbusMessagePool() = delete;
+
+  static ModbusMessage *MP_slot[MESSAGE_POOL_SIZE];  // Pool buffers, allocated on first use
+  static bool MP_used[MESSAGE_POOL_SIZE];            // Flags for buffers handed out
+  static uint16_t MP_inUse;                          // Current number of buffers in use
+  static uint16_t MP_highWater;                      // Maximum of MP_inUse so far
+  static uint32_t MP_exhausted;                      // Number of heap fallbacks
+#if USE_MUTEX
+  static mutex MP_lock;                              // Protect pool against concurrent access
+#endif
+};
+
+#endif
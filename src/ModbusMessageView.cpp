@@ -0,0 +1,67 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusMessageView.h"
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Conversion to an owned ModbusMessage - this will copy the data!
+ModbusMessageView::operator ModbusMessage() const {
+  ModbusMessage m(MV_size);
+  if (MV_size) m.add(MV_data, MV_size);
+  return m;
+}
+
+// slice: view on a part of this view, starting at offset with up to count bytes
+ModbusMessageView ModbusMessageView::slice(uint16_t offset, uint16_t count) const {
+  // Offset beyond the data? Return an empty view
+  if (offset >= MV_size) return ModbusMessageView();
+  // Limit count to the data available
+  if (count > MV_size - offset) count = MV_size - offset;
+  return ModbusMessageView(MV_data + offset, count);
+}
+
+// provide restricted operator[] interface
+uint8_t ModbusMessageView::operator[](uint16_t index) const {
+  if (index < MV_size) {
+    return MV_data[index];
+  }
+  LOG_W("Index %d out of bounds (>=%d).\n", index, MV_size);
+  return 0;
+}
+
+uint8_t ModbusMessageView::getServerID() const {
+  // Only if we have data and it is at least as long to fit serverID and function code, return serverID
+  if (MV_size >= 2) { return MV_data[0]; }
+  return 0;
+}
+
+uint8_t ModbusMessageView::getFunctionCode() const {
+  // Only if we have data and it is at least as long to fit serverID and function code, return FC
+  if (MV_size >= 2) { return MV_data[1]; }
+  return 0;
+}
+
+// getError() - returns error code
+Error ModbusMessageView::getError() const {
+  // Do we have data long enough and does it indicate an error?
+  if (MV_size > 2 && (MV_data[1] & 0x80)) {
+    // Yes. Get it.
+    return static_cast<Modbus::Error>(MV_data[2]);
+  }
+  // Default: everything OK - SUCCESS
+  return SUCCESS;
+}
+
+// get() - read a byte array of a given size into a vector<uint8_t>. Returns updated index
+uint16_t ModbusMessageView::get(uint16_t index, vector<uint8_t>& v, uint8_t count) const {
+  // Clean target vector
+  v.clear();
+  // Loop until required count is complete or the source is exhausted
+  while (index < MV_size && count--) {
+    v.push_back(MV_data[index++]);
+  }
+  return index;
+}
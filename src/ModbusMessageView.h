@@ -0,0 +1,83 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_MESSAGE_VIEW_H
+#define _MODBUS_MESSAGE_VIEW_H
+#include "ModbusMessage.h"
+
+// ModbusMessageView: read-only, non-owning look into a block of message data.
+// Creating a view, or a slice of it, will not copy any data. The view is only valid as long as
+// the underlying buffer is - do not keep it beyond the call it was handed in!
+class ModbusMessageView {
+public:
+  typedef const uint8_t *const_iterator;
+
+  // Empty view
+  ModbusMessageView() : MV_data(nullptr), MV_size(0) {}
+
+  // View on a block of data
+  ModbusMessageView(const uint8_t *data, uint16_t size) : MV_data(data), MV_size(size) {}
+
+  // View on a complete ModbusMessage
+  explicit ModbusMessageView(ModbusMessage& m) : MV_data(m.data()), MV_size(m.size()) {}
+
+  // Conversion to an owned ModbusMessage - this will copy the data!
+  explicit operator ModbusMessage() const;
+
+  // slice: view on a part of this view, starting at offset with up to count bytes
+  ModbusMessageView slice(uint16_t offset, uint16_t count = 0xFFFF) const;
+
+  // Exposed methods of ModbusMessage
+  inline const uint8_t *data() const { return MV_data; }
+  inline uint16_t size() const { return MV_size; }
+  uint8_t operator[](uint16_t index) const;  // restricted operator[] interface as in ModbusMessage
+  inline operator bool() const { return MV_size >= 2; }
+
+  // provide iterator interface on the data
+  inline const_iterator begin() const { return MV_data; }
+  inline const_iterator end() const   { return MV_data + MV_size; }
+
+  // Modbus data extraction
+  uint8_t getServerID() const;      // returns Server ID or 0 if data is shorter than 2
+  uint8_t getFunctionCode() const;  // returns FC or 0 if data is shorter than 2
+  Error   getError() const;         // returns error code (data[2], if data[1] > 0x7F, else SUCCESS)
+
+  // get() - read a byte array of a given size into a vector<uint8_t>. Returns updated index
+  uint16_t get(uint16_t index, vector<uint8_t>& v, uint8_t count) const;
+
+  // get() - recursion stopper for template function below
+  inline uint16_t get(uint16_t index) const { return index; }
+
+  // Template function to extend getOne(index, A&) to get(index, A&, B&, C&, ...)
+  template <class T, class... Args>
+  typename std::enable_if<!std::is_pointer<T>::value, uint16_t>::type
+  get(uint16_t index, T& v, Args&... args) const {
+    uint16_t pos = getOne(index, v);
+    return get(pos, args...);
+  }
+
+protected:
+  // getOne() - read a MSB-first value starting at byte index. Returns updated index
+  template <typename T> uint16_t getOne(uint16_t index, T& retval) const {
+    uint16_t sz = sizeof(retval);    // Size of value to be read
+
+    retval = 0;                      // return value
+
+    // Will it fit?
+    if (index + sz <= MV_size) {
+      // Yes. Copy it MSB first
+      while (sz) {
+        sz--;
+        retval <<= 8;
+        retval |= MV_data[index++];
+      }
+    }
+    return index;
+  }
+
+  const uint8_t *MV_data;        // Start of viewed data
+  uint16_t MV_size;              // Number of bytes viewed
+};
+
+#endif
@@ -0,0 +1,191 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusPoller.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include <algorithm>
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+uint16_t ModbusPoller::instanceCounter = 0;
+
+// Constructor takes the client to issue the requests on
+ModbusPoller::ModbusPoller(ModbusClient& client, uint32_t maxPending, bool coalesce) :
+  MP_client(client),
+  MP_entries(),
+  MP_maxPending(maxPending ? maxPending : 1),
+  MP_issued(0),
+  MP_skipped(0),
+#if HAS_FREERTOS
+  MP_task(nullptr) {
+#elif IS_LINUX
+  MP_task(0) {
+#endif
+  instanceCounter++;
+  if (coalesce) MP_client.coalesceReads();
+}
+
+// Destructor: stop the task
+ModbusPoller::~ModbusPoller() {
+  end();
+}
+
+// add: declare a scan list entry
+bool ModbusPoller::add(uint32_t token, uint8_t serverID, uint8_t functionCode, uint16_t address, uint16_t count, uint32_t period, uint8_t priority) {
+  // Reads only, with a period
+  if (functionCode < READ_COIL || functionCode > READ_INPUT_REGISTER || !period) {
+    LOG_E("Invalid scan list entry %08X: FC %02X, period %u\n", token, functionCode, period);
+    return false;
+  }
+  ModbusMessage request;
+  if (request.setMessage(serverID, functionCode, address, count) != SUCCESS) return false;
+
+  LOCK_GUARD(lockGuard, MP_lock);
+  for (auto& e : MP_entries) {
+    if (e.token == token) {
+      LOG_E("Token %08X already in scan list\n", token);
+      return false;
+    }
+  }
+  MP_entries.push_back(PollEntry(token, request, period, priority, millis()));
+  LOG_D("Scan list entry %08X added: %02X/%02X %u/%u every %ums\n", token, serverID, functionCode, address, count, period);
+  // It is due right away
+  MP_wakeup.signal();
+  return true;
+}
+
+// remove: take an entry off the scan list
+bool ModbusPoller::remove(uint32_t token) {
+  LOCK_GUARD(lockGuard, MP_lock);
+  for (auto it = MP_entries.begin(); it != MP_entries.end(); ++it) {
+    if (it->token == token) {
+      MP_entries.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+// clear: empty the scan list
+void ModbusPoller::clear() {
+  LOCK_GUARD(lockGuard, MP_lock);
+  MP_entries.clear();
+}
+
+// loop: issue the due entries. Returns the ms until it needs to be called again
+uint32_t ModbusPoller::loop() {
+  uint32_t nextCall = 1000;
+  unsigned long now = millis();
+  std::vector<PollEntry *> due;
+
+  LOCK_GUARD(lockGuard, MP_lock);
+  // Collect all entries due, and find the time the next will be due
+  for (auto& e : MP_entries) {
+    long left = (long)(e.due - now);
+    if (left <= 0) {
+      due.push_back(&e);
+    } else if ((uint32_t)left < nextCall) {
+      nextCall = left;
+    }
+  }
+  if (due.empty()) return nextCall;
+
+  // Highest priority first, within the same priority the longest waiting
+  std::sort(due.begin(), due.end(), [now](const PollEntry *a, const PollEntry *b) {
+    if (a->priority != b->priority) return a->priority < b->priority;
+    return (now - a->due) > (now - b->due);
+  });
+
+  for (auto e : due) {
+    // Back-pressure: do not flood the client, try again soon
+    if (MP_client.pendingRequests() >= MP_maxPending) return 1;
+    if (MP_client.addRequest(e->request, e->token) != SUCCESS) return 1;
+    MP_issued++;
+    // Next read is due one period later - unless we are late by more than that
+    uint32_t missed = (now - e->due) / e->period;
+    if (missed) {
+      MP_skipped += missed;
+      LOG_V("Scan list entry %08X skipped %u periods\n", e->token, missed);
+    }
+    e->due += (missed + 1) * e->period;
+    uint32_t left = e->due - now;
+    if (left < nextCall) nextCall = left;
+  }
+  return nextCall;
+}
+
+// issued: number of reads issued
+uint32_t ModbusPoller::issued() {
+  return MP_issued;
+}
+
+// skipped: number of periods skipped for back-pressure
+uint32_t ModbusPoller::skipped() {
+  return MP_skipped;
+}
+
+// resetCounts: set issued and skipped counts to zero
+void ModbusPoller::resetCounts() {
+  LOCK_GUARD(lockGuard, MP_lock);
+  MP_issued = 0;
+  MP_skipped = 0;
+}
+
+// begin: start a task calling loop()
+#if IS_LINUX
+void *ModbusPoller::pHandle(void *p) {
+  run((ModbusPoller *)p);
+  return nullptr;
+}
+#endif
+
+void ModbusPoller::begin(int coreID) {
+  if (!MP_task) {
+#if IS_LINUX
+    int rc = pthread_create(&MP_task, NULL, &pHandle, this);
+    if (rc) {
+      LOG_E("Error creating poller thread: %d\n", rc);
+    } else {
+      LOG_D("Poller worker started.\n");
+    }
+#else
+    // Create unique task name
+    char taskName[18];
+    snprintf(taskName, 18, "Modbus%02XPOLL", instanceCounter);
+    // Start task to issue the scan list
+    xTaskCreatePinnedToCore((TaskFunction_t)&run, taskName, 4096, this, 5, &MP_task, coreID >= 0 ? coreID : NULL);
+    LOG_D("Poller task %d started.\n", (uint32_t)MP_task);
+#endif
+  }
+}
+
+// end: stop the task
+void ModbusPoller::end() {
+  if (MP_task) {
+    // Do not kill it in the middle of a loop()
+    LOCK_GUARD(lockGuard, MP_lock);
+#if IS_LINUX
+    pthread_cancel(MP_task);
+    MP_task = 0;
+#else
+    vTaskDelete(MP_task);
+    MP_task = nullptr;
+#endif
+    LOG_D("Poller worker killed.\n");
+  }
+}
+
+// run: poller task
+void ModbusPoller::run(ModbusPoller *instance) {
+  // Loop forever - or until task is killed
+  while (1) {
+    uint32_t wait = instance->loop();
+    instance->MP_wakeup.wait(wait ? wait : 1);
+  }
+}
+
+#endif  // HAS_FREERTOS || IS_LINUX
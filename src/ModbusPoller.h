@@ -0,0 +1,92 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_POLLER_H
+#define _MODBUS_POLLER_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#include <vector>
+#include "ModbusClient.h"
+#include "ModbusWakeup.h"
+
+// ModbusPoller: issues the reads of a scan list on a ModbusClient periodically.
+// Each entry is read every period ms, counted from its first issue, so delays do not add up.
+// Due entries are issued by priority (0 is highest), as long as the client has less than
+// maxPending requests pending. Periods missed completely by that are skipped and counted.
+// The responses come in through the client's onData/onError/onResponse handlers with the
+// token of the entry. With coalescing, due entries with adjacent ranges are merged by the client.
+class ModbusPoller {
+public:
+  explicit ModbusPoller(ModbusClient& client, uint32_t maxPending = 4, bool coalesce = true);
+  ~ModbusPoller();
+
+  // add: declare a scan list entry for a read of FC 0x01..0x04. Returns false if it is invalid
+  // or the token is in use already. The first read will be issued right away.
+  bool add(uint32_t token, uint8_t serverID, uint8_t functionCode, uint16_t address, uint16_t count, uint32_t period, uint8_t priority = 0);
+
+  // remove: take an entry off the scan list. Returns false if the token was not found
+  bool remove(uint32_t token);
+
+  // clear: empty the scan list
+  void clear();
+
+  // begin: start a task calling loop()
+  void begin(int coreID = -1);
+
+  // end: stop the task
+  void end();
+
+  // loop: issue the due entries. Returns the ms until it needs to be called again.
+  // Call it regularly yourself, if you do not want to use begin().
+  uint32_t loop();
+
+  // Informative: number of reads issued and of periods skipped for back-pressure
+  uint32_t issued();
+  uint32_t skipped();
+  void resetCounts();
+
+protected:
+  struct PollEntry {
+    uint32_t token;
+    ModbusMessage request;      // The read request to issue
+    uint32_t period;            // Time in ms between two reads
+    uint8_t priority;           // Priority class, 0 is highest
+    unsigned long due;          // Time the next read is due
+    PollEntry(uint32_t t, ModbusMessage& r, uint32_t p, uint8_t pr, unsigned long d) :
+      token(t), request(r), period(p), priority(pr), due(d) {}
+  };
+
+  // Prevent copy construction and assignment
+  ModbusPoller(const ModbusPoller&) = delete;
+  ModbusPoller& operator=(const ModbusPoller&) = delete;
+
+  // run: poller task
+  static void run(ModbusPoller *instance);
+#if IS_LINUX
+  static void *pHandle(void *p);
+#endif
+
+  ModbusClient& MP_client;          // Client to issue the requests on
+  std::vector<PollEntry> MP_entries; // The scan list
+  uint32_t MP_maxPending;           // Issue no more while the client has this many pending
+  uint32_t MP_issued;               // Number of reads issued
+  uint32_t MP_skipped;              // Number of periods skipped
+  #if USE_MUTEX
+  mutex MP_lock;                    // Protects the scan list
+  #endif
+  ModbusWakeup MP_wakeup;           // Wakes up the task when an entry was added
+#if HAS_FREERTOS
+  TaskHandle_t MP_task;             // Poller task
+#elif IS_LINUX
+  pthread_t MP_task;
+#endif
+  static uint16_t instanceCounter;  // Number of pollers created
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // _MODBUS_POLLER_H
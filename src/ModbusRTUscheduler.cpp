@@ -0,0 +1,145 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusRTUscheduler.h"
+
+#if HAS_FREERTOS
+
+#include "ModbusMessagePool.h"
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+uint16_t ModbusRTUscheduler::instanceCounter = 0;
+
+// Constructor: no clients, no task yet
+ModbusRTUscheduler::ModbusRTUscheduler() :
+  MS_task(nullptr) {
+  instanceCounter++;
+}
+
+// Destructor: stop the task and hand back all clients
+ModbusRTUscheduler::~ModbusRTUscheduler() {
+  end();
+  while (!MS_clients.empty()) {
+    remove(*MS_clients.front());
+  }
+}
+
+// addClient: let the scheduler drive a client on serial
+bool ModbusRTUscheduler::addClient(ModbusClientRTU& client, Stream& serial, uint32_t baudRate) {
+  // The state machines know Modbus RTU only
+  if (client.MR_useASCII || !baudRate) {
+    LOG_E("Client can not be scheduled (ASCII mode or no baud rate)\n");
+    return false;
+  }
+  // Stop the client's own task, or detach it from another scheduler
+  client.end();
+
+  LOCK_GUARD(lockGuard, MS_lock);
+  client.MR_serial = &serial;
+  client.MTRSrts(LOW);
+  client.MR_interval = RTUutils::calculateInterval(baudRate);
+  // 11 bits per character: start, 8 data, parity or second stop and stop bit
+  client.MR_charMicros = (11000000UL + baudRate - 1) / baudRate;
+  client.MR_lastMicros = micros();
+  client.MR_state = ModbusClientRTU::MRS_IDLE;
+  // New requests shall wake up the scheduler task instead
+  client.MR_notify = &MS_wakeup;
+  client.MR_scheduler = this;
+  // Initially clean the serial buffer
+  while (serial.available()) {
+    serial.read();
+  }
+  MS_clients.push_back(&client);
+  LOG_D("Client added to scheduler, %d clients. Interval=%d\n", MS_clients.size(), client.MR_interval);
+  // There may be requests queued already
+  MS_wakeup.signal();
+  return true;
+}
+
+// addClient: HardwareSerial variant
+bool ModbusRTUscheduler::addClient(ModbusClientRTU& client, HardwareSerial& serial) {
+  serial.setRxFIFOFull(1);
+  return addClient(client, serial, serial.baudRate());
+}
+
+// remove: stop driving a client
+void ModbusRTUscheduler::remove(ModbusClientRTU& client) {
+  LOCK_GUARD(lockGuard, MS_lock);
+  for (auto it = MS_clients.begin(); it != MS_clients.end(); ++it) {
+    if (*it == &client) {
+      MS_clients.erase(it);
+      // A response may be on its way - drop it
+      if (client.MR_rxBuffer) {
+        ModbusMessagePool::release(client.MR_rxBuffer);
+        client.MR_rxBuffer = nullptr;
+      }
+      // Release the bus, if we stopped in the middle of sending
+      if (client.MR_state == ModbusClientRTU::MRS_SENDING) client.MTRSrts(LOW);
+      client.MR_state = ModbusClientRTU::MRS_IDLE;
+      client.MR_notify = &client.MR_wakeup;
+      client.MR_scheduler = nullptr;
+      LOG_D("Client removed from scheduler, %d clients left\n", MS_clients.size());
+      break;
+    }
+  }
+}
+
+// begin: start the scheduler task
+void ModbusRTUscheduler::begin(int coreID) {
+  // Task already running? End it in case
+  end();
+
+  // Create unique task name
+  char taskName[18];
+  snprintf(taskName, 18, "Modbus%02XSCHED", instanceCounter);
+  // Start task to handle the clients
+  xTaskCreatePinnedToCore((TaskFunction_t)&run, taskName, 4096, this, 6, &MS_task, coreID >= 0 ? coreID : NULL);
+
+  LOG_D("Scheduler task %d started.\n", (uint32_t)MS_task);
+}
+
+// end: stop the scheduler task
+void ModbusRTUscheduler::end() {
+  if (MS_task) {
+    // Wait for a turn to be finished - the clients' states must be consistent
+    LOCK_GUARD(lockGuard, MS_lock);
+    vTaskDelete(MS_task);
+    LOG_D("Scheduler task %d killed.\n", (uint32_t)MS_task);
+    MS_task = nullptr;
+  }
+}
+
+// clients: number of clients driven
+uint16_t ModbusRTUscheduler::clients() {
+  LOCK_GUARD(lockGuard, MS_lock);
+  return MS_clients.size();
+}
+
+// run: scheduler task
+// Each turn steps all clients once. All buses idle: sleep until a request is queued.
+// Waiting for the bus or responses only: give the other tasks a tick. Else go on right away.
+void ModbusRTUscheduler::run(ModbusRTUscheduler *instance) {
+  // Loop forever - or until task is killed
+  while (1) {
+    uint8_t most = ModbusClientRTU::STEP_IDLE;
+    {
+      LOCK_GUARD(lockGuard, instance->MS_lock);
+      for (auto client : instance->MS_clients) {
+        uint8_t rc = client->step();
+        if (rc > most) most = rc;
+      }
+    }
+    if (most == ModbusClientRTU::STEP_IDLE) {
+      instance->MS_wakeup.wait(1000);
+    } else if (most == ModbusClientRTU::STEP_WAIT) {
+      delay(1);
+    } else {
+      taskYIELD();
+    }
+  }
+}
+
+#endif  // HAS_FREERTOS
@@ -0,0 +1,63 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_RTU_SCHEDULER_H
+#define _MODBUS_RTU_SCHEDULER_H
+
+#include "options.h"
+
+#if HAS_FREERTOS
+
+#include "ModbusClientRTU.h"
+#include "ModbusWakeup.h"
+#include <vector>
+
+// ModbusRTUscheduler: drives several ModbusClientRTU instances on different buses from one task.
+// Instead of a task with its own stack per client, all buses are served round robin by
+// non-blocking send and receive state machines. Requests are made on the clients as usual.
+// Only Modbus RTU is supported, and UART events are not used while a client is scheduled.
+// Do not add or remove clients from within the clients' onData/onError/onResponse handlers!
+class ModbusRTUscheduler {
+public:
+  ModbusRTUscheduler();
+  ~ModbusRTUscheduler();
+
+  // addClient: let the scheduler drive a client on serial. The client's own task is stopped.
+  // Returns false if the client is in ASCII mode
+  bool addClient(ModbusClientRTU& client, Stream& serial, uint32_t baudRate);
+  // Special variant for HardwareSerial
+  bool addClient(ModbusClientRTU& client, HardwareSerial& serial);
+
+  // remove: stop driving a client. Requests still queued are left to the client
+  void remove(ModbusClientRTU& client);
+
+  // begin: start the scheduler task
+  void begin(int coreID = -1);
+
+  // end: stop the scheduler task
+  void end();
+
+  // Number of clients driven
+  uint16_t clients();
+
+protected:
+  // Prevent copy construction and assignment
+  ModbusRTUscheduler(const ModbusRTUscheduler&) = delete;
+  ModbusRTUscheduler& operator=(const ModbusRTUscheduler&) = delete;
+
+  // run: scheduler task
+  static void run(ModbusRTUscheduler *instance);
+
+  std::vector<ModbusClientRTU *> MS_clients;  // Clients driven by this scheduler
+  #if USE_MUTEX
+  mutex MS_lock;                              // Protects MS_clients and the clients' states
+  #endif
+  ModbusWakeup MS_wakeup;                     // Wakes up the task when a request was queued
+  TaskHandle_t MS_task;                       // Scheduler task
+  static uint16_t instanceCounter;            // Number of schedulers created
+};
+
+#endif  // HAS_FREERTOS
+
+#endif  // _MODBUS_RTU_SCHEDULER_H
@@ -0,0 +1,174 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusReadCache.h"
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Constructor
+ModbusReadCache::ModbusReadCache(uint32_t maxAge, uint16_t maxEntries) :
+  RC_entries(),
+  RC_maxAge(maxAge),
+  RC_maxEntries(maxEntries ? maxEntries : 1),
+  RC_generation(0),
+  RC_hits(0),
+  RC_misses(0) { }
+
+// setMaxAge: change the time entries are valid. 0: no more caching
+void ModbusReadCache::setMaxAge(uint32_t maxAge) {
+  LOCK_GUARD(lockGuard, RC_lock);
+  RC_maxAge = maxAge;
+  if (!maxAge) RC_entries.clear();
+}
+
+// isRead: true if request is a read the cache can take
+bool ModbusReadCache::isRead(ModbusMessage& request) {
+  if (request.size() != 6) return false;
+  uint8_t fc = request.getFunctionCode();
+  return fc >= READ_COIL && fc <= READ_INPUT_REGISTER;
+}
+
+// range: get the range of a read, or the range a write will change. For writes, functionCode
+// is set to the read FC that will see the change. Returns false for all other requests.
+bool ModbusReadCache::range(ModbusMessage& request, uint8_t& functionCode, uint16_t& address, uint16_t& count) {
+  if (request.size() < 6) return false;
+  functionCode = request.getFunctionCode();
+  request.get(2, address, count);
+  switch (functionCode) {
+  case READ_COIL:
+  case READ_DISCR_INPUT:
+  case READ_HOLD_REGISTER:
+  case READ_INPUT_REGISTER:
+    return request.size() == 6;
+  case WRITE_COIL:
+    functionCode = READ_COIL;
+    count = 1;
+    return true;
+  case WRITE_MULT_COILS:
+    functionCode = READ_COIL;
+    return true;
+  case WRITE_HOLD_REGISTER:
+  case MASK_WRITE_REGISTER:
+    functionCode = READ_HOLD_REGISTER;
+    count = 1;
+    return true;
+  case WRITE_MULT_REGISTERS:
+    functionCode = READ_HOLD_REGISTER;
+    return true;
+  case R_W_MULT_REGISTERS:
+    // The write range follows the read range
+    if (request.size() < 10) return false;
+    functionCode = READ_HOLD_REGISTER;
+    request.get(6, address, count);
+    return true;
+  default:
+    break;
+  }
+  return false;
+}
+
+// get: look for a fresh entry covering the range of request and build the response from it
+bool ModbusReadCache::get(ModbusMessage& request, ModbusMessage& response) {
+  uint8_t fc = 0;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  if (!isRead(request) || !range(request, fc, address, count) || !count) return false;
+
+  LOCK_GUARD(lockGuard, RC_lock);
+  if (!RC_maxAge) return false;
+  unsigned long now = millis();
+  for (auto& e : RC_entries) {
+    if (e.functionCode != fc || address < e.address || address + count > e.address + e.count) continue;
+    if (now - e.time > RC_maxAge) continue;
+    // Found one. Cut out the range requested
+    uint16_t offset = address - e.address;
+    response.clear();
+    response.add(request.getServerID(), fc);
+    if (fc == READ_HOLD_REGISTER || fc == READ_INPUT_REGISTER) {
+      response.add(static_cast<uint8_t>(count * 2));
+      response.add(e.data.data() + offset * 2, count * 2);
+    } else {
+      // Coils and discrete inputs are packed LSB first - shift them into place
+      uint8_t bytes = (count + 7) / 8;
+      response.add(bytes);
+      for (uint8_t i = 0; i < bytes; ++i) {
+        uint8_t b = 0;
+        for (uint8_t j = 0; j < 8 && i * 8 + j < count; ++j) {
+          uint16_t bit = offset + i * 8 + j;
+          if (e.data[bit / 8] & (1 << (bit % 8))) b |= (1 << j);
+        }
+        response.add(b);
+      }
+    }
+    RC_hits++;
+    LOG_D("Cache hit for %02X/%02X %d/%d\n", request.getServerID(), fc, address, count);
+    return true;
+  }
+  RC_misses++;
+  return false;
+}
+
+// generation: current state of the cached data as far as writes are concerned
+uint32_t ModbusReadCache::generation() {
+  LOCK_GUARD(lockGuard, RC_lock);
+  return RC_generation;
+}
+
+// put: store the response to a read, unless a write was seen since generation was taken
+void ModbusReadCache::put(ModbusMessage& request, ModbusMessage& response, uint32_t generation) {
+  uint8_t fc = 0;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  if (!isRead(request) || !range(request, fc, address, count) || !count) return;
+  // Only complete data responses will do
+  if (response.getError() != SUCCESS || response.getFunctionCode() != fc || response.size() < 3) return;
+  uint16_t bytes = (fc == READ_HOLD_REGISTER || fc == READ_INPUT_REGISTER) ? count * 2 : (count + 7) / 8;
+  if (response[2] != bytes || response.size() != bytes + 3) return;
+
+  LOCK_GUARD(lockGuard, RC_lock);
+  if (!RC_maxAge || generation != RC_generation) return;
+  // Replace an entry for the same range, or else the oldest one if there is no room left
+  auto slot = RC_entries.end();
+  for (auto it = RC_entries.begin(); it != RC_entries.end(); ++it) {
+    if (it->functionCode == fc && it->address == address && it->count == count) {
+      slot = it;
+      break;
+    }
+    if (RC_entries.size() >= RC_maxEntries && (slot == RC_entries.end() || it->time < slot->time)) slot = it;
+  }
+  if (slot != RC_entries.end()) {
+    *slot = CacheEntry(fc, address, count, response.data() + 3, bytes);
+  } else {
+    RC_entries.emplace_back(fc, address, count, response.data() + 3, bytes);
+  }
+}
+
+// invalidate: drop all entries overlapping the range written by request
+void ModbusReadCache::invalidate(ModbusMessage& request) {
+  uint8_t fc = 0;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  if (isRead(request) || !range(request, fc, address, count)) return;
+
+  LOCK_GUARD(lockGuard, RC_lock);
+  // Reads on their way already may return data from before the write
+  RC_generation++;
+  for (auto it = RC_entries.begin(); it != RC_entries.end();) {
+    if (it->functionCode == fc && address < it->address + it->count && it->address < address + count) {
+      LOG_D("Cache entry %02X %d/%d dropped\n", fc, it->address, it->count);
+      it = RC_entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// clear: drop all entries
+void ModbusReadCache::clear() {
+  LOCK_GUARD(lockGuard, RC_lock);
+  RC_generation++;
+  RC_entries.clear();
+}
@@ -0,0 +1,80 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_READ_CACHE_H
+#define _MODBUS_READ_CACHE_H
+
+#include "options.h"
+#include <vector>
+#if USE_MUTEX
+#include <mutex>      // NOLINT
+#endif
+#include "ModbusMessage.h"
+
+// ModbusReadCache: responses to reads (FC 0x01..0x04) of one server, kept for some time.
+// A read of the same range or a part of one cached will be answered from the cache while the
+// entry is younger than maxAge ms. Writes of coils or holding registers (FC 0x05, 0x06, 0x0F,
+// 0x10, 0x16, 0x17) drop the cached reads overlapping the written range.
+// All methods may be called from any task.
+class ModbusReadCache {
+public:
+  // Constructor: maxAge ms an entry is valid, maxEntries ranges kept at most
+  explicit ModbusReadCache(uint32_t maxAge, uint16_t maxEntries = 16);
+
+  // setMaxAge: change the time entries are valid. 0: no more caching, all entries are dropped
+  void setMaxAge(uint32_t maxAge);
+
+  // isRead: true if request is a read the cache can take
+  static bool isRead(ModbusMessage& request);
+
+  // get: look for a fresh entry covering the range of request. If found, build the response from it
+  // and return true.
+  bool get(ModbusMessage& request, ModbusMessage& response);
+
+  // generation: current state of the cached data as far as writes are concerned.
+  // Take it before a read is sent and give it to put() with the response.
+  uint32_t generation();
+
+  // put: store the response to a read. It is ignored if a write was seen since generation was taken,
+  // as it may have been read before that write happened.
+  void put(ModbusMessage& request, ModbusMessage& response, uint32_t generation);
+
+  // invalidate: drop all entries overlapping the range written by request. Does nothing for other requests
+  void invalidate(ModbusMessage& request);
+
+  // clear: drop all entries
+  void clear();
+
+  // Counts of reads answered from the cache and passed on
+  inline uint32_t getHitCount() { return RC_hits; }
+  inline uint32_t getMissCount() { return RC_misses; }
+
+protected:
+  // CacheEntry: response data for a range of coils or registers
+  struct CacheEntry {
+    uint8_t functionCode;         // FC of the read
+    uint16_t address;             // First coil or register
+    uint16_t count;               // Number of coils or registers
+    unsigned long time;           // Time the response was received
+    std::vector<uint8_t> data;    // Response data behind the byte count
+    CacheEntry(uint8_t fc, uint16_t a, uint16_t c, const uint8_t *d, uint16_t len) :
+      functionCode(fc), address(a), count(c), time(millis()), data(d, d + len) {}
+  };
+
+  // range: get the range of a read, or the range a write will change together with the read FC
+  // that will see it. Returns false for all other requests.
+  static bool range(ModbusMessage& request, uint8_t& functionCode, uint16_t& address, uint16_t& count);
+
+  std::vector<CacheEntry> RC_entries;  // Cached ranges
+  uint32_t RC_maxAge;                  // ms an entry is valid
+  uint16_t RC_maxEntries;              // Limit for RC_entries
+  uint32_t RC_generation;              // Incremented with each write
+  uint32_t RC_hits;                    // Reads answered from the cache
+  uint32_t RC_misses;                  // Reads not found in the cache
+#if USE_MUTEX
+  std::mutex RC_lock;                  // Protects all of the above
+#endif
+};
+
+#endif
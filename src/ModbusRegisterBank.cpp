@@ -0,0 +1,308 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusRegisterBank.h"
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Constructor
+ModbusRegisterBank::ModbusRegisterBank(uint16_t holdingRegisters, uint16_t inputRegisters,
+                                       uint16_t coils, uint16_t discreteInputs) :
+  RB_holding(holdingRegisters ? new uint16_t[holdingRegisters]() : nullptr),
+  RB_holdingCount(holdingRegisters),
+  RB_input(inputRegisters ? new uint16_t[inputRegisters]() : nullptr),
+  RB_inputCount(inputRegisters),
+  RB_coils(coils),
+  RB_discrete(discreteInputs),
+  RB_seq(0),
+  RB_depth(0) { }
+
+// Destructor
+ModbusRegisterBank::~ModbusRegisterBank() {
+  delete[] RB_holding;
+  delete[] RB_input;
+}
+
+// attach: register the workers for serverID with server
+void ModbusRegisterBank::attach(ModbusServer& server, uint8_t serverID) {
+  using std::placeholders::_1;
+  if (RB_coils.coils()) {
+    server.registerWorker(serverID, READ_COIL, MBSviewWorker(std::bind(&ModbusRegisterBank::readBits, this, _1)));
+    server.registerWorker(serverID, WRITE_COIL, MBSviewWorker(std::bind(&ModbusRegisterBank::writeCoil, this, _1)));
+    server.registerWorker(serverID, WRITE_MULT_COILS, MBSviewWorker(std::bind(&ModbusRegisterBank::writeCoils, this, _1)));
+  }
+  if (RB_discrete.coils()) {
+    server.registerWorker(serverID, READ_DISCR_INPUT, MBSviewWorker(std::bind(&ModbusRegisterBank::readBits, this, _1)));
+  }
+  if (RB_holdingCount) {
+    server.registerWorker(serverID, READ_HOLD_REGISTER, MBSviewWorker(std::bind(&ModbusRegisterBank::readRegisters, this, _1)));
+    server.registerWorker(serverID, WRITE_HOLD_REGISTER, MBSviewWorker(std::bind(&ModbusRegisterBank::writeRegister, this, _1)));
+    server.registerWorker(serverID, WRITE_MULT_REGISTERS, MBSviewWorker(std::bind(&ModbusRegisterBank::writeRegisters, this, _1)));
+  }
+  if (RB_inputCount) {
+    server.registerWorker(serverID, READ_INPUT_REGISTER, MBSviewWorker(std::bind(&ModbusRegisterBank::readRegisters, this, _1)));
+  }
+}
+
+// beginUpdate: start a write. Readers will retry until endUpdate() is called
+void ModbusRegisterBank::beginUpdate() {
+#if USE_MUTEX
+  RB_writeLock.lock();
+#endif
+  if (RB_depth++ == 0) {
+    RB_seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+}
+
+// endUpdate: write is done
+void ModbusRegisterBank::endUpdate() {
+  if (--RB_depth == 0) {
+    RB_seq.fetch_add(1, std::memory_order_release);
+  }
+#if USE_MUTEX
+  RB_writeLock.unlock();
+#endif
+}
+
+// readBegin: wait for no write in progress and return the sequence number
+uint32_t ModbusRegisterBank::readBegin() {
+  uint32_t seq = RB_seq.load(std::memory_order_acquire);
+  // A write in progress will be done shortly - give the writer time to finish it
+  while (seq & 1) {
+    delay(1);
+    seq = RB_seq.load(std::memory_order_acquire);
+  }
+  return seq;
+}
+
+// readRetry: true if a write has happened since readBegin()
+bool ModbusRegisterBank::readRetry(uint32_t seq) {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return RB_seq.load(std::memory_order_relaxed) != seq;
+}
+
+// Setters
+bool ModbusRegisterBank::setHoldingRegister(uint16_t address, uint16_t value) {
+  return setHoldingRegisters(address, 1, &value);
+}
+
+bool ModbusRegisterBank::setHoldingRegisters(uint16_t address, uint16_t count, const uint16_t *values) {
+  if (!count || address + count > RB_holdingCount) return false;
+  beginUpdate();
+  memcpy(RB_holding + address, values, count * sizeof(uint16_t));
+  endUpdate();
+  return true;
+}
+
+bool ModbusRegisterBank::setInputRegister(uint16_t address, uint16_t value) {
+  return setInputRegisters(address, 1, &value);
+}
+
+bool ModbusRegisterBank::setInputRegisters(uint16_t address, uint16_t count, const uint16_t *values) {
+  if (!count || address + count > RB_inputCount) return false;
+  beginUpdate();
+  memcpy(RB_input + address, values, count * sizeof(uint16_t));
+  endUpdate();
+  return true;
+}
+
+bool ModbusRegisterBank::setCoil(uint16_t address, bool value) {
+  if (address >= RB_coils.coils()) return false;
+  beginUpdate();
+  RB_coils.set(address, value);
+  endUpdate();
+  return true;
+}
+
+bool ModbusRegisterBank::setDiscreteInput(uint16_t address, bool value) {
+  if (address >= RB_discrete.coils()) return false;
+  beginUpdate();
+  RB_discrete.set(address, value);
+  endUpdate();
+  return true;
+}
+
+// Getters
+uint16_t ModbusRegisterBank::getHoldingRegister(uint16_t address) {
+  uint16_t value = 0;
+  getHoldingRegisters(address, 1, &value);
+  return value;
+}
+
+bool ModbusRegisterBank::getHoldingRegisters(uint16_t address, uint16_t count, uint16_t *values) {
+  if (!count || address + count > RB_holdingCount) return false;
+  uint32_t seq;
+  do {
+    seq = readBegin();
+    memcpy(values, RB_holding + address, count * sizeof(uint16_t));
+  } while (readRetry(seq));
+  return true;
+}
+
+uint16_t ModbusRegisterBank::getInputRegister(uint16_t address) {
+  uint16_t value = 0;
+  getInputRegisters(address, 1, &value);
+  return value;
+}
+
+bool ModbusRegisterBank::getInputRegisters(uint16_t address, uint16_t count, uint16_t *values) {
+  if (!count || address + count > RB_inputCount) return false;
+  uint32_t seq;
+  do {
+    seq = readBegin();
+    memcpy(values, RB_input + address, count * sizeof(uint16_t));
+  } while (readRetry(seq));
+  return true;
+}
+
+bool ModbusRegisterBank::getCoil(uint16_t address) {
+  bool value;
+  uint32_t seq;
+  do {
+    seq = readBegin();
+    value = RB_coils[address];
+  } while (readRetry(seq));
+  return value;
+}
+
+bool ModbusRegisterBank::getDiscreteInput(uint16_t address) {
+  bool value;
+  uint32_t seq;
+  do {
+    seq = readBegin();
+    value = RB_discrete[address];
+  } while (readRetry(seq));
+  return value;
+}
+
+// readBits: worker for FC 0x01 and 0x02
+ModbusMessage ModbusRegisterBank::readBits(ModbusMessageView request) {
+  ModbusMessage response;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  request.get(2, address, count);
+  CoilData& bits = (request.getFunctionCode() == READ_COIL) ? RB_coils : RB_discrete;
+  if (request.size() != 6 || count < 1 || count > 2000) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+  } else if (address + count > bits.coils()) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  } else {
+    CoilDataView view = bits.view(address, count);
+    uint8_t packed[250];
+    uint32_t seq;
+    do {
+      seq = readBegin();
+      uint16_t bytes = view.copyTo(packed);
+      response.clear();
+      response.add(request.getServerID(), request.getFunctionCode(), static_cast<uint8_t>(bytes));
+      response.add(packed, bytes);
+    } while (readRetry(seq));
+  }
+  return response;
+}
+
+// readRegisters: worker for FC 0x03 and 0x04
+ModbusMessage ModbusRegisterBank::readRegisters(ModbusMessageView request) {
+  ModbusMessage response;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  request.get(2, address, count);
+  bool holding = (request.getFunctionCode() == READ_HOLD_REGISTER);
+  const uint16_t *table = holding ? RB_holding : RB_input;
+  uint16_t size = holding ? RB_holdingCount : RB_inputCount;
+  if (request.size() != 6 || count < 1 || count > 125) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+  } else if (address + count > size) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  } else {
+    uint32_t seq;
+    do {
+      seq = readBegin();
+      response.clear();
+      response.add(request.getServerID(), request.getFunctionCode(), static_cast<uint8_t>(count * 2));
+      for (uint16_t i = 0; i < count; ++i) {
+        response.add(table[address + i]);
+      }
+    } while (readRetry(seq));
+  }
+  return response;
+}
+
+// writeCoil: worker for FC 0x05
+ModbusMessage ModbusRegisterBank::writeCoil(ModbusMessageView request) {
+  ModbusMessage response;
+  uint16_t address = 0;
+  uint16_t value = 0;
+  request.get(2, address, value);
+  if (request.size() != 6 || (value != 0xFF00 && value != 0x0000)) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+  } else if (!setCoil(address, value == 0xFF00)) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  } else {
+    return ECHO_RESPONSE;
+  }
+  return response;
+}
+
+// writeRegister: worker for FC 0x06
+ModbusMessage ModbusRegisterBank::writeRegister(ModbusMessageView request) {
+  ModbusMessage response;
+  uint16_t address = 0;
+  uint16_t value = 0;
+  request.get(2, address, value);
+  if (request.size() != 6) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+  } else if (!setHoldingRegister(address, value)) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  } else {
+    return ECHO_RESPONSE;
+  }
+  return response;
+}
+
+// writeCoils: worker for FC 0x0F
+ModbusMessage ModbusRegisterBank::writeCoils(ModbusMessageView request) {
+  ModbusMessage response;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  uint8_t bytes = 0;
+  request.get(2, address, count, bytes);
+  if (count < 1 || count > 1968 || bytes != (count + 7) / 8 || request.size() != 7 + bytes) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+  } else if (address + count > RB_coils.coils()) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  } else {
+    beginUpdate();
+    RB_coils.set(address, count, request.data() + 7);
+    endUpdate();
+    return ECHO_RESPONSE;
+  }
+  return response;
+}
+
+// writeRegisters: worker for FC 0x10
+ModbusMessage ModbusRegisterBank::writeRegisters(ModbusMessageView request) {
+  ModbusMessage response;
+  uint16_t address = 0;
+  uint16_t count = 0;
+  uint8_t bytes = 0;
+  request.get(2, address, count, bytes);
+  if (count < 1 || count > 123 || bytes != count * 2 || request.size() != 7 + bytes) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_VALUE);
+  } else if (address + count > RB_holdingCount) {
+    response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_DATA_ADDRESS);
+  } else {
+    // Registers come MSB first - take them one by one
+    beginUpdate();
+    for (uint16_t i = 0; i < count; ++i) {
+      RB_holding[address + i] = (request[7 + i * 2] << 8) | request[8 + i * 2];
+    }
+    endUpdate();
+    return ECHO_RESPONSE;
+  }
+  return response;
+}
@@ -0,0 +1,85 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_REGISTER_BANK_H
+#define _MODBUS_REGISTER_BANK_H
+
+#include "options.h"
+#include <atomic>
+#if USE_MUTEX
+#include <mutex>      // NOLINT
+#endif
+#include "ModbusServer.h"
+#include "CoilData.h"
+
+// ModbusRegisterBank: holding and input registers, coils and discrete inputs of a server, with
+// the workers to serve them. attach() registers workers for FC 0x01..0x06, 0x0F and 0x10.
+// Changes by the application are atomic to the server: a read never sees a change half done.
+// Reads are protected by a sequence lock - they may have to be repeated, but never block a writer.
+// Several set...() calls enclosed in beginUpdate() and endUpdate() will be seen at once.
+// Coils and discrete inputs are CoilData objects, so at most 2000 of each.
+class ModbusRegisterBank {
+public:
+  // Constructor: number of registers, coils and discrete inputs, all starting at address 0
+  explicit ModbusRegisterBank(uint16_t holdingRegisters, uint16_t inputRegisters = 0,
+                              uint16_t coils = 0, uint16_t discreteInputs = 0);
+
+  // Destructor
+  ~ModbusRegisterBank();
+
+  // attach: register the workers for serverID with server. Only tables that are not empty are served
+  void attach(ModbusServer& server, uint8_t serverID);
+
+  // beginUpdate, endUpdate: the changes done in between will be seen all at once. May be nested.
+  void beginUpdate();
+  void endUpdate();
+
+  // Application access. Setters return false if the address range does not exist
+  bool setHoldingRegister(uint16_t address, uint16_t value);
+  bool setHoldingRegisters(uint16_t address, uint16_t count, const uint16_t *values);
+  bool setInputRegister(uint16_t address, uint16_t value);
+  bool setInputRegisters(uint16_t address, uint16_t count, const uint16_t *values);
+  bool setCoil(uint16_t address, bool value);
+  bool setDiscreteInput(uint16_t address, bool value);
+
+  // Getters return 0 or false for addresses not existing
+  uint16_t getHoldingRegister(uint16_t address);
+  bool getHoldingRegisters(uint16_t address, uint16_t count, uint16_t *values);
+  uint16_t getInputRegister(uint16_t address);
+  bool getInputRegisters(uint16_t address, uint16_t count, uint16_t *values);
+  bool getCoil(uint16_t address);
+  bool getDiscreteInput(uint16_t address);
+
+protected:
+  // Prevent copy construction and assignment
+  ModbusRegisterBank(const ModbusRegisterBank&) = delete;
+  ModbusRegisterBank& operator=(const ModbusRegisterBank&) = delete;
+
+  // Sequence lock. readBegin: wait for no write in progress and return the sequence number.
+  // readRetry: true if a write has happened meanwhile - the data read has to be thrown away
+  uint32_t readBegin();
+  bool readRetry(uint32_t seq);
+
+  // Workers
+  ModbusMessage readBits(ModbusMessageView request);
+  ModbusMessage readRegisters(ModbusMessageView request);
+  ModbusMessage writeCoil(ModbusMessageView request);
+  ModbusMessage writeRegister(ModbusMessageView request);
+  ModbusMessage writeCoils(ModbusMessageView request);
+  ModbusMessage writeRegisters(ModbusMessageView request);
+
+  uint16_t *RB_holding;            // Holding registers
+  uint16_t RB_holdingCount;
+  uint16_t *RB_input;              // Input registers
+  uint16_t RB_inputCount;
+  CoilData RB_coils;               // Coils
+  CoilData RB_discrete;            // Discrete inputs
+  std::atomic<uint32_t> RB_seq;    // Sequence number, odd while a write is in progress
+  uint8_t RB_depth;                // Nesting level of beginUpdate()
+#if USE_MUTEX
+  std::recursive_mutex RB_writeLock;  // Serializes the writers
+#endif
+};
+
+#endif
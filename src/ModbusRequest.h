@@ -0,0 +1,139 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_REQUEST_H
+#define _MODBUS_REQUEST_H
+
+#include "ModbusMessage.h"
+#include "ModbusMessageView.h"
+
+// Compile-time request builders for the fixed size standard requests.
+// ModbusRequest<FC> checks the number of parameters for FC when compiled and writes the request
+// without any runtime checks - the values are the caller's business:
+//   ModbusRequest<READ_HOLD_REGISTER> rq(1, 100, 10);
+// ModbusFixedRequest<serverID, FC, parameters...> has all values as template parameters and checks
+// them against the Modbus limits when compiled:
+//   ModbusFixedRequest<1, READ_HOLD_REGISTER, 100, 10>::serialize(buffer);
+// Both will only do the standard interpretation of the function codes, regardless of
+// FCT::redefineType(). Requests with data blocks (FC 0x0F, 0x10, 0x17) are not covered.
+
+// ModbusRequestShape: number of uint16_t parameters of a function code and their range check.
+// Only the function codes specialized below can be built.
+template <uint8_t FC> struct ModbusRequestShape;
+
+// FCs 0x07, 0x0B, 0x0C, 0x11: no parameter
+struct ModbusShapeNone {
+  static constexpr uint8_t words = 0;
+  static constexpr bool valid() { return true; }
+};
+template <> struct ModbusRequestShape<Modbus::READ_EXCEPTION_SERIAL> : ModbusShapeNone {};
+template <> struct ModbusRequestShape<Modbus::READ_COMM_CNT_SERIAL> : ModbusShapeNone {};
+template <> struct ModbusRequestShape<Modbus::READ_COMM_LOG_SERIAL> : ModbusShapeNone {};
+template <> struct ModbusRequestShape<Modbus::REPORT_SERVER_ID_SERIAL> : ModbusShapeNone {};
+
+// FC 0x18: FIFO address
+template <> struct ModbusRequestShape<Modbus::READ_FIFO_QUEUE> {
+  static constexpr uint8_t words = 1;
+  static constexpr bool valid(uint16_t) { return true; }
+};
+
+// FCs 0x01..0x06: address and count or value
+template <uint16_t MAXCOUNT> struct ModbusShapeRead {
+  static constexpr uint8_t words = 2;
+  static constexpr bool valid(uint16_t, uint16_t count) { return count > 0 && count <= MAXCOUNT; }
+};
+template <> struct ModbusRequestShape<Modbus::READ_COIL> : ModbusShapeRead<0x7D0> {};
+template <> struct ModbusRequestShape<Modbus::READ_DISCR_INPUT> : ModbusShapeRead<0x7D0> {};
+template <> struct ModbusRequestShape<Modbus::READ_HOLD_REGISTER> : ModbusShapeRead<0x7D> {};
+template <> struct ModbusRequestShape<Modbus::READ_INPUT_REGISTER> : ModbusShapeRead<0x7D> {};
+template <> struct ModbusRequestShape<Modbus::WRITE_COIL> {
+  static constexpr uint8_t words = 2;
+  static constexpr bool valid(uint16_t, uint16_t value) { return value == 0 || value == 0xFF00; }
+};
+template <> struct ModbusRequestShape<Modbus::WRITE_HOLD_REGISTER> {
+  static constexpr uint8_t words = 2;
+  static constexpr bool valid(uint16_t, uint16_t) { return true; }
+};
+
+// FC 0x16: address, AND mask and OR mask
+template <> struct ModbusRequestShape<Modbus::MASK_WRITE_REGISTER> {
+  static constexpr uint8_t words = 3;
+  static constexpr bool valid(uint16_t, uint16_t, uint16_t) { return true; }
+};
+
+// ModbusRequest: a request for FC, held inside the object
+template <uint8_t FC>
+class ModbusRequest {
+public:
+  static constexpr uint16_t SIZE = 2 + 2 * ModbusRequestShape<FC>::words;
+
+  // Constructor: server ID and the parameters of FC
+  template <typename... Params>
+  explicit ModbusRequest(uint8_t serverID, Params... params) {
+    serialize(RQ_data, serverID, params...);
+  }
+
+  // serialize: write the request for serverID and params into buf, that must have room for SIZE bytes.
+  // Returns the address behind the request
+  template <typename... Params>
+  static uint8_t *serialize(uint8_t *buf, uint8_t serverID, Params... params) {
+    static_assert(sizeof...(Params) == ModbusRequestShape<FC>::words, "Wrong number of parameters for this function code");
+    *buf++ = serverID;
+    *buf++ = FC;
+    return putWords(buf, static_cast<uint16_t>(params)...);
+  }
+
+  inline const uint8_t *data() const { return RQ_data; }
+  inline uint16_t size() const { return SIZE; }
+
+  // view: look at the request as a message, for instance to hand it to a server
+  inline ModbusMessageView view() const { return ModbusMessageView(RQ_data, SIZE); }
+
+  // message: copy the request into a ModbusMessage, as the clients will take it
+  ModbusMessage message() const {
+    ModbusMessage m(SIZE);
+    m.add(RQ_data, SIZE);
+    return m;
+  }
+
+protected:
+  // putWords: write the parameters MSB first
+  static inline uint8_t *putWords(uint8_t *buf) { return buf; }
+  template <typename... Words>
+  static inline uint8_t *putWords(uint8_t *buf, uint16_t w, Words... words) {
+    *buf++ = w >> 8;
+    *buf++ = w & 0xFF;
+    return putWords(buf, words...);
+  }
+
+  uint8_t RQ_data[SIZE];
+};
+
+template <uint8_t FC> constexpr uint16_t ModbusRequest<FC>::SIZE;
+
+// ModbusFixedRequest: a request completely known at compile time, checked against the Modbus limits
+template <uint8_t SERVERID, uint8_t FC, uint16_t... PARAMS>
+struct ModbusFixedRequest {
+  static_assert(SERVERID > 0 && SERVERID <= 247, "Server ID must be 1..247");
+  static_assert(sizeof...(PARAMS) == ModbusRequestShape<FC>::words, "Wrong number of parameters for this function code");
+  static_assert(ModbusRequestShape<FC>::valid(PARAMS...), "Parameter out of range for this function code");
+
+  static constexpr uint16_t SIZE = ModbusRequest<FC>::SIZE;
+
+  // serialize: write the request into buf, that must have room for SIZE bytes.
+  // Returns the address behind the request
+  static inline uint8_t *serialize(uint8_t *buf) {
+    return ModbusRequest<FC>::serialize(buf, SERVERID, PARAMS...);
+  }
+
+  // request: return the request as a ModbusRequest object
+  static inline ModbusRequest<FC> request() {
+    return ModbusRequest<FC>(SERVERID, PARAMS...);
+  }
+};
+
+template <uint8_t SERVERID, uint8_t FC, uint16_t... PARAMS>
+constexpr uint16_t ModbusFixedRequest<SERVERID, FC, PARAMS...>::SIZE;
+
+#endif
@@ -0,0 +1,325 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_RING_H
+#define _MODBUS_RING_H
+
+#include "options.h"
+#include <stdint.h>
+#include <new>
+#include <deque>
+#include <utility>
+#include <atomic>
+#include <type_traits>
+
+// Compile with MODBUS_STATIC_ALLOCATION defined to have the memory of ModbusClientRTU, ModbusClientTCP
+// and ModbusServerRTU fixed when they are constructed:
+// - the worker tasks get their stacks and control blocks inside the objects (xTaskCreateStatic)
+// - the request queues are ModbusRings of queueLimit entries for each priority lane
+// - ModbusClientTCP takes its RequestEntry objects from queueLimit preallocated slots. These are
+//   released after the response only, so queueLimit counts the requests in flight as well.
+//   It will serve MODBUS_TCP_TARGETS target hosts at the same time. Requests to more are answered
+//   with a REQUEST_QUEUE_FULL error. Its connector tasks, one per pooled connection, are created
+//   in begin() still, together with their job queue.
+// Choose queueLimit in the constructors to fit - the memory for it is taken right away.
+// Together with INLINE_MESSAGE (see ModbusMessage.h) queued requests will not touch the heap at all.
+#ifdef MODBUS_STATIC_ALLOCATION
+#ifndef MODBUS_TCP_TARGETS
+#define MODBUS_TCP_TARGETS 4
+#endif
+#endif
+
+// ModbusRing: fixed capacity FIFO providing the subset of the std::deque interface the request
+// queues are using. The storage is allocated once by reserve() and kept until destruction.
+// push_back() will refuse to add more than the capacity - check size() before, or its return value!
+template <typename T>
+class ModbusRing {
+public:
+  // iterator: runs from front to back, or backwards for rbegin()/rend()
+  class iterator {
+  public:
+    iterator(ModbusRing *r, uint16_t i, bool back) : ring(r), index(i), backwards(back) {}
+    inline T& operator*() const { return ring->at(backwards ? index - 1 : index); }
+    inline T *operator->() const { return &(ring->at(backwards ? index - 1 : index)); }
+    inline iterator& operator++() {
+      if (backwards) index--; else index++;
+      return *this;
+    }
+    inline bool operator==(const iterator& o) const { return index == o.index; }
+    inline bool operator!=(const iterator& o) const { return index != o.index; }
+  protected:
+    ModbusRing *ring;
+    uint16_t index;             // Position counted from the front
+    bool backwards;
+  };
+  typedef iterator reverse_iterator;
+
+  explicit ModbusRing(uint16_t capacity = 0) :
+    RG_slot(nullptr),
+    RG_capacity(0),
+    RG_head(0),
+    RG_count(0) {
+    reserve(capacity);
+  }
+
+  ~ModbusRing() {
+    clear();
+    ::operator delete(RG_slot);
+  }
+
+  // Move constructor - takes over the storage
+  ModbusRing(ModbusRing&& r) noexcept :
+    RG_slot(r.RG_slot),
+    RG_capacity(r.RG_capacity),
+    RG_head(r.RG_head),
+    RG_count(r.RG_count) {
+    r.RG_slot = nullptr;
+    r.RG_capacity = 0;
+    r.RG_head = 0;
+    r.RG_count = 0;
+  }
+
+  // Not copyable - the entries are owned by the ring
+  ModbusRing(const ModbusRing&) = delete;
+  ModbusRing& operator=(const ModbusRing&) = delete;
+  ModbusRing& operator=(ModbusRing&&) = delete;
+
+  // reserve: allocate room for capacity entries. Only works once, while there is no storage yet
+  void reserve(uint16_t capacity) {
+    if (RG_slot || !capacity) return;
+    RG_slot = static_cast<T *>(::operator new(sizeof(T) * capacity));
+    RG_capacity = capacity;
+  }
+
+  inline uint16_t capacity() const { return RG_capacity; }
+  inline uint16_t size() const { return RG_count; }
+  inline bool empty() const { return RG_count == 0; }
+  inline bool full() const { return RG_count >= RG_capacity; }
+
+  // Unchecked element access - the ring must not be empty
+  inline T& front() { return at(0); }
+  inline T& back() { return at(RG_count - 1); }
+  inline T& at(uint16_t index) {
+    uint32_t i = RG_head + index;
+    return RG_slot[i < RG_capacity ? i : i - RG_capacity];
+  }
+
+  // push_back: add an entry at the end. Returns false if the ring is full
+  bool push_back(T&& v) {
+    if (full()) return false;
+    new (&at(RG_count)) T(std::move(v));
+    RG_count++;
+    return true;
+  }
+  bool push_back(const T& v) {
+    if (full()) return false;
+    new (&at(RG_count)) T(v);
+    RG_count++;
+    return true;
+  }
+
+  // pop_front: remove the first entry
+  void pop_front() {
+    if (!RG_count) return;
+    at(0).~T();
+    if (++RG_head >= RG_capacity) RG_head = 0;
+    RG_count--;
+  }
+
+  // clear: remove all entries, but keep the storage
+  void clear() {
+    while (RG_count) pop_front();
+    RG_head = 0;
+  }
+
+  inline iterator begin() { return iterator(this, 0, false); }
+  inline iterator end() { return iterator(this, RG_count, false); }
+  inline reverse_iterator rbegin() { return iterator(this, RG_count, true); }
+  inline reverse_iterator rend() { return iterator(this, 0, true); }
+
+protected:
+  T *RG_slot;                   // Storage for RG_capacity entries
+  uint16_t RG_capacity;
+  uint16_t RG_head;             // Index of the first entry
+  uint16_t RG_count;            // Number of entries
+};
+
+// ModbusInbox: bounded lock-free queue between any number of tasks pushing entries and those
+// popping them, without a mutex. push() will never block - if there is no room, it returns false.
+// The capacity is rounded up to the next power of 2.
+// Each cell carries a sequence number telling whose turn it is: a cell is free to be filled for
+// position pos, if it holds pos, and filled to be popped, if it holds pos + 1. pop() will set it
+// to pos plus the capacity, for the push of the next round. (D. Vyukov's bounded queue)
+template <typename T>
+class ModbusInbox {
+public:
+  explicit ModbusInbox(uint16_t capacity) :
+    IN_cell(nullptr),
+    IN_mask(0),
+    IN_head(0),
+    IN_tail(0) {
+    uint32_t size = 2;
+    while (size < capacity) size <<= 1;
+    IN_cell = new Cell[size];
+    IN_mask = size - 1;
+    for (uint32_t i = 0; i < size; ++i) {
+      IN_cell[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Destructor - entries not taken out are destroyed
+  ~ModbusInbox() {
+    for (uint32_t pos = IN_head; pos != IN_tail; ++pos) {
+      reinterpret_cast<T *>(&cell(pos).data)->~T();
+    }
+    delete[] IN_cell;
+  }
+
+  // Not copyable
+  ModbusInbox(const ModbusInbox&) = delete;
+  ModbusInbox& operator=(const ModbusInbox&) = delete;
+
+  // push: add an entry. Returns false if the queue is full
+  inline bool push(T&& v) { return push(&v, 1); }
+  inline bool push(const T& v) {
+    T c(v);
+    return push(&c, 1);
+  }
+
+  // push: add n entries in a row, moved from v[0..n-1]. Others' entries will not come between.
+  // Either all are added, or none - then false is returned
+  bool push(T *v, uint16_t n) {
+    if (!n || n > IN_mask + 1) return false;
+    uint32_t pos = IN_tail.load(std::memory_order_relaxed);
+    while (true) {
+      // Are all n cells free for us?
+      int32_t dif = 0;
+      uint16_t i = 0;
+      for (; i < n; ++i) {
+        dif = static_cast<int32_t>(cell(pos + i).seq.load(std::memory_order_acquire) - (pos + i));
+        if (dif) break;
+      }
+      if (i == n) {
+        // Yes. Claim them - unless another producer was faster. Then pos is updated to try again
+        if (IN_tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) break;
+      } else if (dif < 0) {
+        // Cell still holds an entry from the previous round: full
+        return false;
+      } else {
+        // Cell was claimed by another producer meanwhile
+        pos = IN_tail.load(std::memory_order_relaxed);
+      }
+    }
+    // The cells are ours now. Fill them and hand each over to pop()
+    for (uint16_t i = 0; i < n; ++i) {
+      Cell& c = cell(pos + i);
+      new (&c.data) T(std::move(v[i]));
+      c.seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return true;
+  }
+
+  // pop: move the oldest entry to v. Returns false if there is none
+  bool pop(T& v) {
+    uint32_t pos = IN_head.load(std::memory_order_relaxed);
+    while (true) {
+      int32_t dif = static_cast<int32_t>(cell(pos).seq.load(std::memory_order_acquire) - (pos + 1));
+      if (dif == 0) {
+        // Filled. Claim it - unless another task was faster
+        if (IN_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (dif < 0) {
+        // Not yet (completely) filled by its producer: nothing for us
+        return false;
+      } else {
+        pos = IN_head.load(std::memory_order_relaxed);
+      }
+    }
+    Cell& c = cell(pos);
+    T *p = reinterpret_cast<T *>(&c.data);
+    v = std::move(*p);
+    p->~T();
+    // Free the cell for the next round
+    c.seq.store(pos + IN_mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // size: number of entries pushed and not yet popped. Only a snapshot if producers are busy
+  inline uint32_t size() const {
+    return IN_tail.load(std::memory_order_relaxed) - IN_head.load(std::memory_order_relaxed);
+  }
+  inline bool empty() const { return size() == 0; }
+
+protected:
+  struct Cell {
+    std::atomic<uint32_t> seq;  // Position the cell is waiting for, see above
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+  };
+
+  inline Cell& cell(uint32_t pos) { return IN_cell[pos & IN_mask]; }
+
+  Cell *IN_cell;                // Storage for IN_mask + 1 cells
+  uint32_t IN_mask;
+  std::atomic<uint32_t> IN_head;  // Next position to pop
+  std::atomic<uint32_t> IN_tail;  // Next position to push
+};
+
+// ModbusSlots: fixed number of preallocated objects of type T, to be handed out by create()
+// instead of new and taken back by destroy() instead of delete. create() will return nullptr
+// if all are in use. Both may be called from different tasks.
+template <typename T>
+class ModbusSlots {
+public:
+  explicit ModbusSlots(uint16_t count) :
+    RS_slot(static_cast<T *>(::operator new(sizeof(T) * (count ? count : 1)))),
+    RS_free(count),
+    RS_count(count) {
+    // All slots are free in the beginning
+    for (uint16_t i = 0; i < count; ++i) {
+      RS_free.push(i);
+    }
+  }
+
+  // Destructor - all objects must have been given back before!
+  ~ModbusSlots() {
+    ::operator delete(RS_slot);
+  }
+
+  // Not copyable
+  ModbusSlots(const ModbusSlots&) = delete;
+  ModbusSlots& operator=(const ModbusSlots&) = delete;
+
+  // create: construct an object in a free slot with the arguments given
+  template <typename... Args>
+  T *create(Args&&... args) {
+    uint16_t i = 0;
+    if (!RS_free.pop(i)) return nullptr;
+    return new (&RS_slot[i]) T(std::forward<Args>(args)...);
+  }
+
+  // destroy: give back an object from create()
+  void destroy(T *p) {
+    if (!p) return;
+    p->~T();
+    RS_free.push(static_cast<uint16_t>(p - RS_slot));
+  }
+
+  // inUse: number of objects handed out
+  inline uint16_t inUse() const {
+    return RS_count - RS_free.size();
+  }
+
+protected:
+  T *RS_slot;                   // Storage for RS_count objects
+  ModbusInbox<uint16_t> RS_free;  // Indexes of the free slots
+  uint16_t RS_count;
+};
+
+// ModbusLane: the queue type of a priority lane
+#ifdef MODBUS_STATIC_ALLOCATION
+template <typename T> using ModbusLane = ModbusRing<T>;
+#else
+template <typename T> using ModbusLane = std::deque<T>;
+#endif
+
+#endif
@@ -2,22 +2,104 @@
 // eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
 //               MIT license - see license.md for details
 // =================================================================================================
-#include <Arduino.h>
 #include "ModbusServer.h"
+#if USE_MUTEX
+#include <condition_variable>  // NOLINT
+#endif
 
 #undef LOCAL_LOG_LEVEL
 // #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
 #include "Logging.h"
 
+// registry: get the current worker registrations. Entries found stay valid as long as the snapshot is held
+// The reader is counted before the pointer is read, so publish() will see it if the registry is replaced.
+ModbusServer::MBSsnapshot ModbusServer::registry() {
+  MS_readers.fetch_add(1);
+  return MBSsnapshot(MS_registry.load(), &MS_readers);
+}
+
+// beginUpdate: get a copy of the current registrations to be modified. nullptr if sealed.
+ModbusServer::MBSregistry *ModbusServer::beginUpdate() {
+  MBSsnapshot current = registry();
+  // Sealed registrations may not be changed any more
+  if (current->table) return nullptr;
+  MBSregistry *r = new MBSregistry;
+  r->workerMap = current->workerMap;
+  return r;
+}
+
+// publish: make the modified registrations the current ones
+// Tasks still holding the old snapshot will continue to use it. It is kept in MS_retired until a
+// later publish() - or the destructor - finds no snapshot held at all.
+void ModbusServer::publish(MBSregistry *r) {
+  MS_retired.push_back(MS_registry.exchange(r));
+  // A reader that got one of the retired registries was counted before, and is still counted
+  if (MS_readers.load() == 0) {
+    for (auto old : MS_retired) {
+      delete old;
+    }
+    MS_retired.clear();
+  }
+}
+
 // registerWorker: register a worker function for a certain serverID/FC combination
 // If there is one already, it will be overwritten!
 void ModbusServer::registerWorker(uint8_t serverID, uint8_t functionCode, MBSworker worker) {
-  workerMap[serverID][functionCode] = worker;
+  LOCK_GUARD(updLock, MS_updateLock);
+  MBSregistry *r = beginUpdate();
+  if (!r) {
+    LOG_E("Server is sealed - worker for %02X/%02X not registered\n", serverID, functionCode);
+    return;
+  }
+  MBSentry& e = r->workerMap[serverID][functionCode];
+  e.worker = worker;
+  e.viewWorker = nullptr;
+  e.deferredWorker = nullptr;
+  publish(r);
   LOG_D("Registered worker for %02X/%02X\n", serverID, functionCode);
 }
 
-// getWorker: if a worker function is registered, return its address, nullptr otherwise
-MBSworker ModbusServer::getWorker(uint8_t serverID, uint8_t functionCode) {
+// registerWorker variant for workers taking a ModbusMessageView
+void ModbusServer::registerWorker(uint8_t serverID, uint8_t functionCode, MBSviewWorker worker) {
+  LOCK_GUARD(updLock, MS_updateLock);
+  MBSregistry *r = beginUpdate();
+  if (!r) {
+    LOG_E("Server is sealed - worker for %02X/%02X not registered\n", serverID, functionCode);
+    return;
+  }
+  MBSentry& e = r->workerMap[serverID][functionCode];
+  e.worker = nullptr;
+  e.viewWorker = worker;
+  e.deferredWorker = nullptr;
+  publish(r);
+  LOG_D("Registered view worker for %02X/%02X\n", serverID, functionCode);
+}
+
+// registerDeferredWorker: register a worker responding later through a MBSresponder
+void ModbusServer::registerDeferredWorker(uint8_t serverID, uint8_t functionCode, MBSdeferredWorker worker) {
+  LOCK_GUARD(updLock, MS_updateLock);
+  MBSregistry *r = beginUpdate();
+  if (!r) {
+    LOG_E("Server is sealed - worker for %02X/%02X not registered\n", serverID, functionCode);
+    return;
+  }
+  MBSentry& e = r->workerMap[serverID][functionCode];
+  e.worker = nullptr;
+  e.viewWorker = nullptr;
+  e.deferredWorker = worker;
+  publish(r);
+  LOG_D("Registered deferred worker for %02X/%02X\n", serverID, functionCode);
+}
+
+// findEntry: look up the worker entry for serverID/functionCode (or ANY_FUNCTION_CODE)
+const ModbusServer::MBSentry *ModbusServer::MBSregistry::findEntry(uint8_t serverID, uint8_t functionCode) const {
+  // Sealed? Then the dispatch table has the answer
+  if (table) {
+    // Any worker for the serverID?
+    if (!table[serverID]) return nullptr;
+    // Yes. Function codes above 0x7F only may have a ANY_FUNCTION_CODE worker - found at [0]
+    return table[serverID]->entry[functionCode < 0x80 ? functionCode : static_cast<uint8_t>(ANY_FUNCTION_CODE)];
+  }
   // Search the FC map associated with the serverID
   auto svmap = workerMap.find(serverID);
   // Is there one?
@@ -26,34 +108,93 @@ MBSworker ModbusServer::getWorker(uint8_t serverID, uint8_t functionCode) {
     auto fcmap = svmap->second.find(functionCode);;
     // Found it?
     if (fcmap != svmap->second.end()) {
-      // Yes. Return the function pointer for it.
+      // Yes. Return the entry for it.
       LOG_D("Worker found for %02X/%02X\n", serverID, functionCode);
-      return fcmap->second;
+      return &(fcmap->second);
       // No, no explicit worker found, but may be there is one for ANY_FUNCTION_CODE?
     } else {
       fcmap = svmap->second.find(ANY_FUNCTION_CODE);;
       // Found it?
       if (fcmap != svmap->second.end()) {
-        // Yes. Return the function pointer for it.
+        // Yes. Return the entry for it.
         LOG_D("Worker found for %02X/ANY\n", serverID);
-        return fcmap->second;
+        return &(fcmap->second);
       }
     }
   }
-  // No matching function pointer found
+  // No matching entry found
   LOG_D("No matching worker found\n");
   return nullptr;
 }
 
+// isServerFor: if any worker function is registered for the given serverID, return true
+bool ModbusServer::MBSregistry::isServerFor(uint8_t serverID) const {
+  // Sealed? Then the dispatch table has the answer
+  if (table) return table[serverID] != nullptr;
+  // Search the FC map for the serverID
+  auto svmap = workerMap.find(serverID);
+  // Is it there? Then return true
+  if (svmap != workerMap.end()) return true;
+  // No, serverID was not found. Return false
+  return false;
+}
+
+// Destructor: free the dispatch table, if any
+ModbusServer::MBSregistry::~MBSregistry() {
+  if (table) {
+    for (uint16_t i = 0; i < 256; ++i) {
+      delete table[i];
+    }
+    delete[] table;
+  }
+}
+
+// getWorker: if a worker function is registered, return its address, nullptr otherwise
+MBSworker ModbusServer::getWorker(uint8_t serverID, uint8_t functionCode) {
+  MBSsnapshot reg = registry();
+  const MBSentry *e = reg->findEntry(serverID, functionCode);
+  if (e) {
+    // Plain worker?
+    if (e->worker) return e->worker;
+    // No, must be a view worker. Wrap it to accept a ModbusMessage
+    if (e->viewWorker) {
+      MBSviewWorker vw = e->viewWorker;
+      return [vw](ModbusMessage msg) { return vw(ModbusMessageView(msg)); };
+    }
+    // A deferred worker will be waited for
+    if (e->deferredWorker) {
+      MBSdeferredWorker dw = e->deferredWorker;
+      uint32_t timeout = MS_deferredTimeout;
+      return [dw, timeout](ModbusMessage msg) { return waitDeferred(dw, std::move(msg), timeout); };
+    }
+  }
+  return nullptr;
+}
+
+// getViewWorker: if a MBSviewWorker is registered, return its address, nullptr otherwise
+MBSviewWorker ModbusServer::getViewWorker(uint8_t serverID, uint8_t functionCode) {
+  MBSsnapshot reg = registry();
+  const MBSentry *e = reg->findEntry(serverID, functionCode);
+  if (e) return e->viewWorker;
+  return nullptr;
+}
+
 // unregisterWorker; remove again all or part of the registered workers for a given server ID
 // Returns true if the worker was found and removed
 bool ModbusServer::unregisterWorker(uint8_t serverID, uint8_t functionCode) {
   uint16_t numEntries = 0;    // Number of entries removed
 
+  LOCK_GUARD(updLock, MS_updateLock);
+  MBSregistry *r = beginUpdate();
+  if (!r) {
+    LOG_E("Server is sealed - workers for %02X/%02X not removed\n", serverID, functionCode);
+    return false;
+  }
+
   // Is there at least one entry for the serverID?
-  auto svmap = workerMap.find(serverID);
+  auto svmap = r->workerMap.find(serverID);
   // Is there one?
-  if (svmap != workerMap.end()) {
+  if (svmap != r->workerMap.end()) {
     // Yes. we may proceed with it
     // Are we to look for a single serverID/FC combination?
     if (functionCode) {
@@ -61,21 +202,52 @@ bool ModbusServer::unregisterWorker(uint8_t serverID, uint8_t functionCode) {
       numEntries = svmap->second.erase(functionCode);
     } else {
       // No, the serverID shall be removed with all references
-      numEntries = workerMap.erase(serverID);
+      numEntries = r->workerMap.erase(serverID);
     }
   } 
+  // Only publish if something has changed
+  if (numEntries) {
+    publish(r);
+  } else {
+    delete r;
+  }
   LOG_D("Removed %d worker entries for %d/%d\n", numEntries, serverID, functionCode);
   return (numEntries ? true : false);
 }
 
 // isServerFor: if any worker function is registered for the given serverID, return true
 bool ModbusServer::isServerFor(uint8_t serverID) {
-  // Search the FC map for the serverID
-  auto svmap = workerMap.find(serverID);
-  // Is it there? Then return true
-  if (svmap != workerMap.end()) return true;
-  // No, serverID was not found. Return false
-  return false;
+  return registry()->isServerFor(serverID);
+}
+
+// isSealed: return true if seal() was called
+bool ModbusServer::isSealed() {
+  return registry()->table != nullptr;
+}
+
+// seal: freeze the worker registrations and use a flat table to look up workers from now on
+void ModbusServer::seal() {
+  LOCK_GUARD(updLock, MS_updateLock);
+  MBSregistry *r = beginUpdate();
+  if (!r) return;
+  FCtable **table = new FCtable *[256]();
+  for (auto it = r->workerMap.begin(); it != r->workerMap.end(); ++it) {
+    FCtable *fct = new FCtable;
+    // Worker for ANY_FUNCTION_CODE is the default for all
+    auto any = it->second.find(ANY_FUNCTION_CODE);
+    const MBSentry *dflt = (any != it->second.end()) ? &(any->second) : nullptr;
+    for (uint8_t fc = 0; fc < 0x80; ++fc) {
+      fct->entry[fc] = dflt;
+    }
+    // Now fill in the explicitly registered function codes
+    for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+      if (it2->first < 0x80) fct->entry[it2->first] = &(it2->second);
+    }
+    table[it->first] = fct;
+  }
+  r->table = table;
+  LOG_D("Server sealed, %d server IDs\n", r->workerMap.size());
+  publish(r);
 }
 
 // getMessageCount: read number of messages processed
@@ -88,13 +260,101 @@ uint32_t ModbusServer::getErrorCount() {
   return errorCount;
 }
 
-// resetCounts: set both message and error counts to zero
+// resetCounts: set message, error and shed counts to zero
 void ModbusServer::resetCounts() {
-  {
-    LOCK_GUARD(cntLock, m);
-    messageCount = 0;
-    errorCount = 0;
+  messageCount = 0;
+  errorCount = 0;
+  MS_shed = 0;
+  statistics.reset();
+  latency.reset();
+}
+
+// limitRate: limit the requests per second of each client
+void ModbusServer::limitRate(uint32_t rate, uint32_t burst) {
+  LOCK_GUARD(limLock, MS_limitLock);
+  MS_rate = rate;
+  MS_burst = burst ? burst : (rate ? rate : 1);
+  // Start over with full buckets
+  MS_buckets.clear();
+}
+
+// limitInflight: limit the number of requests served at the same time
+void ModbusServer::limitInflight(uint32_t maxInflight) {
+  MS_maxInflight = maxInflight;
+}
+
+// setDeferredTimeout: set the time a deferred worker has to respond
+void ModbusServer::setDeferredTimeout(uint32_t timeout) {
+  MS_deferredTimeout = timeout;
+}
+
+// getShedCount: number of requests answered with SERVER_DEVICE_BUSY by the limits
+uint32_t ModbusServer::getShedCount() {
+  return MS_shed;
+}
+
+// admit: check a request of client against the limits
+bool ModbusServer::admit(uint32_t client) {
+  // Room for another one?
+  uint32_t inflight = ++MS_inflight;
+  if (MS_maxInflight && inflight > MS_maxInflight) {
+    MS_inflight--;
+    MS_shed++;
+    return false;
+  }
+  if (!MS_rate) return true;
+
+  LOCK_GUARD(limLock, MS_limitLock);
+  unsigned long now = millis();
+  uint32_t full = MS_burst * 1000;
+  auto it = MS_buckets.find(client);
+  if (it == MS_buckets.end()) {
+    // New client. Make room, if necessary, by dropping the one heard of least recently
+    if (MS_buckets.size() >= MODBUS_RATE_CLIENTS) {
+      auto oldest = MS_buckets.begin();
+      for (auto b = MS_buckets.begin(); b != MS_buckets.end(); ++b) {
+        if (now - b->second.last > now - oldest->second.last) oldest = b;
+      }
+      MS_buckets.erase(oldest);
+    }
+    it = MS_buckets.insert({ client, { full, now } }).first;
+  }
+  // Fill up the bucket for the time passed: rate per second is rate/1000 per ms
+  Bucket& b = it->second;
+  uint64_t level = b.level + (uint64_t)(now - b.last) * MS_rate;
+  b.level = (level > full) ? full : level;
+  b.last = now;
+  if (b.level < 1000) {
+    MS_inflight--;
+    MS_shed++;
+    return false;
   }
+  b.level -= 1000;
+  return true;
+}
+
+// release: an admitted request was answered
+void ModbusServer::release() {
+  MS_inflight--;
+}
+
+// shed: respond SERVER_DEVICE_BUSY to a request over the limits
+ModbusMessage ModbusServer::shed(ModbusMessageView request) {
+  LOG_D("Request shed\n");
+  ModbusMessage response;
+  response.setError(request.getServerID(), request.getFunctionCode(), SERVER_DEVICE_BUSY);
+  countRequest(request, response);
+  return response;
+}
+
+// onTraceHandler: register a handler to get the trace of each request served
+bool ModbusServer::onTraceHandler(MBOnTrace handler) {
+  if (MS_onTrace) {
+    LOG_W("onTrace handler was already claimed\n");
+    return false;
+  }
+  MS_onTrace = handler;
+  return true;
 }
 
 // LocalRequest: get response from locally running server.
@@ -104,13 +364,14 @@ ModbusMessage ModbusServer::localRequest(ModbusMessage msg) {
   uint8_t functionCode = msg.getFunctionCode();
   LOG_D("Local request for %02X/%02X\n", serverID, functionCode);
   HEXDUMP_V("Request", msg.data(), msg.size());
-  // Try to get a worker for the request
-  MBSworker worker = getWorker(serverID, functionCode);
+  // Try to get a worker for the request. Keep the snapshot until the worker is done
+  MBSsnapshot reg = registry();
+  const MBSentry *e = reg->findEntry(serverID, functionCode);
   // Did we get one?
-  if (worker != nullptr) {
+  if (e && e->isSet()) {
     // Yes. call it and return the response
     LOG_D("Call worker\n");
-    m = worker(msg);
+    m = callWorker(e, ModbusMessageView(msg));
     LOG_D("Worker responded\n");
     HEXDUMP_V("Worker response", m.data(), m.size());
     // Process Response. Is it one of the predefined types?
@@ -121,8 +382,7 @@ ModbusMessage ModbusServer::localRequest(ModbusMessage msg) {
         m.clear();
         break;
       case 0xF1: // ECHO
-        m.clear();
-        m.append(msg);
+        m = std::move(msg);
         break;
       default:   // Will not get here, but lint likes it!
         break;
@@ -133,7 +393,7 @@ ModbusMessage ModbusServer::localRequest(ModbusMessage msg) {
   } else {
     LOG_D("No worker found. Error response.\n");
     // No. Is there at least one worker for the serverID?
-    if (isServerFor(serverID)) {
+    if (reg->isServerFor(serverID)) {
       // Yes. Respond with "illegal function code"
       m.setError(serverID, functionCode, ILLEGAL_FUNCTION);
     } else {
@@ -148,18 +408,236 @@ ModbusMessage ModbusServer::localRequest(ModbusMessage msg) {
   return m;
 }
 
+// processRequest: find the worker for a request, call it and return the response. Counts the request.
+ModbusMessage ModbusServer::processRequest(ModbusMessageView request) {
+  ModbusMessage userData;
+  Error error = SUCCESS;
+  // Hold the registry snapshot while the worker is running
+  MBSsnapshot reg = registry();
+  if (reg->isServerFor(request.getServerID())) {
+    const MBSentry *entry = reg->findEntry(request.getServerID(), request.getFunctionCode());
+    if (entry && entry->isSet()) {
+      // request is well formed and is being served by user API
+      userData = callWorker(entry, request);
+      resolveResponse(request, userData);
+    } else {  // no worker found
+      error = ILLEGAL_FUNCTION;
+    }
+  } else {  // mismatch server ID
+    error = INVALID_SERVER;
+  }
+  if (error != SUCCESS) {
+    userData.setError(request.getServerID(), request.getFunctionCode(), error);
+  }
+  countRequest(request, userData);
+  return userData;
+}
+
+// deferRequest: if a deferred worker is registered for the request, call it and return true
+bool ModbusServer::deferRequest(ModbusMessageView request, MBSresponder respond) {
+  MBSsnapshot reg = registry();
+  const MBSentry *entry = reg->findEntry(request.getServerID(), request.getFunctionCode());
+  if (!entry || !entry->deferredWorker) return false;
+  // The request buffer will be gone long before the response is there - take a copy
+  ModbusMessage copy;
+  copy.add(request.data(), request.size());
+  // Guard against responders called more than once
+  std::shared_ptr<std::atomic<bool>> done = std::make_shared<std::atomic<bool>>(false);
+  LOG_D("Deferred worker called\n");
+  MBSresponder responder = [this, copy, done, respond](ModbusMessage response) mutable {
+    if (done->exchange(true)) {
+      LOG_W("Deferred request responded to twice - ignored\n");
+      return;
+    }
+    ModbusMessageView request(copy.data(), copy.size());
+    resolveResponse(request, response);
+    countRequest(request, response);
+    respond(std::move(response));
+  };
+  {
+    // Keep it for expireDeferred(). Those answered meanwhile are dropped
+    LOCK_GUARD(deferLock, MS_deferLock);
+    for (auto it = MS_deferred.begin(); it != MS_deferred.end();) {
+      if (*(it->done)) {
+        it = MS_deferred.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    unsigned long now = millis();
+    MS_deferred.push_back({ done, now, request.getServerID(), request.getFunctionCode(), responder });
+  }
+  entry->deferredWorker(std::move(copy), std::move(responder));
+  return true;
+}
+
+// expireDeferred: answer deferred requests waiting too long with TIMEOUT
+void ModbusServer::expireDeferred(bool all) {
+  std::vector<Deferred> expired;
+  {
+    LOCK_GUARD(deferLock, MS_deferLock);
+    unsigned long now = millis();
+    for (auto it = MS_deferred.begin(); it != MS_deferred.end();) {
+      if (*(it->done)) {
+        it = MS_deferred.erase(it);
+      } else if (all || (MS_deferredTimeout && now - it->since >= MS_deferredTimeout)) {
+        expired.push_back(std::move(*it));
+        it = MS_deferred.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  // Respond outside of the lock - the responder will hand the response on to the server
+  for (auto& d : expired) {
+    LOG_W("Deferred worker did not respond in time\n");
+    ModbusMessage response;
+    response.setError(d.serverID, d.functionCode, TIMEOUT);
+    d.respond(std::move(response));
+  }
+}
+
+// callWorker: call the worker of entry and return its response as is. Waits for a deferred worker
+ModbusMessage ModbusServer::callWorker(const MBSentry *entry, ModbusMessageView request) {
+  // Only view workers can do without a copy of the request
+  if (entry->viewWorker) return entry->viewWorker(request);
+  ModbusMessage copy;
+  copy.add(request.data(), request.size());
+  if (entry->worker) return entry->worker(std::move(copy));
+  return waitDeferred(entry->deferredWorker, std::move(copy), MS_deferredTimeout);
+}
+
+// DeferredWait: the response of a deferred worker, handed over to the task waiting for it
+struct DeferredWait {
+  ModbusMessage response;
+#if USE_MUTEX
+  bool done;
+  std::mutex lock;
+  std::condition_variable cv;
+#else
+  volatile bool done;
+#endif
+  DeferredWait() : response(), done(false) {}
+};
+
+// waitDeferred: call a deferred worker and wait for it to respond
+ModbusMessage ModbusServer::waitDeferred(const MBSdeferredWorker& worker, ModbusMessage request, uint32_t timeout) {
+  uint8_t serverID = request.getServerID();
+  uint8_t functionCode = request.getFunctionCode();
+  // Shared with the responder, as that may be called after we have given up on it
+  std::shared_ptr<DeferredWait> wait = std::make_shared<DeferredWait>();
+  worker(std::move(request), [wait](ModbusMessage response) {
+    {
+      LOCK_GUARD(lockGuard, wait->lock);
+      if (wait->done) return;
+      wait->response = std::move(response);
+      wait->done = true;
+    }
+#if USE_MUTEX
+    wait->cv.notify_one();
+#endif
+  });
+#if USE_MUTEX
+  std::unique_lock<std::mutex> lock(wait->lock);
+  if (!timeout) {
+    wait->cv.wait(lock, [wait] { return wait->done; });
+  } else {
+    wait->cv.wait_for(lock, std::chrono::milliseconds(timeout), [wait] { return wait->done; });
+  }
+#else
+  unsigned long start = millis();
+  while (!wait->done && (!timeout || millis() - start < timeout)) {
+    delay(1);
+  }
+#endif
+  if (!wait->done) {
+    // Too late. A response coming in now will find done set and be dropped
+    wait->done = true;
+    LOG_W("Deferred worker did not respond in time\n");
+    ModbusMessage response;
+    response.setError(serverID, functionCode, TIMEOUT);
+    return response;
+  }
+  // The responder is done with it and will not touch it again
+  return std::move(wait->response);
+}
+
+// resolveResponse: replace NIL_RESPONSE by an empty response and ECHO_RESPONSE by the request
+void ModbusServer::resolveResponse(ModbusMessageView request, ModbusMessage& response) {
+  // One of the predefined types?
+  if (response[0] == 0xFF && (response[1] == 0xF0 || response[1] == 0xF1)) {
+    // Yes. Check it
+    switch (response[1]) {
+    case 0xF0: // NIL
+      response.clear();
+      LOG_D("NIL response\n");
+      break;
+    case 0xF1: // ECHO
+      response.clear();
+      response.add(request.data(), request.size());
+      if (request.getFunctionCode() == WRITE_MULT_REGISTERS ||
+          request.getFunctionCode() == WRITE_MULT_COILS) {
+        response.resize(6);
+      }
+      LOG_D("ECHO response\n");
+      break;
+    default:   // Will not get here!
+      break;
+    }
+  } else {
+    // No. User provided data response
+    LOG_D("Data response\n");
+  }
+}
+
+// countRequest: count a request and its response in the message and error counts and statistics
+void ModbusServer::countRequest(ModbusMessageView request, ModbusMessage& response) {
+  messageCount++;
+  if (response.getError() != SUCCESS) errorCount++;
+  statistics.count(request.getServerID(), request.getFunctionCode(), response.getError(), request.size(), response.size());
+}
+
+// traceDone: a request is served - add its trace to the latency histograms and hand it to MS_onTrace
+void ModbusServer::traceDone(ModbusTrace& trace, ModbusMessageView request, const ModbusMessage& response) {
+  trace.serverID = request.getServerID();
+  trace.functionCode = request.getFunctionCode() & 0x7F;
+  trace.error = response.getError();
+  latency.add(trace);
+  if (MS_onTrace) MS_onTrace(trace);
+}
+
 // Constructor
 ModbusServer::ModbusServer() :
+  MS_registry(new MBSregistry),
+  MS_readers(0),
+  MS_retired(),
   messageCount(0),
-  errorCount(0) { }
+  errorCount(0),
+  latency(true),
+  MS_onTrace(nullptr),
+  MS_capture(nullptr),
+  MS_pool(nullptr),
+  MS_buckets(),
+  MS_rate(0),
+  MS_burst(0),
+  MS_maxInflight(0),
+  MS_inflight(0),
+  MS_shed(0),
+  MS_deferred(),
+  MS_deferredTimeout(MODBUS_DEFERRED_TIMEOUT) { }
 
 // Destructor
 ModbusServer::~ModbusServer() {
+  for (auto old : MS_retired) {
+    delete old;
+  }
+  delete MS_registry.load();
 }
 
 // listServer: Print out all mapped server/FC combinations
 void ModbusServer::listServer() {
-  for (auto it = workerMap.begin(); it != workerMap.end(); ++it) {
+  MBSsnapshot reg = registry();
+  for (auto it = reg->workerMap.begin(); it != reg->workerMap.end(); ++it) {
     LOG_N("Server %3d: ", it->first);
     for (auto it2 = it->second.begin(); it2 != it->second.end(); it2++) {
       LOGRAW_N(" %02X", it2->first);
@@ -10,18 +10,34 @@
 #include <map>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <atomic>
 #if USE_MUTEX
 #include <mutex>      // NOLINT
 #endif
 #include "ModbusTypeDefs.h"
 #include "ModbusError.h"
 #include "ModbusMessage.h"
+#include "ModbusMessageView.h"
+#include "ModbusStatistics.h"
+#include "ModbusTrace.h"
+#include "ModbusCapture.h"
 
 #if USE_MUTEX
 using std::mutex;
 using std::lock_guard;
 #endif
 
+// Number of clients limitRate() keeps track of. The one heard of least recently is forgotten for a new one
+#ifndef MODBUS_RATE_CLIENTS
+#define MODBUS_RATE_CLIENTS 32
+#endif
+
+// ms a deferred worker is given to respond, see setDeferredTimeout()
+#ifndef MODBUS_DEFERRED_TIMEOUT
+#define MODBUS_DEFERRED_TIMEOUT 20000
+#endif
+
 // Standard response variants for "no response" and "echo the request"
 const ModbusMessage NIL_RESPONSE (std::vector<uint8_t>{0xFF, 0xF0});
 const ModbusMessage ECHO_RESPONSE(std::vector<uint8_t>{0xFF, 0xF1});
@@ -29,15 +45,41 @@ const ModbusMessage ECHO_RESPONSE(std::vector<uint8_t>{0xFF, 0xF1});
 // MBSworker: function signature for worker functions to handle single serverID/functionCode combinations
 using MBSworker = std::function<ModbusMessage(ModbusMessage msg)>;
 
+// MBSviewWorker: alternative worker signature receiving a read-only view on the request.
+// The view points into the server's receive buffer, so no copy of the request is made.
+using MBSviewWorker = std::function<ModbusMessage(ModbusMessageView msg)>;
+
+// MBSresponder: handle to complete a deferred request. Call it exactly once with the response,
+// from any task and at any time later. NIL_RESPONSE and ECHO_RESPONSE may be used as well.
+// A response later than the server's deferred timeout (see setDeferredTimeout()) is dropped.
+using MBSresponder = std::function<void(ModbusMessage response)>;
+
+// MBSdeferredWorker: worker that need not respond at once. It gets the request and a responder
+// to send the response with whenever it is there - the bridge will respond from an onResponse
+// callback, for instance. It shall return quickly and must not block.
+using MBSdeferredWorker = std::function<void(ModbusMessage msg, MBSresponder respond)>;
+
+class ModbusWorkerPool;
+
 class ModbusServer {
 public:
   // registerWorker: register a worker function for a certain serverID/FC combination
   // If there is one already, it will be overwritten!
   void registerWorker(uint8_t serverID, uint8_t functionCode, MBSworker worker);
-  
+  void registerWorker(uint8_t serverID, uint8_t functionCode, MBSviewWorker worker);
+
+  // registerDeferredWorker: same for a worker responding later. Servers serving several connections
+  // from one task (ModbusServerTCPasync, ModbusServerTCPepoll) will take other requests in the
+  // meantime. All others will wait for the response, as with a plain worker.
+  void registerDeferredWorker(uint8_t serverID, uint8_t functionCode, MBSdeferredWorker worker);
+
   // getWorker: if a worker function is registered, return its address, nullptr otherwise
+  // A worker registered as MBSviewWorker or MBSdeferredWorker will be returned wrapped into a MBSworker
   MBSworker getWorker(uint8_t serverID, uint8_t functionCode);
 
+  // getViewWorker: if a MBSviewWorker is registered, return its address, nullptr otherwise
+  MBSviewWorker getViewWorker(uint8_t serverID, uint8_t functionCode);
+
   // unregisterWorker; remove again all or part of the registered workers for a given server ID
   // Returns true if the worker was found and removed
   bool unregisterWorker(uint8_t serverID, uint8_t functionCode = 0);
@@ -45,21 +87,64 @@ public:
   // isServerFor: if any worker function is registered for the given serverID, return true
   bool isServerFor(uint8_t serverID);
 
+  // seal: freeze the worker registrations and use a flat table to look up workers from now on.
+  // No locking is needed for the lookups, but no more workers may be registered or unregistered!
+  void seal();
+
+  // isSealed: return true if seal() was called
+  bool isSealed();
+
   // getMessageCount: read number of messages processed
   uint32_t getMessageCount();
 
   // getErrorCount: read number of errors responded
   uint32_t getErrorCount();
 
-  // resetCounts: set both message and error counts to zero
+  // resetCounts: set message, error and shed counts and statistics to zero
   void resetCounts();
 
+  // limitRate: serve at most rate requests per second of each client (told apart by its IP address)
+  // with bursts of up to burst requests. More are answered with SERVER_DEVICE_BUSY at once, without
+  // calling a worker. rate 0: no limit (default). burst 0: a second's worth of requests.
+  // The TCP servers will take the limits, ModbusServerRTU has a single client anyway.
+  void limitRate(uint32_t rate, uint32_t burst = 0);
+
+  // limitInflight: serve at most maxInflight requests at the same time, those waiting for deferred
+  // workers or the worker pool included. More are answered with SERVER_DEVICE_BUSY. 0: no limit
+  void limitInflight(uint32_t maxInflight);
+
+  // getShedCount: number of requests answered with SERVER_DEVICE_BUSY by the limits above
+  uint32_t getShedCount();
+
+  // setDeferredTimeout: ms a deferred worker has to respond. Requests not answered in time get a
+  // TIMEOUT error response, the late response is dropped. 0: wait forever.
+  // Default is MODBUS_DEFERRED_TIMEOUT - keep it above the timeout of a bridge's clients.
+  void setDeferredTimeout(uint32_t timeout);
+
+  // getStatistics: transaction statistics by serverID/function code
+  inline const ModbusStatistics& getStatistics() { return statistics; }
+
+  // getLatency: latency histograms by transaction phase, see ModbusTrace.h
+  inline const ModbusLatency& getLatency() { return latency; }
+
+  // onTraceHandler: register a handler to get the trace of each request served
+  bool onTraceHandler(MBOnTrace handler);
+
+  // useCapture: record the frames received and sent in capture, see ModbusCapture.h. nullptr: stop recording
+  inline void useCapture(ModbusCapture *c) { MS_capture = c; }
+
   // Local request to the server
   ModbusMessage localRequest(ModbusMessage msg);
 
   // listServer: print out all server/FC combinations served
   void listServer();
 
+  // useWorkerPool: run the worker functions on the tasks of pool instead of the serving task. nullptr: no pool.
+  // Only servers serving several connections from one task will use it - ModbusServerTCPasync and
+  // ModbusServerTCPepoll. If the pool is busy, requests are answered with SERVER_DEVICE_BUSY.
+  // The pool must be running as long as the server is.
+  inline void useWorkerPool(ModbusWorkerPool *pool) { MS_pool = pool; }
+
 protected:
   // Constructor
   ModbusServer();
@@ -74,11 +159,141 @@ protected:
   // Virtual function to prevent this class being instantiated
   virtual void isInstance() = 0;
 
-  std::map<uint8_t, std::map<uint8_t, MBSworker>> workerMap;      // map on serverID->functionCode->worker function
-  uint32_t messageCount;         // Number of Requests processed
-  uint32_t errorCount;           // Number of errors responded
+  // Worker map entry - only one of these is set
+  struct MBSentry {
+    MBSworker worker;              // Worker taking a ModbusMessage
+    MBSviewWorker viewWorker;      // Worker taking a ModbusMessageView
+    MBSdeferredWorker deferredWorker;  // Worker responding through a MBSresponder
+    inline bool isSet() const { return worker || viewWorker || deferredWorker; }
+  };
+
+  // Dispatch table for one serverID: entry for each function code 0x00..0x7F, ANY_FUNCTION_CODE resolved
+  struct FCtable {
+    const MBSentry *entry[128];
+  };
+
+  // MBSregistry: a set of worker registrations. A published registry is never changed again -
+  // registerWorker() etc. will publish a modified copy instead. Serving tasks hold on to the
+  // snapshot they got, so they will never see a half-done change, and a worker running will not hold
+  // up a registration. Taking a snapshot is lock-free: a reader count and a plain atomic pointer.
+  struct MBSregistry {
+    std::map<uint8_t, std::map<uint8_t, MBSentry>> workerMap;      // map on serverID->functionCode->worker function
+    FCtable **table;             // Dispatch table by serverID, built by seal(). nullptr while not sealed
+
+    MBSregistry() : workerMap(), table(nullptr) {}
+    ~MBSregistry();
+    MBSregistry(const MBSregistry&) = delete;
+    MBSregistry& operator=(const MBSregistry&) = delete;
+
+    // findEntry: look up the worker entry for serverID/functionCode (or ANY_FUNCTION_CODE)
+    // Servers should call the worker through the entry to avoid copying it.
+    const MBSentry *findEntry(uint8_t serverID, uint8_t functionCode) const;
+
+    // isServerFor: if any worker function is registered for the given serverID, return true
+    bool isServerFor(uint8_t serverID) const;
+  };
+
+  // MBSsnapshot: the registry current when registry() was called. Counted in MS_readers while held -
+  // replaced registries are not deleted before no snapshot is held any more.
+  class MBSsnapshot {
+  public:
+    MBSsnapshot(const MBSregistry *r, std::atomic<uint32_t> *readers) : reg(r), readers(readers) {}
+    MBSsnapshot(MBSsnapshot&& s) : reg(s.reg), readers(s.readers) { s.readers = nullptr; }
+    ~MBSsnapshot() { if (readers) readers->fetch_sub(1); }
+    MBSsnapshot(const MBSsnapshot&) = delete;
+    MBSsnapshot& operator=(const MBSsnapshot&) = delete;
+    inline const MBSregistry *operator->() const { return reg; }
+  protected:
+    const MBSregistry *reg;
+    std::atomic<uint32_t> *readers;
+  };
+
+  // processRequest: find the worker for a request, call it and return the response. Counts the request.
+  // NIL_RESPONSE and ECHO_RESPONSE are resolved already - an empty response is not to be sent at all.
+  ModbusMessage processRequest(ModbusMessageView request);
+
+  // deferRequest: if a deferred worker is registered for the request, call it and return true.
+  // respond will get the response, NIL_RESPONSE and ECHO_RESPONSE resolved and counted like
+  // processRequest() does, whenever the worker is done - maybe before deferRequest() returns!
+  // Returns false if the request has to be processed the usual way.
+  bool deferRequest(ModbusMessageView request, MBSresponder respond);
+
+  // callWorker: call the worker of entry and return its response as is. Waits for a deferred worker
+  ModbusMessage callWorker(const MBSentry *entry, ModbusMessageView request);
+
+  // waitDeferred: call a deferred worker and wait for it to respond, for timeout ms at most (0: forever).
+  // Returns a TIMEOUT error response if the worker was too late
+  static ModbusMessage waitDeferred(const MBSdeferredWorker& worker, ModbusMessage request, uint32_t timeout);
+
+  // expireDeferred: answer the requests taken by deferRequest() that are waiting for longer than
+  // the deferred timeout with a TIMEOUT error response. all: answer all waiting, the server is stopping.
+  // Servers using deferRequest() have to call it regularly.
+  void expireDeferred(bool all = false);
+
+  // resolveResponse: replace NIL_RESPONSE by an empty response and ECHO_RESPONSE by the request
+  static void resolveResponse(ModbusMessageView request, ModbusMessage& response);
+
+  // countRequest: count a request and its response in the message and error counts and statistics
+  void countRequest(ModbusMessageView request, ModbusMessage& response);
+
+  // admit: may a request of client (its IP address) be served? If not, it is over the limits of
+  // limitRate() or limitInflight() and has to be answered by shed(). Else release() must be called
+  // when it is answered.
+  bool admit(uint32_t client);
+  void release();
+
+  // shed: the SERVER_DEVICE_BUSY response to a request over the limits. Counts the request
+  ModbusMessage shed(ModbusMessageView request);
+
+  // traceDone: a request is served - add its trace to the latency histograms and hand it to MS_onTrace.
+  // trace.token has to be set by the caller. Server ID and function code may be taken from the response as well
+  void traceDone(ModbusTrace& trace, ModbusMessageView request, const ModbusMessage& response);
+
+  // registry: get the current worker registrations. Entries found stay valid as long as the snapshot is held
+  MBSsnapshot registry();
+
+  // beginUpdate: get a copy of the current registrations to be modified. nullptr if sealed.
+  // MS_updateLock must be held until publish() is done!
+  MBSregistry *beginUpdate();
+
+  // publish: make the modified registrations the current ones
+  void publish(MBSregistry *r);
+
+  std::atomic<const MBSregistry *> MS_registry;  // Current worker registrations. Only access by registry() and publish()!
+  std::atomic<uint32_t> MS_readers;              // Number of snapshots held
+  std::vector<const MBSregistry *> MS_retired;   // Replaced registries, waiting for MS_readers to be 0. MS_updateLock
+  std::atomic<uint32_t> messageCount;  // Number of Requests processed
+  std::atomic<uint32_t> errorCount;    // Number of errors responded
+  ModbusStatistics statistics;   // Transaction counts by serverID/function code
+  ModbusLatency latency;         // Transaction times by phase
+  MBOnTrace MS_onTrace;          // Transaction trace handler
+  ModbusCapture *MS_capture;     // Frame capture, if any
+  ModbusWorkerPool *MS_pool;     // Worker pool to run the worker functions, if any
+  // Token bucket of a client for limitRate(). A request takes 1000 from level
+  struct Bucket {
+    uint32_t level;              // Requests allowed now, in 1/1000
+    unsigned long last;          // Time level was brought up to date
+  };
+  std::map<uint32_t, Bucket> MS_buckets;  // Buckets by client IP address
+  uint32_t MS_rate;              // Requests per second per client, 0: no limit
+  uint32_t MS_burst;             // Bucket size in requests
+  uint32_t MS_maxInflight;       // Requests served at the same time, 0: no limit
+  std::atomic<uint32_t> MS_inflight;  // Requests admitted and not answered yet
+  std::atomic<uint32_t> MS_shed;       // Requests answered with SERVER_DEVICE_BUSY by the limits
+  // A request taken by deferRequest() and its responder, until it is answered or expired
+  struct Deferred {
+    std::shared_ptr<std::atomic<bool>> done;  // Set by the first response
+    unsigned long since;         // millis() the request was taken
+    uint8_t serverID;
+    uint8_t functionCode;
+    MBSresponder respond;        // The responder given to the worker
+  };
+  std::vector<Deferred> MS_deferred;  // Deferred requests not known to be answered yet
+  uint32_t MS_deferredTimeout;   // ms to wait for a deferred worker, 0: forever
   #if USE_MUTEX
-  mutex m;                       // mutex to cover changes to messageCount and errorCount
+  mutex MS_updateLock;           // mutex to serialize changes to the worker registrations
+  mutex MS_limitLock;            // Protects MS_buckets
+  mutex MS_deferLock;            // Protects MS_deferred
   #endif
 };
 
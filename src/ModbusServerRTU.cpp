@@ -4,7 +4,7 @@
 // =================================================================================================
 #include "ModbusServerRTU.h"
 
-#if HAS_FREERTOS
+#if HAS_FREERTOS || IS_LINUX
 
 #undef LOG_LEVEL_LOCAL
 #include "Logging.h"
@@ -15,7 +15,12 @@ uint8_t ModbusServerRTU::instanceCounter = 0;
 // Constructor with RTS pin GPIO (or -1)
 ModbusServerRTU::ModbusServerRTU(uint32_t timeout, int rtsPin) :
   ModbusServer(),
+#if IS_LINUX
+  serverTask(0),
+  MSRstopping(false),
+#else
   serverTask(nullptr),
+#endif
   serverTimeout(timeout),
   MSRserial(nullptr),
   MSRinterval(2000),     // will be calculated in begin()!
@@ -23,17 +28,30 @@ ModbusServerRTU::ModbusServerRTU(uint32_t timeout, int rtsPin) :
   MSRrtsPin(rtsPin), 
   MSRuseASCII(false),
   MSRskipLeadingZeroByte(false),
+  MSRearlyEnd(false),
+  #if HAS_UART_EVENTS
+  MSRuart(nullptr),
+  #endif
+  MSRuseEvents(false),
+  MSRhwRS485(false),
   listener(nullptr),
   sniffer(nullptr) {
   // Count instances one up
   instanceCounter++;
   // If we have a GPIO RE/DE pin, configure it.
   if (MSRrtsPin >= 0) {
+#if IS_LINUX && !IS_RASPBERRY
+    // No GPIOs here - have the kernel driver toggle DE/RE, see HardwareSerial::useRS485()
+    LOG_W("RTS pin not supported, use the RS485 mode of the serial device or an RTS callback\n");
+    MSRrtsPin = -1;
+    MRTSrts = RTUutils::RTSauto;
+#else
     pinMode(MSRrtsPin, OUTPUT);
     MRTSrts = [this](bool level) {
       digitalWrite(MSRrtsPin, level);
     };
     MRTSrts(LOW);
+#endif
   } else {
     MRTSrts = RTUutils::RTSauto;
   }
@@ -42,7 +60,12 @@ ModbusServerRTU::ModbusServerRTU(uint32_t timeout, int rtsPin) :
 // Constructor with RTS callback
 ModbusServerRTU::ModbusServerRTU(uint32_t timeout, RTScallback rts) :
   ModbusServer(),
+#if IS_LINUX
+  serverTask(0),
+  MSRstopping(false),
+#else
   serverTask(nullptr),
+#endif
   serverTimeout(timeout),
   MSRserial(nullptr),
   MSRinterval(2000),     // will be calculated in begin()!
@@ -50,6 +73,12 @@ ModbusServerRTU::ModbusServerRTU(uint32_t timeout, RTScallback rts) :
   MRTSrts(rts), 
   MSRuseASCII(false),
   MSRskipLeadingZeroByte(false),
+  MSRearlyEnd(false),
+  #if HAS_UART_EVENTS
+  MSRuart(nullptr),
+  #endif
+  MSRuseEvents(false),
+  MSRhwRS485(false),
   listener(nullptr),
   sniffer(nullptr) {
   // Count instances one up
@@ -61,6 +90,8 @@ ModbusServerRTU::ModbusServerRTU(uint32_t timeout, RTScallback rts) :
 
 // Destructor
 ModbusServerRTU::~ModbusServerRTU() {
+  // Stop the server task - this will have the UART driver stop signalling to us as well
+  end();
 }
 
 // start: create task with RTU server - general version
@@ -73,8 +104,22 @@ void ModbusServerRTU::begin(Stream& serial, uint32_t baudRate, int coreID) {
 void ModbusServerRTU::begin(HardwareSerial& serial, int coreID) {
   MSRserial = &serial;
   uint32_t baudRate = serial.baudRate();
+#if !IS_LINUX
   serial.setRxFIFOFull(1);
+#endif
+#if HAS_UART_RS485
+  // Shall the UART switch DE/RE? Then we must not do it as well
+  if (MSRhwRS485 && RTUutils::enableRS485(serial, MSRrtsPin)) {
+    MRTSrts = RTUutils::RTSauto;
+  }
+#endif
   doBegin(baudRate, coreID);
+#if HAS_UART_EVENTS
+  // Shall the UART driver tell us about frame ends? Until this is done, the server will poll
+  if (MSRuseEvents && RTUutils::enableFrameEvents(serial, MSRinterval, MSRframeEvent)) {
+    MSRuart = &serial;
+  }
+#endif
 }
 
 void ModbusServerRTU::doBegin(uint32_t baudRate, int coreID) {
@@ -84,23 +129,61 @@ void ModbusServerRTU::doBegin(uint32_t baudRate, int coreID) {
   // Set minimum interval time
   MSRinterval = RTUutils::calculateInterval(baudRate);
 
+#if IS_LINUX
+  int rc = pthread_create(&serverTask, NULL, &pHandle, this);
+  if (rc) {
+    LOG_E("Error creating RTU server thread: %d\n", rc);
+    serverTask = 0;
+    return;
+  }
+#else
   // Create unique task name
   char taskName[18];
   snprintf(taskName, 18, "MBsrv%02XRTU", instanceCounter);
 
   // Start task to handle the client
+#ifdef MODBUS_STATIC_ALLOCATION
+  serverTask = xTaskCreateStaticPinnedToCore((TaskFunction_t)&serve, taskName, 4096, this, 8, MSRstack, &MSRtaskBuffer, coreID >= 0 ? coreID : NULL);
+#else
   xTaskCreatePinnedToCore((TaskFunction_t)&serve, taskName, 4096, this, 8, &serverTask, coreID >= 0 ? coreID : NULL);
+#endif
+#endif
 
   LOG_D("Server task %d started. Interval=%d\n", (uint32_t)serverTask, MSRinterval);
 }
 
+#if IS_LINUX
+void *ModbusServerRTU::pHandle(void *p) {
+  serve((ModbusServerRTU *)p);
+  return nullptr;
+}
+#endif
+
 // end: kill server task
 void ModbusServerRTU::end() {
+#if IS_LINUX
+  // Have the thread leave its loop. It will see that after the receive timeout at the latest
+  if (serverTask) {
+    MSRstopping = true;
+    pthread_join(serverTask, NULL);
+    LOG_D("Server thread stopped.\n");
+    serverTask = 0;
+    MSRstopping = false;
+  }
+#else
   if (serverTask != nullptr) {
     vTaskDelete(serverTask);
     LOG_D("Server task %d stopped.\n", (uint32_t)serverTask);
     serverTask = nullptr;
   }
+#endif
+#if HAS_UART_EVENTS
+  // No more frame events
+  if (MSRuart) {
+    RTUutils::disableFrameEvents(*MSRuart);
+    MSRuart = nullptr;
+  }
+#endif
 }
 
 // Toggle protocol to ModbusASCII
@@ -127,6 +210,32 @@ void ModbusServerRTU::skipLeading0x00(bool onOff) {
   LOG_D("Skip leading 0x00 mode = %s\n", onOff ? "ON" : "OFF");
 }
 
+// Toggle UART event driven receive
+void ModbusServerRTU::useUARTevents(bool onOff) {
+#if HAS_UART_EVENTS
+  MSRuseEvents = onOff;
+  LOG_D("UART event mode = %s\n", onOff ? "ON" : "OFF");
+#else
+  LOG_W("UART events not available - using polling\n");
+#endif
+}
+
+// Toggle early frame end by expected length
+void ModbusServerRTU::earlyFrameEnd(bool onOff) {
+  MSRearlyEnd = onOff;
+  LOG_D("Early frame end mode = %s\n", onOff ? "ON" : "OFF");
+}
+
+// Toggle DE/RE switching by the UART
+void ModbusServerRTU::useHardwareRS485(bool onOff) {
+#if HAS_UART_RS485
+  MSRhwRS485 = onOff;
+  LOG_D("UART RS485 mode = %s\n", onOff ? "ON" : "OFF");
+#else
+  LOG_W("UART RS485 mode not available - using the RTS callback\n");
+#endif
+}
+
 // Special case: worker to react on broadcast requests
 void ModbusServerRTU::registerBroadcastWorker(MSRlistener worker) {
   // If there is one already, it will be overwritten!
@@ -148,15 +257,22 @@ void ModbusServerRTU::serve(ModbusServerRTU *myServer) {
   ModbusMessage request;                // received request message
   ModbusMessage m;                      // Application's response data
   ModbusMessage response;               // Response proper to be sent
+  ModbusTrace trace;                    // Times of the transaction points passed
 
   // init microseconds timer
   myServer->MSRlastMicros = micros();
 
   while (true) {
+#if IS_LINUX
+    // end() wants us to leave
+    if (myServer->MSRstopping) return;
+#endif
     // Initialize all temporary vectors
     request.clear();
     response.clear();
     m.clear();
+    trace.clear();
+    uint32_t firstByte = 0;
 
     // Wait for and read an request
     request = RTUutils::receive(
@@ -166,11 +282,21 @@ void ModbusServerRTU::serve(ModbusServerRTU *myServer) {
       myServer->MSRlastMicros, 
       myServer->MSRinterval, 
       myServer->MSRuseASCII, 
-      myServer->MSRskipLeadingZeroByte);
+      myServer->MSRskipLeadingZeroByte,
+      myServer->MSRearlyEnd,
+#if HAS_UART_EVENTS
+      myServer->MSRuart ? &myServer->MSRframeEvent : nullptr,
+#else
+      nullptr,
+#endif
+      &firstByte,
+      myServer->MS_capture);
 
     // Request longer than 1 byte (that will signal an error in receive())? 
     if (request.size() > 1) {
       LOG_D("Request received.\n");
+      if (firstByte) trace.mark(TracePoint::FIRST_BYTE, firstByte);
+      trace.mark(TracePoint::FRAME_COMPLETE);
 
       // Yes. 
       // Do we have a sniffer listening?
@@ -189,17 +315,18 @@ void ModbusServerRTU::serve(ModbusServerRTU *myServer) {
       } else {
         // No Broadcast. 
         // Do we have a callback function registered for it?
-        MBSworker callBack = myServer->getWorker(request[0], request[1]);
-        if (callBack) {
+        // Call it through the table entry - no need to copy the worker.
+        // The registry snapshot keeps the entry valid while the worker is running
+        MBSsnapshot reg = myServer->registry();
+        const MBSentry *entry = reg->findEntry(request[0], request[1]);
+        if (entry && entry->isSet()) {
           LOG_D("Callback found.\n");
           // Yes, we do. Count the message
-          {
-            LOCK_GUARD(cntLock, myServer->m);
-            myServer->messageCount++;
-          }
-          // Get the user's response
+          myServer->messageCount++;
+          // Get the user's response. A deferred worker will be waited for
           LOG_D("Callback called.\n");
-          m = callBack(request);
+          trace.mark(TracePoint::DISPATCH);
+          m = myServer->callWorker(entry, ModbusMessageView(request));
           HEXDUMP_V("Callback response", m.data(), m.size());
 
           // Process Response. Is it one of the predefined types?
@@ -221,11 +348,11 @@ void ModbusServerRTU::serve(ModbusServerRTU *myServer) {
             }
           } else {
             // No predefined. User provided data in free format
-            response = m;
+            response = std::move(m);
           }
         } else {
           // No callback. Is at least the serverID valid and no broadcast?
-          if (myServer->isServerFor(request[0]) && request[0] != 0x00) {
+          if (reg->isServerFor(request[0]) && request[0] != 0x00) {
             // Yes. Send back a ILLEGAL_FUNCTION error
             response.setError(request.getServerID(), request.getFunctionCode(), ILLEGAL_FUNCTION);
           }
@@ -234,14 +361,20 @@ void ModbusServerRTU::serve(ModbusServerRTU *myServer) {
         // Do we have gathered a valid response now?
         if (response.size() >= 3) {
           // Yes. send it back.
-          RTUutils::send(*(myServer->MSRserial), myServer->MSRlastMicros, myServer->MSRinterval, myServer->MRTSrts, response, myServer->MSRuseASCII);
+          trace.mark(TracePoint::SEND_START);
+          RTUutils::send(*(myServer->MSRserial), myServer->MSRlastMicros, myServer->MSRinterval, myServer->MRTSrts, response, myServer->MSRuseASCII, myServer->MS_capture);
+          trace.mark(TracePoint::SEND_END);
           LOG_D("Response sent.\n");
           // Count it, in case we had an error response
           if (response.getError() != SUCCESS) {
-            LOCK_GUARD(errorCntLock, myServer->m);
             myServer->errorCount++;
           }
         }
+        // Keep statistics for all requests we have served or responded to
+        if (entry || response.size() >= 3) {
+          myServer->statistics.count(request.getServerID(), request.getFunctionCode(), response.getError(), request.size(), response.size());
+          myServer->traceDone(trace, ModbusMessageView(request), response);
+        }
       }
     } else {
       // No, we got a 1-byte request, meaning an error has happened in receive()
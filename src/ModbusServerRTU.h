@@ -7,17 +7,22 @@
 
 #include "options.h"
 
-#if HAS_FREERTOS
+#if HAS_FREERTOS || IS_LINUX
 
-#include <Arduino.h>
-#include "Stream.h"
 #include "ModbusServer.h"
 #include "RTUutils.h"
+#include "ModbusWakeup.h"
 
+#if HAS_FREERTOS
+#include <Arduino.h>
 extern "C" {
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 }
+#elif IS_LINUX
+#include <atomic>
+#include <pthread.h>
+#endif
 
 // Specal function signature for broadcast or sniffer listeners
 using MSRlistener = std::function<void(ModbusMessage msg)>;
@@ -33,6 +38,7 @@ public:
 
   // begin: create task with RTU server to accept requests
   void begin(Stream& serial, uint32_t baudRate, int coreID = -1);
+  // On Linux, HardwareSerial is the termios device of examples/Linux
   void begin(HardwareSerial& serial, int coreID = -1);
 
   // end: kill server task
@@ -50,6 +56,17 @@ public:
   // Toggle skipping of leading 0x00 byte
   void skipLeading0x00(bool onOff = true);
 
+  // Toggle early frame end: return requests as soon as their expected length has arrived with a valid CRC
+  void earlyFrameEnd(bool onOff = true);
+
+  // Toggle UART event driven receive. Only effective for a HardwareSerial and before begin()!
+  // The server task will sleep until the UART driver reports a complete frame instead of polling.
+  void useUARTevents(bool onOff = true);
+
+  // Toggle DE/RE switching by the UART. Only effective for a HardwareSerial and before begin()!
+  // See ModbusClientRTU::useHardwareRS485()
+  void useHardwareRS485(bool onOff = true);
+
   // Special case: worker to react on broadcast requests
   void registerBroadcastWorker(MSRlistener worker);
 
@@ -67,7 +84,16 @@ protected:
   void doBegin(uint32_t baudRate, int coreID);
 
   static uint8_t instanceCounter;        // Number of RTU servers created (for task names)
+#if HAS_FREERTOS
   TaskHandle_t serverTask;               // task of the started server
+#ifdef MODBUS_STATIC_ALLOCATION
+  StackType_t MSRstack[4096];            // Stack of the server task, see ModbusRing.h
+  StaticTask_t MSRtaskBuffer;            // Control block of the server task
+#endif
+#elif IS_LINUX
+  pthread_t serverTask;                  // thread of the started server
+  std::atomic<bool> MSRstopping;         // true: end() is waiting for the thread to leave
+#endif
   uint32_t serverTimeout;                // given timeout for receive. Does not really
                                          // matter for a server, but is needed in 
                                          // RTUutils. After timeout without any message
@@ -80,13 +106,23 @@ protected:
   RTScallback MRTSrts;                   // Callback to set the RTS line to HIGH/LOW
   bool MSRuseASCII;                      // true=ModbusASCII, false=ModbusRTU
   bool MSRskipLeadingZeroByte;           // true=first byte ignored if 0x00, false=all bytes accepted
+  bool MSRearlyEnd;                      // true=end frames by expected length, false=by the interval gap only
+#if HAS_UART_EVENTS
+  HardwareSerial *MSRuart;               // HardwareSerial signalling frame ends, nullptr if not active
+  ModbusWakeup MSRframeEvent;            // Signalled by the UART driver on a frame end
+#endif
+  bool MSRuseEvents;                     // true=UART event driven receive requested
+  bool MSRhwRS485;                       // true=DE/RE to be switched by the UART
   MSRlistener listener;                  // Broadcast listener 
   MSRlistener sniffer;                   // Sniffer listener 
 
   // serve: loop function for server task
   static void serve(ModbusServerRTU *myself);
+#if IS_LINUX
+  static void *pHandle(void *p);
+#endif
 };
 
-#endif  // HAS_FREERTOS
+#endif  // HAS_FREERTOS || IS_LINUX
 
 #endif // INCLUDE GUARD
@@ -8,13 +8,18 @@
 // #undef LOCAL_LOG_LEVEL
 #include "Logging.h"
 
-ModbusServerTCPasync::mb_client::mb_client(ModbusServerTCPasync* s, AsyncClient* c) :
+ModbusServerTCPasync::mb_client::mb_client(ModbusServerTCPasync* s, Shard* sh, AsyncClient* c) :
   server(s),
+  shard(sh),
   client(c),
+  peer(static_cast<uint32_t>(c->remoteIP())),
   lastActiveTime(millis()),
   message(nullptr),
+  rxTrace(),
   error(SUCCESS),
-  outbox() {
+  outbox(),
+  pending(0),
+  disconnected(false) {
     client->onData([](void* i, AsyncClient* c, void* data, size_t len) { (static_cast<mb_client*>(i))->onData(static_cast<uint8_t*>(data), len); }, this);
     client->onPoll([](void* i, AsyncClient* c) { (static_cast<mb_client*>(i))->onPoll(); }, this);
     client->onDisconnect([](void* i, AsyncClient* c) { (static_cast<mb_client*>(i))->onDisconnect(); }, this);
@@ -24,8 +29,11 @@ ModbusServerTCPasync::mb_client::mb_client(ModbusServerTCPasync* s, AsyncClient*
 ModbusServerTCPasync::mb_client::~mb_client() {
   // clear outbox, if data is left
   while (!outbox.empty()) {
+    ModbusMessagePool::release(outbox.front().head);
     outbox.pop();
   }
+  // Give back a partially received request, if any
+  ModbusMessagePool::release(message);
 
   delete client;  // will also close connection, if any
 }
@@ -39,8 +47,10 @@ void ModbusServerTCPasync::mb_client::onData(uint8_t* data, size_t len) {
   while (i < len) {
     // 0. start
     if (!message) {
-      message = new ModbusMessage(8);
+      message = ModbusMessagePool::acquire();
       error = SUCCESS;
+      rxTrace.clear();
+      rxTrace.mark(TracePoint::FIRST_BYTE);
     }
 
     //  1. get minimal 8 bytes to move on
@@ -61,10 +71,7 @@ void ModbusServerTCPasync::mb_client::onData(uint8_t* data, size_t len) {
     if (error != SUCCESS) {
       ModbusMessage response;
       response.setError(message->getServerID(), message->getFunctionCode(), error);
-      message->resize(4);
-      message->add(static_cast<uint16_t>(3));
-      message->append(response);
-      addResponseToOutbox(message);  // outbox has pointer ownership now
+      addResponseToOutbox(message, std::move(response), rxTrace);  // outbox has pointer ownership now
       // reset to starting values and process remaining data
       message = nullptr;
       return;  // protocol validation, abort further parsing
@@ -81,62 +88,93 @@ void ModbusServerTCPasync::mb_client::onData(uint8_t* data, size_t len) {
       continue;
     }
 
-    // 4. request complete, process
-    ModbusMessage request(messageLength - 6);  // create request without MBAP, with server ID
-    request.add(message->data() + 6, message->size() - 6);
-    ModbusMessage userData;
-    if (server->isServerFor(request.getServerID())) {
-      MBSworker callback = server->getWorker(request.getServerID(), request.getFunctionCode());
-      if (callback) {
-        // request is well formed and is being served by user API
-        userData = callback(request);
-        // Process Response
-        // One of the predefined types?
-        if (userData[0] == 0xFF && (userData[1] == 0xF0 || userData[1] == 0xF1)) {
-          // Yes. Check it
-          switch (userData[1]) {
-          case 0xF0: // NIL
-            userData.clear();
-            LOG_D("NIL response\n");
-            break;
-          case 0xF1: // ECHO
-            userData = request;
-            if (request.getFunctionCode() == WRITE_MULT_REGISTERS ||
-                request.getFunctionCode() == WRITE_MULT_COILS) {
-              userData.resize(6);
-            }
-            LOG_D("ECHO response\n");
-            break;
-          default:   // Will not get here!
-            break;
-          }
-        } else {
-          // No. User provided data response
-          LOG_D("Data response\n");
-        }
-        error = SUCCESS;
-      } else {  // no worker found
-        error = ILLEGAL_FUNCTION;
-      }
-    } else {  // mismatch server ID
-      error = INVALID_SERVER;
+    // 4. request complete. Take it over, the buffer will take the response
+    rxTrace.mark(TracePoint::FRAME_COMPLETE);
+    if (server->MS_capture) server->MS_capture->add(ModbusCapture::TCP_RX, message->data(), message->size(), nullptr, 0, rxTrace.time(TracePoint::FIRST_BYTE));
+    ModbusMessage *m = message;
+    message = nullptr;
+    // View on the request without MBAP, with server ID - no copy needed
+    ModbusMessageView request(m->data() + 6, m->size() - 6);
+    // Over the limits? Then tell the client to try again later
+    if (!server->admit(peer)) {
+      addResponseToOutbox(m, server->shed(request), rxTrace);
+      continue;
     }
-    if (error != SUCCESS) {
-      userData.setError(request.getServerID(), request.getFunctionCode(), error);
+    // Count it as pending - a deferred worker or the pool may respond at once
+    {
+      LOCK_GUARD(lock1, obLock);
+      pending++;
     }
-    // Keep transaction id and protocol id
-    message->resize(4);
-    // Add new payload length
-    message->add(static_cast<uint16_t>(userData.size()));
-    // Append payload
-    message->append(userData);
-    // Transfer message data to outbox
-    addResponseToOutbox(message);
-    message = nullptr;
+    // Is it for a deferred worker? The response will come back through the outbox
+    if (server->deferRequest(request, [this, m](ModbusMessage response) { complete(m, std::move(response)); })) {
+      server->latency.add(LatencyPhase::RECEIVING, rxTrace.span(TracePoint::FIRST_BYTE, TracePoint::FRAME_COMPLETE));
+      continue;
+    }
+#if HAS_FREERTOS
+    // Is there a shard task or a worker pool to run the worker? Same here
+    ModbusWorkerPool *pool = shard->task.isRunning() ? &(shard->task) : server->MS_pool;
+    if (pool && pool->submit([this, m]() { serve(m); })) {
+      server->latency.add(LatencyPhase::RECEIVING, rxTrace.span(TracePoint::FIRST_BYTE, TracePoint::FRAME_COMPLETE));
+      continue;
+    }
+#endif
+    {
+      LOCK_GUARD(lock1, obLock);
+      pending--;
+    }
+#if HAS_FREERTOS
+    if (pool) {
+      // Pool is busy - tell the client to try again later
+      LOG_D("worker pool busy\n");
+      ModbusMessage response;
+      response.setError(request.getServerID(), request.getFunctionCode(), SERVER_DEVICE_BUSY);
+      server->countRequest(request, response);
+      addResponseToOutbox(m, std::move(response), rxTrace);
+      server->release();
+      continue;
+    }
+#endif
+    // No, process it right here
+    rxTrace.mark(TracePoint::DISPATCH);
+    ModbusMessage userData = server->processRequest(request);
+    server->release();
+    // Transfer header and response to outbox
+    addResponseToOutbox(m, std::move(userData), rxTrace);
   }  // end while loop iterating incoming data
 }
 
+// serve: run the worker for a request on a pool task and put the response into the outbox
+// m holds the complete request with MBAP header and will take the response.
+void ModbusServerTCPasync::mb_client::serve(ModbusMessage* m) {
+  ModbusTrace trace;
+  trace.mark(TracePoint::DISPATCH);
+  complete(m, server->processRequest(ModbusMessageView(m->data() + 6, m->size() - 6)), trace);
+}
+
+// complete: put the response to a pending request into the outbox. May be called from any task
+void ModbusServerTCPasync::mb_client::complete(ModbusMessage* m, ModbusMessage userData, const ModbusTrace& trace) {
+  bool last = false;
+  {
+    LOCK_GUARD(lock1, obLock);
+    // Still connected? Then send the response. A NIL response will not be sent at all
+    if (!disconnected && userData.size()) {
+      setHead(m, userData);
+      outbox.push(Outgoing(m, std::move(userData), trace));
+      handleOutbox();
+      m = nullptr;
+    }
+    pending--;
+    last = disconnected && !pending;
+  }
+  server->release();
+  ModbusMessagePool::release(m);
+  // The connection was dropped while we were busy - we are the last to know
+  if (last) delete this;
+}
+
 void ModbusServerTCPasync::mb_client::onPoll() {
+  // Deferred workers too late will call back into the clients - not with obLock held
+  server->expireDeferred();
   LOCK_GUARD(lock1, obLock);
   handleOutbox();
   if (server->idle_timeout > 0 && 
@@ -151,22 +189,58 @@ void ModbusServerTCPasync::mb_client::onDisconnect() {
   server->onClientDisconnect(this);
 }
 
-void ModbusServerTCPasync::mb_client::addResponseToOutbox(ModbusMessage* response) {
-  if (response->size() > 0) {
+// release: the connection is gone. Returns true if it may be deleted, else the last pending response will do it
+bool ModbusServerTCPasync::mb_client::release() {
+  LOCK_GUARD(lock1, obLock);
+  disconnected = true;
+  return !pending;
+}
+
+// busy: return true while the worker pool or deferred workers have requests of this connection
+bool ModbusServerTCPasync::mb_client::busy() {
+  LOCK_GUARD(lock1, obLock);
+  return pending > 0;
+}
+
+// addResponseToOutbox: queue response to the request in m. m will keep the MBAP header
+void ModbusServerTCPasync::mb_client::addResponseToOutbox(ModbusMessage* m, ModbusMessage response, const ModbusTrace& trace) {
+  // A NIL response will not be sent at all
+  if (response.size() > 0) {
+    setHead(m, response);
     LOCK_GUARD(lock1, obLock);
-    outbox.push(response);
+    outbox.push(Outgoing(m, std::move(response), trace));
     handleOutbox();
+  } else {
+    // Nothing to send - recycle the buffer
+    ModbusMessagePool::release(m);
   }
 }
 
+// setHead: cut down the request in m to its MBAP header, with the length of response
+void ModbusServerTCPasync::mb_client::setHead(ModbusMessage* m, ModbusMessage& response) {
+  // Keep transaction id and protocol id, set the new payload length
+  m->resize(4);
+  m->add(static_cast<uint16_t>(response.size()));
+}
+
+// handleOutbox: send what the connection will take. Header and response are added separately,
+// but sent as one packet
 void ModbusServerTCPasync::mb_client::handleOutbox() {
   while (!outbox.empty()) {
-    ModbusMessage* m = outbox.front();
-    if (m->size() <= client->space()) {
-      LOG_D("sending (%d)\n", m->size());
-      client->add(reinterpret_cast<const char*>(m->data()), m->size(), ASYNC_WRITE_FLAG_COPY);
+    Outgoing& o = outbox.front();
+    size_t len = o.head->size() + o.pdu.size();
+    if (len <= client->space()) {
+      LOG_D("sending (%d)\n", len);
+      o.trace.mark(TracePoint::SEND_START);
+      if (server->MS_capture) server->MS_capture->add(ModbusCapture::TCP_TX, o.head->data(), o.head->size(), o.pdu.data(), o.pdu.size());
+      client->add(reinterpret_cast<const char*>(o.head->data()), o.head->size(), ASYNC_WRITE_FLAG_COPY);
+      client->add(reinterpret_cast<const char*>(o.pdu.data()), o.pdu.size(), ASYNC_WRITE_FLAG_COPY);
       client->send();
-      delete m;
+      o.trace.mark(TracePoint::SEND_END);
+      // The head still has the transaction ID, the response the server ID and function code
+      o.trace.token = ((*o.head)[0] << 8) | (*o.head)[1];
+      server->traceDone(o.trace, ModbusMessageView(o.pdu), o.pdu);
+      ModbusMessagePool::release(o.head);
       outbox.pop();
     } else {
       return;
@@ -176,7 +250,9 @@ void ModbusServerTCPasync::mb_client::handleOutbox() {
 
 ModbusServerTCPasync::ModbusServerTCPasync() :
   server(nullptr),
-  clients(),
+  shards(),
+  shardCount(0),
+  shardQueueLimit(8),
   maxNoClients(5),
   idle_timeout(60000) {
     // setup will be done in 'start'
@@ -191,7 +267,28 @@ ModbusServerTCPasync::~ModbusServerTCPasync() {
 
 uint16_t ModbusServerTCPasync::activeClients() {
   LOCK_GUARD(lock1, cListLock);
-  return clients.size();
+  uint16_t count = 0;
+  for (auto shard : shards) {
+    count += shard->count;
+  }
+  return count;
+}
+
+// useShards: share the connections out to count tasks, each serving the requests of its connections
+bool ModbusServerTCPasync::useShards(uint8_t count, uint16_t queueLimit) {
+#if HAS_FREERTOS
+  if (server) {
+    LOG_W("Server already running.\n");
+    return false;
+  }
+  if (count && !queueLimit) return false;
+  shardCount = count;
+  shardQueueLimit = queueLimit;
+  return true;
+#else
+  LOG_W("Shards need FreeRTOS.\n");
+  return false;
+#endif
 }
 
 
@@ -204,6 +301,23 @@ bool ModbusServerTCPasync::start(uint16_t port, uint8_t maxClients, uint32_t tim
   
   maxNoClients = maxClients;
   idle_timeout = timeout;
+
+  // Set up the shards - a single one without a task of its own, if not requested otherwise
+  {
+    LOCK_GUARD(lock1, cListLock);
+    do {
+      shards.push_back(new Shard());
+    } while (shards.size() < shardCount);
+#if HAS_FREERTOS
+    // Pin the shard tasks to the cores in turn
+    for (uint8_t i = 0; i < shardCount; ++i) {
+      if (!shards[i]->task.begin(1, shardQueueLimit, i % portNUM_PROCESSORS)) {
+        LOG_E("Could not start task for shard %d\n", i);
+      }
+    }
+#endif
+  }
+
   server = new AsyncServer(port);
   if (server) {
     server->setNoDelay(true);
@@ -228,12 +342,28 @@ bool ModbusServerTCPasync::stop() {
 
   // now close existing clients
   LOCK_GUARD(lock1, cListLock);
-  while (!clients.empty()) {
-    // prevent onDisconnect handler to be called, resulting in deadlock
-    clients.front()->client->onDisconnect(nullptr, nullptr);
-    delete clients.front();
-    clients.pop_front();
+  for (auto shard : shards) {
+    {
+      LOCK_GUARD(lock2, shard->lock);
+      while (!shard->clients.empty()) {
+        mb_client *c = shard->clients.front();
+        // prevent onDisconnect handler to be called, resulting in deadlock
+        c->client->onDisconnect(nullptr, nullptr);
+        // Wait for the shard task and the worker pool to be done with its requests.
+        // Deferred workers are not waited for, their requests get a TIMEOUT response
+        while (c->busy()) {
+          expireDeferred(true);
+          delay(1);
+        }
+        delete c;
+        shard->clients.pop_front();
+      }
+      shard->count = 0;
+    }
+    // The shard task has nothing left to do
+    delete shard;
   }
+  shards.clear();
   delete server;
   server = nullptr;
   LOG_D("Modbus server stopped\n");
@@ -248,9 +378,18 @@ bool ModbusServerTCPasync::isRunning() {
 void ModbusServerTCPasync::onClientConnect(AsyncClient* client) {
   LOG_D("new client\n");
   LOCK_GUARD(lock1, cListLock);
-  if (clients.size() < maxNoClients) {
-    clients.emplace_back(new mb_client(this, client));
-    LOG_D("nr clients: %d\n", clients.size());
+  // Find the shard with the least connections
+  Shard *shard = nullptr;
+  uint16_t count = 0;
+  for (auto s : shards) {
+    count += s->count;
+    if (!shard || s->count < shard->count) shard = s;
+  }
+  if (shard && count < maxNoClients) {
+    LOCK_GUARD(lock2, shard->lock);
+    shard->clients.emplace_back(new mb_client(this, shard, client));
+    shard->count++;
+    LOG_D("nr clients: %d\n", count + 1);
   } else {
     LOG_D("max number of clients reached, closing new\n");
     client->close(true);
@@ -259,10 +398,13 @@ void ModbusServerTCPasync::onClientConnect(AsyncClient* client) {
 }
 
 void ModbusServerTCPasync::onClientDisconnect(mb_client* client) {
-  LOCK_GUARD(lock1, cListLock);
+  // Only the client's shard is locked, the others may go on serving
+  Shard *shard = client->shard;
+  LOCK_GUARD(lock1, shard->lock);
   // delete mb_client from list
-  clients.remove_if([client](mb_client* i) { return i->client == client->client; });
-  // delete client itself
-  delete client;
-  LOG_D("nr clients: %d\n", clients.size());
+  shard->clients.remove_if([client](mb_client* i) { return i->client == client->client; });
+  shard->count = shard->clients.size();
+  // delete client itself - unless the shard task, the worker pool or deferred workers are still busy with its requests
+  if (client->release()) delete client;
+  LOG_D("nr clients in shard: %d\n", shard->clients.size());
 }
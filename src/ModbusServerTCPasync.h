@@ -9,6 +9,7 @@
 
 #include <list>
 #include <queue>
+#include <atomic>
 #if USE_MUTEX
 #include <mutex> // NOLINT
 #endif
@@ -23,6 +24,8 @@
 #endif
 
 #include "ModbusServer.h"
+#include "ModbusMessagePool.h"
+#include "ModbusWorkerPool.h"
 
 #if USE_MUTEX
 using std::lock_guard;
@@ -31,25 +34,60 @@ using std::lock_guard;
 class ModbusServerTCPasync : public ModbusServer {
 
  private:
+  class mb_client;
+
+  // Shard: a share of the connections, with a task of its own serving their requests
+  struct Shard {
+    std::list<mb_client*> clients;
+    std::atomic<uint8_t> count; // Number of clients, to find the least loaded shard without locking them all
+#if HAS_FREERTOS
+    ModbusWorkerPool task;      // Single task serving the requests - not started without sharding
+#endif
+    #if USE_MUTEX
+    std::mutex lock;            // client list protection
+    #endif
+    Shard() : clients(), count(0) {}
+  };
+
   class mb_client {
    friend class ModbusServerTCPasync;
    
    public:
-    mb_client(ModbusServerTCPasync* s, AsyncClient* c);
+    mb_client(ModbusServerTCPasync* s, Shard* sh, AsyncClient* c);
     ~mb_client();
 
    private:
     void onData(uint8_t* data, size_t len);
     void onPoll();
     void onDisconnect();
-    void addResponseToOutbox(ModbusMessage* response);
+    void addResponseToOutbox(ModbusMessage* m, ModbusMessage response, const ModbusTrace& trace);
+    void setHead(ModbusMessage* m, ModbusMessage& response);
     void handleOutbox();
+    void serve(ModbusMessage* m);   // Run the worker on a pool task
+    // Send the response to a pending request
+    void complete(ModbusMessage* m, ModbusMessage userData, const ModbusTrace& trace = ModbusTrace());
+    bool release();                 // Connection is gone. True if it may be deleted now
+    bool busy();                    // Requests are with the worker pool or deferred workers
     ModbusServerTCPasync* server;
+    Shard* shard;
     AsyncClient* client;
+    uint32_t peer;          // Client's IP address, for the rate limit
     uint32_t lastActiveTime;
     ModbusMessage* message;
+    ModbusTrace rxTrace;    // Trace of the request in message
     Modbus::Error error;
-    std::queue<ModbusMessage*> outbox;
+    // Response waiting to be sent: MBAP header in the request's buffer and the response as it came.
+    // Requests handed to the worker pool or a deferred worker have their trace started over at DISPATCH,
+    // their RECEIVING phase is counted on its own
+    struct Outgoing {
+      ModbusMessage* head;
+      ModbusMessage pdu;
+      ModbusTrace trace;
+      Outgoing(ModbusMessage* h, ModbusMessage p, const ModbusTrace& t) : head(h), pdu(std::move(p)), trace(t) {}
+    };
+    std::queue<Outgoing> outbox;
+    uint16_t pending;       // Requests with the worker pool or deferred workers
+    bool disconnected;      // Connection is gone, the last pending response will delete us
     #if USE_MUTEX
     std::mutex obLock;  // outbox protection
     #endif
@@ -69,6 +107,13 @@ class ModbusServerTCPasync : public ModbusServer {
   // start: create task with TCP server to accept requests
   bool start(uint16_t port, uint8_t maxClients, uint32_t timeout, int coreID = -1);
 
+  // useShards: share the connections out to count tasks, each serving the requests of its connections.
+  // The tasks are pinned to the cores in turn, so all cores will run worker functions. A connection's
+  // requests are served in order. queueLimit: number of requests waiting per task - more will be
+  // answered with SERVER_DEVICE_BUSY. count 0 (default): requests are served on the AsyncTCP task.
+  // Only available with FreeRTOS, to be called before start().
+  bool useShards(uint8_t count, uint16_t queueLimit = 8);
+
   // stop: drop all connections and kill server task
   bool stop();
  
@@ -81,11 +126,13 @@ class ModbusServerTCPasync : public ModbusServer {
   void onClientDisconnect(mb_client* client);
 
   AsyncServer* server;
-  std::list<mb_client*> clients;
+  std::vector<Shard*> shards;   // One at least, with a task of its own each after useShards()
+  uint8_t shardCount;           // Number of shard tasks requested
+  uint16_t shardQueueLimit;     // Requests waiting per shard task
   uint8_t maxNoClients;
   uint32_t idle_timeout;
   #if USE_MUTEX
-  std::mutex cListLock;  // client list protection
+  std::mutex cListLock;  // protects shards while connecting and stopping
   #endif
 };
 
@@ -0,0 +1,510 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusServerTCPepoll.h"
+#include "ModbusWorkerPool.h"
+
+#if IS_LINUX
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+// Constructor
+ModbusServerTCPepoll::ModbusServerTCPepoll() :
+  ME_listen(-1),
+  ME_epoll(-1),
+  ME_wake(-1),
+  ME_stopping(false),
+  ME_thread(0),
+  ME_clients(),
+  ME_active(0),
+  ME_maxClients(0),
+  ME_idleTimeout(0),
+  ME_lastIdleCheck(0),
+  ME_serial(0),
+  ME_done(),
+  ME_pending(0) { }
+
+// Destructor: closes the connections
+ModbusServerTCPepoll::~ModbusServerTCPepoll() {
+  if (isRunning()) stop();
+}
+
+// activeClients: return number of clients currently connected
+uint16_t ModbusServerTCPepoll::activeClients() {
+  return ME_active;
+}
+
+// start: open the server port and start the event loop thread
+bool ModbusServerTCPepoll::start(uint16_t port, uint16_t maxClients, uint32_t timeout) {
+  // don't restart if already running
+  if (isRunning()) {
+    LOG_W("Server already running.\n");
+    return false;
+  }
+  ME_maxClients = maxClients;
+  ME_idleTimeout = timeout;
+  ME_stopping = false;
+
+  // Open the server socket
+  ME_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (ME_listen < 0) {
+    LOG_E("Could not open server socket: %s\n", strerror(errno));
+    return false;
+  }
+  int one = 1;
+  setsockopt(ME_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(ME_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(ME_listen, SOMAXCONN) < 0) {
+    LOG_E("Could not listen on port %d: %s\n", port, strerror(errno));
+    close(ME_listen);
+    ME_listen = -1;
+    return false;
+  }
+
+  // Set up the event loop. The eventfd is there to wake it up for stop() and pool responses
+  ME_epoll = epoll_create1(EPOLL_CLOEXEC);
+  ME_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  bool ok = (ME_epoll >= 0 && ME_wake >= 0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  if (ok) {
+    ev.data.fd = ME_listen;
+    ok = (epoll_ctl(ME_epoll, EPOLL_CTL_ADD, ME_listen, &ev) == 0);
+  }
+  if (ok) {
+    ev.data.fd = ME_wake;
+    ok = (epoll_ctl(ME_epoll, EPOLL_CTL_ADD, ME_wake, &ev) == 0);
+  }
+  if (ok) {
+    int rc = pthread_create(&ME_thread, NULL, &serve, this);
+    if (rc) {
+      LOG_E("Error creating server thread: %d\n", rc);
+      ok = false;
+    }
+  } else {
+    LOG_E("Could not set up event loop: %s\n", strerror(errno));
+  }
+  if (!ok) {
+    if (ME_wake >= 0) close(ME_wake);
+    if (ME_epoll >= 0) close(ME_epoll);
+    close(ME_listen);
+    ME_listen = ME_epoll = ME_wake = -1;
+    return false;
+  }
+  LOG_D("Modbus server started on port %d\n", port);
+  return true;
+}
+
+// stop: drop all connections and end the event loop thread
+bool ModbusServerTCPepoll::stop() {
+  if (!isRunning()) {
+    LOG_W("Server not running.\n");
+    return false;
+  }
+  // Wake up the event loop and wait for it to close all connections
+  ME_stopping = true;
+  uint64_t one = 1;
+  if (write(ME_wake, &one, sizeof(one)) < 0) {
+    LOG_E("Could not signal server thread: %s\n", strerror(errno));
+  }
+  pthread_join(ME_thread, NULL);
+  // The worker pool or deferred workers may still be busy with requests for us.
+  // Deferred workers are not waited for, their requests get a TIMEOUT response
+  while (ME_pending) {
+    expireDeferred(true);
+    delay(1);
+  }
+  ME_done.clear();
+  close(ME_wake);
+  close(ME_epoll);
+  close(ME_listen);
+  ME_listen = ME_epoll = ME_wake = -1;
+  LOG_D("Modbus server stopped\n");
+  return true;
+}
+
+// isRunning: return true is server is running
+bool ModbusServerTCPepoll::isRunning() {
+  return ME_listen >= 0;
+}
+
+// serve: thread function running the event loop
+void *ModbusServerTCPepoll::serve(void *p) {
+  (static_cast<ModbusServerTCPepoll *>(p))->loop();
+  return nullptr;
+}
+
+// loop: wait for events and handle them until stop() is called
+void ModbusServerTCPepoll::loop() {
+  struct epoll_event events[64];
+  bool done = false;
+
+  while (!done) {
+    // Wake up regularly to look for idle connections and deferred requests waiting too long
+    int wait = (ME_idleTimeout && ME_idleTimeout < 1000) ? ME_idleTimeout : 1000;
+    if (MS_deferredTimeout && MS_deferredTimeout < (uint32_t)wait) wait = MS_deferredTimeout;
+    int n = epoll_wait(ME_epoll, events, 64, wait);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      LOG_E("epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == ME_wake) {
+        uint64_t count;
+        if (read(ME_wake, &count, sizeof(count)) < 0) {
+          LOG_W("Could not read wakeup: %s\n", strerror(errno));
+        }
+        if (ME_stopping) {
+          done = true;
+        } else {
+          handleDone();
+        }
+      } else if (fd == ME_listen) {
+        acceptClients();
+      } else {
+        auto it = ME_clients.find(fd);
+        if (it == ME_clients.end()) continue;
+        mb_client *c = it->second;
+        bool ok = true;
+        if (events[i].events & EPOLLIN) ok = onData(c);
+        if (ok && (events[i].events & EPOLLOUT)) ok = handleOutbox(c);
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) ok = false;
+        if (ok) {
+          updateEvents(c);
+        } else {
+          closeClient(c);
+        }
+      }
+    }
+    closeIdleClients();
+    expireDeferred();
+  }
+
+  // Close all connections
+  while (!ME_clients.empty()) {
+    closeClient(ME_clients.begin()->second);
+  }
+}
+
+// acceptClients: take all pending connections, as long as maxClients is not reached
+void ModbusServerTCPepoll::acceptClients() {
+  while (1) {
+    struct sockaddr_in peer;
+    socklen_t peerLen = sizeof(peer);
+    memset(&peer, 0, sizeof(peer));
+    int fd = accept4(ME_listen, (struct sockaddr *)&peer, &peerLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_W("accept failed: %s\n", strerror(errno));
+      }
+      return;
+    }
+    if (ME_clients.size() >= ME_maxClients) {
+      LOG_D("max number of clients reached, closing new\n");
+      close(fd);
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(ME_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      LOG_W("Could not watch new client: %s\n", strerror(errno));
+      close(fd);
+      continue;
+    }
+    ME_clients[fd] = new mb_client(fd, ++ME_serial, peer.sin_addr.s_addr);
+    ME_active = ME_clients.size();
+    LOG_D("new client, nr clients: %d\n", ME_clients.size());
+  }
+}
+
+// onData: read all there is from a connection and process all complete requests
+// Returns false if the connection has to be closed
+bool ModbusServerTCPepoll::onData(mb_client *c) {
+  while (1) {
+    uint32_t now = micros();
+    if (!c->rxPtr) c->rxFirst = now;
+    ssize_t got = recv(c->fd, c->rxBuffer + c->rxPtr, sizeof(c->rxBuffer) - c->rxPtr, 0);
+    if (got == 0) {
+      LOG_D("client disconnected\n");
+      return false;
+    }
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      LOG_D("receive failed: %s\n", strerror(errno));
+      return false;
+    }
+    c->rxPtr += got;
+    c->lastActiveTime = millis();
+    LOG_D("data len %d\n", got);
+
+    // Process all complete requests in the buffer
+    while (c->rxPtr >= 6) {
+      uint16_t protocolID = (c->rxBuffer[2] << 8) | c->rxBuffer[3];
+      uint16_t len = (c->rxBuffer[4] << 8) | c->rxBuffer[5];
+      // Preliminary validation: protocol bytes and message length
+      Error error = SUCCESS;
+      if (protocolID != 0) {
+        error = TCP_HEAD_MISMATCH;
+        LOG_D("invalid protocol\n");
+      } else if (len < 2 || len > 256) {
+        error = PACKET_LENGTH_ERROR;
+        LOG_D("length error\n");
+      }
+      ModbusTrace trace;
+      trace.mark(TracePoint::FIRST_BYTE, c->rxFirst);
+      trace.token = (c->rxBuffer[0] << 8) | c->rxBuffer[1];
+      if (error != SUCCESS) {
+        // We have lost synchronization. Respond with the error and drop what was received
+        ModbusMessage response;
+        response.setError(c->rxPtr > 6 ? c->rxBuffer[6] : 0, c->rxPtr > 7 ? c->rxBuffer[7] : 0, error);
+        addResponse(c, c->rxBuffer, response, trace);
+        c->rxPtr = 0;
+        break;
+      }
+      // Receive until request is complete
+      if (c->rxPtr < len + 6) break;
+      LOG_D("request complete (len:%d)\n", len + 6);
+      trace.mark(TracePoint::FRAME_COMPLETE);
+      if (MS_capture) MS_capture->add(ModbusCapture::TCP_RX, c->rxBuffer, len + 6, nullptr, 0, c->rxFirst);
+
+      // View on the request without MBAP, with server ID - no copy needed
+      ModbusMessageView request(c->rxBuffer + 6, len);
+      // Over the limits? Then tell the client to try again later
+      if (!admit(c->peer)) {
+        LOG_D("request shed\n");
+        ModbusMessage response = shed(request);
+        addResponse(c, c->rxBuffer, response, trace);
+      // Is it for a deferred worker? The response will come back through handleDone()
+      } else if (deferredRequest(c, request, trace)) {
+        LOG_D("request deferred\n");
+      // Is there a worker pool to run the worker?
+      } else if (MS_pool) {
+        // Yes. Hand it over, the response will come back through handleDone()
+        if (!poolRequest(c, request, trace)) {
+          // Pool is busy - tell the client to try again later
+          LOG_D("worker pool busy\n");
+          ModbusMessage response;
+          response.setError(request.getServerID(), request.getFunctionCode(), SERVER_DEVICE_BUSY);
+          countRequest(request, response);
+          addResponse(c, c->rxBuffer, response, trace);
+          release();
+        }
+      } else {
+        // No, process it right here
+        trace.mark(TracePoint::DISPATCH);
+        ModbusMessage response = processRequest(request);
+        release();
+        // A NIL response will not be sent at all
+        if (response.size()) {
+          addResponse(c, c->rxBuffer, response, trace);
+        } else {
+          traceDone(trace, request, response);
+        }
+      }
+      // Remove the request from the buffer. The rest came with this read
+      c->rxPtr -= len + 6;
+      if (c->rxPtr) memmove(c->rxBuffer, c->rxBuffer + len + 6, c->rxPtr);
+      c->rxFirst = now;
+    }
+    // Stop reading if the client does not take its responses - updateEvents() will pause it
+    if (c->outbox.size() - c->outPtr > MODBUS_EPOLL_OUTBOX_LIMIT) break;
+  }
+  return handleOutbox(c);
+}
+
+// poolRequest: hand a request over to the worker pool. Returns false if the pool is busy
+// The request has to be copied - the buffer will be overwritten by the next one.
+bool ModbusServerTCPepoll::poolRequest(mb_client *c, ModbusMessageView request, ModbusTrace& trace) {
+  Done done(c, trace);
+  ModbusMessage copy;
+  copy.add(request.data(), request.size());
+  ME_pending++;
+  bool rc = MS_pool->submit([this, done, copy]() mutable {
+    done.trace.mark(TracePoint::DISPATCH);
+    done.response = processRequest(ModbusMessageView(copy.data(), copy.size()));
+    handBack(done);
+  });
+  if (!rc) ME_pending--;
+  return rc;
+}
+
+// deferredRequest: hand a request over to a deferred worker, if there is one for it
+bool ModbusServerTCPepoll::deferredRequest(mb_client *c, ModbusMessageView request, ModbusTrace& trace) {
+  trace.mark(TracePoint::DISPATCH);
+  Done done(c, trace);
+  // Count it before - the worker may respond right away
+  ME_pending++;
+  bool rc = deferRequest(request, [this, done](ModbusMessage response) mutable {
+    done.response = std::move(response);
+    handBack(done);
+  });
+  if (!rc) ME_pending--;
+  return rc;
+}
+
+// handBack: give a response from another thread to the event loop to be sent
+void ModbusServerTCPepoll::handBack(Done& done) {
+  {
+    LOCK_GUARD(lockGuard, ME_doneLock);
+    ME_done.push_back(std::move(done));
+  }
+  // Wake up the event loop to send it
+  uint64_t one = 1;
+  if (write(ME_wake, &one, sizeof(one)) < 0) {
+    LOG_E("Could not signal server thread: %s\n", strerror(errno));
+  }
+  release();
+  ME_pending--;
+}
+
+// handleDone: put the responses from the worker pool and deferred workers into the outboxes
+void ModbusServerTCPepoll::handleDone() {
+  std::deque<Done> done;
+  {
+    LOCK_GUARD(lockGuard, ME_doneLock);
+    done.swap(ME_done);
+  }
+  for (auto& d : done) {
+    // Is the connection still there? A NIL response will not be sent at all
+    auto it = ME_clients.find(d.fd);
+    if (it == ME_clients.end() || it->second->serial != d.serial || !d.response.size()) continue;
+    mb_client *c = it->second;
+    addResponse(c, d.header, d.response, d.trace);
+    if (handleOutbox(c)) {
+      updateEvents(c);
+    } else {
+      closeClient(c);
+    }
+  }
+}
+
+// addResponse: send a response with its MBAP header, taking the transactionID from header.
+// Header and response are given to the socket as they are. Only what it will not take at once
+// is queued in the outbox.
+void ModbusServerTCPepoll::addResponse(mb_client *c, const uint8_t *header, ModbusMessage& response, ModbusTrace& trace) {
+  trace.mark(TracePoint::SEND_START);
+  // Keep transaction id and protocol id, add payload length
+  uint8_t head[6];
+  memcpy(head, header, 4);
+  head[4] = (response.size() >> 8) & 0xFF;
+  head[5] = response.size() & 0xFF;
+  if (MS_capture) MS_capture->add(ModbusCapture::TCP_TX, head, 6, response.data(), response.size());
+  size_t done = 0;
+  // Nothing waiting to be sent before? Then try to send it right away
+  if (c->outPtr == c->outbox.size()) {
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = 6;
+    iov[1].iov_base = const_cast<uint8_t *>(response.data());
+    iov[1].iov_len = response.size();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t sent;
+    do {
+      sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (sent < 0 && errno == EINTR);
+    // Errors will show up again in handleOutbox()
+    if (sent > 0) done = sent;
+    LOG_D("sent (%d)\n", done);
+  }
+  // Queue the rest
+  if (done < 6) c->outbox.insert(c->outbox.end(), head + done, head + 6);
+  size_t skip = (done > 6) ? done - 6 : 0;
+  c->outbox.insert(c->outbox.end(), response.data() + skip, response.data() + response.size());
+  // A response queued in part is taken as sent when it is handed to the outbox
+  trace.mark(TracePoint::SEND_END);
+  traceDone(trace, ModbusMessageView(response), response);
+}
+
+// handleOutbox: send as much of the outbox as the socket will take. Returns false on errors
+bool ModbusServerTCPepoll::handleOutbox(mb_client *c) {
+  while (c->outPtr < c->outbox.size()) {
+    ssize_t sent = send(c->fd, c->outbox.data() + c->outPtr, c->outbox.size() - c->outPtr, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      LOG_D("send failed: %s\n", strerror(errno));
+      return false;
+    }
+    LOG_D("sent (%d)\n", sent);
+    c->outPtr += sent;
+  }
+  // All out? Then start over with an empty outbox
+  if (c->outPtr == c->outbox.size()) {
+    c->outbox.clear();
+    c->outPtr = 0;
+  }
+  return true;
+}
+
+// updateEvents: set the epoll events needed for the state of the connection
+// We will wait for room to send only while responses are pending, and stop reading requests
+// while the client lets too many responses pile up.
+void ModbusServerTCPepoll::updateEvents(mb_client *c) {
+  size_t pending = c->outbox.size() - c->outPtr;
+  bool reading = (pending <= MODBUS_EPOLL_OUTBOX_LIMIT);
+  bool writing = (pending > 0);
+  if (reading == c->reading && writing == c->writing) return;
+  struct epoll_event ev;
+  ev.events = 0;
+  if (reading) ev.events |= EPOLLIN;
+  if (writing) ev.events |= EPOLLOUT;
+  ev.data.fd = c->fd;
+  if (epoll_ctl(ME_epoll, EPOLL_CTL_MOD, c->fd, &ev) == 0) {
+    c->reading = reading;
+    c->writing = writing;
+  }
+}
+
+// closeClient: close a connection and forget about it
+void ModbusServerTCPepoll::closeClient(mb_client *c) {
+  epoll_ctl(ME_epoll, EPOLL_CTL_DEL, c->fd, nullptr);
+  close(c->fd);
+  ME_clients.erase(c->fd);
+  delete c;
+  ME_active = ME_clients.size();
+  LOG_D("nr clients: %d\n", ME_clients.size());
+}
+
+// closeIdleClients: close connections without a request for longer than the idle timeout
+void ModbusServerTCPepoll::closeIdleClients() {
+  if (!ME_idleTimeout) return;
+  // Looking at all connections takes a while, so do not do it on every event
+  unsigned long now = millis();
+  if (now - ME_lastIdleCheck < (ME_idleTimeout < 1000 ? ME_idleTimeout : 1000)) return;
+  ME_lastIdleCheck = now;
+  std::vector<mb_client *> idle;
+  for (auto& it : ME_clients) {
+    if (now - it.second->lastActiveTime > ME_idleTimeout) idle.push_back(it.second);
+  }
+  for (auto c : idle) {
+    LOG_D("client idle, closing\n");
+    closeClient(c);
+  }
+}
+
+#endif  // IS_LINUX
@@ -0,0 +1,142 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_SERVER_TCP_EPOLL_H
+#define _MODBUS_SERVER_TCP_EPOLL_H
+
+#include "options.h"
+
+#if IS_LINUX
+#include <map>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>    // NOLINT
+#include <pthread.h>
+#include "ModbusServer.h"
+
+// Bytes of unsent responses a connection may pile up before no more requests are read from it
+#ifndef MODBUS_EPOLL_OUTBOX_LIMIT
+#define MODBUS_EPOLL_OUTBOX_LIMIT 4096
+#endif
+
+// ModbusServerTCPepoll: Modbus TCP server for Linux.
+// All connections are served by a single thread running an epoll event loop on non-blocking
+// sockets, so hundreds of connections will not need hundreds of threads.
+// The worker functions are called from that thread - a slow worker will hold up all connections,
+// unless a ModbusWorkerPool is given to run them with useWorkerPool(). Deferred workers will
+// respond from wherever they like; the event loop will send the response.
+class ModbusServerTCPepoll : public ModbusServer {
+public:
+  // Constructor
+  ModbusServerTCPepoll();
+
+  // Destructor: closes the connections
+  ~ModbusServerTCPepoll();
+
+  // activeClients: return number of clients currently connected
+  uint16_t activeClients();
+
+  // start: open the server port and start the event loop thread.
+  // timeout: ms a connection may be idle before it is closed. 0: never
+  bool start(uint16_t port, uint16_t maxClients, uint32_t timeout);
+
+  // stop: drop all connections and end the event loop thread.
+  // Will wait for the worker pool and deferred workers to respond to the requests they have.
+  bool stop();
+
+  // isRunning: return true is server is running
+  bool isRunning();
+
+protected:
+  inline void isInstance() { }
+
+  // mb_client: state of one connection
+  struct mb_client {
+    int fd;                          // Socket
+    uint32_t serial;                 // Connection number, to tell it from a later one with the same socket
+    uint32_t peer;                   // Client's IP address, for the rate limit
+    unsigned long lastActiveTime;    // Time of the last request received
+    uint8_t rxBuffer[262];           // Request being received: MBAP header and up to 256 bytes
+    uint16_t rxPtr;                  // Number of bytes in rxBuffer
+    uint32_t rxFirst;                // micros() of the read that brought in the start of rxBuffer
+    std::vector<uint8_t> outbox;     // Responses not yet sent
+    size_t outPtr;                   // Number of bytes in outbox sent already
+    bool reading;                    // EPOLLIN is enabled
+    bool writing;                    // EPOLLOUT is enabled
+    mb_client(int f, uint32_t s, uint32_t p) :
+      fd(f), serial(s), peer(p), lastActiveTime(millis()), rxPtr(0), rxFirst(0), outbox(), outPtr(0), reading(true), writing(false) {}
+  };
+
+  // serve: thread function running the event loop
+  static void *serve(void *p);
+  void loop();
+
+  // acceptClients: take all pending connections, as long as maxClients is not reached
+  void acceptClients();
+
+  // onData: read all there is from a connection and process all complete requests
+  // Returns false if the connection has to be closed
+  bool onData(mb_client *c);
+
+  // Done: response from the worker pool or a deferred worker, to be sent by the event loop
+  struct Done {
+    int fd;                          // Socket of the connection
+    uint32_t serial;                 // Connection number
+    uint8_t header[4];               // Transaction and protocol ID of the request
+    ModbusMessage response;
+    ModbusTrace trace;               // Trace of the request up to now
+    Done(mb_client *c, const ModbusTrace& t) : fd(c->fd), serial(c->serial), response(), trace(t) {
+      memcpy(header, c->rxBuffer, 4);
+    }
+  };
+
+  // poolRequest: hand a request over to the worker pool. Returns false if the pool is busy
+  bool poolRequest(mb_client *c, ModbusMessageView request, ModbusTrace& trace);
+
+  // deferredRequest: hand a request over to a deferred worker. Returns false if there is none for it
+  bool deferredRequest(mb_client *c, ModbusMessageView request, ModbusTrace& trace);
+
+  // handBack: give a response from another thread to the event loop to be sent. done is moved on
+  void handBack(Done& done);
+
+  // handleDone: put the responses from the worker pool and deferred workers into the outboxes
+  void handleDone();
+
+  // addResponse: send a response with its MBAP header, taking the transactionID from header.
+  // What the socket will not take at once is queued in the outbox
+  // The trace of the request is completed and counted.
+  void addResponse(mb_client *c, const uint8_t *header, ModbusMessage& response, ModbusTrace& trace);
+
+  // handleOutbox: send as much of the outbox as the socket will take. Returns false on errors
+  bool handleOutbox(mb_client *c);
+
+  // updateEvents: set the epoll events needed for the state of the connection
+  void updateEvents(mb_client *c);
+
+  // closeClient: close a connection and forget about it
+  void closeClient(mb_client *c);
+
+  // closeIdleClients: close connections without a request for longer than the idle timeout
+  void closeIdleClients();
+
+  int ME_listen;                        // Listening socket, -1 if not running
+  int ME_epoll;                         // epoll instance
+  int ME_wake;                          // eventfd to wake up the event loop for stop() and pool responses
+  std::atomic<bool> ME_stopping;        // stop() was called
+  pthread_t ME_thread;                  // Event loop thread
+  std::map<int, mb_client *> ME_clients;  // Connections by socket. Only touched by the event loop
+  std::atomic<uint16_t> ME_active;      // Number of connections
+  uint16_t ME_maxClients;               // Maximum number of connections
+  uint32_t ME_idleTimeout;              // ms until an idle connection is closed, 0: never
+  unsigned long ME_lastIdleCheck;       // Time idle connections were looked for last
+  uint32_t ME_serial;                   // Number of connections accepted
+  std::deque<Done> ME_done;             // Responses from the worker pool and deferred workers
+  std::mutex ME_doneLock;               // Protects ME_done
+  std::atomic<uint16_t> ME_pending;     // Number of requests with the worker pool or deferred workers
+};
+
+#endif  // IS_LINUX
+
+#endif
@@ -8,6 +8,8 @@
 #include <Arduino.h>
 #include <mutex>  // NOLINT
 #include "ModbusServer.h"
+#include "ModbusWakeup.h"
+#include "TCPutils.h"
 #undef LOCAL_LOG_LEVEL
 // #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
 #include "Logging.h"
@@ -39,6 +41,12 @@ public:
   // stop: drop all connections and kill server task
   bool stop();
 
+  // useSingleTask: serve all connections in turn from the server task, instead of starting a task for
+  // each. Saves a task with its stack per connection. The connections are read without blocking, one
+  // request per connection and turn. A slow or deferred worker will hold up all connections, though!
+  // Takes effect with the next start().
+  inline void useSingleTask(bool singleTask = true) { serverSingleTask = singleTask; }
+
 protected:
   // Prevent copy construction and assignment
   ModbusServerTCP(ModbusServerTCP& m) = delete;
@@ -51,12 +59,14 @@ protected:
   uint16_t serverPort;
   uint32_t serverTimeout;
   bool serverGoDown;
+  bool serverSingleTask;         // All connections are served by the server task
   mutex clientLock;
+  ModbusWakeup serverWakeup;     // Wakes up the server task when a client slot is free again
 
   struct ClientData {
-    ClientData() : task(nullptr), client(0), timeout(0), parent(nullptr) {}
+    ClientData() : task(nullptr), client(0), timeout(0), parent(nullptr), peer(0), lastMessage(0), rxLen(0) {}
     ClientData(TaskHandle_t t, CT& c, uint32_t to, ModbusServerTCP<ST, CT> *p) : 
-      task(t), client(c), timeout(to), parent(p) {}
+      task(t), client(c), timeout(to), parent(p), peer(static_cast<uint32_t>(c.remoteIP())), lastMessage(millis()), rxLen(0) {}
     ~ClientData() {
       if (client) {
         client.stop();
@@ -70,12 +80,25 @@ protected:
     CT client;
     uint32_t timeout;
     ModbusServerTCP<ST, CT> *parent;
+    uint32_t peer;                // Client's IP address, for the rate limit
+    // Single task mode only: request received so far
+    unsigned long lastMessage;
+    uint16_t rxLen;
+    uint8_t rx[TCPutils::MAX_ADU];
+    ModbusTrace trace;
   };
   ClientData **clients;
 
   // serve: loop function for server task
   static void serve(ModbusServerTCP<ST, CT> *myself);
 
+  // multiplex: loop function for server task in single task mode
+  static void multiplex(ModbusServerTCP<ST, CT> *myself);
+
+  // pollClient: single task mode - take what the client has sent without blocking and serve a request,
+  // if it is complete. Returns false if the connection is done
+  bool pollClient(ClientData *cd);
+
   // worker: loop function for client tasks
   static void worker(ClientData *myData);
 
@@ -97,7 +120,8 @@ ModbusServerTCP<ST, CT>::ModbusServerTCP() :
   serverTask(nullptr),
   serverPort(502),
   serverTimeout(20000),
-  serverGoDown(false) {
+  serverGoDown(false),
+  serverSingleTask(false) {
     clients = new ClientData*[numClients]();
    }
 
@@ -106,7 +130,9 @@ template <typename ST, typename CT>
 ModbusServerTCP<ST, CT>::~ModbusServerTCP() {
   for (uint8_t i = 0; i < numClients; ++i) {
     if (clients[i] != nullptr) {
+      lock_guard<mutex> cL(clientLock);
       delete clients[i];
+      clients[i] = nullptr;
     }
   }
   delete[] clients;
@@ -118,8 +144,9 @@ template <typename ST, typename CT>
 uint16_t ModbusServerTCP<ST, CT>::activeClients() {
   uint8_t cnt = 0;
   for (uint8_t i = 0; i < numClients; ++i) {
-    // Current slot could have been previously used - look for cleared task handles
-    if (clients[i] != nullptr) {
+    // Current slot could have been previously used - look for cleared task handles.
+    // In single task mode the server task will clean up itself
+    if (clients[i] != nullptr && !serverSingleTask) {
       // Empty task handle?
       if (clients[i]->task == nullptr) {
         // Yes. Delete entry and init client pointer
@@ -158,8 +185,9 @@ template <typename ST, typename CT>
     char taskName[18];
     snprintf(taskName, 18, "MBserve%04X", port);
 
-    // Start task to handle the client
-    xTaskCreatePinnedToCore((TaskFunction_t)&serve, taskName, 4096, this, 5, &serverTask, coreID >= 0 ? coreID : NULL);
+    // Start task to handle the client - or all of them
+    TaskFunction_t loop = serverSingleTask ? (TaskFunction_t)&multiplex : (TaskFunction_t)&serve;
+    xTaskCreatePinnedToCore(loop, taskName, 4096, this, 5, &serverTask, coreID >= 0 ? coreID : NULL);
     LOG_D("Server task %s started (%d).\n", taskName, (uint32_t)serverTask);
 
     // Wait two seconds for it to establish
@@ -176,6 +204,7 @@ template <typename ST, typename CT>
       // Client is alive?
       if (clients[i] != nullptr) {
         // Yes. Close the connection
+        lock_guard<mutex> cL(clientLock);
         delete clients[i];
         clients[i] = nullptr;
       }
@@ -183,6 +212,7 @@ template <typename ST, typename CT>
     if (serverTask != nullptr) {
       // Signal server task to stop
       serverGoDown = true;
+      serverWakeup.signal();
       delay(5000);
       LOG_D("Killed server task %d\n", (uint32_t)(serverTask));
       serverTask = nullptr;
@@ -238,17 +268,163 @@ void ModbusServerTCP<ST, CT>::serve(ModbusServerTCP<ST, CT> *myself) {
           myself->accept(ec, myself->serverTimeout, 0);
           LOG_D("Accepted connection - %d clients running\n", myself->activeClients());
         }
+        // Give scheduler room to breathe
+        delay(10);
+      } else {
+        // No. Sleep until a client task has finished
+        myself->serverWakeup.wait(1000);
+      }
+    }
+    LOG_E("Server going down\n");
+    // We must go down
+    SERVER_END;
+  }
+  vTaskDelete(NULL);
+}
+
+template <typename ST, typename CT>
+void ModbusServerTCP<ST, CT>::multiplex(ModbusServerTCP<ST, CT> *myself) {
+  // need a local scope here to delete the server at termination time
+  if (1) {
+    // Set up server with given port
+    ST server(myself->serverPort);
+
+    // Start it
+    server.begin();
+
+    // Loop until being killed
+    while (!myself->serverGoDown) {
+      bool idle = true;
+      // Do we have clients left to use?
+      if (myself->clientAvailable()) {
+        // Yes. accept one, if it has connected
+        CT ec = server.accept();
+        if (ec) {
+          lock_guard<mutex> cL(myself->clientLock);
+          for (uint8_t i = 0; i < myself->numClients; ++i) {
+            if (myself->clients[i] == nullptr) {
+              myself->clients[i] = new ClientData(nullptr, ec, myself->serverTimeout, myself);
+              LOG_D("Accepted connection in slot %d\n", i);
+              break;
+            }
+          }
+          idle = false;
+        }
+      }
+      // Serve all clients in turn
+      {
+        lock_guard<mutex> cL(myself->clientLock);
+        for (uint8_t i = 0; i < myself->numClients; ++i) {
+          ClientData *cd = myself->clients[i];
+          if (cd == nullptr) continue;
+          unsigned long last = cd->lastMessage;
+          if (!myself->pollClient(cd)) {
+            LOG_D("Client %d done\n", i);
+            delete cd;
+            myself->clients[i] = nullptr;
+          } else if (cd->lastMessage != last) {
+            idle = false;
+          }
+        }
       }
-      // Give scheduler room to breathe
-      delay(10);
+      // Give scheduler room to breathe, if there was nothing to do
+      if (idle) delay(1);
     }
     LOG_E("Server going down\n");
+    // Drop the connections left
+    {
+      lock_guard<mutex> cL(myself->clientLock);
+      for (uint8_t i = 0; i < myself->numClients; ++i) {
+        delete myself->clients[i];
+        myself->clients[i] = nullptr;
+      }
+    }
     // We must go down
     SERVER_END;
   }
   vTaskDelete(NULL);
 }
 
+// pollClient: single task mode - take what the client has sent without blocking and serve a request,
+// if it is complete. Returns false if the connection is done
+template <typename ST, typename CT>
+bool ModbusServerTCP<ST, CT>::pollClient(ClientData *cd) {
+  CT& client = cd->client;
+  if (!client.connected()) return false;
+  int avail = client.available();
+  if (avail <= 0) {
+    // Nothing new - has the connection been idle for too long?
+    return !cd->timeout || (millis() - cd->lastMessage < cd->timeout);
+  }
+  cd->lastMessage = millis();
+  if (!cd->rxLen) {
+    cd->trace.clear();
+    cd->trace.mark(TracePoint::FIRST_BYTE);
+  }
+
+  // Read the MBAP header first, then as much of the rest as the header tells
+  uint16_t frameLength = TCPutils::frameLength(cd->rx, cd->rxLen);
+  uint16_t want = (frameLength ? frameLength : 6) - cd->rxLen;
+  int got = client.read(cd->rx + cd->rxLen, (avail < want) ? avail : want);
+  if (got <= 0) return true;
+  cd->rxLen += got;
+  frameLength = TCPutils::frameLength(cd->rx, cd->rxLen);
+
+  if (frameLength == TCPutils::INVALID_FRAME) {
+    // We have lost synchronization. Respond with the error and drop what was received
+    Error error = (cd->rx[2] || cd->rx[3]) ? TCP_HEAD_MISMATCH : PACKET_LENGTH_ERROR;
+    LOG_D("Invalid MBAP header\n");
+    // Echo server ID and FC, if they are there, like the worker tasks do
+    while (cd->rxLen < 8) {
+      int b = client.read();
+      if (b < 0) break;
+      cd->rx[cd->rxLen++] = b;
+    }
+    uint8_t serverID = (cd->rxLen > 6) ? cd->rx[6] : 0;
+    uint8_t functionCode = (cd->rxLen > 7) ? cd->rx[7] : 0;
+    while (client.read() != -1) {}
+    ModbusMessage response;
+    response.setError(serverID, functionCode, error);
+    cd->rx[4] = 0;
+    cd->rx[5] = response.size();
+    TCPutils::writeFrame(client, cd->rx, response.data(), response.size());
+    errorCount++;
+    cd->rxLen = 0;
+    return true;
+  }
+  // Request complete?
+  if (!frameLength || cd->rxLen < frameLength) return true;
+  cd->rxLen = 0;
+  if (MS_capture) MS_capture->add(ModbusCapture::TCP_RX, cd->rx, frameLength, nullptr, 0, cd->trace.time(TracePoint::FIRST_BYTE));
+
+  // Yes. View on the request without MBAP, with server ID - no copy needed
+  ModbusMessageView request(cd->rx + 6, frameLength - 6);
+  cd->trace.mark(TracePoint::FRAME_COMPLETE);
+  cd->trace.mark(TracePoint::DISPATCH);
+  // Over the limits? Then tell the client to try again later
+  ModbusMessage response;
+  if (admit(cd->peer)) {
+    response = processRequest(request);
+    release();
+  } else {
+    response = shed(request);
+  }
+  // A NIL response will not be sent at all
+  if (response.size()) {
+    // Keep transaction and protocol ID of the request and set the new length
+    cd->rx[4] = (response.size() >> 8) & 0xFF;
+    cd->rx[5] = response.size() & 0xFF;
+    cd->trace.mark(TracePoint::SEND_START);
+    if (MS_capture) MS_capture->add(ModbusCapture::TCP_TX, cd->rx, 6, response.data(), response.size());
+    TCPutils::writeFrame(client, cd->rx, response.data(), response.size());
+    cd->trace.mark(TracePoint::SEND_END);
+    HEXDUMP_V("Response", response.data(), response.size());
+  }
+  cd->trace.token = (cd->rx[0] << 8) | cd->rx[1];
+  traceDone(cd->trace, request, response);
+  return true;
+}
+
 template <typename ST, typename CT>
 void ModbusServerTCP<ST, CT>::worker(ClientData *myData) {
   // Get own reference data in handier form
@@ -266,28 +442,40 @@ void ModbusServerTCP<ST, CT>::worker(ClientData *myData) {
     // Get a request
     if (myClient.available()) {
       response.clear();
+      ModbusTrace trace;
+      trace.mark(TracePoint::FIRST_BYTE);
       ModbusMessage m = myParent->receive(myClient, 100);
+      trace.mark(TracePoint::FRAME_COMPLETE);
+      // Note the request size for the statistics
+      uint16_t requestSize = m.size();
+      if (myParent->MS_capture && requestSize >= 8) {
+        myParent->MS_capture->add(ModbusCapture::TCP_RX, m.data(), requestSize, nullptr, 0, trace.time(TracePoint::FIRST_BYTE));
+      }
 
       // has it the minimal length (6 bytes TCP header plus serverID plus FC)?
       if (m.size() >= 8) {
-        {
-          LOCK_GUARD(cntLock, myParent->m);
-          myParent->messageCount++;
-        }
-        // Extract request data
-        ModbusMessage request;
-        request.add(m.data() + 6, m.size() - 6);
+        myParent->messageCount++;
+        // Extract request data - a view behind the MBAP header, no copy needed
+        ModbusMessageView request(m.data() + 6, m.size() - 6);
 
         // Protocol ID shall be 0x0000 - is it?
         if (m[2] == 0 && m[3] == 0) {
           // ServerID shall be at [6], FC at [7]. Check both
-          if (myParent->isServerFor(request.getServerID())) {
+          // Hold the registry snapshot while the worker is running
+          MBSsnapshot reg = myParent->registry();
+          bool admitted = myParent->admit(myData->peer);
+          if (!admitted) {
+            // Over the limits - tell the client to try again later
+            LOG_D("Request shed\n");
+            response.setError(request.getServerID(), request.getFunctionCode(), SERVER_DEVICE_BUSY);
+          } else if (reg->isServerFor(request.getServerID())) {
             // Server is correct - in principle. Do we serve the FC?
-            MBSworker callBack = myParent->getWorker(request.getServerID(), request.getFunctionCode());
-            if (callBack) {
+            const MBSentry *entry = reg->findEntry(request.getServerID(), request.getFunctionCode());
+            if (entry && entry->isSet()) {
               // Yes, we do.
-              // Invoke the worker method to get a response
-              ModbusMessage data = callBack(request);
+              // Invoke the worker method to get a response. A deferred worker will be waited for
+              trace.mark(TracePoint::DISPATCH);
+              ModbusMessage data = myParent->callWorker(entry, request);
               // Process Response
               // One of the predefined types?
               if (data[0] == 0xFF && (data[1] == 0xF0 || data[1] == 0xF1)) {
@@ -298,7 +486,7 @@ void ModbusServerTCP<ST, CT>::worker(ClientData *myData) {
                   LOG_D("NIL response\n");
                   break;
                 case 0xF1: // ECHO
-                  response = request;
+                  response.add(request.data(), request.size());
                   if (request.getFunctionCode() == WRITE_MULT_REGISTERS ||
                       request.getFunctionCode() == WRITE_MULT_COILS) {
                     response.resize(6);
@@ -310,7 +498,7 @@ void ModbusServerTCP<ST, CT>::worker(ClientData *myData) {
                 }
               } else {
                 // No. User provided data response
-                response = data;
+                response = std::move(data);
                 LOG_D("Data response\n");
               }
             } else {
@@ -321,32 +509,45 @@ void ModbusServerTCP<ST, CT>::worker(ClientData *myData) {
             // No, serverID is not served here
             response.setError(request.getServerID(), request.getFunctionCode(), INVALID_SERVER);
           }
+          if (admitted) myParent->release();
         } else {
           // No, protocol ID was something weird
           response.setError(request.getServerID(), request.getFunctionCode(), TCP_HEAD_MISMATCH);
         }
       }
-      delay(1);
       // Do we have a response to send?
       if (response.size() >= 3) {
         // Yes. Do it now.
-        // Cut off length and request data, then update TCP header
-        m.resize(4);
-        m.add(static_cast<uint16_t>(response.size()));
-        // Append response
-        m.append(response);
-        myClient.write(m.data(), m.size());
-        HEXDUMP_V("Response", m.data(), m.size());
+        // Keep transaction and protocol ID of the request and set the new length.
+        // Header and response go out together, the response is not copied behind the header
+        uint8_t head[6];
+        memcpy(head, m.data(), 4);
+        head[4] = (response.size() >> 8) & 0xFF;
+        head[5] = response.size() & 0xFF;
+        trace.mark(TracePoint::SEND_START);
+        if (myParent->MS_capture) myParent->MS_capture->add(ModbusCapture::TCP_TX, head, 6, response.data(), response.size());
+        TCPutils::writeFrame(myClient, head, response.data(), response.size());
+        trace.mark(TracePoint::SEND_END);
+        HEXDUMP_V("Response head", head, 6);
+        HEXDUMP_V("Response", response.data(), response.size());
         // count error responses
         if (response.getError() != SUCCESS) {
-          LOCK_GUARD(cntLock, myParent->m);
           myParent->errorCount++;
         }
       }
+      // Keep statistics for the request, even if it got no response. Server ID and FC are unchanged in m
+      if (requestSize >= 8) {
+        myParent->statistics.count(m[6], m[7], response.getError(), requestSize - 6, response.size());
+        trace.token = (m[0] << 8) | m[1];
+        myParent->traceDone(trace, ModbusMessageView(m.data() + 6, requestSize - 6), response);
+      }
       // We did something communicationally - rewind timeout timer
       myLastMessage = millis();
+      // Pipelined requests waiting already will be taken right away
+    } else {
+      // Nothing to do - give scheduler room to breathe
+      delay(1);
     }
-    delay(1);
   }
 
   if (millis() - myLastMessage >= myTimeOut) {
@@ -366,6 +567,8 @@ void ModbusServerTCP<ST, CT>::worker(ClientData *myData) {
     lock_guard<mutex> cL(myParent->clientLock);
     myData->task = nullptr;
   }
+  // Tell the server task a slot is free again
+  myParent->serverWakeup.signal();
 
   delay(50);
   vTaskDelete(NULL);
@@ -385,18 +588,22 @@ ModbusMessage ModbusServerTCP<ST, CT>::receive(CT& client, uint32_t timeWait) {
   while ((millis() - lastMillis < timeWait) && ((cnt < 6) || (cnt < lengthVal)) && (cnt < BUFFERSIZE)) 
   {
     // Is there data waiting?
-    if (client.available()) {
-        buffer[cnt] = client.read();
-        // Are we at the TCP header length field byte #1?
-        if (cnt == 4) lengthVal = buffer[cnt] << 8;
-        // Are we at the TCP header length field byte #2?
-        if (cnt == 5) {
-          lengthVal |= buffer[cnt];
-          lengthVal += 6;
+    int avail = client.available();
+    if (avail > 0) {
+      // Read up to the end of the TCP header first, then up to the end of the request.
+      // Never read beyond - a pipelined request may follow right behind
+      uint16_t want = ((cnt < 6) ? 6 : lengthVal) - cnt;
+      if (want > BUFFERSIZE - cnt) want = BUFFERSIZE - cnt;
+      int got = client.read(buffer + cnt, (avail < want) ? avail : want);
+      if (got > 0) {
+        cnt += got;
+        // Is the TCP header complete? Then we know the length
+        if (cnt >= 6 && !lengthVal) {
+          lengthVal = ((buffer[4] << 8) | buffer[5]) + 6;
         }
-        cnt++;
         // Rewind EOT and timeout timers
         lastMillis = millis();
+      }
     } else {
       delay(1); // Give scheduler room to breathe
     }
@@ -0,0 +1,136 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusStatistics.h"
+
+// Constructor: all counters zero, all slots free
+ModbusStatistics::ModbusStatistics() :
+  ST_untracked(0) {
+  for (uint16_t i = 0; i < MODBUS_STATS_SLOTS; ++i) {
+    ST_slot[i].key.store(0);
+  }
+  reset();
+}
+
+// count: add a transaction. Combinations beyond MODBUS_STATS_SLOTS will only show in untracked()
+void ModbusStatistics::count(uint8_t serverID, uint8_t functionCode, Error error, uint16_t bytesIn, uint16_t bytesOut) {
+  // Error responses carry the function code with the top bit set - count them with the request FC
+  functionCode &= 0x7F;
+  if (error != SUCCESS) {
+    ST_byCode[errorIndex(error)].fetch_add(1, std::memory_order_relaxed);
+  }
+  Slot *s = findSlot(0x10000 | (serverID << 8) | functionCode);
+  if (!s) {
+    ST_untracked.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  s->requests.fetch_add(1, std::memory_order_relaxed);
+  s->bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+  s->bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+  if (error != SUCCESS) {
+    if (error < TIMEOUT) {
+      s->exceptions.fetch_add(1, std::memory_order_relaxed);
+    } else if (error == TIMEOUT) {
+      s->timeouts.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      s->otherErrors.fetch_add(1, std::memory_order_relaxed);
+    }
+    s->lastError.store(error, std::memory_order_relaxed);
+  }
+}
+
+// snapshot: get copies of all combinations seen so far
+std::vector<ModbusStatsEntry> ModbusStatistics::snapshot() const {
+  std::vector<ModbusStatsEntry> entries;
+  for (uint16_t i = 0; i < MODBUS_STATS_SLOTS; ++i) {
+    // Slots are taken in order, so the first free one ends the list
+    if (!ST_slot[i].key.load(std::memory_order_acquire)) break;
+    ModbusStatsEntry e;
+    copySlot(ST_slot[i], e);
+    entries.push_back(e);
+  }
+  return entries;
+}
+
+// get: copy the statistics for one combination. Returns false if it was not seen yet
+bool ModbusStatistics::get(uint8_t serverID, uint8_t functionCode, ModbusStatsEntry& entry) const {
+  uint32_t key = 0x10000 | (serverID << 8) | (functionCode & 0x7F);
+  for (uint16_t i = 0; i < MODBUS_STATS_SLOTS; ++i) {
+    uint32_t k = ST_slot[i].key.load(std::memory_order_acquire);
+    if (!k) break;
+    if (k == key) {
+      copySlot(ST_slot[i], entry);
+      return true;
+    }
+  }
+  return false;
+}
+
+// errorsByCode: number of errors with the given error code, for all combinations
+uint32_t ModbusStatistics::errorsByCode(Error error) const {
+  if (error == SUCCESS) return 0;
+  return ST_byCode[errorIndex(error)].load(std::memory_order_relaxed);
+}
+
+// reset: set all counters to zero. Combinations seen keep their slots.
+void ModbusStatistics::reset() {
+  for (uint16_t i = 0; i < MODBUS_STATS_SLOTS; ++i) {
+    Slot& s = ST_slot[i];
+    s.requests.store(0, std::memory_order_relaxed);
+    s.exceptions.store(0, std::memory_order_relaxed);
+    s.timeouts.store(0, std::memory_order_relaxed);
+    s.otherErrors.store(0, std::memory_order_relaxed);
+    s.bytesIn.store(0, std::memory_order_relaxed);
+    s.bytesOut.store(0, std::memory_order_relaxed);
+    s.lastError.store(SUCCESS, std::memory_order_relaxed);
+  }
+  for (uint16_t i = 0; i < MODBUS_STATS_ERROR_TYPES; ++i) {
+    ST_byCode[i].store(0, std::memory_order_relaxed);
+  }
+  ST_untracked.store(0, std::memory_order_relaxed);
+}
+
+// findSlot: get the slot for a key, claiming a free one if needed. nullptr if all are taken
+// Free slots are always claimed lowest first, so no key can end up in two slots.
+ModbusStatistics::Slot *ModbusStatistics::findSlot(uint32_t key) {
+  for (uint16_t i = 0; i < MODBUS_STATS_SLOTS; ++i) {
+    uint32_t k = ST_slot[i].key.load(std::memory_order_acquire);
+    // Free slot? Try to claim it
+    if (!k) {
+      if (ST_slot[i].key.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+        return &ST_slot[i];
+      }
+      // Someone else was faster - k now holds the key claimed
+    }
+    if (k == key) return &ST_slot[i];
+  }
+  return nullptr;
+}
+
+// copySlot: fill entry from a slot
+void ModbusStatistics::copySlot(const Slot& s, ModbusStatsEntry& entry) {
+  uint32_t k = s.key.load(std::memory_order_relaxed);
+  entry.serverID = (k >> 8) & 0xFF;
+  entry.functionCode = k & 0xFF;
+  entry.requests = s.requests.load(std::memory_order_relaxed);
+  entry.exceptions = s.exceptions.load(std::memory_order_relaxed);
+  entry.timeouts = s.timeouts.load(std::memory_order_relaxed);
+  entry.otherErrors = s.otherErrors.load(std::memory_order_relaxed);
+  entry.bytesIn = s.bytesIn.load(std::memory_order_relaxed);
+  entry.bytesOut = s.bytesOut.load(std::memory_order_relaxed);
+  entry.lastError = static_cast<Error>(s.lastError.load(std::memory_order_relaxed));
+}
+
+// errorIndex: map an error code to its bucket
+uint8_t ModbusStatistics::errorIndex(Error error) {
+  // Modbus exceptions 0x00..0x0B
+  if (error <= GATEWAY_TARGET_NO_RESP) return error;
+  // Communication errors 0xE0..0xEF
+  if (error >= TIMEOUT && error <= ASCII_INVALID_CHAR) return 12 + (error - TIMEOUT);
+  if (error == BROADCAST_ERROR) return 28;
+  if (error == REQUEST_EXPIRED) return 29;
+  if (error == SERVER_BACKED_OFF) return 30;
+  // Anything else
+  return 31;
+}
@@ -0,0 +1,97 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_STATISTICS_H
+#define _MODBUS_STATISTICS_H
+
+#include <atomic>
+#include <vector>
+#include "ModbusTypeDefs.h"
+
+using namespace Modbus;  // NOLINT
+
+// Number of serverID/function code combinations tracked per client or server
+#ifndef MODBUS_STATS_SLOTS
+#define MODBUS_STATS_SLOTS 16
+#endif
+
+// Number of error code buckets: 0x00..0x0B, 0xE0..0xEF, 0xF0..0xF2 and all others
+#define MODBUS_STATS_ERROR_TYPES 32
+
+// ModbusStatsEntry: copy of the statistics for one serverID/function code combination
+struct ModbusStatsEntry {
+  uint8_t serverID;
+  uint8_t functionCode;
+  uint32_t requests;             // Number of transactions
+  uint32_t exceptions;           // Number of Modbus exception responses (0x01..0x0B)
+  uint32_t timeouts;             // Number of TIMEOUT errors
+  uint32_t otherErrors;          // Number of all other errors
+  uint32_t bytesIn;              // Number of message bytes received
+  uint32_t bytesOut;             // Number of message bytes sent
+  Error lastError;               // Most recent error, SUCCESS if there was none yet
+
+  ModbusStatsEntry() :
+    serverID(0), functionCode(0), requests(0), exceptions(0), timeouts(0),
+    otherErrors(0), bytesIn(0), bytesOut(0), lastError(SUCCESS) {}
+  inline uint32_t errors() const { return exceptions + timeouts + otherErrors; }
+};
+
+// ModbusStatistics: transaction counters by serverID/function code.
+// All counters are atomic, so counting never blocks and copies may be taken while traffic goes on.
+// Copies are not synchronized across counters - a transaction counted in the meantime may show up
+// in one counter and not yet in another.
+// Byte counts are those of the messages (serverID, function code and data) without any framing.
+class ModbusStatistics {
+public:
+  ModbusStatistics();
+
+  // count: add a transaction. Combinations beyond MODBUS_STATS_SLOTS will only show in untracked()
+  void count(uint8_t serverID, uint8_t functionCode, Error error, uint16_t bytesIn, uint16_t bytesOut);
+
+  // snapshot: get copies of all combinations seen so far
+  std::vector<ModbusStatsEntry> snapshot() const;
+
+  // get: copy the statistics for one combination. Returns false if it was not seen yet
+  bool get(uint8_t serverID, uint8_t functionCode, ModbusStatsEntry& entry) const;
+
+  // errorsByCode: number of errors with the given error code, for all combinations
+  uint32_t errorsByCode(Error error) const;
+
+  // untracked: number of transactions that did not find a free slot
+  inline uint32_t untracked() const { return ST_untracked.load(std::memory_order_relaxed); }
+
+  // reset: set all counters to zero. Combinations seen keep their slots.
+  void reset();
+
+protected:
+  struct Slot {
+    std::atomic<uint32_t> key;   // 0: free, else 0x10000 | serverID << 8 | functionCode
+    std::atomic<uint32_t> requests;
+    std::atomic<uint32_t> exceptions;
+    std::atomic<uint32_t> timeouts;
+    std::atomic<uint32_t> otherErrors;
+    std::atomic<uint32_t> bytesIn;
+    std::atomic<uint32_t> bytesOut;
+    std::atomic<uint8_t> lastError;
+  };
+
+  // Prevent copy construction or assignment
+  ModbusStatistics(const ModbusStatistics& other) = delete;
+  ModbusStatistics& operator=(const ModbusStatistics& other) = delete;
+
+  // findSlot: get the slot for a key, claiming a free one if needed. nullptr if all are taken
+  Slot *findSlot(uint32_t key);
+
+  // copySlot: fill entry from a slot
+  static void copySlot(const Slot& s, ModbusStatsEntry& entry);
+
+  // errorIndex: map an error code to its bucket
+  static uint8_t errorIndex(Error error);
+
+  Slot ST_slot[MODBUS_STATS_SLOTS];                               // Counters by serverID/function code
+  std::atomic<uint32_t> ST_byCode[MODBUS_STATS_ERROR_TYPES];      // Error counts by error code
+  std::atomic<uint32_t> ST_untracked;                             // Transactions without a slot
+};
+
+#endif
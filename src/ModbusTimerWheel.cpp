@@ -0,0 +1,86 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusTimerWheel.h"
+
+// Constructor: tick is the resolution in ms, a full turn of the wheel takes SLOTS * tick ms
+ModbusTimerWheel::ModbusTimerWheel(uint16_t tick) :
+  TW_tick(tick ? tick : 1),
+  TW_current(0),
+  TW_time(0),
+  TW_count(0) {
+  for (uint16_t i = 0; i < SLOTS; ++i) {
+    TW_slot[i] = nullptr;
+  }
+}
+
+// start: put timer t on the wheel, to expire timeout ms after now. A running timer is restarted
+void ModbusTimerWheel::start(Timer *t, uint32_t timeout, uint32_t now) {
+  stop(t);
+  // An empty wheel has nothing to catch up with
+  if (!TW_count) TW_time = now;
+  t->TW_deadline = now + timeout;
+  // Distance of the deadline from the current tick. Differences are taken to be safe at the millis() wrap
+  uint32_t delta = timeout;
+  if (static_cast<int32_t>(now - TW_time) > 0) delta += now - TW_time;
+  // The timer belongs to the first tick not before its deadline, so it will never expire early.
+  // The current tick was looked at already, so it is the next one at least
+  uint32_t ahead = (delta + TW_tick - 1) / TW_tick;
+  link(t, TW_current + (ahead ? ahead : 1));
+}
+
+// stop: take timer t off the wheel, if it is running
+void ModbusTimerWheel::stop(Timer *t) {
+  if (!t->running()) return;
+  *(t->TW_prev) = t->TW_next;
+  if (t->TW_next) t->TW_next->TW_prev = t->TW_prev;
+  t->TW_next = nullptr;
+  t->TW_prev = nullptr;
+  TW_count--;
+}
+
+// link: put t into the slot for tick
+void ModbusTimerWheel::link(Timer *t, uint32_t tick) {
+  Timer **slot = &TW_slot[tick & (SLOTS - 1)];
+  t->TW_next = *slot;
+  if (t->TW_next) t->TW_next->TW_prev = &(t->TW_next);
+  t->TW_prev = slot;
+  *slot = t;
+  TW_count++;
+}
+
+// expire: take all timers due at now off the wheel and return them as a list linked by next()
+ModbusTimerWheel::Timer *ModbusTimerWheel::expire(uint32_t now) {
+  Timer *expired = nullptr;
+  Timer **tail = &expired;
+  // No tick passed since the last call - nothing to do
+  if (static_cast<int32_t>(now - TW_time) < TW_tick) return nullptr;
+  uint32_t ticks = (now - TW_time) / TW_tick;
+  // More than a full turn behind: each slot needs to be looked at only once
+  uint32_t first = TW_current + 1;
+  if (ticks > SLOTS) first = TW_current + ticks - SLOTS + 1;
+  TW_current += ticks;
+  TW_time += ticks * TW_tick;
+
+  for (uint32_t tick = first; TW_count && tick != TW_current + 1; ++tick) {
+    Timer **link = &TW_slot[tick & (SLOTS - 1)];
+    while (*link) {
+      Timer *t = *link;
+      // Timers for a later turn of the wheel will stay
+      if (static_cast<int32_t>(now - t->TW_deadline) < 0) {
+        link = &(t->TW_next);
+        continue;
+      }
+      // Unlink and append to the expired list
+      *link = t->TW_next;
+      if (t->TW_next) t->TW_next->TW_prev = link;
+      t->TW_next = nullptr;
+      t->TW_prev = nullptr;
+      TW_count--;
+      *tail = t;
+      tail = &(t->TW_next);
+    }
+  }
+  return expired;
+}
@@ -0,0 +1,73 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_TIMER_WHEEL_H
+#define _MODBUS_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ModbusTimerWheel: hashed timer wheel for request timeouts.
+// Timers are hashed into SLOTS slots by their deadline, so adding and removing one is O(1),
+// regardless of the number of timers running. expire() will only look at the slots of the ticks
+// passed since its last call. A timer longer than a full turn of the wheel is looked at once per turn.
+// The wheel does not keep time by itself - it will be driven by calling expire() periodically.
+// Not thread safe: the owner has to protect it.
+class ModbusTimerWheel {
+public:
+  // Timer: to be inherited by the objects to be timed
+  class Timer {
+  public:
+    Timer() : TW_next(nullptr), TW_prev(nullptr), TW_deadline(0) { }
+    // running: true if the timer is on a wheel
+    inline bool running() const { return TW_prev != nullptr; }
+    // next: the following timer in the list returned by expire()
+    inline Timer *next() const { return TW_next; }
+
+  protected:
+    friend class ModbusTimerWheel;
+    Timer *TW_next;           // Next timer in the slot or the expired list
+    Timer **TW_prev;          // Link pointing to this timer - nullptr if not running
+    uint32_t TW_deadline;     // millis() value the timer will expire at
+  };
+
+  // Number of slots - must be a power of 2
+  static const uint16_t SLOTS = 64;
+
+  // Constructor: tick is the resolution in ms, a full turn of the wheel takes SLOTS * tick ms
+  explicit ModbusTimerWheel(uint16_t tick = 4);
+
+  // start: put timer t on the wheel, to expire timeout ms after now. A running timer is restarted
+  void start(Timer *t, uint32_t timeout, uint32_t now);
+
+  // stop: take timer t off the wheel, if it is running
+  void stop(Timer *t);
+
+  // expire: take all timers due at now off the wheel and return them as a list linked by next().
+  // Returns nullptr if none is due
+  Timer *expire(uint32_t now);
+
+  // Number of timers running
+  inline uint32_t size() const { return TW_count; }
+  inline bool empty() const { return TW_count == 0; }
+
+  // Resolution in ms
+  inline uint16_t tick() const { return TW_tick; }
+
+protected:
+  // Prevent copy construction and assignment
+  ModbusTimerWheel(const ModbusTimerWheel&) = delete;
+  ModbusTimerWheel& operator=(const ModbusTimerWheel&) = delete;
+
+  // link: put t into the slot for tick
+  void link(Timer *t, uint32_t tick);
+
+  Timer *TW_slot[SLOTS];      // Slot lists, each linked by TW_next
+  uint16_t TW_tick;           // Resolution in ms
+  uint32_t TW_current;        // Number of the last tick looked at by expire()
+  uint32_t TW_time;           // millis() value the current tick started at
+  uint32_t TW_count;          // Number of timers running
+};
+
+#endif  // _MODBUS_TIMER_WHEEL_H
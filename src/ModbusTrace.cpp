@@ -0,0 +1,88 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusTrace.h"
+
+// Phase table entry: phase time is that from point 'from' to point 'to'
+struct PhaseSpan {
+  LatencyPhase phase;
+  TracePoint from;
+  TracePoint to;
+};
+
+static const PhaseSpan clientPhases[] = {
+  { LatencyPhase::QUEUED,     TracePoint::ENQUEUE,        TracePoint::SEND_START },
+  { LatencyPhase::SENDING,    TracePoint::SEND_START,     TracePoint::SEND_END },
+  { LatencyPhase::WAITING,    TracePoint::SEND_END,       TracePoint::FIRST_BYTE },
+  { LatencyPhase::RECEIVING,  TracePoint::FIRST_BYTE,     TracePoint::FRAME_COMPLETE },
+  { LatencyPhase::PROCESSING, TracePoint::FRAME_COMPLETE, TracePoint::DISPATCH },
+  { LatencyPhase::TOTAL,      TracePoint::ENQUEUE,        TracePoint::DISPATCH },
+};
+
+static const PhaseSpan serverPhases[] = {
+  { LatencyPhase::RECEIVING,  TracePoint::FIRST_BYTE,     TracePoint::FRAME_COMPLETE },
+  { LatencyPhase::QUEUED,     TracePoint::FRAME_COMPLETE, TracePoint::DISPATCH },
+  { LatencyPhase::PROCESSING, TracePoint::DISPATCH,       TracePoint::SEND_START },
+  { LatencyPhase::SENDING,    TracePoint::SEND_START,     TracePoint::SEND_END },
+  { LatencyPhase::TOTAL,      TracePoint::FIRST_BYTE,     TracePoint::SEND_END },
+};
+
+// Constructor: all counters zero
+ModbusLatency::ModbusLatency(bool server) :
+  LT_server(server) {
+  reset();
+}
+
+// add: count the phases of a transaction done. Phases with points not passed are left out
+void ModbusLatency::add(const ModbusTrace& trace) {
+  const PhaseSpan *table = LT_server ? serverPhases : clientPhases;
+  uint8_t entries = LT_server ? sizeof(serverPhases) / sizeof(PhaseSpan) : sizeof(clientPhases) / sizeof(PhaseSpan);
+  for (uint8_t i = 0; i < entries; ++i) {
+    if (trace.passed(table[i].from) && trace.passed(table[i].to)) {
+      add(table[i].phase, trace.span(table[i].from, table[i].to));
+    }
+  }
+}
+
+// add: count a single phase time
+void ModbusLatency::add(LatencyPhase phase, uint32_t us) {
+  // Bucket is the number of bits above the 8 lower ones
+  uint8_t bucket = 0;
+  us >>= 8;
+  while (us && bucket < MODBUS_LATENCY_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  LT_bucket[static_cast<uint8_t>(phase)][bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+// count: number of transactions in a bucket of a phase
+uint32_t ModbusLatency::count(LatencyPhase phase, uint8_t bucket) const {
+  if (bucket >= MODBUS_LATENCY_BUCKETS) return 0;
+  return LT_bucket[static_cast<uint8_t>(phase)][bucket].load(std::memory_order_relaxed);
+}
+
+// count: number of transactions in all buckets of a phase
+uint32_t ModbusLatency::count(LatencyPhase phase) const {
+  uint32_t sum = 0;
+  for (uint8_t b = 0; b < MODBUS_LATENCY_BUCKETS; ++b) {
+    sum += count(phase, b);
+  }
+  return sum;
+}
+
+// bucketLimit: upper limit (exclusive) of a bucket in us. 0xFFFFFFFF for the last one
+uint32_t ModbusLatency::bucketLimit(uint8_t bucket) {
+  if (bucket >= MODBUS_LATENCY_BUCKETS - 1 || bucket >= 24) return 0xFFFFFFFF;
+  return 256UL << bucket;
+}
+
+// reset: set all counters to zero
+void ModbusLatency::reset() {
+  for (uint8_t p = 0; p < MODBUS_LATENCY_PHASES; ++p) {
+    for (uint8_t b = 0; b < MODBUS_LATENCY_BUCKETS; ++b) {
+      LT_bucket[p][b].store(0, std::memory_order_relaxed);
+    }
+  }
+}
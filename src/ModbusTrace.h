@@ -0,0 +1,111 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_TRACE_H
+#define _MODBUS_TRACE_H
+
+#include <atomic>
+#include <functional>
+#include "options.h"
+#include "ModbusTypeDefs.h"
+
+using namespace Modbus;  // NOLINT
+
+// TracePoint: the points a transaction passes on its way through a client or server
+enum class TracePoint : uint8_t {
+  ENQUEUE = 0,                // Client: request taken into the queue
+  DEQUEUE,                    // Client: request taken off the queue by the worker
+  SEND_START,                 // Request (client) or response (server) starts being written
+  SEND_END,                   // ... is written completely
+  FIRST_BYTE,                 // First byte of the response (client) or request (server) has arrived
+  FRAME_COMPLETE,             // ... the frame is complete
+  DISPATCH,                   // Client: response handed to the callback. Server: request handed to the worker
+};
+#define MODBUS_TRACE_POINTS 7
+
+// ModbusTrace: the record of one transaction. The times are micros() values, 0 for a point not passed.
+// TCP clients will take FIRST_BYTE from the read that brought in the start of the frame.
+struct ModbusTrace {
+  uint32_t token;             // Client: the request's token. TCP server: the transaction ID. RTU server: 0
+  uint8_t serverID;
+  uint8_t functionCode;
+  Error error;                // Error of the response, SUCCESS if there was none
+  uint32_t at[MODBUS_TRACE_POINTS];
+
+  ModbusTrace() : token(0), serverID(0), functionCode(0), error(SUCCESS) { clear(); }
+  // clear: forget all times, to start over with another transaction
+  inline void clear() { for (uint8_t i = 0; i < MODBUS_TRACE_POINTS; ++i) at[i] = 0; }
+  // mark: note the time a point is passed at - 0 is taken for "not passed", so it will never be used
+  inline void mark(TracePoint p) {
+    uint32_t t = micros();
+    at[static_cast<uint8_t>(p)] = t ? t : 1;
+  }
+  // mark: same with a time taken before
+  inline void mark(TracePoint p, uint32_t t) { at[static_cast<uint8_t>(p)] = t ? t : 1; }
+  inline bool passed(TracePoint p) const { return at[static_cast<uint8_t>(p)] != 0; }
+  inline uint32_t time(TracePoint p) const { return at[static_cast<uint8_t>(p)]; }
+  // span: us from point a to point b. Both have to be passed
+  inline uint32_t span(TracePoint a, TracePoint b) const { return time(b) - time(a); }
+};
+
+// Trace handler: called with each transaction done, in the context of the worker
+typedef std::function<void(const ModbusTrace& trace)> MBOnTrace;
+
+// LatencyPhase: the parts a transaction's time is broken up into.
+// Client: QUEUED  ENQUEUE -> SEND_START, SENDING  SEND_START -> SEND_END, WAITING  SEND_END -> FIRST_BYTE,
+//         RECEIVING  FIRST_BYTE -> FRAME_COMPLETE, PROCESSING  FRAME_COMPLETE -> DISPATCH, TOTAL  ENQUEUE -> DISPATCH
+// Server: RECEIVING  FIRST_BYTE -> FRAME_COMPLETE, QUEUED  FRAME_COMPLETE -> DISPATCH,
+//         PROCESSING  DISPATCH -> SEND_START, SENDING  SEND_START -> SEND_END, TOTAL  FIRST_BYTE -> SEND_END
+//         (WAITING is not used by servers)
+enum class LatencyPhase : uint8_t {
+  QUEUED = 0,
+  SENDING,
+  WAITING,
+  RECEIVING,
+  PROCESSING,
+  TOTAL,
+};
+#define MODBUS_LATENCY_PHASES 6
+
+// Number of histogram buckets per phase
+#ifndef MODBUS_LATENCY_BUCKETS
+#define MODBUS_LATENCY_BUCKETS 16
+#endif
+
+// ModbusLatency: fixed bucket latency histograms by phase.
+// Bucket 0 counts times below 256us, each following one covers twice the range of the one before, up
+// to bucketLimit(). The last bucket takes all above. With 16 buckets that is 256us, 512us, ... 4.2s.
+// All counters are atomic like those of ModbusStatistics, adding never blocks.
+class ModbusLatency {
+public:
+  explicit ModbusLatency(bool server = false);
+
+  // add: count the phases of a transaction done. Phases with points not passed are left out
+  void add(const ModbusTrace& trace);
+
+  // add: count a single phase time
+  void add(LatencyPhase phase, uint32_t us);
+
+  // count: number of transactions in a bucket of a phase
+  uint32_t count(LatencyPhase phase, uint8_t bucket) const;
+
+  // count: number of transactions in all buckets of a phase
+  uint32_t count(LatencyPhase phase) const;
+
+  // bucketLimit: upper limit (exclusive) of a bucket in us. 0xFFFFFFFF for the last one
+  static uint32_t bucketLimit(uint8_t bucket);
+
+  // reset: set all counters to zero
+  void reset();
+
+protected:
+  // Prevent copy construction or assignment
+  ModbusLatency(const ModbusLatency& other) = delete;
+  ModbusLatency& operator=(const ModbusLatency& other) = delete;
+
+  bool LT_server;                                                          // Phases as seen by a server
+  std::atomic<uint32_t> LT_bucket[MODBUS_LATENCY_PHASES][MODBUS_LATENCY_BUCKETS];  // Counters
+};
+
+#endif  // _MODBUS_TRACE_H
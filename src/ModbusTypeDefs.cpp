@@ -16,7 +16,7 @@ FCType FCT::table[] = {
 // 0x.8      0x.9       0x.A       0x.B       0x.C       0x.D       0x.E       0x.F
   FCGENERIC, FCILLEGAL, FCILLEGAL, FC07_TYPE, FC07_TYPE, FCILLEGAL, FCILLEGAL, FC0F_TYPE,  // 0x0.
 // 0x.0      0x.1       0x.2       0x.3       0x.4       0x.5       0x.6       0x.7
-  FC10_TYPE, FC07_TYPE, FCILLEGAL, FCILLEGAL, FCGENERIC, FCGENERIC, FC16_TYPE, FCGENERIC,  // 0x1.
+  FC10_TYPE, FC07_TYPE, FCILLEGAL, FCILLEGAL, FCGENERIC, FCGENERIC, FC16_TYPE, FC17_TYPE,  // 0x1.
 // 0x.8      0x.9       0x.A       0x.B       0x.C       0x.D       0x.E       0x.F
   FC18_TYPE, FCILLEGAL, FCILLEGAL, FCILLEGAL, FCILLEGAL, FCILLEGAL, FCILLEGAL, FCILLEGAL,  // 0x1.
 // 0x.0      0x.1       0x.2       0x.3       0x.4       0x.5       0x.6       0x.7
@@ -81,6 +81,8 @@ enum Error : uint8_t {
   ASCII_CRC_ERR          = 0xEE,
   ASCII_INVALID_CHAR     = 0xEF,
   BROADCAST_ERROR        = 0xF0,
+  REQUEST_EXPIRED        = 0xF1,
+  SERVER_BACKED_OFF      = 0xF2,
   UNDEFINED_ERROR        = 0xFF  // otherwise uncovered communication error
 };
 
@@ -110,6 +112,7 @@ enum FCType : uint8_t {
   FC10_TYPE,         // two uint16_t parameters, a uint8_t length byte and a uint8_t* pointer to array of words (FC 0x10)
   FC16_TYPE,         // three uint16_t parameters (FC 0x16)
   FC18_TYPE,         // one uint16_t parameter (FC 0x18)
+  FC17_TYPE,         // four uint16_t parameters, a uint8_t length byte and a uint16_t* pointer to array of words (FC 0x17)
   FCGENERIC,         // for FCs not yet explicitly coded (or too complex)
   FCUSER,            // No checks except the server ID
   FCILLEGAL,         // not allowed function codes
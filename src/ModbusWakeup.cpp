@@ -0,0 +1,69 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusWakeup.h"
+
+#if HAS_FREERTOS || IS_LINUX
+#if IS_LINUX
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#if HAS_FREERTOS
+ModbusWakeup::ModbusWakeup() :
+  WU_sem(xSemaphoreCreateBinary()) { }
+
+ModbusWakeup::~ModbusWakeup() {
+  if (WU_sem) vSemaphoreDelete(WU_sem);
+}
+
+// signal: wake up the waiting task
+void ModbusWakeup::signal() {
+  xSemaphoreGive(WU_sem);
+}
+
+// wait: block until signal() was called or timeout ms have passed. Returns true if signalled
+bool ModbusWakeup::wait(uint32_t timeout) {
+  return xSemaphoreTake(WU_sem, pdMS_TO_TICKS(timeout)) == pdTRUE;
+}
+
+#elif IS_LINUX
+ModbusWakeup::ModbusWakeup() :
+  WU_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  WU_pfds() { }
+
+ModbusWakeup::~ModbusWakeup() {
+  if (WU_fd >= 0) close(WU_fd);
+}
+
+// signal: wake up the waiting task
+void ModbusWakeup::signal() {
+  uint64_t one = 1;
+  if (write(WU_fd, &one, sizeof(one)) < 0) { }  // Counter overflow only - we are signalled anyway
+}
+
+// wait: block until signal() was called or timeout ms have passed. Returns true if signalled
+bool ModbusWakeup::wait(uint32_t timeout) {
+  return wait(timeout, std::vector<int>());
+}
+
+// wait: block until signal() was called, a socket has data or timeout ms have passed
+bool ModbusWakeup::wait(uint32_t timeout, const std::vector<int>& fds) {
+  WU_pfds.clear();
+  WU_pfds.push_back({ WU_fd, POLLIN, 0 });
+  for (int fd : fds) {
+    WU_pfds.push_back({ fd, POLLIN, 0 });
+  }
+  int rc = poll(WU_pfds.data(), WU_pfds.size(), timeout > INT32_MAX ? -1 : static_cast<int>(timeout));
+  if (rc <= 0) return false;
+  // Reset the signal, if given
+  if (WU_pfds[0].revents & POLLIN) {
+    uint64_t count = 0;
+    if (read(WU_fd, &count, sizeof(count)) < 0) { }  // Taken by another wait() already
+  }
+  return true;
+}
+#endif
+
+#endif  // HAS_FREERTOS || IS_LINUX
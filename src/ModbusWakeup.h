@@ -0,0 +1,56 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_WAKEUP_H
+#define _MODBUS_WAKEUP_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+#if HAS_FREERTOS
+extern "C" {
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+}
+#elif IS_LINUX
+#include <vector>
+#include <poll.h>
+#endif
+
+// ModbusWakeup: lets a worker task sleep until there is something to do.
+// signal() will wake up the task blocked in wait(). A signal given while nobody is waiting
+// is kept, so the next wait() will return immediately. Meant for exactly one waiting task!
+class ModbusWakeup {
+public:
+  ModbusWakeup();
+  ~ModbusWakeup();
+
+  // signal: wake up the waiting task
+  void signal();
+
+  // wait: block until signal() was called or timeout ms have passed. Returns true if signalled
+  bool wait(uint32_t timeout);
+
+#if IS_LINUX
+  // wait: block until signal() was called, one of the sockets in fds has data to read or timeout ms
+  // have passed. Returns true if signalled or data is there
+  bool wait(uint32_t timeout, const std::vector<int>& fds);
+#endif
+
+protected:
+  // Prevent copy construction and assignment
+  ModbusWakeup(const ModbusWakeup&) = delete;
+  ModbusWakeup& operator=(const ModbusWakeup&) = delete;
+
+#if HAS_FREERTOS
+  SemaphoreHandle_t WU_sem;      // Binary semaphore given by signal()
+#elif IS_LINUX
+  int WU_fd;                     // eventfd written by signal(), to be polled together with sockets
+  std::vector<struct pollfd> WU_pfds;  // Poll set of the latest wait()
+#endif
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // _MODBUS_WAKEUP_H
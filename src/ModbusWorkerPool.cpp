@@ -0,0 +1,141 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#include "ModbusWorkerPool.h"
+
+#if HAS_FREERTOS || IS_LINUX
+
+#undef LOCAL_LOG_LEVEL
+// #define LOCAL_LOG_LEVEL LOG_LEVEL_VERBOSE
+#include "Logging.h"
+
+uint16_t ModbusWorkerPool::instanceCounter = 0;
+
+// Constructor
+ModbusWorkerPool::ModbusWorkerPool() :
+  WP_jobs(),
+  WP_queueLimit(0),
+  WP_stopping(false),
+  WP_running(false),
+  WP_alive(0),
+  WP_tasks() {
+  instanceCounter++;
+}
+
+// Destructor: stop the tasks
+ModbusWorkerPool::~ModbusWorkerPool() {
+  end();
+}
+
+// begin: start the pool with tasks tasks, pinned to coreID
+bool ModbusWorkerPool::begin(uint8_t tasks, uint16_t queueLimit, int coreID) {
+  if (WP_running) {
+    LOG_W("Worker pool already running.\n");
+    return false;
+  }
+  if (!tasks || !queueLimit) return false;
+  WP_queueLimit = queueLimit;
+  WP_stopping = false;
+
+  for (uint8_t i = 0; i < tasks; ++i) {
+#if HAS_FREERTOS
+    // Create unique task name
+    char taskName[18];
+    snprintf(taskName, 18, "Modbus%02XPOOL%d", instanceCounter, i);
+    TaskHandle_t task = nullptr;
+    // Start task to take the jobs
+    if (xTaskCreatePinnedToCore((TaskFunction_t)&run, taskName, 4096, this, 5, &task, coreID >= 0 ? coreID : NULL) != pdPASS) {
+      LOG_E("Could not create pool task %d\n", i);
+      break;
+    }
+#elif IS_LINUX
+    pthread_t task;
+    int rc = pthread_create(&task, NULL, &pHandle, this);
+    if (rc) {
+      LOG_E("Error creating pool thread %d: %d\n", i, rc);
+      break;
+    }
+#endif
+    WP_alive++;
+    WP_tasks.push_back(task);
+  }
+  WP_running = true;
+  // None started at all? Then we are not running
+  if (WP_tasks.empty()) {
+    end();
+    return false;
+  }
+  LOG_D("Worker pool started with %d tasks\n", WP_tasks.size());
+  return true;
+}
+
+// end: let the tasks finish the jobs they are running and stop them
+void ModbusWorkerPool::end() {
+  if (!WP_running) return;
+  {
+    std::lock_guard<std::mutex> lg(WP_lock);
+    WP_stopping = true;
+    WP_jobs.clear();
+  }
+  WP_cv.notify_all();
+#if HAS_FREERTOS
+  // The tasks will delete themselves - wait for all to be done
+  while (WP_alive) {
+    delay(1);
+  }
+#elif IS_LINUX
+  for (auto task : WP_tasks) {
+    pthread_join(task, NULL);
+  }
+#endif
+  WP_tasks.clear();
+  WP_running = false;
+  LOG_D("Worker pool stopped\n");
+}
+
+// submit: queue a job. Returns false if the pool is not running or the queue is full
+bool ModbusWorkerPool::submit(Job job) {
+  if (!WP_running) return false;
+  {
+    std::lock_guard<std::mutex> lg(WP_lock);
+    if (WP_stopping || WP_jobs.size() >= WP_queueLimit) return false;
+    WP_jobs.push_back(job);
+  }
+  WP_cv.notify_one();
+  return true;
+}
+
+// pending: number of jobs waiting for a free task
+uint16_t ModbusWorkerPool::pending() {
+  std::lock_guard<std::mutex> lg(WP_lock);
+  return WP_jobs.size();
+}
+
+#if IS_LINUX
+void *ModbusWorkerPool::pHandle(void *p) {
+  run(static_cast<ModbusWorkerPool *>(p));
+  return nullptr;
+}
+#endif
+
+// run: task function, taking jobs until end() is called
+void ModbusWorkerPool::run(ModbusWorkerPool *instance) {
+  while (1) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(instance->WP_lock);
+      instance->WP_cv.wait(lock, [instance] { return instance->WP_stopping || !instance->WP_jobs.empty(); });
+      if (instance->WP_stopping) break;
+      job = instance->WP_jobs.front();
+      instance->WP_jobs.pop_front();
+    }
+    job();
+  }
+  instance->WP_alive--;
+#if HAS_FREERTOS
+  vTaskDelete(NULL);
+#endif
+}
+
+#endif  // HAS_FREERTOS || IS_LINUX
@@ -0,0 +1,81 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _MODBUS_WORKER_POOL_H
+#define _MODBUS_WORKER_POOL_H
+
+#include "options.h"
+
+#if HAS_FREERTOS || IS_LINUX
+#include <deque>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>               // NOLINT
+#include <condition_variable>  // NOLINT
+#if HAS_FREERTOS
+extern "C" {
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+}
+#elif IS_LINUX
+#include <pthread.h>
+#endif
+
+// ModbusWorkerPool: a fixed number of tasks running jobs from a bounded queue.
+// Servers serving many connections from one task will hand their requests to a pool, if given
+// one with ModbusServer::useWorkerPool(), so a slow worker function will not hold up the others.
+// One pool may be shared by several servers.
+class ModbusWorkerPool {
+public:
+  using Job = std::function<void()>;
+
+  ModbusWorkerPool();
+  ~ModbusWorkerPool();
+
+  // begin: start the pool with tasks tasks, pinned to coreID (FreeRTOS only, -1: any core).
+  // queueLimit: number of jobs that may wait for a free task
+  bool begin(uint8_t tasks = 2, uint16_t queueLimit = 16, int coreID = -1);
+
+  // end: let the tasks finish the jobs they are running and stop them. Jobs still waiting are dropped!
+  void end();
+
+  // submit: queue a job. Returns false if the pool is not running or the queue is full
+  bool submit(Job job);
+
+  // pending: number of jobs waiting for a free task
+  uint16_t pending();
+
+  // isRunning: return true if begin() was called successfully
+  inline bool isRunning() { return WP_running; }
+
+protected:
+  // Prevent copy construction and assignment
+  ModbusWorkerPool(const ModbusWorkerPool&) = delete;
+  ModbusWorkerPool& operator=(const ModbusWorkerPool&) = delete;
+
+  // run: task function, taking jobs until end() is called
+  static void run(ModbusWorkerPool *instance);
+#if IS_LINUX
+  static void *pHandle(void *p);
+#endif
+
+  std::deque<Job> WP_jobs;          // Jobs waiting for a free task
+  std::mutex WP_lock;               // Protects WP_jobs and WP_stopping
+  std::condition_variable WP_cv;    // Idle tasks are sleeping on this one
+  uint16_t WP_queueLimit;           // Maximum number of jobs waiting
+  bool WP_stopping;                 // end() was called, tasks shall stop
+  std::atomic<bool> WP_running;     // Pool was started
+  std::atomic<uint8_t> WP_alive;    // Number of tasks still running
+#if HAS_FREERTOS
+  std::vector<TaskHandle_t> WP_tasks;
+#elif IS_LINUX
+  std::vector<pthread_t> WP_tasks;
+#endif
+  static uint16_t instanceCounter;  // Number of pools created, for the task names
+};
+
+#endif  // HAS_FREERTOS || IS_LINUX
+
+#endif  // _MODBUS_WORKER_POOL_H
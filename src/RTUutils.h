@@ -5,18 +5,37 @@
 #ifndef _RTU_UTILS_H
 #define _RTU_UTILS_H
 #include <stdint.h>
+#include "options.h"
 #if NEED_UART_PATCH
   #include <soc/uart_struct.h>
 #endif
 #include <vector>
+#if IS_LINUX
+#include "HardwareSerial.h"
+#else
 #include "Stream.h"
+#endif
 #include "ModbusTypeDefs.h"
 #include <functional>
 
 typedef std::function<void(bool level)> RTScallback;
 
+class ModbusWakeup;
+class ModbusCapture;
+
 using namespace Modbus;  // NOLINT
 
+// CRC16 calculation engines to be selected by MODBUS_CRC_ENGINE:
+// MODBUS_CRC_BYTEWISE: classic table lookup per byte, 512 bytes of tables
+// MODBUS_CRC_SLICING4: 4 bytes per step, 2kB of tables
+// MODBUS_CRC_SLICING8: 8 bytes per step, 4kB of tables (default)
+#define MODBUS_CRC_BYTEWISE 1
+#define MODBUS_CRC_SLICING4 4
+#define MODBUS_CRC_SLICING8 8
+#ifndef MODBUS_CRC_ENGINE
+#define MODBUS_CRC_ENGINE MODBUS_CRC_SLICING8
+#endif
+
 // RTUutils is bundling the send, receive and CRC functions for Modbus RTU communications.
 // RTU server and client will make use of it.
 // All functions are static!
@@ -28,8 +47,18 @@ class RTUutils {
 // calcCRC: calculate the CRC16 value for a given block of data
     static uint16_t calcCRC(const uint8_t* data, uint16_t len);
 
+// updateCRC: add one more byte to a running CRC16. Start with 0xFFFF.
+// Run over a complete frame including its CRC bytes, the result will be 0 for a valid frame.
+    static uint16_t updateCRC(uint16_t crc, uint8_t b);
+
+// calcCRCbytewise, calcCRCslicing4, calcCRCslicing8: the CRC16 engines calcCRC() may use.
+// All give the same results - these are for the benchmark mainly.
+    static uint16_t calcCRCbytewise(const uint8_t* data, uint16_t len);
+    static uint16_t calcCRCslicing4(const uint8_t* data, uint16_t len);
+    static uint16_t calcCRCslicing8(const uint8_t* data, uint16_t len);
+
 // calcCRC: calculate the CRC16 value for a given block of data
-    static uint16_t calcCRC(ModbusMessage msg);
+    static uint16_t calcCRC(const ModbusMessage& msg);
 
 // validCRC #1: check the CRC in a block of data for validity
     static bool validCRC(const uint8_t* data, uint16_t len);
@@ -38,10 +67,10 @@ class RTUutils {
     static bool validCRC(const uint8_t* data, uint16_t len, uint16_t CRC);
 
 // validCRC #1: check the CRC in a message for validity
-    static bool validCRC(ModbusMessage msg);
+    static bool validCRC(const ModbusMessage& msg);
 
 // validCRC #2: check the CRC of a message against a given one
-    static bool validCRC(ModbusMessage msg, uint16_t CRC);
+    static bool validCRC(const ModbusMessage& msg, uint16_t CRC);
 
 // addCRC: extend a RTUMessage by a valid CRC
     static void addCRC(ModbusMessage& raw);
@@ -54,6 +83,46 @@ class RTUutils {
       return;  // NOLINT
     }
 
+// Modbus ASCII codec
+// encodeASCII: write data as hex digits to out, which must have room for 2 * len characters
+    static void encodeASCII(const uint8_t *data, uint16_t len, uint8_t *out);
+
+// calcLRC: the Modbus ASCII check byte (longitudinal redundancy check) for data
+    static uint8_t calcLRC(const uint8_t *data, uint16_t len);
+
+// ASCIIdecoder: takes an ASCII frame character by character as it comes in. The bytes are put
+// into target and the LRC is run along with them, so the frame is done with its line feed.
+// Characters before the lead-in are skipped, but all need to be valid ASCII frame characters.
+    class ASCIIdecoder {
+    public:
+      // Outcome of take(): more characters needed, a valid frame is complete or the frame is broken
+      enum Result : uint8_t { MORE = 0, FRAME, FAILED };
+
+      // target will be cleared. No more than limit bytes will be taken, LRC included
+      ASCIIdecoder(ModbusMessage& target, uint16_t limit);
+
+      // take: process one character. With FRAME target holds the message without the LRC,
+      // with FAILED error() tells what was wrong
+      Result take(uint8_t c);
+
+      // started: the lead-in was seen
+      inline bool started() const { return AD_state != AD_LEAD_IN; }
+
+      inline Error error() const { return AD_error; }
+
+    protected:
+      enum State : uint8_t { AD_LEAD_IN = 0, AD_HIGH, AD_LOW, AD_LF };
+      Result fail(Error e);
+
+      ModbusMessage& AD_target;
+      uint16_t AD_limit;
+      uint16_t AD_count;          // Bytes taken
+      uint8_t AD_state;
+      uint8_t AD_high;            // High nibble of the byte being decoded
+      uint8_t AD_lrc;             // Sum of all bytes taken - 0 after the LRC for a valid frame
+      Error AD_error;
+    };
+
 // Necessary preparations for a HardwareSerial
     static void prepareHardwareSerial(HardwareSerial& s, uint16_t bufferSize = 260) {
       s.setRxBufferSize(bufferSize);
@@ -63,16 +132,50 @@ class RTUutils {
   protected:
 // Printable characters for ASCII protocol: 012345678ABCDEF
     static const char ASCIIwrite[];
-    static const char ASCIIread[];
+// Values of all characters: hex digits 0x00..0x0F, ':' 0xF0, CR 0xF1, LF 0xF2, all others 0xFF
+    static const uint8_t ASCIIread[];
 
     RTUutils() = delete;
 
 // receive: get a Modbus message from serial, maintaining timeouts etc.
-    static ModbusMessage receive(uint8_t caller, Stream& serial, uint32_t timeout, unsigned long& lastMicros, uint32_t interval, bool ASCIImode, bool skipLeadingZeroBytes = false);
+// With earlyEnd, a RTU frame is returned as soon as its expected length has arrived with a valid CRC
+// With a frameEvent, the caller will sleep until the UART driver has signalled a frame end on it
+// With firstByte, the micros() time the first byte was seen at is returned there - untouched if none came
+// With a capture, a RTU frame received is recorded there as it came, including the CRC
+    static ModbusMessage receive(uint8_t caller, Stream& serial, uint32_t timeout, unsigned long& lastMicros, uint32_t interval, bool ASCIImode, bool skipLeadingZeroBytes = false, bool earlyEnd = false, ModbusWakeup *frameEvent = nullptr, uint32_t *firstByte = nullptr, ModbusCapture *capture = nullptr);
+
+#if HAS_UART_EVENTS
+// enableFrameEvents: have the UART driver signal frameEvent after a gap of at least interval without data
+    static bool enableFrameEvents(HardwareSerial& serial, uint32_t interval, ModbusWakeup& frameEvent);
+
+// disableFrameEvents: stop signalling frame ends
+    static void disableFrameEvents(HardwareSerial& serial);
+#endif
+
+#if HAS_UART_RS485
+// enableRS485: have the UART switch the RS485 DE/RE line itself - on ESP32 in the UART's RS485 half
+// duplex mode on rtsPin, on Linux by the kernel driver. The line is released right with the last
+// stop bit then, not when flush() returns. Returns false if the UART would not do it.
+    static bool enableRS485(HardwareSerial& serial, int8_t rtsPin);
+#endif
+
+// frameLength: expected length of a RTU frame including CRC, as far as known from the bytes received.
+// caller 'C' expects a response, 'S' a request. Returns 0 if more bytes are needed, 0xFFFF if unknown.
+    static uint16_t frameLength(uint8_t caller, const uint8_t *data, uint16_t len);
 
 // send: send a Modbus message in either format (ModbusMessage or data/len)
-    static void send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, const uint8_t* data, uint16_t len, bool ASCIImode);
-    static void send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, ModbusMessage raw, bool ASCIImode);
+// With a capture, a RTU frame sent is recorded there, including the CRC
+    static void send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, const uint8_t* data, uint16_t len, bool ASCIImode, ModbusCapture *capture = nullptr);
+    static void send(Stream& serial, unsigned long& lastMicros, uint32_t interval, RTScallback r, ModbusMessage& raw, bool ASCIImode, ModbusCapture *capture = nullptr);
+
+// sendStart, sendEnd: send a RTU frame without blocking, for callers driving several buses.
+// sendStart writes the frame with CRC to serial. The caller has to respect the interval before and
+// has to wait for the transmission to be done before calling sendEnd.
+    static void sendStart(Stream& serial, RTScallback r, const uint8_t* data, uint16_t len, ModbusCapture *capture = nullptr);
+// The message variants put the CRC into the room behind the message, if there is some, and write the
+// frame in one go. The message is left as it was.
+    static void sendStart(Stream& serial, RTScallback r, ModbusMessage& msg, ModbusCapture *capture = nullptr);
+    static void sendEnd(Stream& serial, unsigned long& lastMicros, RTScallback r);
 };
 
 #endif
@@ -0,0 +1,68 @@
+// =================================================================================================
+// eModbus: Copyright 2020 by Michael Harwerth, Bert Melis and the contributors to eModbus
+//               MIT license - see license.md for details
+// =================================================================================================
+#ifndef _TCP_UTILS_H
+#define _TCP_UTILS_H
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+// TCPutils is bundling the framing functions for Modbus TCP.
+// TCP clients and servers will make use of it.
+// All functions are static!
+class TCPutils {
+public:
+  // Maximum size of a Modbus TCP ADU: MBAP header and PDU with server ID
+  static const uint16_t MAX_ADU = 6 + 254;
+
+  // writeFrame: write MBAP header (6 bytes) and PDU of a Modbus TCP frame to client.
+  // Clients having a scatter write - write(head, headLen, data, len) like the Linux Client - will get
+  // both parts as they are, to be sent in one go without copying the PDU.
+  // All others get a write of one block, put together on the stack: separate writes may end up in
+  // separate packets, and some servers will not take a MBAP header arriving on its own.
+  // Returns the number of bytes written.
+  template <typename CT>
+  static size_t writeFrame(CT& client, const uint8_t *head, const uint8_t *pdu, uint16_t len) {
+    return write(client, head, pdu, len, 0);
+  }
+
+  // Returned by frameLength() for data not starting with a valid MBAP header
+  static const uint16_t INVALID_FRAME = 0xFFFF;
+
+  // frameLength: length of the frame starting at data including the MBAP header, as far as known
+  // from the len bytes received. Returns 0 if more bytes are needed, INVALID_FRAME if the MBAP header
+  // is broken - the connection has lost synchronization then.
+  static inline uint16_t frameLength(const uint8_t *data, uint16_t len) {
+    if (len < 6) return 0;
+    uint16_t protocolID = (data[2] << 8) | data[3];
+    uint16_t pduLength = (data[4] << 8) | data[5];
+    if (protocolID != 0 || pduLength < 2 || pduLength > MAX_ADU - 6) return INVALID_FRAME;
+    return pduLength + 6;
+  }
+
+protected:
+  TCPutils() = delete;
+
+  // Scatter write available - picked by overload resolution, as 0 is an int
+  template <typename CT>
+  static auto write(CT& client, const uint8_t *head, const uint8_t *pdu, uint16_t len, int)
+    -> decltype(client.write(head, (size_t)6, pdu, (size_t)len)) {
+    return client.write(head, 6, pdu, len);
+  }
+
+  // Plain write only
+  template <typename CT>
+  static size_t write(CT& client, const uint8_t *head, const uint8_t *pdu, uint16_t len, long) {  // NOLINT
+    if (len > MAX_ADU - 6) {
+      // Will not fit - cannot be a valid frame anyway, so let it go in two parts
+      return client.write(head, 6) + client.write(pdu, len);
+    }
+    uint8_t frame[MAX_ADU];
+    memcpy(frame, head, 6);
+    memcpy(frame + 6, pdu, len);
+    return client.write(frame, 6 + len);
+  }
+};
+
+#endif
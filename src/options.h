@@ -13,6 +13,20 @@
 #define HAS_ETHERNET 1
 #define IS_LINUX 0
 #define NEED_UART_PATCH 1
+// HardwareSerial::onReceive() and setRxTimeout() are needed for event driven RTU receive
+#if defined(ESP_ARDUINO_VERSION_VAL)
+#if ESP_ARDUINO_VERSION >= ESP_ARDUINO_VERSION_VAL(2, 0, 6)
+#define HAS_UART_EVENTS 1
+// HardwareSerial::setMode() with UART_MODE_RS485_HALF_DUPLEX lets the UART switch DE/RE
+#define HAS_UART_RS485 1
+#endif
+#endif
+#ifndef HAS_UART_EVENTS
+#define HAS_UART_EVENTS 0
+#endif
+#ifndef HAS_UART_RS485
+#define HAS_UART_RS485 0
+#endif
 
 /* === ESP8266 DEFINITIONS AND MACROS === */
 #elif defined(ESP8266)
@@ -22,6 +36,8 @@
 #define HAS_ETHERNET 0
 #define IS_LINUX 0
 #define NEED_UART_PATCH 0
+#define HAS_UART_EVENTS 0
+#define HAS_UART_RS485 0
 
 /* === LINUX DEFINITIONS AND MACROS === */
 #elif defined(__linux__)
@@ -30,6 +46,9 @@
 #define HAS_ETHERNET 0
 #define IS_LINUX 1
 #define NEED_UART_PATCH 0
+#define HAS_UART_EVENTS 0
+// The kernel driver will switch DE/RE, see HardwareSerial::useRS485()
+#define HAS_UART_RS485 1
 #include <cstdio>  // for printf()
 #include <cstring> // for memcpy(), strlen() etc.
 #include <cinttypes> // for uint32_t etc.
@@ -37,11 +56,22 @@
 #include <wiringPi.h>
 #else
 #include <chrono>  // NOLINT
+#include <ctime>
 // Use nanosleep() to avoid problems with pthreads (std::this_thread::sleep_for would interfere!)
-#define delay(x)  nanosleep((const struct timespec[]){{x/1000, (x%1000)*1000000L}}, NULL);
+inline void delay(uint32_t ms) {
+  struct timespec t = { static_cast<time_t>(ms / 1000), static_cast<long>(ms % 1000) * 1000000L };
+  nanosleep(&t, NULL);
+}
+inline void delayMicroseconds(uint32_t us) {
+  struct timespec t = { static_cast<time_t>(us / 1000000), static_cast<long>(us % 1000000) * 1000L };
+  nanosleep(&t, NULL);
+}
 typedef std::chrono::steady_clock clk;
 #define millis() std::chrono::duration_cast<std::chrono::milliseconds>(clk::now().time_since_epoch()).count()
 #define micros() std::chrono::duration_cast<std::chrono::microseconds>(clk::now().time_since_epoch()).count()
+// Levels for RTS callbacks
+#define HIGH 1
+#define LOW 0
 #endif
 
 /* === INVALID TARGET === */